@@ -0,0 +1,273 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/activation_checkpointing.h
+/// \brief Activation checkpointing, which trades memory for recomputation in the backpropagation step.
+///
+/// During training every layer keeps its input X and the intermediate results computed from it (like Z) until
+/// the end of the backpropagation. The memory needed for this grows with the batch size and the sum of the layer
+/// widths. With activation checkpointing only the activations of selected layers, the checkpoints, are kept
+/// during the feedforward step. During backpropagation the activations of the layers between two checkpoints are
+/// recomputed from the first checkpoint, one segment at a time. The recomputed values are identical to the
+/// original ones, so the gradients are the same as without checkpointing.
+///
+/// Layers that can not be recomputed (dropout layers and batch normalization layers, which change their state in
+/// the feedforward step) are always checkpoints, and so are the layers that follow them.
+
+#pragma once
+
+#include "nerva/neural_networks/dropout_layers.h"
+#include "nerva/neural_networks/low_rank_layers.h"
+#include "nerva/neural_networks/monarch_layers.h"
+#include "nerva/neural_networks/multilayer_perceptron.h"
+#include "nerva/utilities/stopwatch.h"
+#include "nerva/utilities/string_utility.h"
+#include "fmt/format.h"
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace nerva {
+
+/// Returns true if the feedforward step of the layer can be repeated without side effects.
+inline
+bool is_recomputable(const neural_network_layer* layer)
+{
+  if (dynamic_cast<const dropout_layer<eigen::matrix>*>(layer) || dynamic_cast<const dropout_layer<mkl::sparse_matrix_csr<scalar>>*>(layer))
+  {
+    return false;
+  }
+  return dynamic_cast<const linear_layer<eigen::matrix>*>(layer) ||
+         dynamic_cast<const linear_layer<mkl::sparse_matrix_csr<scalar>>*>(layer) ||
+         dynamic_cast<const low_rank_linear_layer*>(layer) ||
+         dynamic_cast<const monarch_linear_layer*>(layer) ||
+         dynamic_cast<const affine_layer*>(layer);
+}
+
+class activation_checkpointing
+{
+  protected:
+    std::vector<bool> m_checkpoints;  // m_checkpoints[i] is true if the activations of layer i are kept
+    std::vector<std::size_t> m_sizes; // m_sizes[i] is the size in bytes of the activations of layer i
+    std::size_t m_memory_budget = 0;
+    double m_recompute_seconds = 0;
+    eigen::matrix m_output;           // the recomputed output of the last layer
+
+    // Sets the checkpoints at the given positions, and at the positions where they are needed.
+    void set_checkpoints(const multilayer_perceptron& M, std::vector<bool> checkpoints)
+    {
+      std::size_t n = M.layers.size();
+      checkpoints.resize(n, false);
+      checkpoints[0] = true;
+      for (std::size_t i = 0; i < n; i++)
+      {
+        if (!is_recomputable(M.layers[i].get()))
+        {
+          checkpoints[i] = true;
+          if (i + 1 < n)
+          {
+            checkpoints[i + 1] = true;
+          }
+        }
+      }
+      m_checkpoints = checkpoints;
+    }
+
+    // Places a checkpoint every `distance` layers, in addition to the required checkpoints.
+    void set_checkpoint_distance(const multilayer_perceptron& M, std::size_t distance)
+    {
+      set_checkpoints(M, {});
+      std::size_t last = 0;
+      for (std::size_t i = 0; i < m_checkpoints.size(); i++)
+      {
+        if (m_checkpoints[i] || i - last >= distance)
+        {
+          m_checkpoints[i] = true;
+          last = i;
+        }
+      }
+    }
+
+    // Calls f(s, e) for the segments [s, e) of layers, starting with the last one.
+    template <typename Function>
+    void for_each_segment(Function f) const
+    {
+      std::size_t e = m_checkpoints.size();
+      while (e > 0)
+      {
+        std::size_t s = e - 1;
+        while (!m_checkpoints[s])
+        {
+          s--;
+        }
+        f(s, e);
+        e = s;
+      }
+    }
+
+  public:
+    /// Chooses the checkpoints for M such that the activations fit into memory_budget bytes, with as little
+    /// recomputation as possible. If that is impossible, the checkpoints with the smallest memory usage are chosen.
+    activation_checkpointing(const multilayer_perceptron& M, std::size_t memory_budget)
+      : m_memory_budget(memory_budget)
+    {
+      for (const auto& layer: M.layers)
+      {
+        m_sizes.push_back(layer->activation_size() * sizeof(scalar));
+      }
+
+      std::size_t n = M.layers.size();
+      std::size_t best_distance = 1;
+      std::size_t best_memory = std::numeric_limits<std::size_t>::max();
+      for (std::size_t distance = 1; distance <= n; distance++)
+      {
+        set_checkpoint_distance(M, distance);
+        std::size_t memory = peak_memory();
+        if (memory <= memory_budget)
+        {
+          best_distance = distance;  // larger distances need more recomputation
+          break;
+        }
+        if (memory < best_memory)
+        {
+          best_memory = memory;
+          best_distance = distance;
+        }
+      }
+      set_checkpoint_distance(M, best_distance);
+    }
+
+    /// Uses the given checkpoints for M, extended with the checkpoints that are required.
+    activation_checkpointing(const multilayer_perceptron& M, const std::vector<bool>& checkpoints)
+    {
+      for (const auto& layer: M.layers)
+      {
+        m_sizes.push_back(layer->activation_size() * sizeof(scalar));
+      }
+      set_checkpoints(M, checkpoints);
+      m_memory_budget = peak_memory();
+    }
+
+    [[nodiscard]] const std::vector<bool>& checkpoints() const
+    {
+      return m_checkpoints;
+    }
+
+    /// Returns the size in bytes of the activations without checkpointing.
+    [[nodiscard]] std::size_t full_memory() const
+    {
+      std::size_t result = 0;
+      for (std::size_t size: m_sizes)
+      {
+        result += size;
+      }
+      return result;
+    }
+
+    /// Returns the maximal size in bytes of the activations that are stored at the same time. These are the
+    /// activations of the checkpoints, and the recomputed activations of one segment.
+    [[nodiscard]] std::size_t peak_memory() const
+    {
+      std::size_t stored = 0;
+      std::size_t recomputed = 0;
+      for_each_segment([&](std::size_t s, std::size_t e)
+      {
+        stored += m_sizes[s];
+        std::size_t segment = 0;
+        for (std::size_t j = s + 1; j < e; j++)
+        {
+          segment += m_sizes[j];
+        }
+        recomputed = std::max(recomputed, segment);
+      });
+      return stored + recomputed;
+    }
+
+    /// Returns the number of feedforward steps of layers that are recomputed per batch.
+    [[nodiscard]] std::size_t recomputed_layers() const
+    {
+      std::size_t result = 0;
+      for_each_segment([&](std::size_t s, std::size_t e)
+      {
+        if (e - s > 1)
+        {
+          result += e - s;
+        }
+      });
+      return result;
+    }
+
+    /// Computes the output of M for the input X, and releases the activations of the layers that are not checkpoints.
+    void feedforward(multilayer_perceptron& M, const eigen::matrix& X, eigen::matrix& result)
+    {
+      NERVA_TIMER_START("feedforward");
+      auto& layers = M.layers;
+      std::size_t n = layers.size();
+      layers.front()->X = X;
+      for (std::size_t i = 0; i < n; i++)
+      {
+        layers[i]->feedforward(i + 1 < n ? layers[i + 1]->X : result);
+        if (!m_checkpoints[i])
+        {
+          layers[i]->release_activations();
+        }
+      }
+      NERVA_TIMER_STOP("feedforward");
+    }
+
+    /// Computes the same result as M.backpropagate(Y, DY), after a call to feedforward. The activations of each
+    /// segment are recomputed from its checkpoint, and released after the segment has been backpropagated.
+    void backpropagate(multilayer_perceptron& M, const eigen::matrix& Y, const eigen::matrix& DY)
+    {
+      NERVA_TIMER_START("backpropagate");
+      auto& layers = M.layers;
+      std::size_t n = layers.size();
+      for_each_segment([&](std::size_t s, std::size_t e)
+      {
+        if (e - s > 1)
+        {
+          utilities::stopwatch watch;
+          for (std::size_t j = s; j < e; j++)
+          {
+            layers[j]->feedforward(j + 1 < n ? layers[j + 1]->X : m_output);
+          }
+          m_recompute_seconds += watch.seconds();
+        }
+
+        for (std::size_t j = e; j-- > s; )
+        {
+          layers[j]->backpropagate(j + 1 < n ? layers[j + 1]->X : Y, j + 1 < n ? layers[j + 1]->DX : DY);
+        }
+
+        for (std::size_t j = s + 1; j < e; j++)
+        {
+          layers[j]->release_activations();
+        }
+      });
+      NERVA_TIMER_STOP("backpropagate");
+    }
+
+    [[nodiscard]] std::string to_string() const
+    {
+      std::vector<std::size_t> indices;
+      for (std::size_t i = 0; i < m_checkpoints.size(); i++)
+      {
+        if (m_checkpoints[i])
+        {
+          indices.push_back(i + 1);
+        }
+      }
+      std::size_t n = m_checkpoints.size();
+      constexpr double MB = 1024.0 * 1024.0;
+      std::string result = fmt::format("activation checkpoints: layers {}\n", utilities::string_join(indices, ", "));
+      result += fmt::format("activation memory: {:.2f} MB instead of {:.2f} MB (budget {:.2f} MB)\n", peak_memory() / MB, full_memory() / MB, m_memory_budget / MB);
+      result += fmt::format("recomputed layers per batch: {} of {} (+{:.1f}% feedforward), recomputation time: {:.8f}s", recomputed_layers(), n, 100.0 * recomputed_layers() / n, m_recompute_seconds);
+      return result;
+    }
+};
+
+} // namespace nerva
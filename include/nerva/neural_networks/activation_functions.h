@@ -281,28 +281,48 @@ struct All_relu_gradient
   }
 };
 
+// The functions Hyperbolic_tangent and Sigmoid use the vectorized (SIMD) implementations of tanh and exp in
+// Eigen. Compared to the exact values, in single precision the error of Hyperbolic_tangent is at most 8 ulp
+// (an absolute error below 5e-7), and the error of Sigmoid is at most 4 ulp. In double precision both are
+// accurate up to a few ulp.
+
 template <typename Matrix>
 auto Hyperbolic_tangent(const Matrix& X)
 {
-  return eigen::apply(hyperbolic_tangent, X);
+  return X.array().tanh().matrix();
 }
 
 template <typename Matrix>
 auto Hyperbolic_tangent_gradient(const Matrix& X)
 {
-  return eigen::apply(hyperbolic_tangent_derivative, X);
+  return (scalar(1) - X.array().tanh().square()).matrix();
+}
+
+// Computes the gradient of Hyperbolic_tangent from its output Y = Hyperbolic_tangent(X)
+template <typename Matrix>
+auto Hyperbolic_tangent_output_gradient(const Matrix& Y)
+{
+  return (scalar(1) - Y.array().square()).matrix();
 }
 
 template <typename Matrix>
 auto Sigmoid(const Matrix& X)
 {
-  return eigen::apply(sigmoid, X);
+  return (scalar(1) + (-X.array()).exp()).inverse().matrix();
 }
 
 template <typename Matrix>
 auto Sigmoid_gradient(const Matrix& X)
 {
-  return eigen::apply(sigmoid_derivative, X);
+  eigen::matrix Y = Sigmoid(X);
+  return (Y.array() * (scalar(1) - Y.array())).matrix().eval();
+}
+
+// Computes the gradient of Sigmoid from its output Y = Sigmoid(X)
+template <typename Matrix>
+auto Sigmoid_output_gradient(const Matrix& Y)
+{
+  return (Y.array() * (scalar(1) - Y.array())).matrix();
 }
 
 struct Srelu
@@ -461,6 +481,13 @@ struct hyperbolic_tangent_activation
     return Hyperbolic_tangent_gradient(X);
   }
 
+  // Computes the gradient from the output Y = (*this)(X), which is cheaper than recomputing it from X
+  template <typename Matrix>
+  auto output_gradient(const Matrix& Y) const
+  {
+    return Hyperbolic_tangent_output_gradient(Y);
+  }
+
   [[nodiscard]] std::string to_string() const
   {
     return "HyperbolicTangent()";
@@ -481,6 +508,13 @@ struct sigmoid_activation
     return Sigmoid_gradient(X);
   }
 
+  // Computes the gradient from the output Y = (*this)(X), which is cheaper than recomputing it from X
+  template <typename Matrix>
+  auto output_gradient(const Matrix& Y) const
+  {
+    return Sigmoid_output_gradient(Y);
+  }
+
   [[nodiscard]] std::string to_string() const
   {
     return "Sigmoid()";
@@ -545,6 +579,52 @@ struct srelu_activation
     return Srelu_gradient(al, tl, ar, tr)(X);
   }
 
+  /// Computes DZ = hadamard(DY, gradient(Z)), and stores the gradients of the parameters al, tl, ar, tr in Dx.
+  /// This is done in a single pass over Z and DY, using partial sums per thread.
+  void backpropagate(const eigen::matrix& Z, const eigen::matrix& DY, eigen::matrix& DZ)
+  {
+    const scalar al = x(0, 0);
+    const scalar tl = x(0, 1);
+    const scalar ar = x(0, 2);
+    const scalar tr = x(0, 3);
+    const long N = Z.rows();
+    const long K = Z.cols();
+
+    DZ.resize(N, K);
+    scalar Dal = 0;
+    scalar Dtl = 0;
+    scalar Dar = 0;
+    scalar Dtr = 0;
+
+#pragma omp parallel for reduction(+:Dal,Dtl,Dar,Dtr)
+    for (long i = 0; i < N; i++)
+    {
+      for (long j = 0; j < K; j++)
+      {
+        scalar z = Z(i, j);
+        scalar dy = DY(i, j);
+        if (z <= tl)
+        {
+          DZ(i, j) = al * dy;
+          Dal += (z - tl) * dy;
+          Dtl += (1 - al) * dy;
+        }
+        else if (z < tr)
+        {
+          DZ(i, j) = dy;
+        }
+        else
+        {
+          DZ(i, j) = ar * dy;
+          Dar += (z - tr) * dy;
+          Dtr += (1 - ar) * dy;
+        }
+      }
+    }
+
+    Dx = eigen::matrix{{Dal, Dtl, Dar, Dtr}};
+  }
+
   [[nodiscard]] std::string to_string() const
   {
     auto al = x(0, 0);
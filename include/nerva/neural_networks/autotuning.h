@@ -0,0 +1,246 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/autotuning.h
+/// \brief Selection of the execution plans of linear layers using micro benchmarks.
+///
+/// The autotuner measures the time of a feedforward and a backpropagation step of each linear layer for a number of
+/// candidate execution plans, using the first batch of the training data, and assigns the fastest plan to the layer.
+/// The results are stored in a cache file, with keys that consist of the CPU model, the number of threads, and the
+/// shape, density and batch size of the layer. Layers that are found in the cache are not measured again, so later
+/// runs start with the tuned plans immediately.
+///
+/// The cache file contains one line per key, of the shape <key> = ExecutionPlan(...).
+
+#pragma once
+
+#include "nerva/neural_networks/execution_plan.h"
+#include "nerva/neural_networks/layers.h"
+#include "nerva/neural_networks/mlp_algorithms.h"
+#include "nerva/neural_networks/multilayer_perceptron.h"
+#include "nerva/utilities/stopwatch.h"
+#include "nerva/utilities/string_utility.h"
+#include "fmt/format.h"
+#include <fstream>
+#include <limits>
+#include <map>
+#include <omp.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace nerva {
+
+/// Returns the model name of the CPU, as found in /proc/cpuinfo.
+inline
+std::string cpu_model()
+{
+  std::ifstream from("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(from, line))
+  {
+    if (utilities::starts_with(line, "model name"))
+    {
+      auto pos = line.find(':');
+      if (pos != std::string::npos)
+      {
+        std::string result = line.substr(pos + 1);
+        utilities::trim(result);
+        return result;
+      }
+    }
+  }
+  return "unknown";
+}
+
+class autotuning_cache
+{
+  protected:
+    std::string m_filename;
+    std::map<std::string, execution_plan> m_plans;
+
+  public:
+    /// Loads the cache from the given file. If the file does not exist, the cache is empty.
+    explicit autotuning_cache(std::string filename)
+      : m_filename(std::move(filename))
+    {
+      std::ifstream from(m_filename);
+      std::string line;
+      while (std::getline(from, line))
+      {
+        auto pos = line.rfind(" = ");
+        if (pos == std::string::npos)
+        {
+          continue;
+        }
+        m_plans[line.substr(0, pos)] = parse_execution_plan(line.substr(pos + 3));
+      }
+    }
+
+    [[nodiscard]] const execution_plan* find(const std::string& key) const
+    {
+      auto i = m_plans.find(key);
+      return i == m_plans.end() ? nullptr : &i->second;
+    }
+
+    void insert(const std::string& key, const execution_plan& plan)
+    {
+      m_plans[key] = plan;
+    }
+
+    void save() const
+    {
+      std::ofstream to(m_filename);
+      if (!to)
+      {
+        throw std::runtime_error("could not write the autotuning cache " + m_filename);
+      }
+      for (const auto& [key, plan]: m_plans)
+      {
+        to << key << " = " << plan.to_string() << '\n';
+      }
+    }
+};
+
+template <typename Matrix>
+std::string autotuning_key(const linear_layer<Matrix>& layer)
+{
+  std::string cpu = cpu_model();
+  auto D = layer.input_size();
+  auto K = layer.output_size();
+  auto N = layer.X.rows();
+  if constexpr (linear_layer<Matrix>::IsSparse)
+  {
+    return fmt::format("{} | threads={} | Sparse(D={}, K={}, N={}, density={:.4f})", cpu, omp_get_max_threads(), D, K, N, layer.W.density());
+  }
+  else
+  {
+    return fmt::format("{} | threads={} | Dense(D={}, K={}, N={})", cpu, omp_get_max_threads(), D, K, N);
+  }
+}
+
+/// Returns the candidate execution plans of a layer. For dense layers these are the Eigen and MKL matrix products,
+/// and for sparse layers the kernels and batch sizes of the computation of the weight gradient.
+template <typename Matrix>
+std::vector<execution_plan> autotuning_candidates(const linear_layer<Matrix>& layer)
+{
+  std::vector<execution_plan> result;
+  if constexpr (linear_layer<Matrix>::IsSparse)
+  {
+    long K = layer.output_size();
+    std::vector<long> batch_sizes = { std::max(4L, K / 10), 16, 64, 256 };
+    std::sort(batch_sizes.begin(), batch_sizes.end());
+    batch_sizes.erase(std::unique(batch_sizes.begin(), batch_sizes.end()), batch_sizes.end());
+    for (auto kernel: { sparse_gradient_kernel::mkl, sparse_gradient_kernel::eigen })
+    {
+      for (long batch_size: batch_sizes)
+      {
+        if (batch_size <= K)
+        {
+          execution_plan plan;
+          plan.sparse_gradient = kernel;
+          plan.sparse_gradient_batch_size = batch_size;
+          result.push_back(plan);
+        }
+      }
+    }
+  }
+  else
+  {
+    for (auto c: { computation::eigen, computation::mkl })
+    {
+      execution_plan plan;
+      plan.dense_computation = c;
+      result.push_back(plan);
+    }
+  }
+  return result;
+}
+
+/// Returns the candidate plan with the smallest time of a feedforward and a backpropagation step. The input X of
+/// the layer must be set. The parameters of the layer are not changed.
+template <typename Matrix>
+execution_plan autotune_layer(linear_layer<Matrix>& layer, unsigned int repetitions = 3)
+{
+  eigen::matrix Y;
+  eigen::matrix DY = eigen::matrix::Constant(layer.X.rows(), layer.output_size(), scalar(0.01));
+  auto candidates = autotuning_candidates(layer);
+  execution_plan result = layer.plan;
+  double best_time = std::numeric_limits<double>::max();
+
+  for (const auto& plan: candidates)
+  {
+    layer.plan = plan;
+    layer.feedforward(Y);  // warm up, e.g. for the jit kernels of MKL
+    layer.backpropagate(Y, DY);
+    double time = std::numeric_limits<double>::max();
+    for (unsigned int i = 0; i < repetitions; i++)
+    {
+      utilities::stopwatch watch;
+      layer.feedforward(Y);
+      layer.backpropagate(Y, DY);
+      time = std::min(time, watch.seconds());
+    }
+    NERVA_LOG(log::verbose) << fmt::format("autotuning {}: {:.6f}s\n", plan.to_string(), time);
+    if (time < best_time)
+    {
+      best_time = time;
+      result = plan;
+    }
+  }
+  return result;
+}
+
+/// Assigns an execution plan to every linear layer of M. The plans are taken from the cache file if possible,
+/// otherwise they are determined with autotune_layer using the inputs of the layers for the batch X. New plans
+/// are added to the cache file. Dense layers are skipped in mixed precision mode, since they do not use the plan.
+inline
+void autotune(multilayer_perceptron& M, const eigen::matrix& X, const std::string& cache_file, unsigned int repetitions = 3)
+{
+  autotuning_cache cache(cache_file);
+  bool changed = false;
+
+  // compute the inputs of the layers; the evaluation mode avoids side effects of dropout and batch normalization
+  set_training_mode(M, false);
+  eigen::matrix Y;
+  M.feedforward(X, Y);
+
+  auto tune = [&](auto& layer)
+  {
+    auto key = autotuning_key(layer);
+    if (auto plan = cache.find(key))
+    {
+      layer.plan = *plan;
+    }
+    else
+    {
+      layer.plan = autotune_layer(layer, repetitions);
+      cache.insert(key, layer.plan);
+      changed = true;
+    }
+    NERVA_LOG(log::verbose) << fmt::format("execution plan of {}: {}\n", layer.to_string(), layer.plan.to_string());
+  };
+
+  for (auto& layer: M.layers)
+  {
+    if (auto slayer = dynamic_cast<linear_layer<mkl::sparse_matrix_csr<scalar>>*>(layer.get()))
+    {
+      tune(*slayer);
+    }
+    else if (auto dlayer = dynamic_cast<linear_layer<eigen::matrix>*>(layer.get()); dlayer && !NervaMixedPrecision)
+    {
+      tune(*dlayer);
+    }
+  }
+  set_training_mode(M, true);
+
+  if (changed)
+  {
+    cache.save();
+  }
+}
+
+} // namespace nerva
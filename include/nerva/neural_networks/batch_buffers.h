@@ -0,0 +1,101 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/batch_buffers.h
+/// \brief Sets of batch sized buffers that can be exchanged with the buffers of the layers.
+///
+/// The layers have buffers like X, DX, Z and DZ with one row per example of a batch. Eigen matrices are
+/// reallocated whenever their size changes, so a feedforward step with a different batch size reallocates the
+/// buffers of all layers, and the next training batch reallocates them again. A batch_buffer_set holds a
+/// separate set of these buffers. Exchanging it with the buffers of the layers takes constant time, since
+/// only the data pointers are swapped. A buffer set is allocated when it is first used with a batch size,
+/// and it is reused for later batches of the same size. A batch_buffer_cache holds one buffer set per batch size,
+/// for computations that alternate between batch sizes.
+
+#pragma once
+
+#include "nerva/neural_networks/layers.h"
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace nerva {
+
+class batch_buffer_set
+{
+  protected:
+    std::vector<std::vector<eigen::matrix>> m_buffers;
+
+  public:
+    /// Exchanges the batch sized buffers of the layers with the buffers in this set.
+    void swap(std::vector<std::shared_ptr<neural_network_layer>>& layers)
+    {
+      m_buffers.resize(layers.size());
+      for (std::size_t i = 0; i < layers.size(); i++)
+      {
+        auto buffers = layers[i]->batch_buffers();
+        m_buffers[i].resize(buffers.size());
+        for (std::size_t j = 0; j < buffers.size(); j++)
+        {
+          buffers[j]->swap(m_buffers[i][j]);
+        }
+      }
+    }
+
+    void clear()
+    {
+      m_buffers.clear();
+    }
+};
+
+/// A buffer set for every batch size that has been used.
+class batch_buffer_cache
+{
+  protected:
+    std::map<long, batch_buffer_set> m_buffers;
+
+  public:
+    /// Returns the buffer set for batches of the given size.
+    batch_buffer_set& operator[](long batch_size)
+    {
+      return m_buffers[batch_size];
+    }
+
+    [[nodiscard]] std::size_t size() const
+    {
+      return m_buffers.size();
+    }
+
+    void clear()
+    {
+      m_buffers.clear();
+    }
+};
+
+/// Uses a buffer set in the layers during the lifetime of this object.
+class scoped_batch_buffers
+{
+  protected:
+    std::vector<std::shared_ptr<neural_network_layer>>& m_layers;
+    batch_buffer_set& m_buffers;
+
+  public:
+    scoped_batch_buffers(std::vector<std::shared_ptr<neural_network_layer>>& layers, batch_buffer_set& buffers)
+      : m_layers(layers), m_buffers(buffers)
+    {
+      m_buffers.swap(m_layers);
+    }
+
+    scoped_batch_buffers(const scoped_batch_buffers&) = delete;
+    scoped_batch_buffers& operator=(const scoped_batch_buffers&) = delete;
+
+    ~scoped_batch_buffers()
+    {
+      m_buffers.swap(m_layers);
+    }
+};
+
+} // namespace nerva
@@ -12,10 +12,132 @@
 #include "nerva/neural_networks/nerva_timer.h"
 #include "nerva/neural_networks/layers.h"
 #include "fmt/format.h"
+#include <algorithm>
 #include <random>
 
 namespace nerva {
 
+// The batch normalization kernels below process the features in blocks of this size. Each block is
+// handled by a single thread, and the column reductions within a block are done with a sweep over the
+// rows of the block, which are contiguous in memory.
+constexpr long batch_normalization_block_size = 32;
+
+/// Computes Z = (X - mean(X)) / sqrt(var(X)) column-wise, and inv_sqrt_Sigma = 1 / sqrt(var(X)).
+/// This is equivalent to the computation
+/// \code
+///   R = X - row_repeat(columns_mean(X), N)
+///   Sigma = diag(R^T * R)^T / N
+///   inv_sqrt_Sigma = inv_sqrt(Sigma)
+///   Z = hadamard(row_repeat(inv_sqrt_Sigma, N), R)
+/// \endcode
+/// but it runs in O(N D) time and does not create any temporaries of size D x D.
+/// \param X An N x D matrix
+/// \param Z An N x D matrix that receives the standardized values
+/// \param mean A 1 x D matrix that receives the column means of X
+/// \param Sigma A 1 x D matrix that receives the column variances of X
+/// \param inv_sqrt_Sigma A 1 x D matrix that receives the inverse standard deviations
+inline
+void batch_normalization_standardize(const eigen::matrix& X, eigen::matrix& Z, eigen::matrix& mean, eigen::matrix& Sigma, eigen::matrix& inv_sqrt_Sigma)
+{
+  using row_vector = Eigen::Matrix<scalar, 1, Eigen::Dynamic>;
+  const long N = X.rows();
+  const long D = X.cols();
+
+  Z.resize(N, D);
+  mean.resize(1, D);
+  Sigma.resize(1, D);
+  inv_sqrt_Sigma.resize(1, D);
+
+#pragma omp parallel for
+  for (long j = 0; j < D; j += batch_normalization_block_size)
+  {
+    long w = std::min(batch_normalization_block_size, D - j);
+    auto X_j = X.middleCols(j, w);
+    auto Z_j = Z.middleCols(j, w);
+
+    row_vector mu = X_j.colwise().sum() / scalar(N);
+    Z_j = X_j.rowwise() - mu;
+    row_vector sigma = Z_j.array().square().colwise().sum() / scalar(N);
+    row_vector inv_sqrt_sigma = eigen::inv_sqrt(sigma);
+    Z_j.array().rowwise() *= inv_sqrt_sigma.array();
+    mean.middleCols(j, w) = mu;
+    Sigma.middleCols(j, w) = sigma;
+    inv_sqrt_Sigma.middleCols(j, w) = inv_sqrt_sigma;
+  }
+}
+
+inline
+void batch_normalization_standardize(const eigen::matrix& X, eigen::matrix& Z, eigen::matrix& inv_sqrt_Sigma)
+{
+  eigen::matrix mean;
+  eigen::matrix Sigma;
+  batch_normalization_standardize(X, Z, mean, Sigma, inv_sqrt_Sigma);
+}
+
+/// Computes the gradients of a batch normalization layer with output Y = hadamard(row_repeat(gamma, N), Z) + row_repeat(beta, N).
+/// This is equivalent to the computation
+/// \code
+///   DZ = hadamard(row_repeat(gamma, N), DY)
+///   Dbeta = columns_sum(DY)
+///   Dgamma = columns_sum(hadamard(Z, DY))
+///   DX = hadamard(row_repeat(inv_sqrt_Sigma / N, N), (N * I - ones(N, N)) * DZ - hadamard(Z, row_repeat(diag(Z^T * DZ)^T, N)))
+/// \endcode
+/// It uses the identities ones(N, N) * DZ = row_repeat(columns_sum(DZ), N) and diag(Z^T * DZ)^T = columns_sum(hadamard(Z, DZ)),
+/// so it runs in O(N D) time and does not create any temporaries of size N x N or D x D.
+/// \param Z The standardized input computed in the feedforward step (N x D)
+/// \param DY The gradient of the output (N x D)
+/// \param gamma The scaling factors (1 x D)
+/// \param inv_sqrt_Sigma The inverse standard deviations computed in the feedforward step (1 x D)
+/// \param DX Receives the gradient of the input (N x D)
+/// \param Dgamma Receives the gradient of gamma (1 x D)
+/// \param Dbeta Receives the gradient of beta (1 x D)
+inline
+void batch_normalization_backpropagate(const eigen::matrix& Z,
+                                       const eigen::matrix& DY,
+                                       const eigen::matrix& gamma,
+                                       const eigen::matrix& inv_sqrt_Sigma,
+                                       eigen::matrix& DX,
+                                       eigen::matrix& Dgamma,
+                                       eigen::matrix& Dbeta
+                                      )
+{
+  using row_vector = Eigen::Matrix<scalar, 1, Eigen::Dynamic>;
+  const long N = Z.rows();
+  const long D = Z.cols();
+
+  DX.resize(N, D);
+  Dgamma.resize(1, D);
+  Dbeta.resize(1, D);
+
+#pragma omp parallel for
+  for (long j = 0; j < D; j += batch_normalization_block_size)
+  {
+    long w = std::min(batch_normalization_block_size, D - j);
+    auto Z_j = Z.middleCols(j, w);
+    auto DY_j = DY.middleCols(j, w);
+    auto DX_j = DX.middleCols(j, w);
+
+    row_vector dbeta = row_vector::Zero(w);
+    row_vector dgamma = row_vector::Zero(w);
+    for (long i = 0; i < N; i++)
+    {
+      dbeta += DY_j.row(i);
+      dgamma.array() += Z_j.row(i).array() * DY_j.row(i).array();
+    }
+    Dbeta.middleCols(j, w) = dbeta;
+    Dgamma.middleCols(j, w) = dgamma;
+
+    // DX = inv_sqrt_Sigma * gamma * (DY - Dbeta / N - Z * Dgamma / N)
+    row_vector a = inv_sqrt_Sigma.middleCols(j, w).array() * gamma.middleCols(j, w).array();
+    row_vector b = dbeta / scalar(N);
+    row_vector c = dgamma / scalar(N);
+    for (long i = 0; i < N; i++)
+    {
+      DX_j.row(i).array() = a.array() * (DY_j.row(i).array() - b.array() - Z_j.row(i).array() * c.array());
+    }
+  }
+}
+
 struct batch_normalization_layer: public neural_network_layer
 {
   using super = neural_network_layer;
@@ -23,19 +145,26 @@ struct batch_normalization_layer: public neural_network_layer
   using super::DX;
 
   eigen::matrix Z;
-  eigen::matrix DZ;
   eigen::matrix gamma;
   eigen::matrix Dgamma;
   eigen::matrix beta;
   eigen::matrix Dbeta;
+  eigen::matrix mean;
+  eigen::matrix Sigma;
   eigen::matrix inv_sqrt_Sigma;
+  eigen::matrix running_mean;
+  eigen::matrix running_Sigma;
+  scalar momentum = 0.1;  // the weight of the current batch in the running statistics
+  bool training = true;   // if false, the running statistics are used instead of the batch statistics
   std::shared_ptr<optimizer_function> optimizer;
 
   explicit batch_normalization_layer(std::size_t D, std::size_t N = 1)
-   : super(D, N), Z(N, D), DZ(N, D), gamma(1, D), Dgamma(1, D), beta(1, D), Dbeta(1, D), inv_sqrt_Sigma(1, D)
+   : super(D, N), Z(N, D), gamma(1, D), Dgamma(1, D), beta(1, D), Dbeta(1, D), mean(1, D), Sigma(1, D), inv_sqrt_Sigma(1, D), running_mean(1, D), running_Sigma(1, D)
   {
     beta.array() = 0;
     gamma.array() = 1;
+    running_mean.array() = 0;
+    running_Sigma.array() = 1;
   }
 
   [[nodiscard]] std::string to_string() const override
@@ -43,49 +172,44 @@ struct batch_normalization_layer: public neural_network_layer
     return fmt::format("BatchNormalization(input_size={}, output_size={})", Z.rows(), Z.rows());
   }
 
-  void feedforward(eigen::matrix& result) override
+  /// Computes the element-wise transformation result = hadamard(row_repeat(scale, N), X) + row_repeat(shift, N)
+  /// that this layer applies at inference time, i.e. using the running statistics.
+  void inference_scale_and_shift(eigen::matrix& scale, eigen::matrix& shift) const
   {
-    using eigen::diag;
     using eigen::hadamard;
     using eigen::inv_sqrt;
-    using eigen::row_repeat;
-    using eigen::columns_mean;
-    auto N = X.rows();
 
-    auto R = (X - row_repeat(columns_mean(X), N)).eval();
-    auto Sigma = diag(R.transpose() * R).transpose() / N;
-    inv_sqrt_Sigma = inv_sqrt(Sigma);
-    Z = hadamard(row_repeat(inv_sqrt_Sigma, N), R);
-    result = hadamard(row_repeat(gamma, N), Z) + row_repeat(beta, N);
+    scale = hadamard(gamma, inv_sqrt(running_Sigma));
+    shift = beta - hadamard(running_mean, scale);
   }
 
-  // tag::timer[]
-  void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
+  void feedforward(eigen::matrix& result) override
   {
-    using eigen::diag;
     using eigen::hadamard;
     using eigen::row_repeat;
-    using eigen::columns_sum;
-    using eigen::identity;
-    using eigen::ones;
-    using eigen::inv_sqrt;
     auto N = X.rows();
 
-    NERVA_TIMER_START("batchnorm1")
-    DZ = hadamard(row_repeat(gamma, N), DY);
-    NERVA_TIMER_STOP("batchnorm1")
+    if (!training)
+    {
+      eigen::matrix scale;
+      eigen::matrix shift;
+      inference_scale_and_shift(scale, shift);
+      result = hadamard(row_repeat(scale, N), X) + row_repeat(shift, N);
+      return;
+    }
 
-    NERVA_TIMER_START("batchnorm2")
-    Dbeta = columns_sum(DY);
-    NERVA_TIMER_STOP("batchnorm2")
-
-    NERVA_TIMER_START("batchnorm3")
-    Dgamma = columns_sum(hadamard(Z, DY));
-    NERVA_TIMER_STOP("batchnorm3")
+    batch_normalization_standardize(X, Z, mean, Sigma, inv_sqrt_Sigma);
+    result = hadamard(row_repeat(gamma, N), Z) + row_repeat(beta, N);
+    running_mean = (1 - momentum) * running_mean + momentum * mean;
+    running_Sigma = (1 - momentum) * running_Sigma + momentum * Sigma;
+  }
 
-    NERVA_TIMER_START("batchnorm4")
-    DX = hadamard(row_repeat(inv_sqrt_Sigma / N, N), (N * identity<eigen::matrix>(N) - ones<eigen::matrix>(N, N)) * DZ - hadamard(Z, row_repeat(diag(Z.transpose() * DZ).transpose(), N)));
-    NERVA_TIMER_STOP("batchnorm4")
+  // tag::timer[]
+  void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
+  {
+    NERVA_TIMER_START("batchnorm")
+    batch_normalization_backpropagate(Z, DY, gamma, inv_sqrt_Sigma, DX, Dgamma, Dbeta);
+    NERVA_TIMER_STOP("batchnorm")
   }
   // end::timer[]
 
@@ -100,6 +224,13 @@ struct batch_normalization_layer: public neural_network_layer
     std::cout << to_string() << std::endl;
     print_numpy_matrix("beta" + i, beta);
     print_numpy_matrix("gamma" + i, gamma);
+    print_numpy_matrix("running_mean" + i, running_mean);
+    print_numpy_matrix("running_Sigma" + i, running_Sigma);
+  }
+
+  std::vector<eigen::matrix*> batch_buffers() override
+  {
+    return { &X, &DX, &Z };
   }
 };
 
@@ -126,30 +257,16 @@ struct simple_batch_normalization_layer: public neural_network_layer
 
   void feedforward(eigen::matrix& result) override
   {
-    using eigen::diag;
-    using eigen::hadamard;
-    using eigen::inv_sqrt;
-    using eigen::row_repeat;
-    using eigen::columns_mean;
-    auto N = X.rows();
-
-    auto R = (X - row_repeat(columns_mean(X), N)).eval();
-    auto Sigma = diag(R.transpose() * R).transpose() / N;
-    inv_sqrt_Sigma = inv_sqrt(Sigma);
-    result = hadamard(row_repeat(inv_sqrt_Sigma, N), R);
+    batch_normalization_standardize(X, result, inv_sqrt_Sigma);
   }
 
+  // The output Y of the feedforward step is the standardized input, so it can be used as Z.
   void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
   {
-    using eigen::diag;
-    using eigen::hadamard;
-    using eigen::identity;
-    using eigen::ones;
-    using eigen::inv_sqrt;
-    using eigen::column_repeat;
-    auto N = X.rows();
-
-    DX = hadamard(column_repeat(inv_sqrt_Sigma / N, N), hadamard(Y, column_repeat(-diag(DY * Y.transpose()), N)) + DY * (N * identity<eigen::matrix>(N) - ones<eigen::matrix>(N, N)));
+    eigen::matrix gamma = eigen::matrix::Ones(1, Y.cols());
+    eigen::matrix Dgamma;
+    eigen::matrix Dbeta;
+    batch_normalization_backpropagate(Y, DY, gamma, inv_sqrt_Sigma, DX, Dgamma, Dbeta);
   }
 
   void optimize(scalar eta) override
@@ -213,6 +330,50 @@ struct affine_layer: public neural_network_layer
 
 using dense_affine_layer = affine_layer;
 
+/// Replaces the parameters of a linear layer with output Y by the parameters of a linear layer with output
+/// hadamard(row_repeat(scale, N), Y) + row_repeat(shift, N). So W := Diag(scale) * W and b := hadamard(scale, b) + shift.
+template <typename Matrix>
+void fold_scale_and_shift(linear_layer<Matrix>& layer, const eigen::matrix& scale, const eigen::matrix& shift)
+{
+  using eigen::hadamard;
+
+  if constexpr (linear_layer<Matrix>::IsSparse)
+  {
+    const auto& row_index = layer.W.row_index();
+    auto& values = layer.W.values();
+    for (long i = 0; i < layer.W.rows(); i++)
+    {
+      for (auto k = row_index[i]; k < row_index[i + 1]; k++)
+      {
+        values[k] *= scale(0, i);
+      }
+    }
+    layer.W.construct_csr();
+  }
+  else
+  {
+    layer.W.array().colwise() *= scale.row(0).transpose().array();
+  }
+  layer.b = hadamard(scale, layer.b) + shift;
+}
+
+/// Folds a batch normalization layer in inference mode into the preceding linear layer.
+template <typename Matrix>
+void fold_batch_normalization_layer(linear_layer<Matrix>& layer, const batch_normalization_layer& blayer)
+{
+  eigen::matrix scale;
+  eigen::matrix shift;
+  blayer.inference_scale_and_shift(scale, shift);
+  fold_scale_and_shift(layer, scale, shift);
+}
+
+/// Folds an affine layer into the preceding linear layer.
+template <typename Matrix>
+void fold_affine_layer(linear_layer<Matrix>& layer, const affine_layer& alayer)
+{
+  fold_scale_and_shift(layer, alayer.gamma, alayer.beta);
+}
+
 template <typename BatchNormalizationLayer>
 void set_batch_normalization_layer_optimizer(BatchNormalizationLayer& layer, const std::string& text)
 {
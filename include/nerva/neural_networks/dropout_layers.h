@@ -12,26 +12,195 @@
 #include "nerva/neural_networks/layers.h"
 #include "nerva/neural_networks/matrix_operations.h"
 #include "fmt/format.h"
+#include <algorithm>
+#include <cstdint>
 #include <random>
+#include <vector>
 
 namespace nerva {
 
+// Returns the random number with index counter in the stream determined by seed. This is the SplitMix64
+// generator, which is counter-based: random numbers can be generated in any order, and in parallel.
+inline
+std::uint64_t counter_based_random(std::uint64_t seed, std::uint64_t counter)
+{
+  std::uint64_t z = seed + (counter + 1) * 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30U)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27U)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31U);
+}
+
+// A K x D dropout mask that is stored using one bit per element. An element of the mask is either 0 or
+// value. Each row is padded to a whole number of 64-bit words.
+class dropout_mask
+{
+  protected:
+    long m_rows;
+    long m_columns;
+    long m_words_per_row;
+    std::vector<std::uint64_t> m_bits;
+    scalar m_value = 1;
+
+    static constexpr long word_size = 64;
+
+  public:
+    // Creates a mask with all elements equal to 1
+    dropout_mask(long rows, long columns)
+      : m_rows(rows),
+        m_columns(columns),
+        m_words_per_row((columns + word_size - 1) / word_size),
+        m_bits(rows * m_words_per_row, ~std::uint64_t(0))
+    {}
+
+    [[nodiscard]] long rows() const
+    {
+      return m_rows;
+    }
+
+    [[nodiscard]] long cols() const
+    {
+      return m_columns;
+    }
+
+    [[nodiscard]] scalar value() const
+    {
+      return m_value;
+    }
+
+    [[nodiscard]] bool bit(long i, long j) const
+    {
+      return (m_bits[i * m_words_per_row + j / word_size] >> (j % word_size)) & 1U;
+    }
+
+    [[nodiscard]] scalar operator()(long i, long j) const
+    {
+      return bit(i, j) ? m_value : scalar(0);
+    }
+
+    // Sets each element of the mask to 1/p with probability p, and to 0 otherwise. The element (i, j) is
+    // determined by the random number with index i * cols() + j in the stream with the given seed, so the
+    // result does not depend on the number of threads.
+    void renew(scalar p, std::uint64_t seed)
+    {
+      auto threshold = static_cast<std::uint64_t>(static_cast<double>(p) * 4294967296.0);  // p * 2^32
+      m_value = scalar(1) / p;
+
+#pragma omp parallel for
+      for (long i = 0; i < m_rows; i++)
+      {
+        for (long w = 0; w < m_words_per_row; w++)
+        {
+          std::uint64_t word = 0;
+          long j_end = std::min(word_size, m_columns - w * word_size);
+          for (long j = 0; j < j_end; j++)
+          {
+            std::uint64_t counter = i * m_columns + w * word_size + j;
+            if ((counter_based_random(seed, counter) >> 32U) < threshold)
+            {
+              word |= std::uint64_t(1) << j;
+            }
+          }
+          m_bits[i * m_words_per_row + w] = word;
+        }
+      }
+    }
+
+    // Computes row := hadamard(row, R.row(i))
+    template <typename Row>
+    void apply_row(long i, Row&& row) const
+    {
+      const std::uint64_t* words = &m_bits[i * m_words_per_row];
+      for (long j = 0; j < m_columns; j++)
+      {
+        row[j] = ((words[j / word_size] >> (j % word_size)) & 1U) ? row[j] * m_value : scalar(0);
+      }
+    }
+
+    // Computes A := hadamard(A, R)
+    template <typename Matrix>
+    void apply(Matrix& A) const
+    {
+#pragma omp parallel for
+      for (long i = 0; i < m_rows; i++)
+      {
+        apply_row(i, A.row(i));
+      }
+    }
+
+    [[nodiscard]] eigen::matrix to_matrix() const
+    {
+      eigen::matrix R(m_rows, m_columns);
+      for (long i = 0; i < m_rows; i++)
+      {
+        for (long j = 0; j < m_columns; j++)
+        {
+          R(i, j) = (*this)(i, j);
+        }
+      }
+      return R;
+    }
+};
+
+// The number of rows of W that are masked at the same time in the products below.
+constexpr long dropout_block_size = 64;
+
+/// Computes result = X * hadamard(W, R)^T without creating the matrix hadamard(W, R). Instead, blocks of
+/// rows of W are masked one at a time.
+inline
+void dropout_product_transposed(const eigen::matrix& X, const eigen::matrix& W, const dropout_mask& R, eigen::matrix& result)
+{
+  const long K = W.rows();
+  result.resize(X.rows(), K);
+  eigen::matrix W_k(std::min(dropout_block_size, K), W.cols());
+
+  for (long k = 0; k < K; k += dropout_block_size)
+  {
+    long size = std::min(dropout_block_size, K - k);
+    W_k.topRows(size) = W.middleRows(k, size);
+    for (long i = 0; i < size; i++)
+    {
+      R.apply_row(k + i, W_k.row(i));
+    }
+    result.middleCols(k, size).noalias() = X * W_k.topRows(size).transpose();
+  }
+}
+
+/// Computes result = DZ * hadamard(W, R) without creating the matrix hadamard(W, R). Instead, blocks of
+/// rows of W are masked one at a time.
+inline
+void dropout_product(const eigen::matrix& DZ, const eigen::matrix& W, const dropout_mask& R, eigen::matrix& result)
+{
+  const long K = W.rows();
+  result.setZero(DZ.rows(), W.cols());
+  eigen::matrix W_k(std::min(dropout_block_size, K), W.cols());
+
+  for (long k = 0; k < K; k += dropout_block_size)
+  {
+    long size = std::min(dropout_block_size, K - k);
+    W_k.topRows(size) = W.middleRows(k, size);
+    for (long i = 0; i < size; i++)
+    {
+      R.apply_row(k + i, W_k.row(i));
+    }
+    result.noalias() += DZ.middleCols(k, size) * W_k.topRows(size);
+  }
+}
+
 template<typename Matrix>
 struct dropout_layer
 {
-  Matrix R;
+  dropout_mask R;
   scalar p;
+  bool training = true;  // if false, no dropout is applied
 
   dropout_layer(std::size_t D, std::size_t K, scalar p_)
-    : p(p_)
-  {
-    R = eigen::matrix::Constant(K, D, scalar(1));
-  }
+    : R(K, D), p(p_)
+  {}
 
   void renew(std::mt19937& rng)
   {
-    std::bernoulli_distribution dist(p);
-    R = R.unaryExpr([&](scalar X) { return static_cast<scalar>(dist(rng)) / p; });
+    std::uint64_t seed = (std::uint64_t(rng()) << 32U) | rng();
+    R.renew(p, seed);
   }
 };
 
@@ -46,11 +215,14 @@ struct linear_dropout_layer : public linear_layer<Matrix>, dropout_layer<Matrix>
   using super::X;
   using super::DX;
   using super::optimizer;
+  using super::jit;
+  using super::plan;
   using super::to_string;
   using super::input_size;
   using super::output_size;
   using dropout_layer<Matrix>::p;
   using dropout_layer<Matrix>::R;
+  using dropout_layer<Matrix>::training;
   static constexpr bool IsSparse = std::is_same_v<Matrix, mkl::sparse_matrix_csr<scalar>>;
 
   linear_dropout_layer(std::size_t D, std::size_t K, std::size_t N, scalar p)
@@ -60,17 +232,29 @@ struct linear_dropout_layer : public linear_layer<Matrix>, dropout_layer<Matrix>
 
   void feedforward(eigen::matrix& result) override
   {
+    using eigen::parallel_assign;
     using eigen::row_repeat;
-    using eigen::hadamard;
     auto N = X.rows();
 
-    result = X * hadamard(W, R).transpose() + row_repeat(b, N);
+    if (!training)
+    {
+      super::feedforward(result);
+      return;
+    }
+
+    dropout_product_transposed(X, W, R, result);
+    parallel_assign(result, result + row_repeat(b, N));
   }
 
   void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
   {
-    using eigen::hadamard;
-    using eigen::columns_sum;
+    using eigen::parallel_columns_sum;
+
+    if (!training)
+    {
+      super::backpropagate(Y, DY);
+      return;
+    }
 
     if constexpr (IsSparse)
     {
@@ -78,18 +262,19 @@ struct linear_dropout_layer : public linear_layer<Matrix>, dropout_layer<Matrix>
     }
     else
     {
-      if (NervaComputation == computation::eigen)
+      if (plan.dense() == computation::eigen)
       {
-        DW = hadamard(DY.transpose() * X, R);
-        Db = columns_sum(DY);
-        DX = DY * hadamard(W, R);
+        DW.noalias() = DY.transpose() * X;
+        R.apply(DW);
+        parallel_columns_sum(DY, Db);
+        dropout_product(DY, W, R, DX);
       }
       else
       {
-        mkl::ddd_product(DW, DY.transpose(), X);
-        DW = hadamard(DW, R);
-        Db = columns_sum(DY);
-        DX = DY * hadamard(W, R);
+        jit.product(DW, DY, X, true, false);
+        R.apply(DW);
+        parallel_columns_sum(DY, Db);
+        dropout_product(DY, W, R, DX);
       }
     }
   }
@@ -115,11 +300,14 @@ struct activation_dropout_layer : public activation_layer<Matrix, ActivationFunc
   using super::Z;
   using super::DZ;
   using super::optimizer;
+  using super::jit;
+  using super::plan;
   using super::input_size;
   using super::output_size;
   using super::to_string;
   using dropout_layer<Matrix>::p;
   using dropout_layer<Matrix>::R;
+  using dropout_layer<Matrix>::training;
   using super::act;
   static constexpr bool IsSparse = std::is_same_v<Matrix, mkl::sparse_matrix_csr<scalar>>;
 
@@ -129,18 +317,31 @@ struct activation_dropout_layer : public activation_layer<Matrix, ActivationFunc
 
   void feedforward(eigen::matrix& result) override
   {
+    using eigen::parallel_assign;
     using eigen::row_repeat;
-    using eigen::hadamard;
     auto N = X.rows();
 
-    Z = X * hadamard(W, R).transpose() + row_repeat(b, N);
-    result = act(Z);
+    if (!training)
+    {
+      super::feedforward(result);
+      return;
+    }
+
+    dropout_product_transposed(X, W, R, Z);
+    parallel_assign(Z, Z + row_repeat(b, N));
+    parallel_assign(result, act(Z));
   }
 
   void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
   {
     using eigen::hadamard;
-    using eigen::columns_sum;
+    using eigen::parallel_columns_sum;
+
+    if (!training)
+    {
+      super::backpropagate(Y, DY);
+      return;
+    }
 
     if constexpr (IsSparse)
     {
@@ -148,20 +349,21 @@ struct activation_dropout_layer : public activation_layer<Matrix, ActivationFunc
     }
     else
     {
-      if (NervaComputation == computation::eigen)
+      if (plan.dense() == computation::eigen)
       {
-        DZ = hadamard(DY, act.gradient(Z));
-        DW = hadamard(DZ.transpose() * X, R);
-        Db = columns_sum(DZ);
-        DX = DZ * hadamard(W, R);
+        this->compute_DZ(Y, DY);
+        DW.noalias() = DZ.transpose() * X;
+        R.apply(DW);
+        parallel_columns_sum(DZ, Db);
+        dropout_product(DZ, W, R, DX);
       }
       else
       {
-        DZ = hadamard(DY, act.gradient(Z));
-        mkl::ddd_product(DW, DZ.transpose(), X);
-        DW = hadamard(DW, R);
-        Db = columns_sum(DZ);
-        DX = DZ * hadamard(W, R);
+        this->compute_DZ(Y, DY);
+        jit.product(DW, DZ, X, true, false);
+        R.apply(DW);
+        parallel_columns_sum(DZ, Db);
+        dropout_product(DZ, W, R, DX);
       }
     }
   }
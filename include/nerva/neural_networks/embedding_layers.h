@@ -0,0 +1,234 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/embedding_layers.h
+/// \brief Embedding layers, that map categorical features to rows of a table.
+///
+/// The input X of an embedding layer is an N x F matrix of indices in the range [0, V), one column per categorical
+/// feature. The indices are stored as scalars, like all the other inputs, so they are passed unchanged through the
+/// datasets and the batch selection of the training loop. The output is the N x (F * d) matrix that contains the
+/// rows of the V x d table W that are selected by the indices, concatenated per example.
+///
+/// Only the rows of W that occur in a batch get a nonzero gradient. These rows are stored in a compact R x d matrix,
+/// and the optimizer updates only those rows, including the optimizer state like the momentum. So the cost of a
+/// batch depends on the number of rows that are touched, and not on V. An embedding layer does not compute the
+/// gradient of its input, so it must be the first layer of a multilayer perceptron.
+
+#pragma once
+
+#include "nerva/neural_networks/layers.h"
+#include "fmt/format.h"
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace nerva {
+
+struct embedding_layer: public neural_network_layer
+{
+  using super = neural_network_layer;
+  using super::X;
+  using super::DX;
+
+  eigen::matrix W;                 // the embedding table (V x d)
+  eigen::matrix DW;                // always empty; the optimizer only refers to it, since the gradient is stored in DW_rows
+  eigen::matrix DW_rows;           // DW_rows.row(r) is the gradient of row touched_rows[r] of W, the other rows are zero
+  std::vector<long> touched_rows;  // the sorted indices of the rows of W that occur in the last batch
+  std::vector<long> indices;       // indices[n * F + f] is the index X(n, f)
+  std::shared_ptr<gradient_descent_optimizer<eigen::matrix>> optimizer;
+
+  // the largest number of rows that can be addressed with an index of type scalar
+  static constexpr long max_rows = 1L << std::numeric_limits<scalar>::digits;
+
+  /// \param F The number of features (i.e. index columns of X)
+  /// \param V The number of rows of the table
+  /// \param d The embedding dimension
+  /// \param N The batch size
+  explicit embedding_layer(std::size_t F, std::size_t V, std::size_t d, std::size_t N)
+    : super(F, N), W(V, d)
+  {
+    if (static_cast<long>(V) > max_rows)
+    {
+      throw std::runtime_error(fmt::format("The number of rows {} of an embedding table can not be larger than {}", V, max_rows));
+    }
+  }
+
+  [[nodiscard]] auto input_size() const -> std::size_t
+  {
+    return X.cols();
+  }
+
+  [[nodiscard]] auto output_size() const -> std::size_t
+  {
+    return X.cols() * W.cols();
+  }
+
+  [[nodiscard]] auto to_string() const -> std::string override
+  {
+    return fmt::format("Embedding(features={}, rows={}, dimension={}, optimizer={})", X.cols(), W.rows(), W.cols(), optimizer->to_string());
+  }
+
+  // Converts the input X into indices, and checks that they are valid.
+  void compute_indices()
+  {
+    long N = X.rows();
+    long F = X.cols();
+    indices.resize(N * F);
+    for (long n = 0; n < N; n++)
+    {
+      for (long f = 0; f < F; f++)
+      {
+        auto i = static_cast<long>(X(n, f));
+        if (i < 0 || i >= W.rows() || static_cast<scalar>(i) != X(n, f))
+        {
+          throw std::runtime_error(fmt::format("Invalid embedding index {} for a table with {} rows", X(n, f), W.rows()));
+        }
+        indices[n * F + f] = i;
+      }
+    }
+  }
+
+  void feedforward(eigen::matrix& result) override
+  {
+    long N = X.rows();
+    long F = X.cols();
+    long d = W.cols();
+    compute_indices();
+    result.resize(N, F * d);
+
+#pragma omp parallel for
+    for (long n = 0; n < N; n++)
+    {
+      for (long f = 0; f < F; f++)
+      {
+        result.row(n).segment(f * d, d) = W.row(indices[n * F + f]);
+      }
+    }
+  }
+
+  void backpropagate(const eigen::matrix& /* Y */, const eigen::matrix& DY) override
+  {
+    long N = X.rows();
+    long F = X.cols();
+    long d = W.cols();
+
+    // sort the (row, position) pairs by row, such that the contributions to a row are adjacent
+    std::vector<std::pair<long, long>> entries(N * F);
+    for (long n = 0; n < N; n++)
+    {
+      for (long f = 0; f < F; f++)
+      {
+        entries[n * F + f] = { indices[n * F + f], n * F + f };
+      }
+    }
+    std::sort(entries.begin(), entries.end());
+
+    std::vector<long> first;  // the positions in entries where a new row starts
+    touched_rows.clear();
+    for (long a = 0; a < N * F; a++)
+    {
+      if (a == 0 || entries[a].first != entries[a - 1].first)
+      {
+        first.push_back(a);
+        touched_rows.push_back(entries[a].first);
+      }
+    }
+    first.push_back(N * F);
+
+    // DW_rows has N * F rows, such that it only depends on the batch size, see batch_buffers
+    long R = touched_rows.size();
+    DW_rows.resize(N * F, d);
+    DW_rows.bottomRows(N * F - R).setZero();
+#pragma omp parallel for
+    for (long r = 0; r < R; r++)
+    {
+      DW_rows.row(r).setZero();
+      for (long a = first[r]; a < first[r + 1]; a++)
+      {
+        long n = entries[a].second / F;
+        long f = entries[a].second % F;
+        DW_rows.row(r) += DY.row(n).segment(f * d, d);
+      }
+    }
+  }
+
+  void optimize(scalar eta) override
+  {
+    optimizer->update_rows(eta, touched_rows, DW_rows);
+  }
+
+  std::vector<eigen::matrix*> batch_buffers() override
+  {
+    auto result = super::batch_buffers();
+    result.push_back(&DW_rows);
+    return result;
+  }
+
+  void clip(scalar epsilon) override
+  {
+    if (optimizer)
+    {
+      optimizer->clip(epsilon);
+    }
+  }
+
+  void info(unsigned int layer_index) const override
+  {
+    std::string i = std::to_string(layer_index);
+    std::cout << to_string() << std::endl;
+    print_numpy_matrix("W" + i, W);
+  }
+};
+
+inline
+void set_embedding_weights(embedding_layer& layer, weight_initialization w, std::mt19937& rng)
+{
+  auto init = make_weight_initializer(w, layer.W, rng);
+  set_weights(layer.W, [&init]() { return (*init)(); });
+}
+
+inline
+void set_embedding_layer_optimizer(embedding_layer& layer, const std::string& text)
+{
+  auto optimizer = parse_optimizer(text, layer.W, layer.DW);
+  layer.optimizer = std::dynamic_pointer_cast<gradient_descent_optimizer<eigen::matrix>>(optimizer);
+  if (!layer.optimizer)
+  {
+    throw std::runtime_error("The optimizer '" + text + "' does not support embedding layers");
+  }
+}
+
+/// Converts groups of one-hot encoded columns into index columns for an embedding layer with a shared table.
+/// Column group f consists of sizes[f] consecutive columns of X. The index of group f is offset by the sum of
+/// the sizes of the previous groups, so every group addresses a separate part of the table.
+/// \param X An N x (sizes[0] + ... + sizes[F-1]) matrix
+/// \return An N x F matrix of indices
+inline
+eigen::matrix one_hot_to_indices(const eigen::matrix& X, const std::vector<long>& sizes)
+{
+  long N = X.rows();
+  long F = sizes.size();
+  eigen::matrix result(N, F);
+
+#pragma omp parallel for
+  for (long n = 0; n < N; n++)
+  {
+    long offset = 0;
+    for (long f = 0; f < F; f++)
+    {
+      Eigen::Index j;
+      X.row(n).segment(offset, sizes[f]).maxCoeff(&j);
+      result(n, f) = static_cast<scalar>(offset + j);
+      offset += sizes[f];
+    }
+  }
+  return result;
+}
+
+} // namespace nerva
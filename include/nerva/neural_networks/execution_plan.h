@@ -0,0 +1,114 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/execution_plan.h
+/// \brief The kernels and parameters that are used for the matrix products of a linear layer.
+///
+/// By default a linear layer uses the global setting NervaComputation for its dense matrix products, and for a
+/// sparse layer the gradient DW = DZ^T * X is computed in batches of max(4, K / 10) rows with MKL. An execution
+/// plan overrides these choices for a single layer, so that every layer can use the kernel that is the fastest
+/// for its shape, density and batch size (see autotuning.h).
+
+#pragma once
+
+#include "nerva/neural_networks/settings.h"
+#include "nerva/utilities/parse.h"
+#include "fmt/format.h"
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+namespace nerva {
+
+/// The kernel that computes the gradient DW = DZ^T * X of a sparse weight matrix, see mkl_eigen.h.
+enum class sparse_gradient_kernel
+{
+  mkl,   // sdd_product_batch: the dense batches are computed with MKL
+  eigen  // sdd_product_batch_eigen: the dense batches are computed with Eigen
+};
+
+struct execution_plan
+{
+  std::optional<computation> dense_computation;  // if empty, NervaComputation is used
+  sparse_gradient_kernel sparse_gradient = sparse_gradient_kernel::mkl;
+  long sparse_gradient_batch_size = 0;  // if 0, the default max(4, K / 10) is used
+
+  /// Returns the computation mode of the dense matrix products.
+  [[nodiscard]] computation dense() const
+  {
+    return dense_computation.value_or(NervaComputation);
+  }
+
+  /// Returns the number of rows of a sparse K x D weight gradient that is computed at once.
+  [[nodiscard]] long gradient_batch_size(long K) const
+  {
+    return sparse_gradient_batch_size > 0 ? sparse_gradient_batch_size : std::max(4L, K / 10);
+  }
+
+  [[nodiscard]] std::string to_string() const
+  {
+    std::string dense = "default";
+    if (dense_computation)
+    {
+      switch (*dense_computation)
+      {
+        case computation::eigen: dense = "eigen"; break;
+        case computation::mkl: dense = "mkl"; break;
+        case computation::blas: dense = "blas"; break;
+        case computation::sycl: dense = "sycl"; break;
+      }
+    }
+    return fmt::format("ExecutionPlan(computation={}, sparse_gradient={}, batch_size={})",
+                       dense,
+                       sparse_gradient == sparse_gradient_kernel::mkl ? "mkl" : "eigen",
+                       sparse_gradient_batch_size);
+  }
+
+  bool operator==(const execution_plan& other) const
+  {
+    return dense_computation == other.dense_computation &&
+           sparse_gradient == other.sparse_gradient &&
+           sparse_gradient_batch_size == other.sparse_gradient_batch_size;
+  }
+};
+
+/// Parses a string of the format ExecutionPlan(computation=<computation>, sparse_gradient=<kernel>, batch_size=<n>).
+inline
+execution_plan parse_execution_plan(const std::string& text)
+{
+  execution_plan result;
+  auto func = utilities::parse_function_call(text);
+  if (func.name != "ExecutionPlan")
+  {
+    throw std::runtime_error("could not parse execution plan '" + text + "'");
+  }
+
+  auto dense = func.as_string("computation", "default");
+  if (dense != "default")
+  {
+    result.dense_computation = parse_computation(dense);
+  }
+
+  auto sparse = func.as_string("sparse_gradient", "mkl");
+  if (sparse == "mkl")
+  {
+    result.sparse_gradient = sparse_gradient_kernel::mkl;
+  }
+  else if (sparse == "eigen")
+  {
+    result.sparse_gradient = sparse_gradient_kernel::eigen;
+  }
+  else
+  {
+    throw std::runtime_error("unknown sparse gradient kernel '" + sparse + "'");
+  }
+
+  result.sparse_gradient_batch_size = static_cast<long>(func.as_scalar("batch_size", 0));
+  return result;
+}
+
+} // namespace nerva
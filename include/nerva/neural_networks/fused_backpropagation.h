@@ -0,0 +1,175 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/fused_backpropagation.h
+/// \brief Backpropagation that updates the weights while the weight gradients are computed.
+///
+/// Normally the gradient DW of a linear layer is stored until it is used by the optimizer, which costs one copy
+/// of the weight matrix per layer. In fused backpropagation the rows of DW are computed in tiles of
+/// fused_backpropagation_tile_rows rows, and each tile is immediately applied to the corresponding rows of W by
+/// the optimizer. Hence the full gradient DW is never stored.
+///
+/// Since the gradients are not available after the backpropagation, fused backpropagation cannot be combined
+/// with gradient checks or with loss scaling in mixed precision mode. It is only applied to dense linear layers
+/// without dropout, with an optimizer that supports updates of rows (GradientDescent, Momentum and Nesterov).
+/// Other layers are backpropagated and optimized in the usual way.
+
+#pragma once
+
+#include "nerva/neural_networks/dropout_layers.h"
+#include "nerva/neural_networks/multilayer_perceptron.h"
+#include <algorithm>
+#include <vector>
+
+namespace nerva {
+
+// The number of rows of the tiles of the weight gradients
+inline long fused_backpropagation_tile_rows = 64;
+
+/// Splits the optimizer of a dense linear layer into the optimizer of W, and the optimizers of the other
+/// parameters. Returns false if there is no optimizer of W that supports updates of rows.
+inline
+bool split_weight_optimizer(dense_linear_layer& layer,
+                            gradient_descent_optimizer<eigen::matrix>*& W_optimizer,
+                            std::vector<optimizer_function*>& other_optimizers)
+{
+  std::vector<optimizer_function*> optimizers;
+  if (auto composite = dynamic_cast<composite_optimizer*>(layer.optimizer.get()))
+  {
+    for (auto& optimizer: composite->optimizers)
+    {
+      optimizers.push_back(optimizer.get());
+    }
+  }
+  else if (layer.optimizer)
+  {
+    optimizers.push_back(layer.optimizer.get());
+  }
+
+  W_optimizer = nullptr;
+  other_optimizers.clear();
+  for (optimizer_function* optimizer: optimizers)
+  {
+    auto goptimizer = dynamic_cast<gradient_descent_optimizer<eigen::matrix>*>(optimizer);
+    if (goptimizer && &goptimizer->x == &layer.W)
+    {
+      W_optimizer = goptimizer;
+    }
+    else
+    {
+      other_optimizers.push_back(optimizer);
+    }
+  }
+  return W_optimizer != nullptr;
+}
+
+/// Returns the layer as a dense linear layer if it supports fused backpropagation, and nullptr otherwise.
+inline
+dense_linear_layer* fused_backpropagation_layer(neural_network_layer* layer)
+{
+  if (NervaMixedPrecision || dynamic_cast<dropout_layer<eigen::matrix>*>(layer))
+  {
+    return nullptr;
+  }
+  auto dlayer = dynamic_cast<dense_linear_layer*>(layer);
+  if (!dlayer)
+  {
+    return nullptr;
+  }
+  gradient_descent_optimizer<eigen::matrix>* W_optimizer;
+  std::vector<optimizer_function*> other_optimizers;
+  return split_weight_optimizer(*dlayer, W_optimizer, other_optimizers) ? dlayer : nullptr;
+}
+
+/// Computes the same result as layer.backpropagate(Y, DY) followed by layer.optimize(eta), without storing the
+/// gradient DW. If compute_DX is false, the gradient DX of the input is not computed.
+inline
+void fused_backpropagate_and_optimize(dense_linear_layer& layer, const eigen::matrix& Y, const eigen::matrix& DY, scalar eta, bool compute_DX = true)
+{
+  using eigen::parallel_columns_sum;
+
+  gradient_descent_optimizer<eigen::matrix>* W_optimizer;
+  std::vector<optimizer_function*> other_optimizers;
+  if (!split_weight_optimizer(layer, W_optimizer, other_optimizers))
+  {
+    throw std::runtime_error("fused backpropagation is not supported for the optimizer " + layer.optimizer->to_string());
+  }
+
+  const eigen::matrix& DZ = layer.backpropagate_linear_gradient(Y, DY);
+
+  // DX must be computed before W is updated
+  if (compute_DX)
+  {
+    if (layer.plan.dense() == computation::eigen)
+    {
+      layer.DX = DZ * layer.W;
+    }
+    else
+    {
+      layer.jit.product(layer.DX, DZ, layer.W);
+    }
+  }
+  parallel_columns_sum(DZ, layer.Db);
+
+  // The rows i, ..., i + r - 1 of DW only depend on the columns i, ..., i + r - 1 of DZ. The tiles are strided
+  // blocks of DZ, so they are always multiplied with Eigen.
+  thread_local eigen::matrix DW_rows;
+  long K = layer.W.rows();
+  long tile_rows = std::max(fused_backpropagation_tile_rows, 1L);
+  for (long i = 0; i < K; i += tile_rows)
+  {
+    long r = std::min(tile_rows, K - i);
+    DW_rows.noalias() = DZ.middleCols(i, r).transpose() * layer.X;
+    W_optimizer->update_rows(eta, i, DW_rows);
+  }
+
+  for (optimizer_function* optimizer: other_optimizers)
+  {
+    optimizer->update(eta);
+  }
+}
+
+/// Computes the same result as M.backpropagate(Y, DY) followed by M.optimize(eta). For layers that support it, the
+/// weight gradients are computed and applied in tiles, see fused_backpropagate_and_optimize. Other layers are
+/// optimized directly after their backpropagation, which gives the same result since a layer only needs the
+/// gradient DX of the next layer.
+inline
+void fused_backpropagate_and_optimize(multilayer_perceptron& M, const eigen::matrix& Y, const eigen::matrix& DY, scalar eta)
+{
+  NERVA_TIMER_START("backpropagate");
+  auto& layers = M.layers;
+  for (auto i = layers.size(); i-- > 0; )
+  {
+    const eigen::matrix& Yi = (i == layers.size() - 1) ? Y : layers[i + 1]->X;
+    const eigen::matrix& DYi = (i == layers.size() - 1) ? DY : layers[i + 1]->DX;
+    if (auto dlayer = fused_backpropagation_layer(layers[i].get()))
+    {
+      // the gradient of the input of the first layer is not needed
+      fused_backpropagate_and_optimize(*dlayer, Yi, DYi, eta, i > 0);
+    }
+    else
+    {
+      layers[i]->backpropagate(Yi, DYi);
+      layers[i]->optimize(eta);
+    }
+  }
+  NERVA_TIMER_STOP("backpropagate");
+}
+
+/// Releases the memory of the weight gradients of the layers of M that support fused backpropagation.
+inline
+void release_weight_gradients(multilayer_perceptron& M)
+{
+  for (auto& layer: M.layers)
+  {
+    if (auto dlayer = fused_backpropagation_layer(layer.get()))
+    {
+      dlayer->DW.resize(0, 0);
+    }
+  }
+}
+
+} // namespace nerva
@@ -0,0 +1,355 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/hashed_layers.h
+/// \brief Linear layers with hashed weight sharing (HashedNets).
+///
+/// A hashed layer with input size D and output size K has a virtual K x D weight matrix W, with entries
+/// W(i, j) = sign(i, j) * w(bucket(i, j)), where w is a vector of B shared parameters and bucket and sign are
+/// computed with a hash function of (i, j). The number of parameters is B + K, independent of D * K.
+///
+/// The matrix W is never stored. The feedforward and backpropagation steps regenerate small blocks of W on the fly,
+/// and use matrix products for each block. The gradient of the shared parameters is accumulated into a buffer of B
+/// elements per thread, and the buffers are added in thread order at the end, which makes the result deterministic.
+/// The first thread accumulates directly into the gradient, and the buffers of the other threads are allocated once
+/// and reused. So the extra memory is O(block_size) per thread, plus B for every thread except the first.
+
+#pragma once
+
+#include "nerva/neural_networks/layers.h"
+#include "fmt/format.h"
+#include <omp.h>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace nerva {
+
+/// The finalizer of the splitmix64 generator, which is a fast hash function with good avalanche behavior.
+inline
+std::uint64_t hash_index(std::uint64_t k, std::uint64_t seed)
+{
+  k += seed + 0x9e3779b97f4a7c15ULL;
+  k = (k ^ (k >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  k = (k ^ (k >> 27)) * 0x94d049bb133111ebULL;
+  return k ^ (k >> 31);
+}
+
+struct hashed_linear_layer: public neural_network_layer
+{
+  using super = neural_network_layer;
+  using super::X;
+  using super::DX;
+
+  eigen::matrix w;   // the shared parameters (1 x B)
+  eigen::matrix b;
+  eigen::matrix Dw;
+  eigen::matrix Db;
+  std::vector<eigen::matrix> Dw_threads;  // the gradient buffers of the threads 1, 2, ..., thread 0 uses Dw
+  long D;            // the input size
+  long K;            // the output size
+  std::uint64_t seed;
+  std::shared_ptr<optimizer_function> optimizer;
+
+  // the number of entries of a block of W that is generated at once
+  static constexpr long block_size = 1L << 14;
+
+  explicit hashed_linear_layer(std::size_t D_, std::size_t K_, std::size_t B, std::size_t N, std::uint64_t seed_ = 0)
+    : super(D_, N), w(1, B), b(1, K_), Dw(1, B), Db(1, K_), D(D_), K(K_), seed(seed_)
+  {
+    if (B == 0)
+    {
+      throw std::runtime_error("The number of buckets of a hashed layer must be positive");
+    }
+  }
+
+  [[nodiscard]] auto input_size() const -> std::size_t
+  {
+    return D;
+  }
+
+  [[nodiscard]] auto output_size() const -> std::size_t
+  {
+    return K;
+  }
+
+  [[nodiscard]] auto buckets() const -> std::size_t
+  {
+    return w.cols();
+  }
+
+  [[nodiscard]] virtual auto activation_to_string() const -> std::string
+  {
+    return "NoActivation()";
+  }
+
+  [[nodiscard]] auto to_string() const -> std::string override
+  {
+    return fmt::format("Hashed(input_size={}, output_size={}, buckets={}, seed={}, optimizer={}, activation={})", input_size(), output_size(), buckets(), seed, optimizer->to_string(), activation_to_string());
+  }
+
+  /// Returns the index in w of the virtual weight W(i, j), and its sign.
+  [[nodiscard]] std::pair<long, scalar> bucket(long i, long j) const
+  {
+    auto h = hash_index(static_cast<std::uint64_t>(i * D + j), seed);
+    return { static_cast<long>(h % buckets()), (h >> 63) ? scalar(-1) : scalar(1) };
+  }
+
+  // Generates the block W(i0 : i0 + m, j0 : j0 + n) of the virtual weight matrix.
+  void weight_block(long i0, long m, long j0, long n, eigen::matrix& result) const
+  {
+    result.resize(m, n);
+    for (long i = 0; i < m; i++)
+    {
+      for (long j = 0; j < n; j++)
+      {
+        auto [k, sign] = bucket(i0 + i, j0 + j);
+        result(i, j) = sign * w(0, k);
+      }
+    }
+  }
+
+  /// Returns the virtual weight matrix. This is only meant for inspection and testing.
+  [[nodiscard]] eigen::matrix weights() const
+  {
+    eigen::matrix W;
+    weight_block(0, K, 0, D, W);
+    return W;
+  }
+
+  // The number of rows of W in a block of block_size entries, if all columns are included.
+  [[nodiscard]] long rows_per_block() const
+  {
+    return std::max(1L, block_size / D);
+  }
+
+  // Computes Z = X * W^T + row_repeat(b, N), one block of rows of W at a time. The blocks correspond to disjoint
+  // columns of Z, so they can be computed in parallel. Mixed precision is not supported.
+  void feedforward_linear(eigen::matrix& Z)
+  {
+    long N = X.rows();
+    long R = rows_per_block();
+    long block_count = (K + R - 1) / R;
+    Z.resize(N, K);
+
+#pragma omp parallel
+    {
+      eigen::matrix W_block;
+
+#pragma omp for schedule(static)
+      for (long t = 0; t < block_count; t++)
+      {
+        long i0 = t * R;
+        long m = std::min(R, K - i0);
+        weight_block(i0, m, 0, D, W_block);
+        Z.middleCols(i0, m).noalias() = X * W_block.transpose();
+        Z.middleCols(i0, m).rowwise() += b.middleCols(i0, m).row(0);
+      }
+    }
+  }
+
+  // Computes the gradients of the parameters and of the input, given the gradient DZ of Z.
+  void backpropagate_linear(const eigen::matrix& DZ)
+  {
+    using eigen::parallel_columns_sum;
+
+    long B = buckets();
+    long R = rows_per_block();
+    long row_block_count = (K + R - 1) / R;
+    long C = std::max(1L, block_size / K);  // the number of columns per block for DX
+    long column_block_count = (D + C - 1) / C;
+
+    // Dw(bucket(i, j)) += sign(i, j) * (DZ^T * X)(i, j), with a separate gradient buffer per thread. The buffers are
+    // only allocated when the number of threads changes.
+    auto thread_count = static_cast<std::size_t>(omp_get_max_threads());
+    if (Dw_threads.size() + 1 != thread_count)
+    {
+      Dw_threads.assign(thread_count - 1, eigen::matrix(1, B));
+    }
+    long team_size = 1;
+#pragma omp parallel
+    {
+      int thread = omp_get_thread_num();
+      if (thread == 0)
+      {
+        team_size = omp_get_num_threads();
+      }
+      eigen::matrix& Dw_thread = thread == 0 ? Dw : Dw_threads[thread - 1];
+      Dw_thread.setZero();
+      eigen::matrix G;
+
+#pragma omp for schedule(static)
+      for (long t = 0; t < row_block_count; t++)
+      {
+        long i0 = t * R;
+        long m = std::min(R, K - i0);
+        G.noalias() = DZ.middleCols(i0, m).transpose() * X;
+        for (long i = 0; i < m; i++)
+        {
+          for (long j = 0; j < D; j++)
+          {
+            auto [k, sign] = bucket(i0 + i, j);
+            Dw_thread(0, k) += sign * G(i, j);
+          }
+        }
+      }
+    }
+
+    // the buffers are summed in thread order, so that the result does not depend on the timing of the threads
+    for (long t = 1; t < team_size; t++)
+    {
+      Dw += Dw_threads[t - 1];
+    }
+
+    // DX = DZ * W, one block of columns of W at a time
+    DX.resize(X.rows(), D);
+#pragma omp parallel
+    {
+      eigen::matrix W_block;
+
+#pragma omp for schedule(static)
+      for (long t = 0; t < column_block_count; t++)
+      {
+        long j0 = t * C;
+        long n = std::min(C, D - j0);
+        weight_block(0, K, j0, n, W_block);
+        DX.middleCols(j0, n).noalias() = DZ * W_block;
+      }
+    }
+
+    parallel_columns_sum(DZ, Db);
+  }
+
+  void feedforward(eigen::matrix& result) override
+  {
+    feedforward_linear(result);
+  }
+
+  void backpropagate(const eigen::matrix& /* Y */, const eigen::matrix& DY) override
+  {
+    backpropagate_linear(DY);
+  }
+
+  void optimize(scalar eta) override
+  {
+    optimizer->update(eta);
+  }
+
+  void clip(scalar epsilon) override
+  {
+    if (optimizer)
+    {
+      optimizer->clip(epsilon);
+    }
+  }
+
+  void info(unsigned int layer_index) const override
+  {
+    std::string i = std::to_string(layer_index);
+    std::cout << to_string() << std::endl;
+    print_numpy_matrix("w" + i, w);
+    print_numpy_matrix("b" + i, b);
+  }
+};
+
+template <typename ActivationFunction>
+struct hashed_activation_layer: public hashed_linear_layer
+{
+  using super = hashed_linear_layer;
+  using super::X;
+  using super::DX;
+
+  ActivationFunction act;
+  eigen::matrix Z;
+  eigen::matrix DZ;
+
+  explicit hashed_activation_layer(std::size_t D, std::size_t K, std::size_t B, std::size_t N, std::uint64_t seed, ActivationFunction act_)
+    : super(D, K, B, N, seed), act(act_), Z(N, K), DZ(N, K)
+  {}
+
+  [[nodiscard]] auto activation_to_string() const -> std::string override
+  {
+    return act.to_string();
+  }
+
+  void feedforward(eigen::matrix& result) override
+  {
+    using eigen::parallel_assign;
+
+    feedforward_linear(Z);
+    parallel_assign(result, act(Z));
+  }
+
+  void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
+  {
+    using eigen::hadamard;
+    using eigen::parallel_assign;
+
+    if constexpr (has_output_gradient<ActivationFunction>::value)
+    {
+      parallel_assign(DZ, hadamard(DY, act.output_gradient(Y)));
+    }
+    else
+    {
+      parallel_assign(DZ, hadamard(DY, act.gradient(Z)));
+    }
+    backpropagate_linear(DZ);
+  }
+
+  void release_activations() override
+  {
+    super::release_activations();
+    Z.resize(0, 0);
+  }
+
+  [[nodiscard]] long activation_size() const override
+  {
+    return super::activation_size() + Z.size();
+  }
+
+  std::vector<eigen::matrix*> batch_buffers() override
+  {
+    auto result = super::batch_buffers();
+    result.insert(result.end(), { &Z, &DZ });
+    return result;
+  }
+};
+
+using hashed_relu_layer = hashed_activation_layer<relu_activation>;
+using hashed_sigmoid_layer = hashed_activation_layer<sigmoid_activation>;
+using hashed_hyperbolic_tangent_layer = hashed_activation_layer<hyperbolic_tangent_activation>;
+
+/// Initializes the shared parameters as if they were the weights of a dense K x D matrix.
+inline
+void set_weights_and_bias(hashed_linear_layer& layer, weight_initialization w, std::mt19937& rng)
+{
+  // the weight initializers only need the shape of the weight matrix, which is not stored
+  struct matrix_shape
+  {
+    long m;
+    long n;
+    [[nodiscard]] long rows() const { return m; }
+    [[nodiscard]] long cols() const { return n; }
+  };
+
+  matrix_shape shape{layer.K, layer.D};
+  auto init = make_weight_initializer(w, shape, rng);
+  set_weights(layer.w, [&init]() { return (*init)(); });
+  init->initialize_bias(layer.b);
+}
+
+inline
+void set_hashed_layer_optimizer(hashed_linear_layer& layer, const std::string& text)
+{
+  auto optimizer_w = parse_optimizer(text, layer.w, layer.Dw);
+  auto optimizer_b = parse_optimizer(text, layer.b, layer.Db);
+  layer.optimizer = make_composite_optimizer(optimizer_w, optimizer_b);
+}
+
+} // namespace nerva
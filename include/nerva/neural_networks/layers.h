@@ -10,9 +10,13 @@
 #pragma once
 
 #include "nerva/neural_networks/activation_functions.h"
+#include "nerva/neural_networks/execution_plan.h"
 #include "nerva/neural_networks/nerva_timer.h"
 #include "nerva/neural_networks/layer_algorithms.h"
+#include "nerva/neural_networks/mixed_precision.h"
+#include "nerva/neural_networks/mkl_activation_functions.h"
 #include "nerva/neural_networks/mkl_eigen.h"
+#include "nerva/neural_networks/mkl_jit_gemm.h"
 #include "nerva/neural_networks/mkl_sparse_matrix.h"
 #include "nerva/neural_networks/optimizers.h"
 #include "nerva/neural_networks/softmax_functions.h"
@@ -24,6 +28,7 @@
 #include <iostream>
 #include <random>
 #include <type_traits>
+#include <vector>
 
 namespace nerva {
 
@@ -57,6 +62,26 @@ struct neural_network_layer
   virtual void info(unsigned int layer_index) const
   {}
 
+  /// Releases the intermediate results of the feedforward step that are only needed for backpropagation, i.e. the
+  /// input X and the buffers computed from it. They are restored by calling feedforward again, see
+  /// activation_checkpointing.h.
+  virtual void release_activations()
+  {
+    X.resize(0, 0);
+  }
+
+  /// Returns the number of elements of the buffers that are released by release_activations.
+  [[nodiscard]] virtual long activation_size() const
+  {
+    return X.size();
+  }
+
+  /// Returns the buffers of the layer with a number of rows that is equal to the batch size, see batch_buffers.h.
+  virtual std::vector<eigen::matrix*> batch_buffers()
+  {
+    return { &X, &DX };
+  }
+
   virtual ~neural_network_layer() = default;
 };
 
@@ -73,6 +98,9 @@ struct linear_layer: public neural_network_layer
   Matrix DW;
   eigen::matrix Db;
   std::shared_ptr<optimizer_function> optimizer;
+  bfloat16_buffers bf16;  // only used in mixed precision mode
+  mkl::jit_gemm_cache jit;  // only used for dense layers in mkl mode
+  execution_plan plan;      // the kernels of the matrix products, see autotuning.h
 
   explicit linear_layer(std::size_t D, std::size_t K, std::size_t N)
     : super(D, N), W(K, D), b(1, K), DW(K, D), Db(1, K)
@@ -102,6 +130,7 @@ struct linear_layer: public neural_network_layer
 
   void feedforward(eigen::matrix& result) override
   {
+    using eigen::parallel_assign;
     using eigen::row_repeat;
 
     auto N = X.rows();
@@ -109,46 +138,97 @@ struct linear_layer: public neural_network_layer
     if constexpr (IsSparse)
     {
       bool W_transposed = true;
+      result.resize(N, W.rows());
       mkl::dds_product(result, X, W, W_transposed);
-      result += row_repeat(b, N);
+      parallel_assign(result, result + row_repeat(b, N));
+    }
+    else if (NervaMixedPrecision)
+    {
+      bf16_linear_feedforward(X, W, b, result, bf16);
     }
     else
     {
-      if (NervaComputation == computation::eigen)
+      if (plan.dense() == computation::eigen)
       {
-        result = X * W.transpose() + row_repeat(b, N);
+        result.noalias() = X * W.transpose();
+        parallel_assign(result, result + row_repeat(b, N));
       }
       else
       {
-        mkl::ddd_product(result, X, W.transpose());
-        result += row_repeat(b, N);
+        jit.set_batch_size(N);
+        jit.product(result, X, W, false, true);
+        parallel_assign(result, result + row_repeat(b, N));
       }
     }
   }
 
   void backpropagate(const eigen::matrix& /* Y */, const eigen::matrix& DY) override
   {
-    using eigen::columns_sum;
+    using eigen::parallel_columns_sum;
 
     if constexpr (IsSparse)
     {
-      mkl::sdd_product_batch(DW, DY.transpose(), X, std::max(4L, static_cast<long>(DY.cols() / 10)));
-      Db = columns_sum(DY);
+      sparse_weight_gradient(DY);
+      parallel_columns_sum(DY, Db);
+      DX.resize(X.rows(), X.cols());
       mkl::dds_product(DX, DY, W);
     }
+    else if (NervaMixedPrecision)
+    {
+      bf16_linear_backpropagate(DY, DW, Db, DX, bf16);
+    }
     else
     {
-      if (NervaComputation == computation::eigen)
+      if (plan.dense() == computation::eigen)
       {
         DW = DY.transpose() * X;
-        Db = columns_sum(DY);
+        parallel_columns_sum(DY, Db);
         DX = DY * W;
       }
       else
       {
-        mkl::ddd_product(DW, DY.transpose(), X);
-        Db = columns_sum(DY);
-        mkl::ddd_product(DX, DY, W);
+        jit.product(DW, DY, X, true, false);
+        parallel_columns_sum(DY, Db);
+        jit.product(DX, DY, W);
+      }
+    }
+  }
+
+  // The backpropagation of dense layers in eigen mode can be split into three parts, that are scheduled separately
+  // by the task graph executor (see task_graph.h). The first part computes the gradient DZ of the output of the
+  // linear part of the layer, and returns a reference to it. The other parts use DZ to compute the gradients of
+  // the parameters and of the input.
+  virtual const eigen::matrix& backpropagate_linear_gradient(const eigen::matrix& /* Y */, const eigen::matrix& DY)
+  {
+    return DY;
+  }
+
+  void backpropagate_parameters(const eigen::matrix& DZ)
+  {
+    using eigen::parallel_columns_sum;
+
+    DW = DZ.transpose() * X;
+    parallel_columns_sum(DZ, Db);
+  }
+
+  void backpropagate_input(const eigen::matrix& DZ)
+  {
+    DX = DZ * W;
+  }
+
+  // Computes DW = DZ^T * X for sparse layers, using the kernel and the batch size of the execution plan.
+  void sparse_weight_gradient(const eigen::matrix& DZ)
+  {
+    if constexpr (IsSparse)
+    {
+      long batch_size = plan.gradient_batch_size(DZ.cols());
+      if (plan.sparse_gradient == sparse_gradient_kernel::eigen)
+      {
+        mkl::sdd_product_batch_eigen(DW, DZ.transpose(), X, batch_size);
+      }
+      else
+      {
+        mkl::sdd_product_batch(DW, DZ.transpose(), X, batch_size);
       }
     }
   }
@@ -202,6 +282,15 @@ struct linear_layer: public neural_network_layer
 using dense_linear_layer = linear_layer<eigen::matrix>;
 using sparse_linear_layer = linear_layer<mkl::sparse_matrix_csr<scalar>>;
 
+// Is true if the activation function can compute its gradient from its output, see sigmoid_activation.
+template <typename ActivationFunction, typename = void>
+struct has_output_gradient : std::false_type
+{};
+
+template <typename ActivationFunction>
+struct has_output_gradient<ActivationFunction, std::void_t<decltype(std::declval<ActivationFunction>().output_gradient(std::declval<eigen::matrix>()))>> : std::true_type
+{};
+
 template <typename Matrix, typename ActivationFunction>
 struct activation_layer : public linear_layer<Matrix>
 {
@@ -213,6 +302,9 @@ struct activation_layer : public linear_layer<Matrix>
   using super::X;
   using super::DX;
   using super::optimizer;
+  using super::bf16;
+  using super::jit;
+  using super::plan;
   using super::input_size;
   using super::output_size;
   static constexpr bool IsSparse = std::is_same_v<Matrix, mkl::sparse_matrix_csr<scalar>>;
@@ -239,6 +331,7 @@ struct activation_layer : public linear_layer<Matrix>
 
   void feedforward(eigen::matrix& result) override
   {
+    using eigen::parallel_assign;
     using eigen::row_repeat;
 
     auto N = X.rows();
@@ -246,53 +339,111 @@ struct activation_layer : public linear_layer<Matrix>
     if constexpr (IsSparse)
     {
       bool W_transposed = true;
+      Z.resize(N, W.rows());
       mkl::dds_product(Z, X, W, W_transposed);
-      Z += row_repeat(b, N);
-      result = act(Z);
+      parallel_assign(Z, Z + row_repeat(b, N));
+      parallel_assign(result, act(Z));
+    }
+    else if (NervaMixedPrecision)
+    {
+      bf16_linear_feedforward(X, W, b, Z, bf16);
+      parallel_assign(result, act(Z));
     }
     else
     {
-      if (NervaComputation == computation::eigen)
+      if (plan.dense() == computation::eigen)
       {
-        Z = X * W.transpose() + row_repeat(b, N);
-        result = act(Z);
+        Z.noalias() = X * W.transpose();
+        parallel_assign(Z, Z + row_repeat(b, N));
+        parallel_assign(result, act(Z));
       }
       else
       {
-        mkl::ddd_product(Z, X, W.transpose());
-        Z += row_repeat(b, N);
-        result = act(Z);
+        jit.set_batch_size(N);
+        jit.product(Z, X, W, false, true);
+        parallel_assign(Z, Z + row_repeat(b, N));
+        mkl::apply_activation(act, Z, result);
       }
     }
   }
 
-  void backpropagate(const eigen::matrix& /* Y */, const eigen::matrix& DY) override
+  // Computes DZ = hadamard(DY, act.gradient(Z)). If possible, the gradient is computed from the output Y.
+  // For SReLU layers the gradients of the activation parameters are computed as well.
+  void compute_DZ(const eigen::matrix& Y, const eigen::matrix& DY)
   {
     using eigen::hadamard;
-    using eigen::columns_sum;
+    using eigen::parallel_assign;
+
+    if constexpr (std::is_same_v<ActivationFunction, srelu_activation>)
+    {
+      act.backpropagate(Z, DY, DZ);  // this also computes the gradients of the srelu parameters
+    }
+    else if constexpr (has_output_gradient<ActivationFunction>::value)
+    {
+      parallel_assign(DZ, hadamard(DY, act.output_gradient(Y)));
+    }
+    else
+    {
+      parallel_assign(DZ, hadamard(DY, act.gradient(Z)));
+    }
+  }
+
+  void release_activations() override
+  {
+    super::release_activations();
+    Z.resize(0, 0);
+  }
+
+  [[nodiscard]] long activation_size() const override
+  {
+    return super::activation_size() + Z.size();
+  }
+
+  std::vector<eigen::matrix*> batch_buffers() override
+  {
+    auto result = super::batch_buffers();
+    result.insert(result.end(), { &Z, &DZ });
+    return result;
+  }
+
+  const eigen::matrix& backpropagate_linear_gradient(const eigen::matrix& Y, const eigen::matrix& DY) override
+  {
+    compute_DZ(Y, DY);
+    return DZ;
+  }
+
+  void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
+  {
+    using eigen::parallel_columns_sum;
 
     if constexpr (IsSparse)
     {
-      DZ = hadamard(DY, act.gradient(Z));
-      mkl::sdd_product_batch(DW, DZ.transpose(), X, std::max(4L, static_cast<long>(DZ.cols() / 10)));
-      Db = columns_sum(DZ);
+      compute_DZ(Y, DY);
+      this->sparse_weight_gradient(DZ);
+      parallel_columns_sum(DZ, Db);
+      DX.resize(X.rows(), X.cols());
       mkl::dds_product(DX, DZ, W);
     }
+    else if (NervaMixedPrecision)
+    {
+      compute_DZ(Y, DY);
+      bf16_linear_backpropagate(DZ, DW, Db, DX, bf16);
+    }
     else
     {
-      if (NervaComputation == computation::eigen)
+      if (plan.dense() == computation::eigen)
       {
-        DZ = hadamard(DY, act.gradient(Z));
+        compute_DZ(Y, DY);
         DW = DZ.transpose() * X;
-        Db = columns_sum(DZ);
+        parallel_columns_sum(DZ, Db);
         DX = DZ * W;
       }
       else
       {
-        DZ = hadamard(DY, act.gradient(Z));
-        mkl::ddd_product(DW, DZ.transpose(), X);
-        Db = columns_sum(DZ);
-        mkl::ddd_product(DX, DZ, W);
+        compute_DZ(Y, DY);
+        jit.product(DW, DZ, X, true, false);
+        parallel_columns_sum(DZ, Db);
+        jit.product(DX, DZ, W);
       }
     }
   }
@@ -389,31 +540,6 @@ struct srelu_layer : public activation_layer<Matrix, srelu_activation>
     : super(D, K, N, srelu_activation(al, tl, ar, tr))
   {}
 
-  void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
-  {
-    using eigen::apply;
-    using eigen::hadamard;
-    using eigen::elements_sum;
-
-    super::backpropagate(Y, DY);
-
-    auto al = act.x(0);
-    auto tl = act.x(1);
-    auto ar = act.x(2);
-    auto tr = act.x(3);
-
-    auto Al = [tl](scalar x)     { return x <= tl ? x - tl : scalar(0); };
-    auto Ar = [tl, tr](scalar x) { return x <= tl || x < tr ? scalar(0) : x - tr; };
-    auto Tl = [tl, al](scalar x) { return x <= tl ? scalar(1) - al : scalar(0); };
-    auto Tr = [tr, ar](scalar x) { return x >= tr ? scalar(1) - ar : scalar(0); };
-
-    auto Dal = elements_sum(hadamard(DY, apply(Al, Z)));
-    auto Dar = elements_sum(hadamard(DY, apply(Ar, Z)));
-    auto Dtl = elements_sum(hadamard(DY, apply(Tl, Z)));
-    auto Dtr = elements_sum(hadamard(DY, apply(Tr, Z)));
-
-    act.Dx = eigen::vector{{Dal, Dtl, Dar, Dtr}};
-  }
 };
 
 using dense_srelu_layer = srelu_layer<eigen::matrix>;
@@ -432,6 +558,9 @@ struct softmax_layer : public linear_layer<Matrix>
   using super::input_size;
   using super::output_size;
   using super::optimizer;
+  using super::bf16;
+  using super::jit;
+  using super::plan;
   static constexpr bool IsSparse = std::is_same_v<Matrix, mkl::sparse_matrix_csr<scalar>>;
 
   eigen::matrix Z;
@@ -455,6 +584,7 @@ struct softmax_layer : public linear_layer<Matrix>
 
   void feedforward(eigen::matrix& result) override
   {
+    using eigen::parallel_assign;
     using eigen::row_repeat;
 
     auto N = X.rows();
@@ -462,61 +592,94 @@ struct softmax_layer : public linear_layer<Matrix>
     if constexpr (IsSparse)
     {
       bool W_transposed = true;
+      Z.resize(N, W.rows());
       mkl::dds_product(Z, X, W, W_transposed);
-      Z += row_repeat(b, N);
-      result = stable_softmax()(Z);
+      parallel_assign(Z, Z + row_repeat(b, N));
+      stable_softmax_rowwise(Z, result);
+    }
+    else if (NervaMixedPrecision)
+    {
+      bf16_linear_feedforward(X, W, b, Z, bf16);
+      stable_softmax_rowwise(Z, result);
     }
     else
     {
       // tag::nerva_computation[]
-      if (NervaComputation == computation::eigen)
+      if (plan.dense() == computation::eigen)
       {
-        Z = X * W.transpose() + row_repeat(b, N);
-        result = stable_softmax()(Z);
+        Z.noalias() = X * W.transpose();
+        parallel_assign(Z, Z + row_repeat(b, N));
+        stable_softmax_rowwise(Z, result);
       }
       else
       {
-        mkl::ddd_product(Z, X, W.transpose());
-        Z += row_repeat(b, N);
-        result = stable_softmax()(Z);
+        jit.set_batch_size(N);
+        jit.product(Z, X, W, false, true);
+        parallel_assign(Z, Z + row_repeat(b, N));
+        stable_softmax_rowwise(Z, result);
       }
       // end::nerva_computation[]
     }
   }
 
-  void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
+  void release_activations() override
   {
-    using eigen::diag;
-    using eigen::hadamard;
-    using eigen::column_repeat;
-    using eigen::columns_sum;
+    super::release_activations();
+    Z.resize(0, 0);
+  }
 
-    auto K = Y.cols();
+  [[nodiscard]] long activation_size() const override
+  {
+    return super::activation_size() + Z.size();
+  }
+
+  std::vector<eigen::matrix*> batch_buffers() override
+  {
+    auto result = super::batch_buffers();
+    result.insert(result.end(), { &Z, &DZ });
+    return result;
+  }
+
+  const eigen::matrix& backpropagate_linear_gradient(const eigen::matrix& Y, const eigen::matrix& DY) override
+  {
+    softmax_rowwise_jacobian_product(Y, DY, DZ);
+    return DZ;
+  }
+
+  void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
+  {
+    using eigen::parallel_columns_sum;
 
     if constexpr (IsSparse)
     {
-      DZ = hadamard(Y, DY - column_repeat(diag(DY * Y.transpose()), K));
-      mkl::sdd_product_batch(DW, DZ.transpose(), X, std::max(4L, static_cast<long>(DZ.cols() / 10)));
-      Db = columns_sum(DZ);
+      softmax_rowwise_jacobian_product(Y, DY, DZ);
+      this->sparse_weight_gradient(DZ);
+      parallel_columns_sum(DZ, Db);
+      DX.resize(X.rows(), X.cols());
       mkl::dds_product(DX, DZ, W);
     }
+    else if (NervaMixedPrecision)
+    {
+      softmax_rowwise_jacobian_product(Y, DY, DZ);
+      bf16_linear_backpropagate(DZ, DW, Db, DX, bf16);
+    }
     else
     {
-      if (NervaComputation == computation::eigen)
+      if (plan.dense() == computation::eigen)
       {
         // tag::matrix_operations[]
-        DZ = hadamard(Y, DY - column_repeat(diag(Y * DY.transpose()), K));
+        softmax_rowwise_jacobian_product(Y, DY, DZ);  // DZ = hadamard(Y, DY - column_repeat(rows_sum(hadamard(Y, DY)), K))
         DW = DZ.transpose() * X;
-        Db = columns_sum(DZ);
+        parallel_columns_sum(DZ, Db);
         DX = DZ * W;
         // end::matrix_operations[]
       }
       else
       {
-        DZ = hadamard(Y, DY - column_repeat(diag(Y * DY.transpose()), K));
-        mkl::ddd_product(DW, DZ.transpose(), X);
-        Db = columns_sum(DZ);
-        mkl::ddd_product(DX, DZ, W);
+        softmax_rowwise_jacobian_product(Y, DY, DZ);
+        jit.product(DW, DZ, X, true, false);
+        parallel_columns_sum(DZ, Db);
+        jit.product(DX, DZ, W);
       }
     }
   }
@@ -538,13 +701,17 @@ struct log_softmax_layer : public linear_layer<Matrix>
   using super::input_size;
   using super::output_size;
   using super::optimizer;
+  using super::bf16;
+  using super::jit;
+  using super::plan;
   static constexpr bool IsSparse = std::is_same_v<Matrix, mkl::sparse_matrix_csr<scalar>>;
 
   eigen::matrix Z;
   eigen::matrix DZ;
+  eigen::matrix S;  // the softmax of Z, which is needed for backpropagation
 
   log_softmax_layer(std::size_t D, std::size_t K, std::size_t N)
-    : super(D, K, N), Z(N, K), DZ(N, K)
+    : super(D, K, N), Z(N, K), DZ(N, K), S(N, K)
   {}
 
   [[nodiscard]] auto to_string() const -> std::string override
@@ -561,6 +728,7 @@ struct log_softmax_layer : public linear_layer<Matrix>
 
   void feedforward(eigen::matrix& result) override
   {
+    using eigen::parallel_assign;
     using eigen::row_repeat;
 
     auto N = X.rows();
@@ -568,57 +736,91 @@ struct log_softmax_layer : public linear_layer<Matrix>
     if constexpr (IsSparse)
     {
       bool W_transposed = true;
+      Z.resize(N, W.rows());
       mkl::dds_product(Z, X, W, W_transposed);
-      Z += row_repeat(b, N);
-      result = stable_log_softmax()(Z);
+      parallel_assign(Z, Z + row_repeat(b, N));
+      stable_log_softmax_rowwise(Z, result, S);
+    }
+    else if (NervaMixedPrecision)
+    {
+      bf16_linear_feedforward(X, W, b, Z, bf16);
+      stable_log_softmax_rowwise(Z, result, S);
     }
     else
     {
-      if (NervaComputation == computation::eigen)
+      if (plan.dense() == computation::eigen)
       {
-        Z = X * W.transpose() + row_repeat(b, N);
-        result = stable_log_softmax()(Z);
+        Z.noalias() = X * W.transpose();
+        parallel_assign(Z, Z + row_repeat(b, N));
+        stable_log_softmax_rowwise(Z, result, S);
       }
       else
       {
-        mkl::ddd_product(Z, X, W.transpose());
-        Z += row_repeat(b, N);
-        result = stable_log_softmax()(Z);
+        jit.set_batch_size(N);
+        jit.product(Z, X, W, false, true);
+        parallel_assign(Z, Z + row_repeat(b, N));
+        stable_log_softmax_rowwise(Z, result, S);
       }
     }
   }
 
-  void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
+  void release_activations() override
   {
-    using eigen::hadamard;
-    using eigen::column_repeat;
-    using eigen::columns_sum;
-    using eigen::rows_sum;
+    super::release_activations();
+    Z.resize(0, 0);
+    S.resize(0, 0);
+  }
 
-    auto K = Y.cols();
+  [[nodiscard]] long activation_size() const override
+  {
+    return super::activation_size() + Z.size() + S.size();
+  }
+
+  std::vector<eigen::matrix*> batch_buffers() override
+  {
+    auto result = super::batch_buffers();
+    result.insert(result.end(), { &Z, &DZ, &S });
+    return result;
+  }
+
+  const eigen::matrix& backpropagate_linear_gradient(const eigen::matrix& /* Y */, const eigen::matrix& DY) override
+  {
+    log_softmax_rowwise_jacobian_product(S, DY, DZ);
+    return DZ;
+  }
+
+  void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
+  {
+    using eigen::parallel_columns_sum;
 
     if constexpr (IsSparse)
     {
-      DZ = DY - hadamard(stable_softmax()(Z), column_repeat(rows_sum(DY), K));
-      mkl::sdd_product_batch(DW, DZ.transpose(), X, std::max(4L, static_cast<long>(DZ.cols() / 10)));
-      Db = columns_sum(DZ);
+      log_softmax_rowwise_jacobian_product(S, DY, DZ);
+      this->sparse_weight_gradient(DZ);
+      parallel_columns_sum(DZ, Db);
+      DX.resize(X.rows(), X.cols());
       mkl::dds_product(DX, DZ, W);
     }
+    else if (NervaMixedPrecision)
+    {
+      log_softmax_rowwise_jacobian_product(S, DY, DZ);
+      bf16_linear_backpropagate(DZ, DW, Db, DX, bf16);
+    }
     else
     {
-      if (NervaComputation == computation::eigen)
+      if (plan.dense() == computation::eigen)
       {
-        DZ = DY - hadamard(stable_softmax()(Z), column_repeat(rows_sum(DY), K));
+        log_softmax_rowwise_jacobian_product(S, DY, DZ);
         DW = DZ.transpose() * X;
-        Db = columns_sum(DZ);
+        parallel_columns_sum(DZ, Db);
         DX = DZ * W;
       }
       else
       {
-        DZ = DY - hadamard(stable_softmax()(Z), column_repeat(rows_sum(DY), K));
-        mkl::ddd_product(DW, DZ.transpose(), X);
-        Db = columns_sum(DZ);
-        mkl::ddd_product(DX, DZ, W);
+        log_softmax_rowwise_jacobian_product(S, DY, DZ);
+        jit.product(DW, DZ, X, true, false);
+        parallel_columns_sum(DZ, Db);
+        jit.product(DX, DZ, W);
       }
     }
   }
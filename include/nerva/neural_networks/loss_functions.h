@@ -551,6 +551,103 @@ auto Negative_log_likelihood_loss_rowwise_gradient(const Matrix1& Y, const Matri
   return -hadamard(column_repeat(inverse(rows_sum(hadamard(Y, T))), K), T);
 }
 
+// The functions below compute the value of a loss function and its gradient multiplied by a scale factor
+// in a single pass over the rows of Y and T. The gradient is stored in DY, which is resized if needed.
+
+inline
+auto Squared_error_loss_rowwise_value_and_gradient(const eigen::matrix& Y, const eigen::matrix& T, eigen::matrix& DY, scalar scale) -> scalar
+{
+  const long N = Y.rows();
+  DY.resize(N, Y.cols());
+  scalar result = 0;
+
+#pragma omp parallel for reduction(+:result)
+  for (long i = 0; i < N; i++)
+  {
+    DY.row(i) = Y.row(i) - T.row(i);
+    result += DY.row(i).squaredNorm();
+    DY.row(i) *= 2 * scale;
+  }
+
+  return result;
+}
+
+inline
+auto Cross_entropy_loss_rowwise_value_and_gradient(const eigen::matrix& Y, const eigen::matrix& T, eigen::matrix& DY, scalar scale) -> scalar
+{
+  const long N = Y.rows();
+  DY.resize(N, Y.cols());
+  scalar result = 0;
+
+#pragma omp parallel for reduction(+:result)
+  for (long i = 0; i < N; i++)
+  {
+    result -= (T.row(i).array() * Y.row(i).array().log()).sum();
+    DY.row(i) = (-scale * T.row(i).array() / Y.row(i).array()).matrix();
+  }
+
+  return result;
+}
+
+inline
+auto Softmax_cross_entropy_loss_rowwise_value_and_gradient(const eigen::matrix& Y, const eigen::matrix& T, eigen::matrix& DY, scalar scale) -> scalar
+{
+  const long N = Y.rows();
+  DY.resize(N, Y.cols());
+  scalar result = 0;
+
+#pragma omp parallel for reduction(+:result)
+  for (long i = 0; i < N; i++)
+  {
+    // DY.row(i) is used to store the exponentials, so that they are computed only once
+    scalar c = Y.row(i).maxCoeff();
+    DY.row(i) = (Y.row(i).array() - c).exp().matrix();
+    scalar E = DY.row(i).sum();
+    scalar t = T.row(i).sum();
+    result -= T.row(i).dot(Y.row(i)) - t * (c + std::log(E));
+    DY.row(i) = scale * ((t / E) * DY.row(i) - T.row(i));
+  }
+
+  return result;
+}
+
+inline
+auto Logistic_cross_entropy_loss_rowwise_value_and_gradient(const eigen::matrix& Y, const eigen::matrix& T, eigen::matrix& DY, scalar scale) -> scalar
+{
+  const long N = Y.rows();
+  DY.resize(N, Y.cols());
+  scalar result = 0;
+
+#pragma omp parallel for reduction(+:result)
+  for (long i = 0; i < N; i++)
+  {
+    // DY.row(i) is used to store the sigmoid values, so that they are computed only once
+    DY.row(i) = (scalar(1) + (-Y.row(i).array()).exp()).inverse().matrix();
+    result -= (T.row(i).array() * DY.row(i).array().log()).sum();
+    DY.row(i) = (scale * T.row(i).array() * (DY.row(i).array() - scalar(1))).matrix();
+  }
+
+  return result;
+}
+
+inline
+auto Negative_log_likelihood_loss_rowwise_value_and_gradient(const eigen::matrix& Y, const eigen::matrix& T, eigen::matrix& DY, scalar scale) -> scalar
+{
+  const long N = Y.rows();
+  DY.resize(N, Y.cols());
+  scalar result = 0;
+
+#pragma omp parallel for reduction(+:result)
+  for (long i = 0; i < N; i++)
+  {
+    scalar p = Y.row(i).dot(T.row(i));
+    result -= std::log(p);
+    DY.row(i) = (-scale / p) * T.row(i);
+  }
+
+  return result;
+}
+
 struct loss_function
 {
   // tag::doc[]
@@ -561,6 +658,15 @@ struct loss_function
   [[nodiscard]] virtual eigen::matrix gradient(const eigen::matrix& Y, const eigen::matrix& T) const = 0;
   // end::doc[]
 
+  /// Calculate the loss for output `Y` and target `T`, and store `scale` times its gradient in `DY`.
+  /// This has the same result as `DY = scale * gradient(Y, T); return value(Y, T);`, but it is
+  /// done in a single pass, and without allocating memory if `DY` already has the right size.
+  virtual scalar value_and_gradient(const eigen::matrix& Y, const eigen::matrix& T, eigen::matrix& DY, scalar scale = 1) const
+  {
+    DY = scale * gradient(Y, T);
+    return value(Y, T);
+  }
+
   [[nodiscard]] virtual auto to_string() const -> std::string = 0;
 
   virtual ~loss_function() = default;
@@ -590,6 +696,11 @@ struct squared_error_loss: public loss_function
     return Squared_error_loss_rowwise_gradient(Y, T);
   }
 
+  scalar value_and_gradient(const eigen::matrix& Y, const eigen::matrix& T, eigen::matrix& DY, scalar scale = 1) const override
+  {
+    return Squared_error_loss_rowwise_value_and_gradient(Y, T, DY, scale);
+  }
+
   [[nodiscard]] auto to_string() const -> std::string override
   {
     return "SquaredErrorLoss()";
@@ -620,6 +731,11 @@ struct cross_entropy_loss: public loss_function
     return Cross_entropy_loss_rowwise_gradient(Y, T);
   }
 
+  scalar value_and_gradient(const eigen::matrix& Y, const eigen::matrix& T, eigen::matrix& DY, scalar scale = 1) const override
+  {
+    return Cross_entropy_loss_rowwise_value_and_gradient(Y, T, DY, scale);
+  }
+
   [[nodiscard]] auto to_string() const -> std::string override
   {
     return "CrossEntropyLoss()";
@@ -650,6 +766,11 @@ struct softmax_cross_entropy_loss: public loss_function
     return Softmax_cross_entropy_loss_rowwise_gradient(Y, T);
   }
 
+  scalar value_and_gradient(const eigen::matrix& Y, const eigen::matrix& T, eigen::matrix& DY, scalar scale = 1) const override
+  {
+    return Softmax_cross_entropy_loss_rowwise_value_and_gradient(Y, T, DY, scale);
+  }
+
   [[nodiscard]] auto to_string() const -> std::string override
   {
     return "SoftmaxCrossEntropyLoss()";
@@ -680,6 +801,11 @@ struct logistic_cross_entropy_loss: public loss_function
     return Logistic_cross_entropy_loss_rowwise_gradient(Y, T);
   }
 
+  scalar value_and_gradient(const eigen::matrix& Y, const eigen::matrix& T, eigen::matrix& DY, scalar scale = 1) const override
+  {
+    return Logistic_cross_entropy_loss_rowwise_value_and_gradient(Y, T, DY, scale);
+  }
+
   [[nodiscard]] auto to_string() const -> std::string override
   {
     return "LogisticCrossEntropyLoss()";
@@ -710,6 +836,11 @@ struct negative_log_likelihood_loss: public loss_function
     return Negative_log_likelihood_loss_rowwise_gradient(Y, T);
   }
 
+  scalar value_and_gradient(const eigen::matrix& Y, const eigen::matrix& T, eigen::matrix& DY, scalar scale = 1) const override
+  {
+    return Negative_log_likelihood_loss_rowwise_value_and_gradient(Y, T, DY, scale);
+  }
+
   [[nodiscard]] auto to_string() const -> std::string override
   {
     return "NegativeLogLikelihoodLoss()";
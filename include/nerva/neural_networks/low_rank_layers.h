@@ -0,0 +1,357 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/low_rank_layers.h
+/// \brief Linear layers with a weight matrix of low rank.
+///
+/// A low rank layer with input size D, output size K and rank r stores its weight matrix as a product W = U * V,
+/// with U a K x r matrix and V an r x D matrix. The feedforward and backpropagation steps are done with two thin
+/// matrix products each, which takes O(N r (K + D)) operations instead of O(N K D) for a dense layer. The factors
+/// can be initialized from a trained dense layer using a truncated singular value decomposition.
+
+#pragma once
+
+#include "nerva/neural_networks/dropout_layers.h"
+#include "nerva/neural_networks/layers.h"
+#include "fmt/format.h"
+#include <Eigen/SVD>
+#include <memory>
+#include <random>
+#include <typeinfo>
+#include <vector>
+
+namespace nerva {
+
+struct low_rank_linear_layer: public neural_network_layer
+{
+  using super = neural_network_layer;
+  using super::X;
+  using super::DX;
+
+  eigen::matrix U;
+  eigen::matrix V;
+  eigen::matrix b;
+  eigen::matrix DU;
+  eigen::matrix DV;
+  eigen::matrix Db;
+  eigen::matrix XV;  // the product X * V^T, which is needed for backpropagation
+  eigen::matrix DXV; // the gradient of XV
+  std::shared_ptr<optimizer_function> optimizer;
+  mkl::jit_gemm_cache jit;  // only used in mkl mode
+
+  explicit low_rank_linear_layer(std::size_t D, std::size_t K, std::size_t r, std::size_t N)
+    : super(D, N), U(K, r), V(r, D), b(1, K), DU(K, r), DV(r, D), Db(1, K), XV(N, r), DXV(N, r)
+  {}
+
+  [[nodiscard]] auto input_size() const -> std::size_t
+  {
+    return V.cols();
+  }
+
+  [[nodiscard]] auto output_size() const -> std::size_t
+  {
+    return U.rows();
+  }
+
+  [[nodiscard]] auto rank() const -> std::size_t
+  {
+    return U.cols();
+  }
+
+  /// Returns the weight matrix U * V.
+  [[nodiscard]] eigen::matrix weights() const
+  {
+    return U * V;
+  }
+
+  [[nodiscard]] virtual auto activation_to_string() const -> std::string
+  {
+    return "NoActivation()";
+  }
+
+  [[nodiscard]] auto to_string() const -> std::string override
+  {
+    return fmt::format("LowRank(input_size={}, output_size={}, rank={}, optimizer={}, activation={})", input_size(), output_size(), rank(), optimizer->to_string(), activation_to_string());
+  }
+
+  // Computes Z = X * V^T * U^T + row_repeat(b, N). Mixed precision is not supported, so this is always done in single precision.
+  void feedforward_linear(eigen::matrix& Z)
+  {
+    using eigen::parallel_assign;
+    using eigen::row_repeat;
+
+    auto N = X.rows();
+
+    if (NervaComputation == computation::eigen)
+    {
+      XV.noalias() = X * V.transpose();
+      Z.noalias() = XV * U.transpose();
+    }
+    else
+    {
+      jit.set_batch_size(N);
+      jit.product(XV, X, V, false, true);
+      jit.product(Z, XV, U, false, true);
+    }
+    parallel_assign(Z, Z + row_repeat(b, N));
+  }
+
+  // Computes the gradients of the parameters and of the input, given the gradient DZ of Z.
+  void backpropagate_linear(const eigen::matrix& DZ)
+  {
+    using eigen::parallel_columns_sum;
+
+    if (NervaComputation == computation::eigen)
+    {
+      DU.noalias() = DZ.transpose() * XV;
+      DXV.noalias() = DZ * U;
+      DV.noalias() = DXV.transpose() * X;
+      DX.noalias() = DXV * V;
+    }
+    else
+    {
+      jit.product(DU, DZ, XV, true, false);
+      jit.product(DXV, DZ, U);
+      jit.product(DV, DXV, X, true, false);
+      jit.product(DX, DXV, V);
+    }
+    parallel_columns_sum(DZ, Db);
+  }
+
+  void feedforward(eigen::matrix& result) override
+  {
+    feedforward_linear(result);
+  }
+
+  void backpropagate(const eigen::matrix& /* Y */, const eigen::matrix& DY) override
+  {
+    backpropagate_linear(DY);
+  }
+
+  void optimize(scalar eta) override
+  {
+    optimizer->update(eta);
+  }
+
+  void clip(scalar epsilon) override
+  {
+    if (optimizer)
+    {
+      optimizer->clip(epsilon);
+    }
+  }
+
+  void info(unsigned int layer_index) const override
+  {
+    std::string i = std::to_string(layer_index);
+    std::cout << to_string() << std::endl;
+    print_numpy_matrix("U" + i, U);
+    print_numpy_matrix("V" + i, V);
+    print_numpy_matrix("b" + i, b);
+  }
+
+  void release_activations() override
+  {
+    super::release_activations();
+    XV.resize(0, 0);
+  }
+
+  [[nodiscard]] long activation_size() const override
+  {
+    return super::activation_size() + XV.size();
+  }
+
+  std::vector<eigen::matrix*> batch_buffers() override
+  {
+    auto result = super::batch_buffers();
+    result.insert(result.end(), { &XV, &DXV });
+    return result;
+  }
+};
+
+template <typename ActivationFunction>
+struct low_rank_activation_layer: public low_rank_linear_layer
+{
+  using super = low_rank_linear_layer;
+  using super::X;
+  using super::DX;
+
+  ActivationFunction act;
+  eigen::matrix Z;
+  eigen::matrix DZ;
+
+  explicit low_rank_activation_layer(std::size_t D, std::size_t K, std::size_t r, std::size_t N, ActivationFunction act_)
+    : super(D, K, r, N), act(act_), Z(N, K), DZ(N, K)
+  {}
+
+  [[nodiscard]] auto activation_to_string() const -> std::string override
+  {
+    return act.to_string();
+  }
+
+  void feedforward(eigen::matrix& result) override
+  {
+    using eigen::parallel_assign;
+
+    feedforward_linear(Z);
+    if (NervaComputation == computation::eigen)
+    {
+      parallel_assign(result, act(Z));
+    }
+    else
+    {
+      mkl::apply_activation(act, Z, result);
+    }
+  }
+
+  void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
+  {
+    using eigen::hadamard;
+    using eigen::parallel_assign;
+
+    if constexpr (has_output_gradient<ActivationFunction>::value)
+    {
+      parallel_assign(DZ, hadamard(DY, act.output_gradient(Y)));
+    }
+    else
+    {
+      parallel_assign(DZ, hadamard(DY, act.gradient(Z)));
+    }
+    backpropagate_linear(DZ);
+  }
+
+  void release_activations() override
+  {
+    super::release_activations();
+    Z.resize(0, 0);
+  }
+
+  [[nodiscard]] long activation_size() const override
+  {
+    return super::activation_size() + Z.size();
+  }
+
+  std::vector<eigen::matrix*> batch_buffers() override
+  {
+    auto result = super::batch_buffers();
+    result.insert(result.end(), { &Z, &DZ });
+    return result;
+  }
+};
+
+using low_rank_relu_layer = low_rank_activation_layer<relu_activation>;
+using low_rank_sigmoid_layer = low_rank_activation_layer<sigmoid_activation>;
+using low_rank_hyperbolic_tangent_layer = low_rank_activation_layer<hyperbolic_tangent_activation>;
+using low_rank_leaky_relu_layer = low_rank_activation_layer<leaky_relu_activation>;
+using low_rank_all_relu_layer = low_rank_activation_layer<all_relu_activation>;
+
+/// Initializes the factors U and V of a low rank layer as if they were the weights of two consecutive layers.
+inline
+void set_weights_and_bias(low_rank_linear_layer& layer, weight_initialization w, std::mt19937& rng)
+{
+  auto init_V = make_weight_initializer(w, layer.V, rng);
+  set_weights(layer.V, [&init_V]() { return (*init_V)(); });
+  init_V->initialize_bias(layer.b);
+  auto init_U = make_weight_initializer(w, layer.U, rng);
+  set_weights(layer.U, [&init_U]() { return (*init_U)(); });
+}
+
+inline
+void set_low_rank_layer_optimizer(low_rank_linear_layer& layer, const std::string& text)
+{
+  auto optimizer_U = parse_optimizer(text, layer.U, layer.DU);
+  auto optimizer_V = parse_optimizer(text, layer.V, layer.DV);
+  auto optimizer_b = parse_optimizer(text, layer.b, layer.Db);
+  layer.optimizer = make_composite_optimizer(optimizer_U, optimizer_V, optimizer_b);
+}
+
+/// Computes the factors U (K x r) and V (r x D) of the best approximation U * V of rank r of the K x D matrix W,
+/// using a truncated singular value decomposition W ~ P * S * Q^T. The singular values are divided evenly over the
+/// factors, i.e. U = P * sqrt(S) and V = sqrt(S) * Q^T.
+inline
+void low_rank_factorization(const eigen::matrix& W, long r, eigen::matrix& U, eigen::matrix& V)
+{
+  using column_major_matrix = Eigen::Matrix<scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor>;
+
+  if (r <= 0 || r > std::min(W.rows(), W.cols()))
+  {
+    throw std::runtime_error(fmt::format("low_rank_factorization: the rank {} is not in the range [1, {}]", r, std::min(W.rows(), W.cols())));
+  }
+
+  Eigen::BDCSVD<column_major_matrix> svd(column_major_matrix(W), Eigen::ComputeThinU | Eigen::ComputeThinV);
+  Eigen::Matrix<scalar, Eigen::Dynamic, 1> sqrt_S = svd.singularValues().head(r).cwiseSqrt();
+  U = svd.matrixU().leftCols(r) * sqrt_S.asDiagonal();
+  V = sqrt_S.asDiagonal() * svd.matrixV().leftCols(r).transpose();
+}
+
+/// Sets the parameters of a low rank layer to the best approximation of rank layer.rank() of the parameters W and b
+/// of a dense layer.
+inline
+void load_dense_weights(low_rank_linear_layer& layer, const eigen::matrix& W, const eigen::matrix& b)
+{
+  if (W.rows() != static_cast<long>(layer.output_size()) || W.cols() != static_cast<long>(layer.input_size()))
+  {
+    throw std::runtime_error(fmt::format("load_dense_weights: expected a {}x{} matrix, but got a {}x{} matrix", layer.output_size(), layer.input_size(), W.rows(), W.cols()));
+  }
+  low_rank_factorization(W, layer.rank(), layer.U, layer.V);
+  layer.b = b;
+}
+
+/// Converts a trained dense layer into a low rank layer of rank r with the same activation function. The weights
+/// are initialized with a truncated singular value decomposition of the weights of the dense layer. Low rank layers
+/// have no dropout, so dense layers with dropout are rejected.
+inline
+std::shared_ptr<low_rank_linear_layer> make_low_rank_layer(const neural_network_layer& layer, long r, const std::string& optimizer)
+{
+  std::shared_ptr<low_rank_linear_layer> result;
+  auto dense_layer = dynamic_cast<const dense_linear_layer*>(&layer);
+  if (!dense_layer)
+  {
+    throw std::runtime_error("make_low_rank_layer: only dense linear layers can be converted");
+  }
+  if (dynamic_cast<const dropout_layer<eigen::matrix>*>(&layer))
+  {
+    throw std::runtime_error("make_low_rank_layer: layers with dropout can not be converted, since low rank layers do not support dropout");
+  }
+
+  auto D = dense_layer->input_size();
+  auto K = dense_layer->output_size();
+  auto N = layer.X.rows();
+  if (auto relu_layer = dynamic_cast<const dense_relu_layer*>(&layer))
+  {
+    result = std::make_shared<low_rank_relu_layer>(D, K, r, N, relu_layer->act);
+  }
+  else if (auto sigmoid_layer = dynamic_cast<const dense_sigmoid_layer*>(&layer))
+  {
+    result = std::make_shared<low_rank_sigmoid_layer>(D, K, r, N, sigmoid_layer->act);
+  }
+  else if (auto tanh_layer = dynamic_cast<const dense_hyperbolic_tangent_layer*>(&layer))
+  {
+    result = std::make_shared<low_rank_hyperbolic_tangent_layer>(D, K, r, N, tanh_layer->act);
+  }
+  else if (auto leaky_relu_layer = dynamic_cast<const dense_leaky_relu_layer*>(&layer))
+  {
+    result = std::make_shared<low_rank_leaky_relu_layer>(D, K, r, N, leaky_relu_layer->act);
+  }
+  else if (auto all_relu_layer = dynamic_cast<const dense_all_relu_layer*>(&layer))
+  {
+    result = std::make_shared<low_rank_all_relu_layer>(D, K, r, N, all_relu_layer->act);
+  }
+  else if (typeid(layer) == typeid(dense_linear_layer))
+  {
+    result = std::make_shared<low_rank_linear_layer>(D, K, r, N);
+  }
+  else
+  {
+    throw std::runtime_error("make_low_rank_layer: unsupported layer " + layer.to_string());
+  }
+
+  load_dense_weights(*result, dense_layer->W, dense_layer->b);
+  set_low_rank_layer_optimizer(*result, optimizer);
+  return result;
+}
+
+} // namespace nerva
@@ -13,6 +13,7 @@
 #include <cmath>
 #include <iostream>
 #include <Eigen/Dense>
+#include "nerva/neural_networks/parallel_operations.h"
 
 namespace nerva::eigen {
 
@@ -100,7 +101,7 @@ auto Diag(const Matrix& x)
 template <typename Matrix>
 auto elements_sum(const Matrix& X)
 {
-  return X.sum();
+  return parallel_elements_sum(X);
 }
 
 template <typename Matrix>
@@ -0,0 +1,253 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/mixed_precision.h
+/// \brief Support for mixed precision training with bf16 matrix products.
+///
+/// In mixed precision mode (see NervaMixedPrecision) the dense linear layers convert their inputs, weights and
+/// output gradients to bf16 before the matrix products, and accumulate the products in fp32. The weights W are
+/// the fp32 master weights, which are updated by the optimizers in fp32. A loss_scaler is used to keep small
+/// gradients representable, and to skip updates with gradients that overflowed.
+
+#pragma once
+
+#include "nerva/neural_networks/eigen.h"
+#include "nerva/neural_networks/settings.h"
+#include "fmt/format.h"
+#include <mkl.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace nerva {
+
+/// Converts x to bf16 using round to nearest even. NaN values remain NaN.
+inline
+std::uint16_t to_bfloat16(float x)
+{
+  std::uint32_t u;
+  std::memcpy(&u, &x, sizeof(u));
+  if ((u & 0x7fffffffU) > 0x7f800000U)
+  {
+    return static_cast<std::uint16_t>((u >> 16U) | 0x0040U);
+  }
+  u += 0x7fffU + ((u >> 16U) & 1U);
+  return static_cast<std::uint16_t>(u >> 16U);
+}
+
+inline
+float from_bfloat16(std::uint16_t x)
+{
+  std::uint32_t u = static_cast<std::uint32_t>(x) << 16U;
+  float result;
+  std::memcpy(&result, &u, sizeof(result));
+  return result;
+}
+
+/// Rounds the elements of A to the nearest bf16 value.
+inline
+void round_to_bfloat16(eigen::matrix& A)
+{
+  scalar* data = A.data();
+  long n = A.size();
+
+#pragma omp parallel for
+  for (long i = 0; i < n; i++)
+  {
+    data[i] = from_bfloat16(to_bfloat16(static_cast<float>(data[i])));
+  }
+}
+
+// A row major matrix with bf16 elements.
+class bfloat16_matrix
+{
+  protected:
+    long m_rows = 0;
+    long m_columns = 0;
+    std::vector<std::uint16_t> m_data;
+
+  public:
+    bfloat16_matrix() = default;
+
+    explicit bfloat16_matrix(const eigen::matrix& A)
+    {
+      assign(A);
+    }
+
+    [[nodiscard]] long rows() const
+    {
+      return m_rows;
+    }
+
+    [[nodiscard]] long cols() const
+    {
+      return m_columns;
+    }
+
+    [[nodiscard]] const std::uint16_t* data() const
+    {
+      return m_data.data();
+    }
+
+    /// Assigns the elements of A rounded to bf16. The memory is only reallocated if the size of A grows.
+    void assign(const eigen::matrix& A)
+    {
+      m_rows = A.rows();
+      m_columns = A.cols();
+      m_data.resize(A.size());
+      const scalar* a = A.data();
+      long n = A.size();
+
+#pragma omp parallel for
+      for (long i = 0; i < n; i++)
+      {
+        m_data[i] = to_bfloat16(static_cast<float>(a[i]));
+      }
+    }
+
+    [[nodiscard]] eigen::matrix to_eigen() const
+    {
+      eigen::matrix result(m_rows, m_columns);
+      scalar* x = result.data();
+      long n = result.size();
+
+#pragma omp parallel for
+      for (long i = 0; i < n; i++)
+      {
+        x[i] = from_bfloat16(m_data[i]);
+      }
+      return result;
+    }
+};
+
+/// Computes C = op(A) * op(B), where op(A) = A^T if A_transposed and op(A) = A otherwise. The operands are in bf16,
+/// and the products are accumulated in fp32.
+inline
+void bf16_product(eigen::matrix& C, const bfloat16_matrix& A, const bfloat16_matrix& B, bool A_transposed = false, bool B_transposed = false)
+{
+  long m = A_transposed ? A.cols() : A.rows();
+  long k = A_transposed ? A.rows() : A.cols();
+  long n = B_transposed ? B.rows() : B.cols();
+  if (k != (B_transposed ? B.cols() : B.rows()))
+  {
+    throw std::runtime_error(fmt::format("bf16_product: the sizes of the operands do not match ({} x {} and {} x {})", m, k, B.rows(), B.cols()));
+  }
+  C.resize(m, n);
+
+  // N.B. bf16_product is not a template, so the MKL call must be excluded by the preprocessor in double precision
+#ifndef NERVA_USE_DOUBLE
+  if (NervaComputation == computation::mkl)
+  {
+    // N.B. MKL uses AVX512-BF16 or AMX instructions for this if the processor supports them
+    CBLAS_TRANSPOSE transA = A_transposed ? CblasTrans : CblasNoTrans;
+    CBLAS_TRANSPOSE transB = B_transposed ? CblasTrans : CblasNoTrans;
+    cblas_gemm_bf16bf16f32(CblasRowMajor, transA, transB, m, n, k, 1.0f,
+                           reinterpret_cast<const MKL_BF16*>(A.data()), A.cols(),
+                           reinterpret_cast<const MKL_BF16*>(B.data()), B.cols(),
+                           0.0f, C.data(), n);
+    return;
+  }
+#endif
+
+  // Emulation: the bf16 values are exactly representable in fp32, so a product of the expanded operands gives
+  // the same result as a bf16 product with fp32 accumulation, up to the order of the additions.
+  eigen::matrix A1 = A.to_eigen();
+  eigen::matrix B1 = B.to_eigen();
+  if (A_transposed && B_transposed)
+  {
+    C.noalias() = A1.transpose() * B1.transpose();
+  }
+  else if (A_transposed)
+  {
+    C.noalias() = A1.transpose() * B1;
+  }
+  else if (B_transposed)
+  {
+    C.noalias() = A1 * B1.transpose();
+  }
+  else
+  {
+    C.noalias() = A1 * B1;
+  }
+}
+
+// The bf16 operands of the matrix products of a dense linear layer in mixed precision mode.
+struct bfloat16_buffers
+{
+  bfloat16_matrix X;   // the input of the layer, which is stored for the backpropagation
+  bfloat16_matrix W;   // a copy of the fp32 master weights
+  bfloat16_matrix DY;  // the gradient of the output
+};
+
+/// Computes result = X * W^T + row_repeat(b, N) using bf16 operands.
+inline
+void bf16_linear_feedforward(const eigen::matrix& X, const eigen::matrix& W, const eigen::matrix& b, eigen::matrix& result, bfloat16_buffers& buffers)
+{
+  using eigen::row_repeat;
+
+  buffers.X.assign(X);
+  buffers.W.assign(W);
+  bf16_product(result, buffers.X, buffers.W, false, true);
+  result += row_repeat(b, X.rows());
+}
+
+/// Computes DW = DY^T * X, Db = columns_sum(DY) and DX = DY * W using bf16 operands. The input X and the weights W
+/// are taken from the buffers, so this must be preceded by a call to bf16_linear_feedforward.
+inline
+void bf16_linear_backpropagate(const eigen::matrix& DY, eigen::matrix& DW, eigen::matrix& Db, eigen::matrix& DX, bfloat16_buffers& buffers)
+{
+  using eigen::columns_sum;
+
+  buffers.DY.assign(DY);
+  bf16_product(DW, buffers.DY, buffers.X, true, false);
+  Db = columns_sum(DY);
+  bf16_product(DX, buffers.DY, buffers.W);
+}
+
+/// Dynamic loss scaling. The gradient of the loss is multiplied with scale before backpropagation. If the
+/// resulting gradients contain infinite or NaN values, the update is skipped and the scale is decreased. After
+/// growth_interval consecutive updates without an overflow the scale is increased.
+struct loss_scaler
+{
+  scalar scale = 65536;
+  scalar growth_factor = 2;
+  scalar backoff_factor = 0.5;
+  unsigned int growth_interval = 2000;
+  unsigned int steps_since_overflow = 0;
+  unsigned int overflow_count = 0;
+
+  explicit loss_scaler(scalar initial_scale = 65536)
+    : scale(initial_scale)
+  {}
+
+  /// Updates the scale after a backpropagation step. Returns false if the update of the parameters must be skipped.
+  bool update(bool overflow)
+  {
+    if (overflow)
+    {
+      scale = std::max(scale * backoff_factor, scalar(1));
+      steps_since_overflow = 0;
+      overflow_count++;
+      return false;
+    }
+    if (++steps_since_overflow == growth_interval)
+    {
+      scale *= growth_factor;
+      steps_since_overflow = 0;
+    }
+    return true;
+  }
+
+  [[nodiscard]] std::string to_string() const
+  {
+    return fmt::format("LossScaler(scale={}, overflows={})", scale, overflow_count);
+  }
+};
+
+} // namespace nerva
@@ -0,0 +1,425 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/mixture_of_experts_layers.h
+/// \brief Mixture of experts layers, in which every example is processed by only a few of the experts.
+///
+/// A mixture of experts layer with input size D and output size K consists of E experts and a gating layer. An
+/// expert is a small MLP block with M hidden units, that computes act(x * W1^T + b1) * W2^T + b2. The gating layer
+/// computes the scores x * Wg^T + bg of the experts for an example x, and selects the k experts with the highest
+/// scores. The output for x is the sum of the outputs of the selected experts, weighted with the softmax of their
+/// scores.
+///
+/// The examples of a batch are grouped by expert into contiguous sub-batches, so each expert does one matrix
+/// product per factor on its group. The results are scattered back to the examples, and the backpropagation uses
+/// the same grouping. The number of operations per example grows with k, while the number of parameters grows with E.
+
+#pragma once
+
+#include "nerva/neural_networks/layers.h"
+#include "fmt/format.h"
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <vector>
+
+namespace nerva {
+
+template <typename ActivationFunction>
+struct mixture_of_experts_layer: public neural_network_layer
+{
+  using super = neural_network_layer;
+  using super::X;
+  using super::DX;
+
+  long E;  // the number of experts
+  long k;  // the number of experts per example
+  long M;  // the number of hidden units of an expert
+  ActivationFunction act;
+
+  eigen::matrix Wg;   // the gating weights (E x D)
+  eigen::matrix bg;   // the gating bias (1 x E)
+  eigen::matrix W1;   // the first weight matrices of the experts, stacked vertically (E * M x D)
+  eigen::matrix b1;   // the first biases of the experts, stacked horizontally (1 x E * M)
+  eigen::matrix W2;   // the second weight matrices of the experts, stacked vertically (E * K x M)
+  eigen::matrix b2;   // the second biases of the experts, stacked horizontally (1 x E * K)
+  eigen::matrix DWg;
+  eigen::matrix Dbg;
+  eigen::matrix DW1;
+  eigen::matrix Db1;
+  eigen::matrix DW2;
+  eigen::matrix Db2;
+  std::shared_ptr<optimizer_function> optimizer;
+
+  // The intermediate results. Rows of the grouped matrices correspond to (example, expert) assignments that are sorted by expert.
+  eigen::matrix G;    // the gating scores (N x E)
+  eigen::matrix DG;   // the gradient of G
+  eigen::matrix Xg;   // the grouped inputs (N * k x D)
+  eigen::matrix Z1;   // the grouped hidden values before the activation (N * k x M)
+  eigen::matrix H1;   // the grouped hidden values (N * k x M)
+  eigen::matrix Yg;   // the grouped outputs of the experts (N * k x K)
+  eigen::matrix DYg;  // the gradient of Yg
+  eigen::matrix DZ1;  // the gradient of Z1
+  eigen::matrix DXg;  // the gradient of Xg
+
+  std::vector<long> assignment_expert;    // assignment_expert[n * k + j] is the j-th expert of example n
+  std::vector<scalar> assignment_weight;  // assignment_weight[n * k + j] is the gate value of the j-th expert of example n
+  std::vector<long> assignment_row;       // assignment_row[n * k + j] is the row of the j-th expert of example n in the grouped matrices
+  std::vector<long> expert_offsets;       // the rows of expert e in the grouped matrices are [expert_offsets[e], expert_offsets[e + 1])
+
+  // Load balancing statistics, accumulated over the feedforward steps in training mode since the last call to
+  // reset_statistics.
+  std::vector<long> expert_counts;        // the number of examples that were routed to an expert
+  std::vector<double> expert_importance;  // the sum of the gate values of an expert
+  bool training = true;                   // if false, the feedforward steps do not update the statistics
+
+  explicit mixture_of_experts_layer(std::size_t D, std::size_t K, std::size_t N, long E_, long k_, long M_, ActivationFunction act_)
+    : super(D, N), E(E_), k(k_), M(M_), act(act_),
+      Wg(E_, D), bg(1, E_), W1(E_ * M_, D), b1(1, E_ * M_), W2(E_ * K, M_), b2(1, E_ * K),
+      DWg(E_, D), Dbg(1, E_), DW1(E_ * M_, D), Db1(1, E_ * M_), DW2(E_ * K, M_), Db2(1, E_ * K)
+  {
+    if (k_ <= 0 || k_ > E_)
+    {
+      throw std::runtime_error(fmt::format("The number of selected experts {} must be in the range [1, {}]", k_, E_));
+    }
+    reset_statistics();
+  }
+
+  [[nodiscard]] auto input_size() const -> std::size_t
+  {
+    return Wg.cols();
+  }
+
+  [[nodiscard]] auto output_size() const -> std::size_t
+  {
+    return W2.rows() / E;
+  }
+
+  [[nodiscard]] auto to_string() const -> std::string override
+  {
+    return fmt::format("MixtureOfExperts(input_size={}, output_size={}, experts={}, k={}, hidden={}, optimizer={}, activation={})", input_size(), output_size(), E, k, M, optimizer->to_string(), act.to_string());
+  }
+
+  // Selects the experts of the examples, and groups the assignments by expert.
+  void route()
+  {
+    auto N = X.rows();
+    assignment_expert.resize(N * k);
+    assignment_weight.resize(N * k);
+    assignment_row.resize(N * k);
+
+#pragma omp parallel for
+    for (long n = 0; n < N; n++)
+    {
+      std::vector<long> experts(E);
+      std::iota(experts.begin(), experts.end(), 0);
+      std::partial_sort(experts.begin(), experts.begin() + k, experts.end(), [&](long e1, long e2) { return G(n, e1) > G(n, e2); });
+
+      // the gate values are the softmax of the scores of the selected experts
+      scalar max_score = G(n, experts[0]);
+      scalar sum = 0;
+      for (long j = 0; j < k; j++)
+      {
+        scalar w = std::exp(G(n, experts[j]) - max_score);
+        assignment_expert[n * k + j] = experts[j];
+        assignment_weight[n * k + j] = w;
+        sum += w;
+      }
+      for (long j = 0; j < k; j++)
+      {
+        assignment_weight[n * k + j] /= sum;
+      }
+    }
+
+    // counting sort of the assignments by expert
+    expert_offsets.assign(E + 1, 0);
+    for (long e: assignment_expert)
+    {
+      expert_offsets[e + 1]++;
+    }
+    std::partial_sum(expert_offsets.begin(), expert_offsets.end(), expert_offsets.begin());
+    std::vector<long> position(expert_offsets.begin(), expert_offsets.end() - 1);
+    for (long a = 0; a < N * k; a++)
+    {
+      assignment_row[a] = position[assignment_expert[a]]++;
+    }
+
+    if (training)
+    {
+      for (long a = 0; a < N * k; a++)
+      {
+        expert_counts[assignment_expert[a]]++;
+        expert_importance[assignment_expert[a]] += assignment_weight[a];
+      }
+    }
+  }
+
+  void feedforward(eigen::matrix& result) override
+  {
+    using eigen::parallel_assign;
+    using eigen::row_repeat;
+
+    auto N = X.rows();
+    auto D = input_size();
+    auto K = output_size();
+
+    G.noalias() = X * Wg.transpose();
+    parallel_assign(G, G + row_repeat(bg, N));
+    route();
+
+    // gather the inputs of the experts
+    Xg.resize(N * k, D);
+#pragma omp parallel for
+    for (long a = 0; a < N * k; a++)
+    {
+      Xg.row(assignment_row[a]) = X.row(a / k);
+    }
+
+    // every expert processes its sub-batch
+    Z1.resize(N * k, M);
+    H1.resize(N * k, M);
+    Yg.resize(N * k, K);
+#pragma omp parallel for schedule(dynamic)
+    for (long e = 0; e < E; e++)
+    {
+      long first = expert_offsets[e];
+      long size = expert_offsets[e + 1] - first;
+      if (size == 0)
+      {
+        continue;
+      }
+      auto Z1_e = Z1.middleRows(first, size);
+      auto H1_e = H1.middleRows(first, size);
+      auto Yg_e = Yg.middleRows(first, size);
+      Z1_e.noalias() = Xg.middleRows(first, size) * W1.middleRows(e * M, M).transpose();
+      Z1_e.rowwise() += b1.middleCols(e * M, M).row(0);
+      H1_e = act(Z1_e);
+      Yg_e.noalias() = H1_e * W2.middleRows(e * K, K).transpose();
+      Yg_e.rowwise() += b2.middleCols(e * K, K).row(0);
+    }
+
+    // scatter the weighted outputs of the experts back to the examples
+    result.resize(N, K);
+#pragma omp parallel for
+    for (long n = 0; n < N; n++)
+    {
+      result.row(n) = assignment_weight[n * k] * Yg.row(assignment_row[n * k]);
+      for (long j = 1; j < k; j++)
+      {
+        result.row(n) += assignment_weight[n * k + j] * Yg.row(assignment_row[n * k + j]);
+      }
+    }
+  }
+
+  void backpropagate(const eigen::matrix& /* Y */, const eigen::matrix& DY) override
+  {
+    using eigen::parallel_columns_sum;
+
+    auto N = X.rows();
+    auto D = input_size();
+    auto K = output_size();
+
+    // the gradients of the outputs of the experts and of the gating scores
+    DYg.resize(N * k, K);
+    DG = eigen::matrix::Zero(N, E);
+#pragma omp parallel for
+    for (long n = 0; n < N; n++)
+    {
+      scalar sum = 0;
+      for (long j = 0; j < k; j++)
+      {
+        long a = n * k + j;
+        DYg.row(assignment_row[a]) = assignment_weight[a] * DY.row(n);
+        scalar Dw = DY.row(n).dot(Yg.row(assignment_row[a]));
+        DG(n, assignment_expert[a]) = Dw;
+        sum += assignment_weight[a] * Dw;
+      }
+      for (long j = 0; j < k; j++)
+      {
+        long a = n * k + j;
+        DG(n, assignment_expert[a]) = assignment_weight[a] * (DG(n, assignment_expert[a]) - sum);
+      }
+    }
+
+    // every expert backpropagates its sub-batch
+    DZ1.resize(N * k, M);
+    DXg.resize(N * k, D);
+#pragma omp parallel for schedule(dynamic)
+    for (long e = 0; e < E; e++)
+    {
+      long first = expert_offsets[e];
+      long size = expert_offsets[e + 1] - first;
+      if (size == 0)
+      {
+        DW1.middleRows(e * M, M).setZero();
+        Db1.middleCols(e * M, M).setZero();
+        DW2.middleRows(e * K, K).setZero();
+        Db2.middleCols(e * K, K).setZero();
+        continue;
+      }
+      auto DYg_e = DYg.middleRows(first, size);
+      auto DZ1_e = DZ1.middleRows(first, size);
+      DW2.middleRows(e * K, K).noalias() = DYg_e.transpose() * H1.middleRows(first, size);
+      Db2.middleCols(e * K, K) = DYg_e.colwise().sum();
+      DZ1_e.noalias() = DYg_e * W2.middleRows(e * K, K);
+      DZ1_e.array() *= act.gradient(Z1.middleRows(first, size)).array();
+      DW1.middleRows(e * M, M).noalias() = DZ1_e.transpose() * Xg.middleRows(first, size);
+      Db1.middleCols(e * M, M) = DZ1_e.colwise().sum();
+      DXg.middleRows(first, size).noalias() = DZ1_e * W1.middleRows(e * M, M);
+    }
+
+    // the gradients of the gating layer
+    DWg.noalias() = DG.transpose() * X;
+    parallel_columns_sum(DG, Dbg);
+    DX.noalias() = DG * Wg;
+
+    // gather the gradients of the inputs
+#pragma omp parallel for
+    for (long n = 0; n < N; n++)
+    {
+      for (long j = 0; j < k; j++)
+      {
+        DX.row(n) += DXg.row(assignment_row[n * k + j]);
+      }
+    }
+  }
+
+  void optimize(scalar eta) override
+  {
+    optimizer->update(eta);
+  }
+
+  void clip(scalar epsilon) override
+  {
+    if (optimizer)
+    {
+      optimizer->clip(epsilon);
+    }
+  }
+
+  void reset_statistics()
+  {
+    expert_counts.assign(E, 0);
+    expert_importance.assign(E, 0);
+  }
+
+  /// Returns the ratio between the largest number of examples routed to an expert and the average number. If the
+  /// load is perfectly balanced, the result is 1.
+  [[nodiscard]] double load_imbalance() const
+  {
+    long total = std::accumulate(expert_counts.begin(), expert_counts.end(), 0L);
+    if (total == 0)
+    {
+      return 1;
+    }
+    long max_count = *std::max_element(expert_counts.begin(), expert_counts.end());
+    return static_cast<double>(max_count) * E / total;
+  }
+
+  [[nodiscard]] std::string statistics() const
+  {
+    return fmt::format("expert counts: {}, importance: {}, load imbalance: {:.4f}",
+                       utilities::string_join(expert_counts, ", "),
+                       utilities::string_join(expert_importance, ", "),
+                       load_imbalance());
+  }
+
+  void info(unsigned int layer_index) const override
+  {
+    std::string i = std::to_string(layer_index);
+    std::cout << to_string() << std::endl;
+    std::cout << statistics() << std::endl;
+    print_numpy_matrix("Wg" + i, Wg);
+    print_numpy_matrix("bg" + i, bg);
+    print_numpy_matrix("W1_" + i, W1);
+    print_numpy_matrix("b1_" + i, b1);
+    print_numpy_matrix("W2_" + i, W2);
+    print_numpy_matrix("b2_" + i, b2);
+  }
+
+  void release_activations() override
+  {
+    super::release_activations();
+    G.resize(0, 0);
+    Xg.resize(0, 0);
+    Z1.resize(0, 0);
+    H1.resize(0, 0);
+    Yg.resize(0, 0);
+  }
+
+  [[nodiscard]] long activation_size() const override
+  {
+    return super::activation_size() + G.size() + Xg.size() + Z1.size() + H1.size() + Yg.size();
+  }
+
+  std::vector<eigen::matrix*> batch_buffers() override
+  {
+    auto result = super::batch_buffers();
+    result.insert(result.end(), { &G, &DG, &Xg, &Z1, &H1, &Yg, &DYg, &DZ1, &DXg });
+    return result;
+  }
+};
+
+using relu_mixture_of_experts_layer = mixture_of_experts_layer<relu_activation>;
+using sigmoid_mixture_of_experts_layer = mixture_of_experts_layer<sigmoid_activation>;
+using hyperbolic_tangent_mixture_of_experts_layer = mixture_of_experts_layer<hyperbolic_tangent_activation>;
+
+/// Calls f(moe_layer) if layer is a mixture of experts layer with one of the supported activation functions.
+/// Returns true if f was called.
+template <typename Function>
+bool visit_mixture_of_experts_layer(neural_network_layer& layer, Function f)
+{
+  if (auto moe_layer = dynamic_cast<relu_mixture_of_experts_layer*>(&layer))
+  {
+    f(*moe_layer);
+    return true;
+  }
+  else if (auto moe_layer = dynamic_cast<sigmoid_mixture_of_experts_layer*>(&layer))
+  {
+    f(*moe_layer);
+    return true;
+  }
+  else if (auto moe_layer = dynamic_cast<hyperbolic_tangent_mixture_of_experts_layer*>(&layer))
+  {
+    f(*moe_layer);
+    return true;
+  }
+  return false;
+}
+
+/// Initializes the gating layer and the layers of the experts as if they were separate dense layers.
+template <typename ActivationFunction>
+void set_weights_and_bias(mixture_of_experts_layer<ActivationFunction>& layer, weight_initialization w, std::mt19937& rng)
+{
+  auto D = layer.input_size();
+  auto K = layer.output_size();
+  eigen::matrix W1_block(layer.M, D);
+  eigen::matrix W2_block(K, layer.M);
+  auto init_g = make_weight_initializer(w, layer.Wg, rng);
+  set_weights(layer.Wg, [&init_g]() { return (*init_g)(); });
+  init_g->initialize_bias(layer.bg);
+  auto init_1 = make_weight_initializer(w, W1_block, rng);
+  set_weights(layer.W1, [&init_1]() { return (*init_1)(); });
+  init_1->initialize_bias(layer.b1);
+  auto init_2 = make_weight_initializer(w, W2_block, rng);
+  set_weights(layer.W2, [&init_2]() { return (*init_2)(); });
+  init_2->initialize_bias(layer.b2);
+}
+
+template <typename ActivationFunction>
+void set_mixture_of_experts_layer_optimizer(mixture_of_experts_layer<ActivationFunction>& layer, const std::string& text)
+{
+  auto optimizer_Wg = parse_optimizer(text, layer.Wg, layer.DWg);
+  auto optimizer_bg = parse_optimizer(text, layer.bg, layer.Dbg);
+  auto optimizer_W1 = parse_optimizer(text, layer.W1, layer.DW1);
+  auto optimizer_b1 = parse_optimizer(text, layer.b1, layer.Db1);
+  auto optimizer_W2 = parse_optimizer(text, layer.W2, layer.DW2);
+  auto optimizer_b2 = parse_optimizer(text, layer.b2, layer.Db2);
+  layer.optimizer = make_composite_optimizer(optimizer_Wg, optimizer_bg, optimizer_W1, optimizer_b1, optimizer_W2, optimizer_b2);
+}
+
+} // namespace nerva
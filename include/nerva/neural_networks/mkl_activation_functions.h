@@ -0,0 +1,73 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/mkl_activation_functions.h
+/// \brief Activation functions that are computed using the MKL vector math (VM) library.
+///
+/// The VM functions are used in their default high accuracy (HA) mode, in which the error of a single
+/// function call is at most 1 ulp. Since Sigmoid is computed using three VM calls (negation, exponentiation
+/// and a linear fraction), its error is at most a few ulp.
+
+#pragma once
+
+#include "nerva/neural_networks/activation_functions.h"
+#include "nerva/neural_networks/eigen.h"
+#include "nerva/neural_networks/mkl_dense_vector.h"
+
+namespace nerva::mkl {
+
+namespace detail {
+
+inline
+dense_vector_view<scalar> make_vector_view(const eigen::matrix& A)
+{
+  return dense_vector_view<scalar>(const_cast<scalar*>(A.data()), A.size());
+}
+
+} // namespace detail
+
+/// Computes Y = Sigmoid(X) = 1 / (1 + exp(-X)) element-wise.
+inline
+void sigmoid(const eigen::matrix& X, eigen::matrix& Y)
+{
+  Y.resize(X.rows(), X.cols());
+  auto x = detail::make_vector_view(X);
+  auto y = detail::make_vector_view(Y);
+  vm_linear_frac(x, x, scalar(-1), scalar(0), scalar(0), scalar(1), y);  // y := -x
+  vm_exp(y, y);                                                          // y := exp(-x)
+  vm_linear_frac(y, y, scalar(0), scalar(1), scalar(1), scalar(1), y);   // y := 1 / (1 + exp(-x))
+}
+
+/// Computes Y = Hyperbolic_tangent(X) element-wise.
+inline
+void hyperbolic_tangent(const eigen::matrix& X, eigen::matrix& Y)
+{
+  Y.resize(X.rows(), X.cols());
+  auto x = detail::make_vector_view(X);
+  auto y = detail::make_vector_view(Y);
+  vm_tanh(x, y);
+}
+
+/// Computes Y = act(X). Activation functions for which an MKL implementation is available are dispatched to it.
+template <typename ActivationFunction>
+void apply_activation(const ActivationFunction& act, const eigen::matrix& X, eigen::matrix& Y)
+{
+  Y = act(X);
+}
+
+inline
+void apply_activation(const sigmoid_activation& /* act */, const eigen::matrix& X, eigen::matrix& Y)
+{
+  sigmoid(X, Y);
+}
+
+inline
+void apply_activation(const hyperbolic_tangent_activation& /* act */, const eigen::matrix& X, eigen::matrix& Y)
+{
+  hyperbolic_tangent(X, Y);
+}
+
+} // namespace nerva::mkl
@@ -0,0 +1,298 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/mkl_jit_gemm.h
+/// \brief Matrix products of small dense matrices using MKL JIT kernels.
+///
+/// For small batches and small layers the overhead of cblas_?gemm (argument checking, and the decisions about
+/// threading and blocking) dominates the computation. MKL can generate a GEMM kernel for one specific shape at
+/// runtime. The class jit_gemm_cache keeps such kernels for the matrix products of a layer.
+
+#pragma once
+
+#include "nerva/neural_networks/eigen.h"
+#include "nerva/neural_networks/mkl_eigen.h"
+#include "nerva/utilities/stopwatch.h"
+#include "fmt/format.h"
+#include <mkl.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace nerva::mkl {
+
+// JIT kernels are used if the batch size is at most jit_gemm_max_batch_size, and all dimensions of the product
+// are at most jit_gemm_max_dimension. The default values are conservative estimates. They can be adapted to the
+// machine using calibrate_jit_gemm_thresholds.
+inline long jit_gemm_max_batch_size = 32;
+inline long jit_gemm_max_dimension = 256;
+
+/// A JIT generated kernel that computes C := op(A) * op(B) for matrices with a fixed shape and layout.
+template <typename Scalar = scalar>
+class jit_gemm_kernel
+{
+  public:
+    using matrix_type = Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic, eigen::default_matrix_layout>;
+    using kernel_type = std::conditional_t<std::is_same_v<Scalar, double>, dgemm_jit_kernel_t, sgemm_jit_kernel_t>;
+
+  protected:
+    void* m_jitter = nullptr;
+    kernel_type m_kernel = nullptr;
+
+  public:
+    long m;
+    long n;
+    long k;
+    bool A_transposed;
+    bool B_transposed;
+
+    jit_gemm_kernel(long m_, long n_, long k_, bool A_transposed_, bool B_transposed_)
+     : m(m_), n(n_), k(k_), A_transposed(A_transposed_), B_transposed(B_transposed_)
+    {
+      constexpr bool row_major = matrix_type::IsRowMajor;
+      constexpr MKL_LAYOUT layout = row_major ? MKL_ROW_MAJOR : MKL_COL_MAJOR;
+      MKL_TRANSPOSE transA = A_transposed ? MKL_TRANS : MKL_NOTRANS;
+      MKL_TRANSPOSE transB = B_transposed ? MKL_TRANS : MKL_NOTRANS;
+
+      // the leading dimensions of the stored matrices A, B and C
+      long lda = (row_major != A_transposed) ? k : m;
+      long ldb = (row_major != B_transposed) ? n : k;
+      long ldc = row_major ? n : m;
+
+      mkl_jit_status_t status;
+      if constexpr (std::is_same_v<Scalar, double>)
+      {
+        status = mkl_jit_create_dgemm(&m_jitter, layout, transA, transB, m, n, k, 1.0, lda, ldb, 0.0, ldc);
+      }
+      else
+      {
+        status = mkl_jit_create_sgemm(&m_jitter, layout, transA, transB, m, n, k, 1.0f, lda, ldb, 0.0f, ldc);
+      }
+      if (status == MKL_JIT_ERROR)
+      {
+        throw std::runtime_error(fmt::format("could not create a JIT gemm kernel for m={} n={} k={}", m, n, k));
+      }
+
+      if constexpr (std::is_same_v<Scalar, double>)
+      {
+        m_kernel = mkl_jit_get_dgemm_ptr(m_jitter);
+      }
+      else
+      {
+        m_kernel = mkl_jit_get_sgemm_ptr(m_jitter);
+      }
+    }
+
+    jit_gemm_kernel(const jit_gemm_kernel&) = delete;
+    jit_gemm_kernel& operator=(const jit_gemm_kernel&) = delete;
+
+    ~jit_gemm_kernel()
+    {
+      if (m_jitter)
+      {
+        mkl_jit_destroy(m_jitter);
+      }
+    }
+
+    [[nodiscard]] bool matches(long m_, long n_, long k_, bool A_transposed_, bool B_transposed_) const
+    {
+      return m == m_ && n == n_ && k == k_ && A_transposed == A_transposed_ && B_transposed == B_transposed_;
+    }
+
+    // Computes C := op(A) * op(B). The matrix C must have the right shape.
+    void operator()(const matrix_type& A, const matrix_type& B, matrix_type& C) const
+    {
+      m_kernel(m_jitter, const_cast<Scalar*>(A.data()), const_cast<Scalar*>(B.data()), C.data());
+    }
+};
+
+/// Computes matrix products C := op(A) * op(B) with MKL. If the matrices are small, JIT kernels are used. These
+/// kernels are created once per shape, and are discarded when the batch size changes. Copies of a cache are empty.
+class jit_gemm_cache
+{
+  protected:
+    std::vector<std::unique_ptr<jit_gemm_kernel<scalar>>> m_kernels;
+    long m_batch_size = -1;
+
+  public:
+    jit_gemm_cache() = default;
+
+    jit_gemm_cache(const jit_gemm_cache&)
+    {}
+
+    jit_gemm_cache& operator=(const jit_gemm_cache&)
+    {
+      clear();
+      return *this;
+    }
+
+    void clear()
+    {
+      m_kernels.clear();
+      m_batch_size = -1;
+    }
+
+    /// Sets the batch size of the following products. If it is different from the current one, the cached
+    /// kernels are discarded.
+    void set_batch_size(long N)
+    {
+      if (N != m_batch_size)
+      {
+        m_kernels.clear();
+        m_batch_size = N;
+      }
+    }
+
+    [[nodiscard]] std::size_t size() const
+    {
+      return m_kernels.size();
+    }
+
+    [[nodiscard]] bool use_jit(long m, long n, long k) const
+    {
+      return m_batch_size > 0 && m_batch_size <= jit_gemm_max_batch_size && std::max({m, n, k}) <= jit_gemm_max_dimension;
+    }
+
+    /// Computes C := op(A) * op(B)
+    void product(eigen::matrix& C, const eigen::matrix& A, const eigen::matrix& B, bool A_transposed = false, bool B_transposed = false)
+    {
+      long m = A_transposed ? A.cols() : A.rows();
+      long n = B_transposed ? B.rows() : B.cols();
+      long k = A_transposed ? A.rows() : A.cols();
+      if (C.rows() != m || C.cols() != n)
+      {
+        C.resize(m, n);
+      }
+
+      if (!use_jit(m, n, k))
+      {
+        auto A_view = mkl::make_dense_matrix_view(A);
+        auto B_view = mkl::make_dense_matrix_view(B);
+        auto C_view = mkl::make_dense_matrix_view(C);
+        ddd_product(C_view, A_view, B_view, A_transposed, B_transposed);
+        return;
+      }
+
+      auto i = std::find_if(m_kernels.begin(), m_kernels.end(), [&](const auto& kernel) { return kernel->matches(m, n, k, A_transposed, B_transposed); });
+      if (i == m_kernels.end())
+      {
+        m_kernels.push_back(std::make_unique<jit_gemm_kernel<scalar>>(m, n, k, A_transposed, B_transposed));
+        i = std::prev(m_kernels.end());
+      }
+      (**i)(A, B, C);
+    }
+};
+
+/// Returns the time of the product Y := X * W^T, with X an N x D matrix and W a D x D matrix, that is computed with
+/// a JIT kernel if jit is true, and with cblas_?gemm otherwise. The result is the minimum over the repetitions of
+/// the time of 10 products.
+inline
+double jit_gemm_benchmark(long N, long D, bool jit, unsigned int repetitions)
+{
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix W = eigen::random_matrix(D, D, -1, 1);
+  eigen::matrix Y(N, D);
+
+  std::unique_ptr<jit_gemm_kernel<scalar>> kernel;
+  if (jit)
+  {
+    kernel = std::make_unique<jit_gemm_kernel<scalar>>(N, D, D, false, true);
+  }
+
+  auto product = [&]()
+  {
+    if (kernel)
+    {
+      (*kernel)(X, W, Y);
+    }
+    else
+    {
+      auto X_view = mkl::make_dense_matrix_view(X);
+      auto W_view = mkl::make_dense_matrix_view(W);
+      auto Y_view = mkl::make_dense_matrix_view(Y);
+      ddd_product(Y_view, X_view, W_view, false, true);
+    }
+  };
+
+  product();  // warm up
+  double result = std::numeric_limits<double>::max();
+  for (unsigned int i = 0; i < repetitions; i++)
+  {
+    utilities::stopwatch watch;
+    for (int j = 0; j < 10; j++)
+    {
+      product();
+    }
+    result = std::min(result, watch.seconds());
+  }
+  return result;
+}
+
+/// Sets jit_gemm_max_batch_size and jit_gemm_max_dimension using micro benchmarks. For a grid of batch sizes and
+/// dimensions (powers of two) the JIT kernels are compared with cblas_?gemm, see jit_gemm_benchmark. The thresholds
+/// are chosen such that the total log speedup of the grid points below them is maximal, so a few noisy measurements
+/// do not change the result much. If JIT kernels are never faster, they are disabled. Returns the new thresholds.
+inline
+std::pair<long, long> calibrate_jit_gemm_thresholds(unsigned int repetitions = 5)
+{
+  const std::vector<long> batch_sizes = { 1, 2, 4, 8, 16, 32, 64, 128, 256 };
+  const std::vector<long> dimensions = { 16, 32, 64, 128, 256, 512, 1024 };
+
+  // gain[i][j] is the log speedup of the JIT kernel for batch size batch_sizes[i] and dimension dimensions[j]
+  std::vector<std::vector<double>> gain(batch_sizes.size(), std::vector<double>(dimensions.size()));
+  for (std::size_t i = 0; i < batch_sizes.size(); i++)
+  {
+    for (std::size_t j = 0; j < dimensions.size(); j++)
+    {
+      double gemm_time = jit_gemm_benchmark(batch_sizes[i], dimensions[j], false, repetitions);
+      try
+      {
+        double jit_time = jit_gemm_benchmark(batch_sizes[i], dimensions[j], true, repetitions);
+        gain[i][j] = std::log(gemm_time / jit_time);
+      }
+      catch (const std::runtime_error&)
+      {
+        // no JIT kernel could be created, so the thresholds must stay below this grid point
+        gain[i][j] = -std::numeric_limits<double>::infinity();
+      }
+    }
+  }
+
+  double best_score = 0;
+  long max_batch_size = 0;  // N.B. a batch size of 0 disables the JIT kernels
+  long max_dimension = 0;
+  for (std::size_t i = 0; i < batch_sizes.size(); i++)
+  {
+    for (std::size_t j = 0; j < dimensions.size(); j++)
+    {
+      double score = 0;
+      for (std::size_t i1 = 0; i1 <= i; i1++)
+      {
+        for (std::size_t j1 = 0; j1 <= j; j1++)
+        {
+          score += gain[i1][j1];
+        }
+      }
+      if (score > best_score)
+      {
+        best_score = score;
+        max_batch_size = batch_sizes[i];
+        max_dimension = dimensions[j];
+      }
+    }
+  }
+
+  jit_gemm_max_batch_size = max_batch_size;
+  jit_gemm_max_dimension = max_dimension;
+  return { max_batch_size, max_dimension };
+}
+
+} // namespace nerva::mkl
@@ -10,22 +10,39 @@
 #pragma once
 
 #include "nerva/neural_networks/dropout_layers.h"
+#include "nerva/neural_networks/embedding_layers.h"
+#include "nerva/neural_networks/hashed_layers.h"
+#include "nerva/neural_networks/low_rank_layers.h"
+#include "nerva/neural_networks/mixture_of_experts_layers.h"
+#include "nerva/neural_networks/monarch_layers.h"
 #include "nerva/neural_networks/multilayer_perceptron.h"
 #include "nerva/neural_networks/numpy_eigen.h"
+#include "nerva/neural_networks/sampled_softmax_layers.h"
 #include "nerva/utilities/string_utility.h"
 #include <pybind11/embed.h>
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <pybind11/eigen.h>
+#include <algorithm>
 #include <cmath>
 #include "fmt/format.h"
 #include <functional>
 #include <memory>
 #include <sstream>
+#include <typeinfo>
 
 namespace nerva {
 
+/// Returns true if the prediction y is correct for the one-hot encoded target t, i.e. if t equals 1 at the index of
+/// the first largest element of y.
+template <typename Prediction, typename Target>
+bool is_correct_classification(const Prediction& y, const Target& t)
+{
+  auto i = std::max_element(y.begin(), y.end()) - y.begin();
+  return t[i] == 1;
+}
+
 inline
 void print_model_info(const multilayer_perceptron& M)
 {
@@ -127,6 +144,116 @@ void renew_dropout_masks(multilayer_perceptron& M, std::mt19937& rng)
   }
 }
 
+/// Switches the layers of M between training mode and inference mode. In inference mode batch normalization
+/// layers use their running statistics, so the output no longer depends on the other examples in the batch,
+/// and dropout layers use their weights without a mask.
+inline
+void set_training_mode(multilayer_perceptron& M, bool training)
+{
+  for (auto& layer: M.layers)
+  {
+    if (auto blayer = dynamic_cast<batch_normalization_layer*>(layer.get()))
+    {
+      blayer->training = training;
+    }
+    else if (auto dlayer = dynamic_cast<dropout_layer<eigen::matrix>*>(layer.get()))
+    {
+      dlayer->training = training;
+    }
+    else if (auto slayer = dynamic_cast<sampled_softmax_layer*>(layer.get()))
+    {
+      slayer->training = training;
+    }
+    else
+    {
+      visit_mixture_of_experts_layer(*layer, [training](auto& moe_layer) { moe_layer.training = training; });
+    }
+  }
+}
+
+/// Returns the training mode of the first layer of M that has one, see set_training_mode.
+inline
+bool is_training_mode(const multilayer_perceptron& M)
+{
+  for (const auto& layer: M.layers)
+  {
+    if (auto blayer = dynamic_cast<batch_normalization_layer*>(layer.get()))
+    {
+      return blayer->training;
+    }
+    else if (auto dlayer = dynamic_cast<dropout_layer<eigen::matrix>*>(layer.get()))
+    {
+      return dlayer->training;
+    }
+    else if (auto slayer = dynamic_cast<sampled_softmax_layer*>(layer.get()))
+    {
+      return slayer->training;
+    }
+    bool training = true;
+    if (visit_mixture_of_experts_layer(*layer, [&training](auto& moe_layer) { training = moe_layer.training; }))
+    {
+      return training;
+    }
+  }
+  return true;
+}
+
+/// Resets the load balancing statistics of the mixture of experts layers of M.
+inline
+void reset_routing_statistics(multilayer_perceptron& M)
+{
+  for (auto& layer: M.layers)
+  {
+    visit_mixture_of_experts_layer(*layer, [](auto& moe_layer) { moe_layer.reset_statistics(); });
+  }
+}
+
+/// Folds batch normalization layers and affine layers into the linear layer that precedes them, and removes
+/// them from M. This only applies to linear layers without an activation function. Batch normalization layers
+/// are folded using their running statistics, so the result should only be used for inference.
+inline
+void fold_normalization_layers(multilayer_perceptron& M)
+{
+  auto fold = [](neural_network_layer* layer, neural_network_layer* next)
+  {
+    auto blayer = dynamic_cast<batch_normalization_layer*>(next);
+    auto alayer = dynamic_cast<affine_layer*>(next);
+    if (!blayer && !alayer)
+    {
+      return false;
+    }
+
+    // N.B. activation layers are derived from linear layers, so dynamic_cast cannot be used here
+    if (typeid(*layer) == typeid(dense_linear_layer))
+    {
+      auto dlayer = static_cast<dense_linear_layer*>(layer);
+      blayer ? fold_batch_normalization_layer(*dlayer, *blayer) : fold_affine_layer(*dlayer, *alayer);
+      return true;
+    }
+    else if (typeid(*layer) == typeid(sparse_linear_layer))
+    {
+      auto slayer = static_cast<sparse_linear_layer*>(layer);
+      blayer ? fold_batch_normalization_layer(*slayer, *blayer) : fold_affine_layer(*slayer, *alayer);
+      return true;
+    }
+    return false;
+  };
+
+  auto& layers = M.layers;
+  for (std::size_t i = 0; i + 1 < layers.size(); )
+  {
+    // after a fold the next layer may be folded into the same linear layer
+    if (fold(layers[i].get(), layers[i + 1].get()))
+    {
+      layers.erase(layers.begin() + i + 1);
+    }
+    else
+    {
+      i++;
+    }
+  }
+}
+
 inline
 std::vector<eigen::matrix> mlp_weights(const multilayer_perceptron& M)
 {
@@ -187,6 +314,98 @@ bool has_nan(const multilayer_perceptron& M)
   return false;
 }
 
+/// Calls f(data, size) for each of the parameter gradients of the layers of M.
+template <typename Function>
+void for_each_gradient(multilayer_perceptron& M, Function f)
+{
+  for (auto& layer: M.layers)
+  {
+    if (auto dlayer = dynamic_cast<dense_linear_layer*>(layer.get()))
+    {
+      f(dlayer->DW.data(), dlayer->DW.size());
+      f(dlayer->Db.data(), dlayer->Db.size());
+    }
+    else if (auto slayer = dynamic_cast<sparse_linear_layer*>(layer.get()))
+    {
+      f(slayer->DW.values().data(), static_cast<long>(slayer->DW.values().size()));
+      f(slayer->Db.data(), slayer->Db.size());
+    }
+    else if (auto blayer = dynamic_cast<batch_normalization_layer*>(layer.get()))
+    {
+      f(blayer->Dgamma.data(), blayer->Dgamma.size());
+      f(blayer->Dbeta.data(), blayer->Dbeta.size());
+    }
+    else if (auto alayer = dynamic_cast<affine_layer*>(layer.get()))
+    {
+      f(alayer->Dgamma.data(), alayer->Dgamma.size());
+      f(alayer->Dbeta.data(), alayer->Dbeta.size());
+    }
+    else if (auto lrlayer = dynamic_cast<low_rank_linear_layer*>(layer.get()))
+    {
+      f(lrlayer->DU.data(), lrlayer->DU.size());
+      f(lrlayer->DV.data(), lrlayer->DV.size());
+      f(lrlayer->Db.data(), lrlayer->Db.size());
+    }
+    else if (auto mlayer = dynamic_cast<monarch_linear_layer*>(layer.get()))
+    {
+      f(mlayer->DR.data(), mlayer->DR.size());
+      f(mlayer->DL.data(), mlayer->DL.size());
+      f(mlayer->Db.data(), mlayer->Db.size());
+    }
+    else if (auto elayer = dynamic_cast<embedding_layer*>(layer.get()))
+    {
+      // only the rows touched by the current batch have a gradient
+      f(elayer->DW_rows.data(), elayer->DW_rows.size());
+    }
+    else if (auto hlayer = dynamic_cast<hashed_linear_layer*>(layer.get()))
+    {
+      f(hlayer->Dw.data(), hlayer->Dw.size());
+      f(hlayer->Db.data(), hlayer->Db.size());
+    }
+
+    if (auto srelu_layer = dynamic_cast<activation_layer<eigen::matrix, srelu_activation>*>(layer.get()))
+    {
+      f(srelu_layer->act.Dx.data(), srelu_layer->act.Dx.size());
+    }
+    else if (auto srelu_layer = dynamic_cast<activation_layer<mkl::sparse_matrix_csr<scalar>, srelu_activation>*>(layer.get()))
+    {
+      f(srelu_layer->act.Dx.data(), srelu_layer->act.Dx.size());
+    }
+
+    visit_mixture_of_experts_layer(*layer, [&f](auto& moe_layer)
+    {
+      f(moe_layer.DWg.data(), moe_layer.DWg.size());
+      f(moe_layer.Dbg.data(), moe_layer.Dbg.size());
+      f(moe_layer.DW1.data(), moe_layer.DW1.size());
+      f(moe_layer.Db1.data(), moe_layer.Db1.size());
+      f(moe_layer.DW2.data(), moe_layer.DW2.size());
+      f(moe_layer.Db2.data(), moe_layer.Db2.size());
+    });
+  }
+}
+
+/// Returns true if the parameter gradients of M contain no infinite or NaN values.
+inline
+bool has_finite_gradients(multilayer_perceptron& M)
+{
+  bool result = true;
+  for_each_gradient(M, [&result](scalar* x, long n)
+  {
+    result = result && Eigen::Map<Eigen::Array<scalar, Eigen::Dynamic, 1>>(x, n).allFinite();
+  });
+  return result;
+}
+
+/// Multiplies the parameter gradients of M with factor.
+inline
+void scale_gradients(multilayer_perceptron& M, scalar factor)
+{
+  for_each_gradient(M, [factor](scalar* x, long n)
+  {
+    Eigen::Map<Eigen::Array<scalar, Eigen::Dynamic, 1>>(x, n) *= factor;
+  });
+}
+
 inline
 void print_srelu_layers(multilayer_perceptron& M)
 {
@@ -222,12 +441,18 @@ void save_weights_and_bias(const multilayer_perceptron& M, const std::string& fi
 
   py::dict data;
   unsigned int index = 1;
+  unsigned int normalization_index = 1;  // the index of batch normalization and affine layers
 
   auto name = [&](const std::string& name)
   {
     return name + std::to_string(index);
   };
 
+  auto save_vector = [&](const std::string& name, const eigen::matrix& x)
+  {
+    data[(name + std::to_string(normalization_index)).c_str()] = pybind11::array_t<scalar>(x.size(), x.data());
+  };
+
   for (auto& layer: M.layers)
   {
     if (auto dlayer = dynamic_cast<dense_linear_layer*>(layer.get()))
@@ -246,6 +471,20 @@ void save_weights_and_bias(const multilayer_perceptron& M, const std::string& fi
       data[name("b").c_str()] = pybind11::array_t<scalar, py::array::f_style>(b.size(), b.data());
       index++;
     }
+    else if (auto blayer = dynamic_cast<batch_normalization_layer*>(layer.get()))
+    {
+      save_vector("gamma", blayer->gamma);
+      save_vector("beta", blayer->beta);
+      save_vector("running_mean", blayer->running_mean);
+      save_vector("running_Sigma", blayer->running_Sigma);
+      normalization_index++;
+    }
+    else if (auto alayer = dynamic_cast<affine_layer*>(layer.get()))
+    {
+      save_vector("gamma", alayer->gamma);
+      save_vector("beta", alayer->beta);
+      normalization_index++;
+    }
   }
 
   py::module::import("numpy").attr("savez_compressed")(filename, **data);
@@ -261,12 +500,23 @@ void load_weights_and_bias(multilayer_perceptron& M, const std::string& filename
 
   py::dict data = py::module::import("numpy").attr("load")(filename);
   unsigned int index = 1;
+  unsigned int normalization_index = 1;  // the index of batch normalization and affine layers
 
   auto name = [&](const std::string& name)
   {
     return name + std::to_string(index);
   };
 
+  // N.B. files that were saved without the parameters of normalization layers are still accepted
+  auto load_vector = [&](const std::string& name, eigen::matrix& x)
+  {
+    auto key = name + std::to_string(normalization_index);
+    if (data.contains(key))
+    {
+      x = eigen::extract_row_vector<scalar>(data, key);
+    }
+  };
+
   for (auto& layer: M.layers)
   {
     if (auto dlayer = dynamic_cast<dense_linear_layer*>(layer.get()))
@@ -281,6 +531,20 @@ void load_weights_and_bias(multilayer_perceptron& M, const std::string& filename
       slayer->b = eigen::extract_row_vector<scalar>(data, name("b"));
       index++;
     }
+    else if (auto blayer = dynamic_cast<batch_normalization_layer*>(layer.get()))
+    {
+      load_vector("gamma", blayer->gamma);
+      load_vector("beta", blayer->beta);
+      load_vector("running_mean", blayer->running_mean);
+      load_vector("running_Sigma", blayer->running_Sigma);
+      normalization_index++;
+    }
+    else if (auto alayer = dynamic_cast<affine_layer*>(layer.get()))
+    {
+      load_vector("gamma", alayer->gamma);
+      load_vector("beta", alayer->beta);
+      normalization_index++;
+    }
   }
 }
 
@@ -0,0 +1,344 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/monarch_layers.h
+/// \brief Linear layers with a structured weight matrix that is the product of two block diagonal matrices.
+///
+/// A Monarch layer with input size D, output size K and b blocks has a weight matrix W = L * P * R, with
+///  - R a block diagonal matrix with b blocks of size p x p, with p = D / b
+///  - P the permutation that transposes a b x p grid, i.e. it maps position i * p + t to position t * b + i
+///  - L a block diagonal matrix with b blocks of size s x p, with s = K / b
+///
+/// The products with R and L are computed as b independent small dense matrix products, so the layer keeps the
+/// efficiency of dense matrix multiplication. If b <= p, every block of L combines outputs of all blocks of R. The
+/// layer has b * p * (p + s) parameters, and a feedforward step takes O(N (D + K) D / b) operations. For b = sqrt(D)
+/// this is O(N D sqrt(D)) instead of O(N K D) for a dense layer.
+
+#pragma once
+
+#include "nerva/neural_networks/layers.h"
+#include "fmt/format.h"
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace nerva {
+
+/// Computes the permutation Y = X * P^T of the columns of X that transposes a b x p grid, i.e. column i * p + t of
+/// X is moved to column t * b + i of Y.
+inline
+void monarch_permute(const eigen::matrix& X, eigen::matrix& Y, long b)
+{
+  long N = X.rows();
+  long p = X.cols() / b;
+  Y.resize(N, X.cols());
+
+#pragma omp parallel for
+  for (long n = 0; n < N; n++)
+  {
+    for (long i = 0; i < b; i++)
+    {
+      for (long t = 0; t < p; t++)
+      {
+        Y(n, t * b + i) = X(n, i * p + t);
+      }
+    }
+  }
+}
+
+/// Computes the inverse of monarch_permute, i.e. column t * b + i of X is moved to column i * p + t of Y.
+inline
+void monarch_permute_inverse(const eigen::matrix& X, eigen::matrix& Y, long b)
+{
+  long N = X.rows();
+  long p = X.cols() / b;
+  Y.resize(N, X.cols());
+
+#pragma omp parallel for
+  for (long n = 0; n < N; n++)
+  {
+    for (long i = 0; i < b; i++)
+    {
+      for (long t = 0; t < p; t++)
+      {
+        Y(n, i * p + t) = X(n, t * b + i);
+      }
+    }
+  }
+}
+
+/// Computes Y = X * A^T, with A a block diagonal matrix with blocks that are stacked vertically in the matrix blocks.
+/// \param X An N x (b * n) matrix
+/// \param blocks A (b * m) x n matrix containing the b blocks of A
+/// \param Y An N x (b * m) matrix
+inline
+void block_diagonal_product(const eigen::matrix& X, const eigen::matrix& blocks, eigen::matrix& Y, long b)
+{
+  long m = blocks.rows() / b;
+  long n = blocks.cols();
+  Y.resize(X.rows(), b * m);
+
+#pragma omp parallel for
+  for (long i = 0; i < b; i++)
+  {
+    Y.middleCols(i * m, m).noalias() = X.middleCols(i * n, n) * blocks.middleRows(i * m, m).transpose();
+  }
+}
+
+/// Computes the gradients Dblocks and DX of block_diagonal_product, given the gradient DY of Y.
+inline
+void block_diagonal_product_backpropagate(const eigen::matrix& X, const eigen::matrix& blocks, const eigen::matrix& DY, eigen::matrix& Dblocks, eigen::matrix& DX, long b)
+{
+  long m = blocks.rows() / b;
+  long n = blocks.cols();
+  Dblocks.resize(blocks.rows(), blocks.cols());
+  DX.resize(X.rows(), X.cols());
+
+#pragma omp parallel for
+  for (long i = 0; i < b; i++)
+  {
+    Dblocks.middleRows(i * m, m).noalias() = DY.middleCols(i * m, m).transpose() * X.middleCols(i * n, n);
+    DX.middleCols(i * n, n).noalias() = DY.middleCols(i * m, m) * blocks.middleRows(i * m, m);
+  }
+}
+
+struct monarch_linear_layer: public neural_network_layer
+{
+  using super = neural_network_layer;
+  using super::X;
+  using super::DX;
+
+  long nblocks;
+  eigen::matrix R;   // the b blocks of size p x p of the first factor, stacked vertically
+  eigen::matrix L;   // the b blocks of size s x p of the second factor, stacked vertically
+  eigen::matrix b;
+  eigen::matrix DR;
+  eigen::matrix DL;
+  eigen::matrix Db;
+  eigen::matrix XR;  // the permuted product X * R^T, which is needed for backpropagation
+  eigen::matrix DXR; // the gradient of XR
+  eigen::matrix H;   // a buffer for the unpermuted values of XR and DXR
+  std::shared_ptr<optimizer_function> optimizer;
+
+  explicit monarch_linear_layer(std::size_t D, std::size_t K, std::size_t nblocks_, std::size_t N)
+    : super(D, N), nblocks(nblocks_)
+  {
+    if (nblocks_ == 0 || D % nblocks_ != 0 || K % nblocks_ != 0)
+    {
+      throw std::runtime_error(fmt::format("The number of blocks {} of a Monarch layer must divide the input size {} and the output size {}", nblocks_, D, K));
+    }
+    long p = D / nblocks;
+    R.resize(D, p);
+    L.resize(K, p);
+    b.resize(1, K);
+    DR.resize(D, p);
+    DL.resize(K, p);
+    Db.resize(1, K);
+    XR.resize(N, D);
+    DXR.resize(N, D);
+    H.resize(N, D);
+  }
+
+  [[nodiscard]] auto input_size() const -> std::size_t
+  {
+    return R.rows();
+  }
+
+  [[nodiscard]] auto output_size() const -> std::size_t
+  {
+    return L.rows();
+  }
+
+  /// Returns the weight matrix L * P * R.
+  [[nodiscard]] eigen::matrix weights() const
+  {
+    long D = input_size();
+    eigen::matrix I = eigen::matrix::Identity(D, D);
+    eigen::matrix IR;
+    eigen::matrix IRP;
+    eigen::matrix W;
+    block_diagonal_product(I, R, IR, nblocks);
+    monarch_permute(IR, IRP, nblocks);
+    block_diagonal_product(IRP, L, W, nblocks);
+    return W.transpose();
+  }
+
+  [[nodiscard]] virtual auto activation_to_string() const -> std::string
+  {
+    return "NoActivation()";
+  }
+
+  [[nodiscard]] auto to_string() const -> std::string override
+  {
+    return fmt::format("Monarch(input_size={}, output_size={}, blocks={}, optimizer={}, activation={})", input_size(), output_size(), nblocks, optimizer->to_string(), activation_to_string());
+  }
+
+  // Computes Z = X * R^T * P^T * L^T + row_repeat(b, N)
+  void feedforward_linear(eigen::matrix& Z)
+  {
+    using eigen::parallel_assign;
+    using eigen::row_repeat;
+
+    auto N = X.rows();
+    block_diagonal_product(X, R, H, nblocks);
+    monarch_permute(H, XR, nblocks);
+    block_diagonal_product(XR, L, Z, nblocks);
+    parallel_assign(Z, Z + row_repeat(b, N));
+  }
+
+  // Computes the gradients of the parameters and of the input, given the gradient DZ of Z.
+  void backpropagate_linear(const eigen::matrix& DZ)
+  {
+    using eigen::parallel_columns_sum;
+
+    block_diagonal_product_backpropagate(XR, L, DZ, DL, DXR, nblocks);
+    monarch_permute_inverse(DXR, H, nblocks);
+    block_diagonal_product_backpropagate(X, R, H, DR, DX, nblocks);
+    parallel_columns_sum(DZ, Db);
+  }
+
+  void feedforward(eigen::matrix& result) override
+  {
+    feedforward_linear(result);
+  }
+
+  void backpropagate(const eigen::matrix& /* Y */, const eigen::matrix& DY) override
+  {
+    backpropagate_linear(DY);
+  }
+
+  void optimize(scalar eta) override
+  {
+    optimizer->update(eta);
+  }
+
+  void clip(scalar epsilon) override
+  {
+    if (optimizer)
+    {
+      optimizer->clip(epsilon);
+    }
+  }
+
+  void info(unsigned int layer_index) const override
+  {
+    std::string i = std::to_string(layer_index);
+    std::cout << to_string() << std::endl;
+    print_numpy_matrix("R" + i, R);
+    print_numpy_matrix("L" + i, L);
+    print_numpy_matrix("b" + i, b);
+  }
+
+  void release_activations() override
+  {
+    super::release_activations();
+    XR.resize(0, 0);
+  }
+
+  [[nodiscard]] long activation_size() const override
+  {
+    return super::activation_size() + XR.size();
+  }
+
+  std::vector<eigen::matrix*> batch_buffers() override
+  {
+    auto result = super::batch_buffers();
+    result.insert(result.end(), { &XR, &DXR, &H });
+    return result;
+  }
+};
+
+template <typename ActivationFunction>
+struct monarch_activation_layer: public monarch_linear_layer
+{
+  using super = monarch_linear_layer;
+  using super::X;
+  using super::DX;
+
+  ActivationFunction act;
+  eigen::matrix Z;
+  eigen::matrix DZ;
+
+  explicit monarch_activation_layer(std::size_t D, std::size_t K, std::size_t nblocks, std::size_t N, ActivationFunction act_)
+    : super(D, K, nblocks, N), act(act_), Z(N, K), DZ(N, K)
+  {}
+
+  [[nodiscard]] auto activation_to_string() const -> std::string override
+  {
+    return act.to_string();
+  }
+
+  void feedforward(eigen::matrix& result) override
+  {
+    using eigen::parallel_assign;
+
+    feedforward_linear(Z);
+    parallel_assign(result, act(Z));
+  }
+
+  void backpropagate(const eigen::matrix& Y, const eigen::matrix& DY) override
+  {
+    using eigen::hadamard;
+    using eigen::parallel_assign;
+
+    if constexpr (has_output_gradient<ActivationFunction>::value)
+    {
+      parallel_assign(DZ, hadamard(DY, act.output_gradient(Y)));
+    }
+    else
+    {
+      parallel_assign(DZ, hadamard(DY, act.gradient(Z)));
+    }
+    backpropagate_linear(DZ);
+  }
+
+  void release_activations() override
+  {
+    super::release_activations();
+    Z.resize(0, 0);
+  }
+
+  [[nodiscard]] long activation_size() const override
+  {
+    return super::activation_size() + Z.size();
+  }
+
+  std::vector<eigen::matrix*> batch_buffers() override
+  {
+    auto result = super::batch_buffers();
+    result.insert(result.end(), { &Z, &DZ });
+    return result;
+  }
+};
+
+using monarch_relu_layer = monarch_activation_layer<relu_activation>;
+using monarch_sigmoid_layer = monarch_activation_layer<sigmoid_activation>;
+using monarch_hyperbolic_tangent_layer = monarch_activation_layer<hyperbolic_tangent_activation>;
+
+/// Initializes the blocks of R and L as if they were the weight matrices of small dense layers.
+inline
+void set_weights_and_bias(monarch_linear_layer& layer, weight_initialization w, std::mt19937& rng)
+{
+  long nblocks = layer.nblocks;
+  eigen::matrix R_block(layer.R.rows() / nblocks, layer.R.cols());
+  eigen::matrix L_block(layer.L.rows() / nblocks, layer.L.cols());
+  auto init_R = make_weight_initializer(w, R_block, rng);
+  set_weights(layer.R, [&init_R]() { return (*init_R)(); });
+  init_R->initialize_bias(layer.b);
+  auto init_L = make_weight_initializer(w, L_block, rng);
+  set_weights(layer.L, [&init_L]() { return (*init_L)(); });
+}
+
+inline
+void set_monarch_layer_optimizer(monarch_linear_layer& layer, const std::string& text)
+{
+  auto optimizer_R = parse_optimizer(text, layer.R, layer.DR);
+  auto optimizer_L = parse_optimizer(text, layer.L, layer.DL);
+  auto optimizer_b = parse_optimizer(text, layer.b, layer.Db);
+  layer.optimizer = make_composite_optimizer(optimizer_R, optimizer_L, optimizer_b);
+}
+
+} // namespace nerva
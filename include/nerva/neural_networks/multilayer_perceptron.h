@@ -9,6 +9,7 @@
 
 #pragma once
 
+#include "nerva/neural_networks/batch_buffers.h"
 #include "nerva/neural_networks/batch_normalization_layers.h"
 #include "nerva/neural_networks/check_gradients.h"
 #include "nerva/neural_networks/layers.h"
@@ -19,6 +20,7 @@ namespace nerva {
 struct multilayer_perceptron
 {
   std::vector<std::shared_ptr<neural_network_layer>> layers;
+  batch_buffer_cache eval_buffers;  // the batch sized buffers of the layers that are used for evaluation, per batch size
 
   [[nodiscard]] std::string to_string() const
   {
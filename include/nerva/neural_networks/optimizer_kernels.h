@@ -0,0 +1,102 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/optimizer_kernels.h
+/// \brief Fused update kernels of the optimizers.
+///
+/// Each kernel updates the parameters x, given the gradient g and the state of the optimizer, in a single pass
+/// over arrays of length n. Every element of x, g and the state is read once and written at most once, so the
+/// cost of an update is bounded by the memory bandwidth. The kernels operate on plain arrays, which makes them
+/// applicable to both dense matrices and the values of sparse CSR matrices. The loops are vectorized and
+/// distributed over the threads with OpenMP, and arrays with less than eigen::parallel_threshold elements are
+/// processed serially.
+
+#pragma once
+
+#include "nerva/neural_networks/eigen.h"
+#include "nerva/neural_networks/parallel_operations.h"
+#include <cmath>
+
+namespace nerva {
+
+/// Computes x := x - eta * g.
+inline
+void fused_gradient_descent_update(scalar* x, const scalar* g, long n, scalar eta)
+{
+#pragma omp parallel for simd schedule(static) if(n >= eigen::parallel_threshold)
+  for (long i = 0; i < n; i++)
+  {
+    x[i] -= eta * g[i];
+  }
+}
+
+/// Computes delta_x := mu * delta_x - eta * g and x := x + delta_x.
+inline
+void fused_momentum_update(scalar* x, const scalar* g, scalar* delta_x, long n, scalar eta, scalar mu)
+{
+#pragma omp parallel for simd schedule(static) if(n >= eigen::parallel_threshold)
+  for (long i = 0; i < n; i++)
+  {
+    scalar d = mu * delta_x[i] - eta * g[i];
+    delta_x[i] = d;
+    x[i] += d;
+  }
+}
+
+/// Computes delta_x := mu * delta_x - eta * g and x := x + mu * delta_x - eta * g.
+inline
+void fused_nesterov_update(scalar* x, const scalar* g, scalar* delta_x, long n, scalar eta, scalar mu)
+{
+#pragma omp parallel for simd schedule(static) if(n >= eigen::parallel_threshold)
+  for (long i = 0; i < n; i++)
+  {
+    scalar gi = eta * g[i];
+    scalar d = mu * delta_x[i] - gi;
+    delta_x[i] = d;
+    x[i] += mu * d - gi;
+  }
+}
+
+/// Computes step t of Adam, with moment estimates m and v:
+///
+///     m := beta1 * m + (1 - beta1) * g
+///     v := beta2 * v + (1 - beta2) * g^2
+///     x := decay * x - eta / (1 - beta1^t) * m / (sqrt(v / (1 - beta2^t)) + epsilon)
+///
+/// The factor decay = 1 - eta * weight_decay is used for the decoupled weight decay of AdamW, and equals 1 for Adam.
+inline
+void fused_adam_update(scalar* x, const scalar* g, scalar* m, scalar* v, long n, scalar eta, scalar beta1, scalar beta2, scalar epsilon, scalar decay, long t)
+{
+  scalar c1 = eta / (scalar(1) - std::pow(beta1, scalar(t)));
+  scalar c2 = scalar(1) / std::sqrt(scalar(1) - std::pow(beta2, scalar(t)));
+
+#pragma omp parallel for simd schedule(static) if(n >= eigen::parallel_threshold)
+  for (long i = 0; i < n; i++)
+  {
+    scalar gi = g[i];
+    scalar mi = beta1 * m[i] + (scalar(1) - beta1) * gi;
+    scalar vi = beta2 * v[i] + (scalar(1) - beta2) * gi * gi;
+    m[i] = mi;
+    v[i] = vi;
+    x[i] = decay * x[i] - c1 * mi / (std::sqrt(vi) * c2 + epsilon);
+  }
+}
+
+/// Computes s := rho * s + (1 - rho) * g^2 and x := x - eta * g / (sqrt(s) + epsilon).
+inline
+void fused_rmsprop_update(scalar* x, const scalar* g, scalar* s, long n, scalar eta, scalar rho, scalar epsilon)
+{
+#pragma omp parallel for simd schedule(static) if(n >= eigen::parallel_threshold)
+  for (long i = 0; i < n; i++)
+  {
+    scalar gi = g[i];
+    scalar si = rho * s[i] + (scalar(1) - rho) * gi * gi;
+    s[i] = si;
+    x[i] -= eta * gi / (std::sqrt(si) + epsilon);
+  }
+}
+
+} // namespace nerva
@@ -12,12 +12,52 @@
 #include "nerva/neural_networks/eigen.h"
 #include "nerva/neural_networks/mkl_eigen.h"
 #include "nerva/neural_networks/mkl_sparse_matrix.h"
+#include "nerva/neural_networks/optimizer_kernels.h"
 #include "nerva/utilities/parse.h"
 #include "nerva/utilities/parse_numbers.h"
 #include "fmt/format.h"
+#include <type_traits>
+#include <vector>
 
 namespace nerva {
 
+// Returns a pointer to the values of x. For sparse matrices these are the values of the CSR representation, which
+// are updated in place. This keeps the MKL handle of the matrix valid, since it refers to the same array.
+template <typename T>
+auto parameter_values(T& x)
+{
+  if constexpr (std::is_same_v<std::remove_const_t<T>, mkl::sparse_matrix_csr<scalar>>)
+  {
+    return x.values().data();
+  }
+  else
+  {
+    return x.data();
+  }
+}
+
+// Returns the number of values of x.
+template <typename T>
+long parameter_size(const T& x)
+{
+  if constexpr (std::is_same_v<T, mkl::sparse_matrix_csr<scalar>>)
+  {
+    return static_cast<long>(x.values().size());
+  }
+  else
+  {
+    return static_cast<long>(x.size());
+  }
+}
+
+// Returns a pointer to row i of x. The rows are contiguous, since dense matrices are stored in row-major order.
+inline
+scalar* row_pointer(eigen::matrix& x, long i)
+{
+  static_assert(eigen::matrix::IsRowMajor);
+  return x.data() + i * x.cols();
+}
+
 // Generic optimizer_function for dense or sparse matrices.
 struct optimizer_function
 {
@@ -38,6 +78,8 @@ struct optimizer_function
 template <typename T>
 struct gradient_descent_optimizer: public optimizer_function
 {
+  static constexpr bool IsSparse = std::is_same_v<T, mkl::sparse_matrix_csr<scalar>>;
+
   T& x;
   T& Dx;
 
@@ -51,22 +93,49 @@ struct gradient_descent_optimizer: public optimizer_function
   }
 
   void update(scalar eta) override
+  {
+    if constexpr (!IsSparse)
+    {
+      if (NervaComputation == computation::blas)
+      {
+        auto x_view = mkl::make_dense_matrix_view(x);
+        auto Dx_view = mkl::make_dense_matrix_view(Dx);
+        mkl::cblas_axpy(-eta, Dx_view, x_view);
+        return;
+      }
+    }
+    fused_gradient_descent_update(parameter_values(x), parameter_values(Dx), parameter_size(x), eta);
+  }
+
+  // Updates the rows [i, i + Dx_rows.rows()) of x, given the corresponding rows of the gradient. This is used by
+  // fused backpropagation, see fused_backpropagation.h. Only dense matrices are supported.
+  virtual void update_rows(scalar eta, long i, const eigen::matrix& Dx_rows)
   {
     if constexpr (std::is_same<T, mkl::sparse_matrix_csr<scalar>>::value)
     {
-      mkl::ss_sum(x, Dx, scalar(1), -eta);
+      throw std::runtime_error("update_rows is not supported for sparse matrices");
     }
     else
     {
-      if (NervaComputation == computation::eigen)
-      {
-        x -= eta * Dx;
-      }
-      else
+      fused_gradient_descent_update(row_pointer(x, i), Dx_rows.data(), Dx_rows.size(), eta);
+    }
+  }
+
+  // Updates the rows rows[0], rows[1], ... of x, given the corresponding rows of the gradient. The other rows of x
+  // and of the optimizer state are left unchanged. This is used for row-sparse gradients, see embedding_layers.h.
+  virtual void update_rows(scalar eta, const std::vector<long>& rows, const eigen::matrix& Dx_rows)
+  {
+    if constexpr (std::is_same<T, mkl::sparse_matrix_csr<scalar>>::value)
+    {
+      throw std::runtime_error("update_rows is not supported for sparse matrices");
+    }
+    else
+    {
+      long n = rows.size();
+#pragma omp parallel for
+      for (long r = 0; r < n; r++)
       {
-        auto x_view = mkl::make_dense_matrix_view(x);
-        auto Dx_view = mkl::make_dense_matrix_view(Dx);
-        mkl::cblas_axpy(-eta, Dx_view, x_view);
+        x.row(rows[r]) -= eta * Dx_rows.row(r);
       }
     }
   }
@@ -108,17 +177,15 @@ struct momentum_optimizer: public gradient_descent_optimizer<T>
   {
     if constexpr (IsSparse)
     {
-      mkl::ss_sum(delta_x, Dx, mu, -eta);
-      mkl::ss_sum(x, delta_x, scalar(1), scalar(1));
+      fused_momentum_update(parameter_values(x), parameter_values(Dx), parameter_values(delta_x), parameter_size(x), eta, mu);
     }
     else
     {
-      if (NervaComputation == computation::eigen)
+      if (NervaComputation == computation::eigen || NervaComputation == computation::mkl)
       {
-        delta_x = mu * delta_x - eta * Dx;
-        x += delta_x;
+        fused_momentum_update(x.data(), Dx.data(), delta_x.data(), x.size(), eta, mu);
       }
-      else if (NervaComputation == computation::mkl || NervaComputation == computation::blas)
+      else if (NervaComputation == computation::blas)
       {
         auto x_view = mkl::make_dense_matrix_view(x);
         auto Dx_view = mkl::make_dense_matrix_view(Dx);
@@ -141,6 +208,36 @@ struct momentum_optimizer: public gradient_descent_optimizer<T>
     }
   }
 
+  void update_rows(scalar eta, long i, const eigen::matrix& Dx_rows) override
+  {
+    if constexpr (IsSparse)
+    {
+      throw std::runtime_error("update_rows is not supported for sparse matrices");
+    }
+    else
+    {
+      fused_momentum_update(row_pointer(x, i), Dx_rows.data(), row_pointer(delta_x, i), Dx_rows.size(), eta, mu);
+    }
+  }
+
+  void update_rows(scalar eta, const std::vector<long>& rows, const eigen::matrix& Dx_rows) override
+  {
+    if constexpr (IsSparse)
+    {
+      throw std::runtime_error("update_rows is not supported for sparse matrices");
+    }
+    else
+    {
+      long n = rows.size();
+#pragma omp parallel for
+      for (long r = 0; r < n; r++)
+      {
+        delta_x.row(rows[r]) = mu * delta_x.row(rows[r]) - eta * Dx_rows.row(r);
+        x.row(rows[r]) += delta_x.row(rows[r]);
+      }
+    }
+  }
+
   void clip(scalar epsilon) override
   {
     if constexpr (IsSparse)
@@ -196,15 +293,13 @@ struct nesterov_optimizer: public momentum_optimizer<T>
   {
     if constexpr (IsSparse)
     {
-      mkl::ss_sum(delta_x, Dx, mu, -eta);
-      mkl::sss_sum(x, delta_x, Dx, scalar(1), mu, -eta);
+      fused_nesterov_update(parameter_values(x), parameter_values(Dx), parameter_values(delta_x), parameter_size(x), eta, mu);
     }
     else
     {
       if (NervaComputation == computation::eigen || NervaComputation == computation::mkl)
       {
-        delta_x = mu * delta_x - eta * Dx;
-        x = x + mu * delta_x - eta * Dx;
+        fused_nesterov_update(x.data(), Dx.data(), delta_x.data(), x.size(), eta, mu);
       }
       else if (NervaComputation == computation::blas)
       {
@@ -230,6 +325,164 @@ struct nesterov_optimizer: public momentum_optimizer<T>
       }
     }
   }
+
+  void update_rows(scalar eta, long i, const eigen::matrix& Dx_rows) override
+  {
+    if constexpr (IsSparse)
+    {
+      throw std::runtime_error("update_rows is not supported for sparse matrices");
+    }
+    else
+    {
+      fused_nesterov_update(row_pointer(x, i), Dx_rows.data(), row_pointer(delta_x, i), Dx_rows.size(), eta, mu);
+    }
+  }
+
+  void update_rows(scalar eta, const std::vector<long>& rows, const eigen::matrix& Dx_rows) override
+  {
+    if constexpr (IsSparse)
+    {
+      throw std::runtime_error("update_rows is not supported for sparse matrices");
+    }
+    else
+    {
+      long n = rows.size();
+#pragma omp parallel for
+      for (long r = 0; r < n; r++)
+      {
+        delta_x.row(rows[r]) = mu * delta_x.row(rows[r]) - eta * Dx_rows.row(r);
+        x.row(rows[r]) += mu * delta_x.row(rows[r]) - eta * Dx_rows.row(r);
+      }
+    }
+  }
+};
+
+// Adam optimization, see https://arxiv.org/abs/1412.6980. The moment estimates m and v are stored per parameter,
+// and t is the number of updates.
+template <typename T>
+struct adam_optimizer: public optimizer_function
+{
+  static constexpr bool IsSparse = std::is_same_v<T, mkl::sparse_matrix_csr<scalar>>;
+
+  T& x;
+  T& Dx;
+  T m;
+  T v;
+  scalar beta1;
+  scalar beta2;
+  scalar epsilon;
+  scalar weight_decay;  // the decoupled weight decay of AdamW
+  long t = 0;
+
+  adam_optimizer(T& x_, T& Dx_, scalar beta1_, scalar beta2_, scalar epsilon_, scalar weight_decay_ = 0)
+    : x(x_),
+      Dx(Dx_),
+      m(x_.rows(), x_.cols()),
+      v(x_.rows(), x_.cols()),
+      beta1(beta1_),
+      beta2(beta2_),
+      epsilon(epsilon_),
+      weight_decay(weight_decay_)
+  {
+    if constexpr (IsSparse)
+    {
+      reset_support();
+    }
+    else
+    {
+      m.array() = scalar(0);
+      v.array() = scalar(0);
+    }
+  }
+
+  [[nodiscard]] auto to_string() const -> std::string override
+  {
+    return fmt::format("Adam(beta1={}, beta2={}, epsilon={})", beta1, beta2, epsilon);
+  }
+
+  void update(scalar eta) override
+  {
+    t++;
+    fused_adam_update(parameter_values(x), parameter_values(Dx), parameter_values(m), parameter_values(v), parameter_size(x),
+                      eta, beta1, beta2, epsilon, scalar(1) - eta * weight_decay, t);
+  }
+
+  void reset_support() override
+  {
+    if constexpr (IsSparse)
+    {
+      m.reset_support(x);
+      v.reset_support(x);
+    }
+  }
+};
+
+// Adam optimization with decoupled weight decay, see https://arxiv.org/abs/1711.05101.
+template <typename T>
+struct adamw_optimizer: public adam_optimizer<T>
+{
+  using super = adam_optimizer<T>;
+  using super::beta1;
+  using super::beta2;
+  using super::epsilon;
+  using super::weight_decay;
+
+  adamw_optimizer(T& x, T& Dx, scalar beta1, scalar beta2, scalar epsilon, scalar weight_decay)
+    : super(x, Dx, beta1, beta2, epsilon, weight_decay)
+  {}
+
+  [[nodiscard]] auto to_string() const -> std::string override
+  {
+    return fmt::format("AdamW(beta1={}, beta2={}, epsilon={}, weight_decay={})", beta1, beta2, epsilon, weight_decay);
+  }
+};
+
+// RMSProp optimization. The running average of the squared gradients is stored in s.
+template <typename T>
+struct rmsprop_optimizer: public optimizer_function
+{
+  static constexpr bool IsSparse = std::is_same_v<T, mkl::sparse_matrix_csr<scalar>>;
+
+  T& x;
+  T& Dx;
+  T s;
+  scalar rho;
+  scalar epsilon;
+
+  rmsprop_optimizer(T& x_, T& Dx_, scalar rho_, scalar epsilon_)
+    : x(x_),
+      Dx(Dx_),
+      s(x_.rows(), x_.cols()),
+      rho(rho_),
+      epsilon(epsilon_)
+  {
+    if constexpr (IsSparse)
+    {
+      reset_support();
+    }
+    else
+    {
+      s.array() = scalar(0);
+    }
+  }
+
+  [[nodiscard]] auto to_string() const -> std::string override
+  {
+    return fmt::format("RMSProp(rho={}, epsilon={})", rho, epsilon);
+  }
+
+  void update(scalar eta) override
+  {
+    fused_rmsprop_update(parameter_values(x), parameter_values(Dx), parameter_values(s), parameter_size(x), eta, rho, epsilon);
+  }
+
+  void reset_support() override
+  {
+    if constexpr (IsSparse)
+    {
+      s.reset_support(x);
+    }
+  }
 };
 
 struct composite_optimizer: public optimizer_function
@@ -301,6 +554,27 @@ auto parse_optimizer(const std::string& text, T& x, T& Dx) -> std::shared_ptr<op
     scalar mu = func.as_scalar("momentum");
     return std::make_shared<nesterov_optimizer<T>>(x, Dx, mu);
   }
+  else if (func.name == "Adam")
+  {
+    scalar beta1 = func.as_scalar("beta1", 0.9);
+    scalar beta2 = func.as_scalar("beta2", 0.999);
+    scalar epsilon = func.as_scalar("epsilon", 1e-8);
+    return std::make_shared<adam_optimizer<T>>(x, Dx, beta1, beta2, epsilon);
+  }
+  else if (func.name == "AdamW")
+  {
+    scalar beta1 = func.as_scalar("beta1", 0.9);
+    scalar beta2 = func.as_scalar("beta2", 0.999);
+    scalar epsilon = func.as_scalar("epsilon", 1e-8);
+    scalar weight_decay = func.as_scalar("weight_decay", 0.01);
+    return std::make_shared<adamw_optimizer<T>>(x, Dx, beta1, beta2, epsilon, weight_decay);
+  }
+  else if (func.name == "RMSProp")
+  {
+    scalar rho = func.as_scalar("rho", 0.9);
+    scalar epsilon = func.as_scalar("epsilon", 1e-8);
+    return std::make_shared<rmsprop_optimizer<T>>(x, Dx, rho, epsilon);
+  }
   else
   {
     throw std::runtime_error("unknown optimizer '" + text + "'");
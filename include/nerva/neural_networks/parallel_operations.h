@@ -0,0 +1,163 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/parallel_operations.h
+/// \brief Parallel evaluation of coefficient-wise expressions and reductions.
+///
+/// Eigen evaluates coefficient-wise expressions and reductions on a single core. The functions in this file
+/// split a matrix into blocks of consecutive rows, and process the blocks with OpenMP. The blocks are assigned
+/// to the threads with a static schedule, so a thread keeps working on the same rows in subsequent operations,
+/// which keeps the memory accesses local on NUMA systems. Matrices with less than parallel_threshold elements
+/// are processed serially.
+///
+/// Reductions first compute a partial result per block, and then add the partial results in a fixed order. The
+/// number of blocks only depends on the shape of the matrix, so the results do not depend on the number of
+/// threads.
+
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace nerva::eigen {
+
+// The minimal number of elements of a matrix for a parallel computation
+inline long parallel_threshold = 32768;
+
+// The approximate number of elements of a block
+inline long parallel_block_size = 8192;
+
+// Returns the number of rows of the blocks of a matrix with the given shape
+inline
+long parallel_block_rows(long rows, long cols)
+{
+  return std::clamp(parallel_block_size / std::max(cols, 1L), 1L, std::max(rows, 1L));
+}
+
+inline
+bool use_parallel(long rows, long cols)
+{
+  return rows * cols >= parallel_threshold && rows > 1;
+}
+
+/// Computes A := expr. Aliasing between A and expr is only allowed if the coefficient (i, j) of expr only depends
+/// on coefficients (i, j) of A.
+template <typename Matrix, typename Expression>
+void parallel_assign(Matrix& A, const Expression& expr)
+{
+  long m = expr.rows();
+  long n = expr.cols();
+  if (!use_parallel(m, n))
+  {
+    A = expr;
+    return;
+  }
+
+  if (A.rows() != m || A.cols() != n)
+  {
+    A.resize(m, n);
+  }
+
+  long block_rows = parallel_block_rows(m, n);
+  long block_count = (m + block_rows - 1) / block_rows;
+
+#pragma omp parallel for schedule(static)
+  for (long k = 0; k < block_count; k++)
+  {
+    long i = k * block_rows;
+    long r = std::min(block_rows, m - i);
+    A.middleRows(i, r) = expr.middleRows(i, r);
+  }
+}
+
+/// Returns the sum of the elements of X.
+template <typename Matrix>
+auto parallel_elements_sum(const Matrix& X)
+{
+  using Scalar = typename Matrix::Scalar;
+
+  long m = X.rows();
+  long n = X.cols();
+  if (!use_parallel(m, n))
+  {
+    return X.sum();
+  }
+
+  long block_rows = parallel_block_rows(m, n);
+  long block_count = (m + block_rows - 1) / block_rows;
+  std::vector<Scalar> sums(block_count);
+
+#pragma omp parallel for schedule(static)
+  for (long k = 0; k < block_count; k++)
+  {
+    long i = k * block_rows;
+    sums[k] = X.middleRows(i, std::min(block_rows, m - i)).sum();
+  }
+
+  Scalar result = 0;
+  for (Scalar sum: sums)
+  {
+    result += sum;
+  }
+  return result;
+}
+
+/// Computes the row vector result := columns_sum(X).
+template <typename Matrix, typename Result>
+void parallel_columns_sum(const Matrix& X, Result& result)
+{
+  using Scalar = typename Matrix::Scalar;
+
+  long m = X.rows();
+  long n = X.cols();
+  if (!use_parallel(m, n))
+  {
+    result = X.colwise().sum();
+    return;
+  }
+
+  long block_rows = parallel_block_rows(m, n);
+  long block_count = (m + block_rows - 1) / block_rows;
+  Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> sums(block_count, n);
+
+#pragma omp parallel for schedule(static)
+  for (long k = 0; k < block_count; k++)
+  {
+    long i = k * block_rows;
+    sums.row(k) = X.middleRows(i, std::min(block_rows, m - i)).colwise().sum();
+  }
+
+  result = sums.colwise().sum();
+}
+
+/// Returns true if X contains NaN values.
+template <typename Matrix>
+bool parallel_has_nan(const Matrix& X)
+{
+  long m = X.rows();
+  long n = X.cols();
+  if (!use_parallel(m, n))
+  {
+    return X.hasNaN();
+  }
+
+  long block_rows = parallel_block_rows(m, n);
+  long block_count = (m + block_rows - 1) / block_rows;
+  bool result = false;
+
+#pragma omp parallel for schedule(static) reduction(||:result)
+  for (long k = 0; k < block_count; k++)
+  {
+    long i = k * block_rows;
+    result = result || X.middleRows(i, std::min(block_rows, m - i)).hasNaN();
+  }
+
+  return result;
+}
+
+} // namespace nerva::eigen
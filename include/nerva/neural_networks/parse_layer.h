@@ -13,6 +13,12 @@
 #include "nerva/neural_networks/layers.h"
 #include "nerva/neural_networks/batch_normalization_layers.h"
 #include "nerva/neural_networks/dropout_layers.h"
+#include "nerva/neural_networks/embedding_layers.h"
+#include "nerva/neural_networks/hashed_layers.h"
+#include "nerva/neural_networks/low_rank_layers.h"
+#include "nerva/neural_networks/mixture_of_experts_layers.h"
+#include "nerva/neural_networks/monarch_layers.h"
+#include "nerva/neural_networks/sampled_softmax_layers.h"
 #include "nerva/neural_networks/sgd_options.h"
 #include "nerva/utilities/parse_numbers.h"
 #include "nerva/utilities/parse.h"
@@ -351,6 +357,228 @@ std::shared_ptr<neural_network_layer> make_dense_linear_dropout_layer(std::size_
   return make_dense_linear_dropout_layer(D, K, N, dropout, activation, parse_weight_initialization(weights), optimizer, rng);
 }
 
+inline
+std::shared_ptr<low_rank_linear_layer> make_low_rank_linear_layer(std::size_t D,
+                                                                  std::size_t K,
+                                                                  long N,
+                                                                  const std::string& layer,
+                                                                  weight_initialization weights,
+                                                                  const std::string& optimizer,
+                                                                  std::mt19937& rng
+)
+{
+  // LowRank(rank=<r>, activation=<activation>)
+  auto func = utilities::parse_function_call(layer);
+  auto r = static_cast<std::size_t>(func.as_scalar("rank"));
+  auto activation = func.as_string("activation", "Linear");
+  if (r == 0 || r > std::min(D, K))
+  {
+    throw std::runtime_error(fmt::format("The rank of the layer '{}' must be in the range [1, {}]", layer, std::min(D, K)));
+  }
+
+  std::shared_ptr<low_rank_linear_layer> result;
+  if (activation == "Linear")
+  {
+    result = std::make_shared<low_rank_linear_layer>(D, K, r, N);
+  }
+  else if (activation == "ReLU")
+  {
+    result = std::make_shared<low_rank_relu_layer>(D, K, r, N, relu_activation());
+  }
+  else if (activation == "Sigmoid")
+  {
+    result = std::make_shared<low_rank_sigmoid_layer>(D, K, r, N, sigmoid_activation());
+  }
+  else if (activation == "HyperbolicTangent")
+  {
+    result = std::make_shared<low_rank_hyperbolic_tangent_layer>(D, K, r, N, hyperbolic_tangent_activation());
+  }
+  else
+  {
+    throw std::runtime_error("Unsupported low rank layer activation '" + activation + "'");
+  }
+  set_weights_and_bias(*result, weights, rng);
+  set_low_rank_layer_optimizer(*result, optimizer);
+  return result;
+}
+
+inline
+std::shared_ptr<hashed_linear_layer> make_hashed_linear_layer(std::size_t D,
+                                                              std::size_t K,
+                                                              long N,
+                                                              const std::string& layer,
+                                                              weight_initialization weights,
+                                                              const std::string& optimizer,
+                                                              std::mt19937& rng
+)
+{
+  // Hashed(buckets=<B>, seed=<seed>, activation=<activation>)
+  auto func = utilities::parse_function_call(layer);
+  auto B = static_cast<std::size_t>(func.as_scalar("buckets"));
+  auto seed = static_cast<std::uint64_t>(func.as_scalar("seed", 0));
+  auto activation = func.as_string("activation", "Linear");
+
+  std::shared_ptr<hashed_linear_layer> result;
+  if (activation == "Linear")
+  {
+    result = std::make_shared<hashed_linear_layer>(D, K, B, N, seed);
+  }
+  else if (activation == "ReLU")
+  {
+    result = std::make_shared<hashed_relu_layer>(D, K, B, N, seed, relu_activation());
+  }
+  else if (activation == "Sigmoid")
+  {
+    result = std::make_shared<hashed_sigmoid_layer>(D, K, B, N, seed, sigmoid_activation());
+  }
+  else if (activation == "HyperbolicTangent")
+  {
+    result = std::make_shared<hashed_hyperbolic_tangent_layer>(D, K, B, N, seed, hyperbolic_tangent_activation());
+  }
+  else
+  {
+    throw std::runtime_error("Unsupported hashed layer activation '" + activation + "'");
+  }
+  set_weights_and_bias(*result, weights, rng);
+  set_hashed_layer_optimizer(*result, optimizer);
+  return result;
+}
+
+inline
+std::shared_ptr<monarch_linear_layer> make_monarch_linear_layer(std::size_t D,
+                                                                std::size_t K,
+                                                                long N,
+                                                                const std::string& layer,
+                                                                weight_initialization weights,
+                                                                const std::string& optimizer,
+                                                                std::mt19937& rng
+)
+{
+  // Monarch(blocks=<b>, activation=<activation>)
+  auto func = utilities::parse_function_call(layer);
+  auto nblocks = static_cast<std::size_t>(func.as_scalar("blocks"));
+  auto activation = func.as_string("activation", "Linear");
+
+  std::shared_ptr<monarch_linear_layer> result;
+  if (activation == "Linear")
+  {
+    result = std::make_shared<monarch_linear_layer>(D, K, nblocks, N);
+  }
+  else if (activation == "ReLU")
+  {
+    result = std::make_shared<monarch_relu_layer>(D, K, nblocks, N, relu_activation());
+  }
+  else if (activation == "Sigmoid")
+  {
+    result = std::make_shared<monarch_sigmoid_layer>(D, K, nblocks, N, sigmoid_activation());
+  }
+  else if (activation == "HyperbolicTangent")
+  {
+    result = std::make_shared<monarch_hyperbolic_tangent_layer>(D, K, nblocks, N, hyperbolic_tangent_activation());
+  }
+  else
+  {
+    throw std::runtime_error("Unsupported Monarch layer activation '" + activation + "'");
+  }
+  set_weights_and_bias(*result, weights, rng);
+  set_monarch_layer_optimizer(*result, optimizer);
+  return result;
+}
+
+template <typename ActivationFunction>
+std::shared_ptr<neural_network_layer> make_mixture_of_experts_layer(std::size_t D,
+                                                                    std::size_t K,
+                                                                    long N,
+                                                                    long E,
+                                                                    long k,
+                                                                    long M,
+                                                                    ActivationFunction act,
+                                                                    weight_initialization weights,
+                                                                    const std::string& optimizer,
+                                                                    std::mt19937& rng
+)
+{
+  auto layer = std::make_shared<mixture_of_experts_layer<ActivationFunction>>(D, K, N, E, k, M, act);
+  set_weights_and_bias(*layer, weights, rng);
+  set_mixture_of_experts_layer_optimizer(*layer, optimizer);
+  return layer;
+}
+
+inline
+std::shared_ptr<neural_network_layer> make_mixture_of_experts_layer(std::size_t D,
+                                                                    std::size_t K,
+                                                                    long N,
+                                                                    const std::string& layer,
+                                                                    weight_initialization weights,
+                                                                    const std::string& optimizer,
+                                                                    std::mt19937& rng
+)
+{
+  // MoE(experts=<E>, k=<k>, hidden=<M>, activation=<activation>)
+  auto func = utilities::parse_function_call(layer);
+  auto E = static_cast<long>(func.as_scalar("experts"));
+  auto k = static_cast<long>(func.as_scalar("k", 1));
+  auto M = static_cast<long>(func.as_scalar("hidden", static_cast<scalar>(K)));
+  auto activation = func.as_string("activation", "ReLU");
+
+  if (activation == "ReLU")
+  {
+    return make_mixture_of_experts_layer(D, K, N, E, k, M, relu_activation(), weights, optimizer, rng);
+  }
+  else if (activation == "Sigmoid")
+  {
+    return make_mixture_of_experts_layer(D, K, N, E, k, M, sigmoid_activation(), weights, optimizer, rng);
+  }
+  else if (activation == "HyperbolicTangent")
+  {
+    return make_mixture_of_experts_layer(D, K, N, E, k, M, hyperbolic_tangent_activation(), weights, optimizer, rng);
+  }
+  throw std::runtime_error("Unsupported mixture of experts activation '" + activation + "'");
+}
+
+inline
+std::shared_ptr<embedding_layer> make_embedding_layer(std::size_t D,
+                                                      std::size_t K,
+                                                      long N,
+                                                      const std::string& layer,
+                                                      weight_initialization weights,
+                                                      const std::string& optimizer,
+                                                      std::mt19937& rng
+)
+{
+  // Embedding(rows=<V>), with D the number of index columns and K = D * d
+  auto func = utilities::parse_function_call(layer);
+  auto V = static_cast<std::size_t>(func.as_scalar("rows"));
+  if (K % D != 0)
+  {
+    throw std::runtime_error(fmt::format("The output size {} of an embedding layer must be a multiple of the input size {}", K, D));
+  }
+  auto result = std::make_shared<embedding_layer>(D, V, K / D, N);
+  set_embedding_weights(*result, weights, rng);
+  set_embedding_layer_optimizer(*result, optimizer);
+  return result;
+}
+
+inline
+std::shared_ptr<sampled_softmax_layer> make_sampled_softmax_layer(std::size_t D,
+                                                                  std::size_t K,
+                                                                  long N,
+                                                                  const std::string& layer,
+                                                                  weight_initialization weights,
+                                                                  const std::string& optimizer,
+                                                                  std::mt19937& rng
+)
+{
+  // SampledSoftmax(samples=<S>, distribution=<distribution>)
+  auto func = utilities::parse_function_call(layer);
+  auto S = static_cast<long>(func.as_scalar("samples"));
+  auto distribution = parse_sampling_distribution(func.as_string("distribution", "LogUniform"));
+  auto result = std::make_shared<sampled_softmax_layer>(D, K, N, S, distribution, rng);
+  set_weights_and_bias(*result, weights, rng);
+  set_sampled_softmax_layer_optimizer(*result, optimizer);
+  return result;
+}
+
 inline
 std::shared_ptr<neural_network_layer> make_linear_layer(std::size_t input_size,
                                                         std::size_t output_size,
@@ -367,6 +595,60 @@ std::shared_ptr<neural_network_layer> make_linear_layer(std::size_t input_size,
   auto K = output_size;
   auto N = batch_size;
 
+  if (utilities::starts_with(activation, "LowRank"))
+  {
+    if (density != 1 || dropout_rate != 0)
+    {
+      throw std::runtime_error("Low rank layers do not support sparsity or dropout");
+    }
+    return make_low_rank_linear_layer(D, K, N, activation, parse_weight_initialization(weights), optimizer, rng);
+  }
+
+  if (utilities::starts_with(activation, "Monarch"))
+  {
+    if (density != 1 || dropout_rate != 0)
+    {
+      throw std::runtime_error("Monarch layers do not support sparsity or dropout");
+    }
+    return make_monarch_linear_layer(D, K, N, activation, parse_weight_initialization(weights), optimizer, rng);
+  }
+
+  if (utilities::starts_with(activation, "Hashed"))
+  {
+    if (density != 1 || dropout_rate != 0)
+    {
+      throw std::runtime_error("Hashed layers do not support sparsity or dropout");
+    }
+    return make_hashed_linear_layer(D, K, N, activation, parse_weight_initialization(weights), optimizer, rng);
+  }
+
+  if (utilities::starts_with(activation, "Embedding"))
+  {
+    if (density != 1 || dropout_rate != 0)
+    {
+      throw std::runtime_error("Embedding layers do not support sparsity or dropout");
+    }
+    return make_embedding_layer(D, K, N, activation, parse_weight_initialization(weights), optimizer, rng);
+  }
+
+  if (utilities::starts_with(activation, "SampledSoftmax"))
+  {
+    if (density != 1 || dropout_rate != 0)
+    {
+      throw std::runtime_error("Sampled softmax layers do not support sparsity or dropout");
+    }
+    return make_sampled_softmax_layer(D, K, N, activation, parse_weight_initialization(weights), optimizer, rng);
+  }
+
+  if (utilities::starts_with(activation, "MoE"))
+  {
+    if (density != 1 || dropout_rate != 0)
+    {
+      throw std::runtime_error("Mixture of experts layers do not support sparsity or dropout");
+    }
+    return make_mixture_of_experts_layer(D, K, N, activation, parse_weight_initialization(weights), optimizer, rng);
+  }
+
   if (dropout_rate == 0)
   {
     if (density == 1)
@@ -464,6 +746,10 @@ std::vector<std::shared_ptr<neural_network_layer>> make_layers(const std::vector
       const std::string& weights = linear_layer_weights[linear_layer_index++];
       const std::string& optimizer = optimizers[optimizer_index++];
       auto llayer = make_linear_layer(D, K, N, density, dropout_rate, activation, weights, optimizer, rng);
+      if (!result.empty() && dynamic_cast<embedding_layer*>(llayer.get()))
+      {
+        throw std::runtime_error(fmt::format("An embedding layer must be the first layer, but it is layer {}", result.size() + 1));
+      }
       result.push_back(llayer);
       input_size = K;
     }
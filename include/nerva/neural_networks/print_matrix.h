@@ -15,12 +15,18 @@
 #include <string>
 #include <type_traits>
 #include <Eigen/Dense>
+#include "nerva/neural_networks/parallel_operations.h"
 
 namespace nerva {
 
 template <typename Matrix>
 bool has_nan(const Matrix& A)
 {
+  if constexpr (std::is_base_of_v<Eigen::EigenBase<Matrix>, Matrix>)
+  {
+    return eigen::parallel_has_nan(A);
+  }
+
   auto rows = A.rows();
   auto columns = A.cols();
   for (auto i = 0; i < rows; i++)
@@ -0,0 +1,492 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/quantization.h
+/// \brief Post-training quantization of multilayer perceptrons to int8, for inference.
+///
+/// The weights of a linear layer are quantized symmetrically with one scale per output channel (i.e. per row
+/// of W). The inputs of the layers are quantized symmetrically with one scale per layer, which is determined
+/// by a calibration pass over a sample of the data. The products are computed using int8 x int8 -> int32
+/// kernels. The conversion of the int32 results back to scalars, the bias and the activation function are
+/// applied to a block of rows at a time, after which the block is quantized again for the next layer.
+
+#pragma once
+
+#include "nerva/neural_networks/mlp_algorithms.h"
+#include "nerva/neural_networks/multilayer_perceptron.h"
+#include "nerva/neural_networks/nerva_timer.h"
+#include "fmt/format.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <typeinfo>
+#include <vector>
+
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+#include <immintrin.h>
+#define NERVA_USE_VNNI
+#endif
+
+namespace nerva {
+
+using int8_matrix = Eigen::Matrix<std::int8_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using int32_matrix = Eigen::Matrix<std::int32_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+// The number of rows that is processed at once by the quantized layers
+constexpr long quantization_block_size = 32;
+
+/// Returns the scale that maps the range [-max_abs, max_abs] to [-127, 127].
+inline
+scalar quantization_scale(scalar max_abs)
+{
+  return max_abs > 0 ? max_abs / 127 : scalar(1);
+}
+
+inline
+std::int8_t quantize_value(scalar x, scalar inv_scale)
+{
+  scalar y = std::nearbyint(x * inv_scale);
+  return static_cast<std::int8_t>(std::clamp(y, scalar(-127), scalar(127)));
+}
+
+/// Quantizes the rows [i0, i0 + A.rows()) of Aq using the given scale.
+template <typename Matrix>
+void quantize_rows(const Matrix& A, scalar scale, int8_matrix& Aq, long i0 = 0)
+{
+  scalar inv_scale = 1 / scale;
+  for (long i = 0; i < A.rows(); i++)
+  {
+    for (long j = 0; j < A.cols(); j++)
+    {
+      Aq(i0 + i, j) = quantize_value(A(i, j), inv_scale);
+    }
+  }
+}
+
+/// Quantizes A using a single scale.
+inline
+void quantize(const eigen::matrix& A, scalar scale, int8_matrix& Aq)
+{
+  long N = A.rows();
+  Aq.resize(N, A.cols());
+
+#pragma omp parallel for
+  for (long i0 = 0; i0 < N; i0 += quantization_block_size)
+  {
+    long n = std::min(quantization_block_size, N - i0);
+    quantize_rows(A.middleRows(i0, n), scale, Aq, i0);
+  }
+}
+
+// A K x D int8 matrix in CSR format.
+struct int8_csr_matrix
+{
+  long rows = 0;
+  long cols = 0;
+  std::vector<MKL_INT> row_index;
+  std::vector<MKL_INT> col_index;
+  std::vector<std::int8_t> values;
+};
+
+/// Quantizes the weight matrix W with a scale per row, and stores the scales in the 1 x K matrix scales.
+inline
+void quantize_weights(const eigen::matrix& W, int8_matrix& Wq, eigen::matrix& scales)
+{
+  long K = W.rows();
+  Wq.resize(K, W.cols());
+  scales.resize(1, K);
+  for (long k = 0; k < K; k++)
+  {
+    scales(0, k) = quantization_scale(W.row(k).cwiseAbs().maxCoeff());
+    quantize_rows(W.row(k), scales(0, k), Wq, k);
+  }
+}
+
+/// Quantizes the sparse weight matrix W with a scale per row, and stores the scales in the 1 x K matrix scales.
+inline
+void quantize_weights(const mkl::sparse_matrix_csr<scalar>& W, int8_csr_matrix& Wq, eigen::matrix& scales)
+{
+  long K = W.rows();
+  const auto& row_index = W.row_index();
+  const auto& values = W.values();
+
+  Wq.rows = K;
+  Wq.cols = W.cols();
+  Wq.row_index = row_index;
+  Wq.col_index = W.col_index();
+  Wq.values.resize(values.size());
+  scales.resize(1, K);
+  for (long k = 0; k < K; k++)
+  {
+    scalar max_abs = 0;
+    for (auto j = row_index[k]; j < row_index[k + 1]; j++)
+    {
+      max_abs = std::max(max_abs, std::fabs(values[j]));
+    }
+    scales(0, k) = quantization_scale(max_abs);
+    scalar inv_scale = 1 / scales(0, k);
+    for (auto j = row_index[k]; j < row_index[k + 1]; j++)
+    {
+      Wq.values[j] = quantize_value(values[j], inv_scale);
+    }
+  }
+}
+
+namespace detail {
+
+inline
+std::int32_t int8_dot(const std::int8_t* x, const std::int8_t* w, long n)
+{
+  std::int32_t result = 0;
+  for (long j = 0; j < n; j++)
+  {
+    result += static_cast<std::int32_t>(x[j]) * static_cast<std::int32_t>(w[j]);
+  }
+  return result;
+}
+
+#ifdef NERVA_USE_VNNI
+// Computes the dot product of x and w, with x an unsigned vector. This matches the VNNI instruction vpdpbusd.
+inline
+std::int32_t uint8_int8_dot(const std::uint8_t* x, const std::int8_t* w, long n)
+{
+  __m512i acc = _mm512_setzero_si512();
+  long j = 0;
+  for (; j + 64 <= n; j += 64)
+  {
+    acc = _mm512_dpbusd_epi32(acc, _mm512_loadu_si512(x + j), _mm512_loadu_si512(w + j));
+  }
+  std::int32_t result = _mm512_reduce_add_epi32(acc);
+  for (; j < n; j++)
+  {
+    result += static_cast<std::int32_t>(x[j]) * static_cast<std::int32_t>(w[j]);
+  }
+  return result;
+}
+#endif
+
+} // namespace detail
+
+/// Computes result = Xq(i0:i0+n, :) * Wq^T using int32 accumulation.
+inline
+void int8_product_block(const int8_matrix& Xq, const int8_matrix& Wq, const std::vector<std::int32_t>& Wq_row_sums, long i0, long n, int32_matrix& result)
+{
+  long D = Xq.cols();
+  long K = Wq.rows();
+  result.resize(n, K);
+
+#ifdef NERVA_USE_VNNI
+  // vpdpbusd multiplies unsigned with signed bytes, so x + 128 is used instead of x, and the
+  // surplus 128 * sum(w) is subtracted afterwards
+  thread_local std::vector<std::uint8_t> X_shifted;
+  X_shifted.resize(n * D);
+  const std::int8_t* x = Xq.data() + i0 * D;
+  for (long j = 0; j < n * D; j++)
+  {
+    X_shifted[j] = static_cast<std::uint8_t>(x[j] ^ 0x80);
+  }
+  for (long k = 0; k < K; k++)
+  {
+    const std::int8_t* w = Wq.data() + k * D;
+    for (long i = 0; i < n; i++)
+    {
+      result(i, k) = detail::uint8_int8_dot(X_shifted.data() + i * D, w, D) - 128 * Wq_row_sums[k];
+    }
+  }
+#else
+  for (long k = 0; k < K; k++)
+  {
+    const std::int8_t* w = Wq.data() + k * D;
+    for (long i = 0; i < n; i++)
+    {
+      result(i, k) = detail::int8_dot(Xq.data() + (i0 + i) * D, w, D);
+    }
+  }
+#endif
+}
+
+/// Computes result = Xq(i0:i0+n, :) * Wq^T using int32 accumulation, with Wq a sparse matrix.
+inline
+void int8_product_block(const int8_matrix& Xq, const int8_csr_matrix& Wq, long i0, long n, int32_matrix& result)
+{
+  long D = Xq.cols();
+  long K = Wq.rows;
+  result.resize(n, K);
+
+  for (long k = 0; k < K; k++)
+  {
+    auto first = Wq.row_index[k];
+    auto last = Wq.row_index[k + 1];
+    for (long i = 0; i < n; i++)
+    {
+      const std::int8_t* x = Xq.data() + (i0 + i) * D;
+      std::int32_t sum = 0;
+      for (auto j = first; j < last; j++)
+      {
+        sum += static_cast<std::int32_t>(x[Wq.col_index[j]]) * static_cast<std::int32_t>(Wq.values[j]);
+      }
+      result(i, k) = sum;
+    }
+  }
+}
+
+// A linear layer with int8 weights, followed by an optional activation function.
+struct quantized_linear_layer
+{
+  bool is_sparse = false;
+  int8_matrix W;                 // the weights, if the layer is dense
+  int8_csr_matrix W_sparse;      // the weights, if the layer is sparse
+  std::vector<std::int32_t> W_row_sums;
+  eigen::matrix W_scales;        // the scales of the rows of W
+  eigen::matrix b;
+  scalar input_scale = 1;
+  std::function<void(eigen::matrix&)> activation;  // is applied in place to a block of outputs
+  std::string name;
+
+  [[nodiscard]] long output_size() const
+  {
+    return b.cols();
+  }
+
+  /// Applies the layer to the rows [i0, i0 + n) of the input Xq, and stores the result in Z.
+  void compute_block(const int8_matrix& Xq, long i0, long n, int32_matrix& Zq, eigen::matrix& Z) const
+  {
+    if (is_sparse)
+    {
+      int8_product_block(Xq, W_sparse, i0, n, Zq);
+    }
+    else
+    {
+      int8_product_block(Xq, W, W_row_sums, i0, n, Zq);
+    }
+    Z = (Zq.cast<scalar>().array().rowwise() * (input_scale * W_scales.row(0).array())).matrix();
+    Z.array().rowwise() += b.row(0).array();
+    if (activation)
+    {
+      activation(Z);
+    }
+  }
+
+  /// Computes the output for the input Xq, and quantizes it using output_scale.
+  void feedforward(const int8_matrix& Xq, scalar output_scale, int8_matrix& result) const
+  {
+    long N = Xq.rows();
+    result.resize(N, output_size());
+
+#pragma omp parallel
+    {
+      int32_matrix Zq;
+      eigen::matrix Z;
+
+#pragma omp for
+      for (long i0 = 0; i0 < N; i0 += quantization_block_size)
+      {
+        long n = std::min(quantization_block_size, N - i0);
+        compute_block(Xq, i0, n, Zq, Z);
+        quantize_rows(Z, output_scale, result, i0);
+      }
+    }
+  }
+
+  /// Computes the output for the input Xq.
+  void feedforward(const int8_matrix& Xq, eigen::matrix& result) const
+  {
+    long N = Xq.rows();
+    result.resize(N, output_size());
+
+#pragma omp parallel
+    {
+      int32_matrix Zq;
+      eigen::matrix Z;
+
+#pragma omp for
+      for (long i0 = 0; i0 < N; i0 += quantization_block_size)
+      {
+        long n = std::min(quantization_block_size, N - i0);
+        compute_block(Xq, i0, n, Zq, Z);
+        result.middleRows(i0, n) = Z;
+      }
+    }
+  }
+
+  [[nodiscard]] std::string to_string() const
+  {
+    return fmt::format("Quantized{}(input_scale={}, activation={})", is_sparse ? "Sparse" : "Dense", input_scale, name);
+  }
+};
+
+namespace detail {
+
+template <typename Matrix, typename ActivationFunction>
+bool try_set_quantized_activation(neural_network_layer* layer, quantized_linear_layer& result)
+{
+  if (auto alayer = dynamic_cast<activation_layer<Matrix, ActivationFunction>*>(layer))
+  {
+    auto act = alayer->act;
+    result.activation = [act](eigen::matrix& Z) { Z = act(Z); };
+    result.name = act.to_string();
+    return true;
+  }
+  return false;
+}
+
+template <typename Matrix>
+void set_quantized_activation(neural_network_layer* layer, quantized_linear_layer& result)
+{
+  if (try_set_quantized_activation<Matrix, relu_activation>(layer, result) ||
+      try_set_quantized_activation<Matrix, leaky_relu_activation>(layer, result) ||
+      try_set_quantized_activation<Matrix, all_relu_activation>(layer, result) ||
+      try_set_quantized_activation<Matrix, trimmed_relu_activation>(layer, result) ||
+      try_set_quantized_activation<Matrix, srelu_activation>(layer, result) ||
+      try_set_quantized_activation<Matrix, sigmoid_activation>(layer, result) ||
+      try_set_quantized_activation<Matrix, hyperbolic_tangent_activation>(layer, result))
+  {
+    return;
+  }
+  if (dynamic_cast<softmax_layer<Matrix>*>(layer))
+  {
+    result.activation = [](eigen::matrix& Z) { eigen::matrix Y; stable_softmax_rowwise(Z, Y); Z = Y; };
+    result.name = "Softmax()";
+  }
+  else if (dynamic_cast<log_softmax_layer<Matrix>*>(layer))
+  {
+    result.activation = [](eigen::matrix& Z) { eigen::matrix Y; eigen::matrix S; stable_log_softmax_rowwise(Z, Y, S); Z = Y; };
+    result.name = "LogSoftmax()";
+  }
+  else if (typeid(*layer) == typeid(linear_layer<Matrix>) || dynamic_cast<linear_dropout_layer<Matrix>*>(layer))
+  {
+    result.name = "NoActivation()";
+  }
+  else
+  {
+    throw std::runtime_error("quantization is not supported for layer " + layer->to_string());
+  }
+}
+
+} // namespace detail
+
+// A multilayer perceptron with quantized linear layers, that can only be used for inference.
+struct quantized_mlp
+{
+  std::vector<quantized_linear_layer> layers;
+  int8_matrix X;  // the quantized input of the current layer
+  int8_matrix Y;  // the quantized output of the current layer
+
+  void feedforward(const eigen::matrix& input, eigen::matrix& result)
+  {
+    NERVA_TIMER_START("feedforward");
+    quantize(input, layers.front().input_scale, X);
+    for (std::size_t i = 0; i < layers.size() - 1; i++)
+    {
+      layers[i].feedforward(X, layers[i + 1].input_scale, Y);
+      std::swap(X, Y);
+    }
+    layers.back().feedforward(X, result);
+    NERVA_TIMER_STOP("feedforward");
+  }
+
+  [[nodiscard]] std::string to_string() const
+  {
+    std::ostringstream out;
+    for (const auto& layer: layers)
+    {
+      out << layer.to_string() << '\n';
+    }
+    return out.str();
+  }
+};
+
+/// Returns the maximum absolute values of the inputs of the layers of M, when applied to the rows of X
+/// in batches of size Q. The inputs are computed in inference mode, after which the mode of M is restored.
+inline
+std::vector<scalar> calibrate(multilayer_perceptron& M, const eigen::matrix& X, long Q)
+{
+  std::vector<scalar> result(M.layers.size(), 0);
+  eigen::matrix Y;
+  bool training = is_training_mode(M);
+  set_training_mode(M, false);
+  for (long i0 = 0; i0 < X.rows(); i0 += Q)
+  {
+    long n = std::min(Q, X.rows() - i0);
+    M.feedforward(X.middleRows(i0, n), Y);
+    for (std::size_t i = 0; i < M.layers.size(); i++)
+    {
+      result[i] = std::max(result[i], M.layers[i]->X.cwiseAbs().maxCoeff());
+    }
+  }
+  set_training_mode(M, training);
+  return result;
+}
+
+/// Quantizes the layers of M. The scales of the layer inputs are determined by applying M to the calibration
+/// data X in batches of size Q. Batch normalization layers are not supported, unless they have been removed
+/// using fold_normalization_layers.
+inline
+quantized_mlp quantize_mlp(multilayer_perceptron& M, const eigen::matrix& X, long Q)
+{
+  quantized_mlp result;
+  std::vector<scalar> max_abs = calibrate(M, X, Q);
+
+  for (std::size_t i = 0; i < M.layers.size(); i++)
+  {
+    neural_network_layer* layer = M.layers[i].get();
+    quantized_linear_layer qlayer;
+    qlayer.input_scale = quantization_scale(max_abs[i]);
+    if (auto dlayer = dynamic_cast<dense_linear_layer*>(layer))
+    {
+      quantize_weights(dlayer->W, qlayer.W, qlayer.W_scales);
+      qlayer.W_row_sums.resize(qlayer.W.rows());
+      for (long k = 0; k < qlayer.W.rows(); k++)
+      {
+        qlayer.W_row_sums[k] = qlayer.W.row(k).cast<std::int32_t>().sum();
+      }
+      qlayer.b = dlayer->b;
+      detail::set_quantized_activation<eigen::matrix>(layer, qlayer);
+    }
+    else if (auto slayer = dynamic_cast<sparse_linear_layer*>(layer))
+    {
+      qlayer.is_sparse = true;
+      quantize_weights(slayer->W, qlayer.W_sparse, qlayer.W_scales);
+      qlayer.b = slayer->b;
+      detail::set_quantized_activation<mkl::sparse_matrix_csr<scalar>>(layer, qlayer);
+    }
+    else
+    {
+      throw std::runtime_error("quantization is not supported for layer " + layer->to_string());
+    }
+    result.layers.push_back(std::move(qlayer));
+  }
+
+  return result;
+}
+
+/// Returns the fraction of the rows of Xtest that is classified correctly by M, using batches of size Q. The last
+/// batch may be smaller, so all rows are evaluated, like in compute_accuracy for a multilayer perceptron.
+inline
+double compute_accuracy(quantized_mlp& M, const eigen::matrix& Xtest, const eigen::matrix& Ttest, long Q)
+{
+  long N = Xtest.rows();
+  std::size_t total_correct = 0;
+  eigen::matrix Ybatch;
+
+  for (long i0 = 0; i0 < N; i0 += Q)
+  {
+    long batch_size = std::min(Q, N - i0);
+    M.feedforward(Xtest.middleRows(i0, batch_size), Ybatch);
+    for (long i = 0; i < batch_size; i++)
+    {
+      if (is_correct_classification(Ybatch.row(i), Ttest.row(i0 + i)))
+      {
+        total_correct++;
+      }
+    }
+  }
+
+  return static_cast<double>(total_correct) / N;
+}
+
+} // namespace nerva
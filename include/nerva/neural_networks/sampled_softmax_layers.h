@@ -0,0 +1,304 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/sampled_softmax_layers.h
+/// \brief An output layer for a large number of classes, that uses sampled softmax during training.
+///
+/// A sampled softmax layer is a linear output layer with K classes, that should be combined with the softmax cross
+/// entropy loss. During evaluation it computes the logits of all K classes. During training it computes only the
+/// logits of the true class of each example, and of a set of S negative classes that is sampled once per batch and
+/// shared by all examples. The output of a training step is an N x (1 + S) matrix, with the logits of the true
+/// classes in the first column, and the targets are replaced accordingly (see sample). The logits are corrected by
+/// subtracting log(S * Q(c)), with Q(c) the probability that class c is sampled, and sampled classes that coincide
+/// with the true class of an example are masked out for that example.
+///
+/// The gradients of W and b are nonzero only in the rows of the true classes and the sampled classes, and only these
+/// rows are updated by the optimizer. So the cost of a training step is O(N (1 + S) D) instead of O(N K D).
+
+#pragma once
+
+#include "nerva/neural_networks/layers.h"
+#include "fmt/format.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <vector>
+
+namespace nerva {
+
+enum class sampling_distribution
+{
+  uniform,
+  log_uniform  // Zipfian; this assumes that the classes are sorted by decreasing frequency
+};
+
+struct sampled_softmax_layer: public neural_network_layer
+{
+  using super = neural_network_layer;
+  using super::X;
+  using super::DX;
+
+  eigen::matrix W;       // the weights (K x D)
+  eigen::matrix b;       // the bias, stored as a column (K x 1) such that it can be updated per class with update_rows
+  eigen::matrix DW;      // always empty; the optimizer only refers to it, since the gradient of W is stored in DW_rows
+  eigen::matrix Db;      // always empty; the optimizer only refers to it, since the gradient of b is stored in Db_rows
+  eigen::matrix DW_rows; // DW_rows.row(r) is the gradient of row rows[r] of W
+  eigen::matrix Db_rows; // Db_rows(r, 0) is the gradient of b(rows[r], 0)
+  std::vector<long> rows;  // the sorted indices of the classes with a nonzero gradient
+  std::shared_ptr<gradient_descent_optimizer<eigen::matrix>> optimizer_W;
+  std::shared_ptr<gradient_descent_optimizer<eigen::matrix>> optimizer_b;
+
+  long S;                             // the number of sampled classes per batch
+  sampling_distribution distribution;
+  bool training = true;               // if false, the logits of all classes are computed
+  bool sample_pending = false;        // true if sample has been called since the last feedforward step
+  bool sampled = false;               // true if the last feedforward step computed the sampled logits
+  std::mt19937 rng;
+
+  std::vector<long> true_classes;     // the true classes of the examples of the current batch
+  std::vector<long> sampled_classes;  // the sampled classes of the current batch
+  eigen::matrix T;                    // the targets corresponding to the sampled logits (N x (1 + S))
+  eigen::matrix W_true;               // the rows of W of the true classes (N x D)
+  eigen::matrix W_sampled;            // the rows of W of the sampled classes (S x D)
+
+  explicit sampled_softmax_layer(std::size_t D, std::size_t K, std::size_t N, long S_, sampling_distribution distribution_, std::mt19937& rng_)
+    : super(D, N), W(K, D), b(K, 1), S(S_), distribution(distribution_), rng(rng_())
+  {
+    if (S_ <= 0 || S_ >= static_cast<long>(K))
+    {
+      throw std::runtime_error(fmt::format("The number of sampled classes {} must be in the range [1, {})", S_, K));
+    }
+  }
+
+  [[nodiscard]] auto input_size() const -> std::size_t
+  {
+    return W.cols();
+  }
+
+  [[nodiscard]] auto output_size() const -> std::size_t
+  {
+    return W.rows();
+  }
+
+  [[nodiscard]] auto to_string() const -> std::string override
+  {
+    return fmt::format("SampledSoftmax(input_size={}, output_size={}, samples={}, distribution={}, optimizer={})", input_size(), output_size(), S,
+                       distribution == sampling_distribution::uniform ? "Uniform" : "LogUniform", optimizer_W->to_string());
+  }
+
+  /// Returns the probability that class c is drawn.
+  [[nodiscard]] double probability(long c) const
+  {
+    long K = W.rows();
+    if (distribution == sampling_distribution::uniform)
+    {
+      return 1.0 / K;
+    }
+    return std::log((c + 2.0) / (c + 1.0)) / std::log(K + 1.0);
+  }
+
+  /// Determines the true classes of the examples from the one-hot encoded targets T_, and samples the negative
+  /// classes of the next training step. The targets of the sampled logits are stored in T. A feedforward step
+  /// in training mode computes the sampled logits only if it is preceded by a call to sample, so the layer can
+  /// also be used for evaluation without switching off the training mode.
+  template <typename Target>
+  void sample(const Target& T_)
+  {
+    long N = T_.rows();
+    long K = W.rows();
+
+    true_classes.resize(N);
+    for (long n = 0; n < N; n++)
+    {
+      Eigen::Index c;
+      T_.row(n).maxCoeff(&c);
+      true_classes[n] = c;
+    }
+
+    sampled_classes.resize(S);
+    std::uniform_real_distribution<double> U(0, 1);
+    for (long j = 0; j < S; j++)
+    {
+      if (distribution == sampling_distribution::uniform)
+      {
+        sampled_classes[j] = std::min(static_cast<long>(U(rng) * K), K - 1);
+      }
+      else
+      {
+        sampled_classes[j] = std::min(static_cast<long>(std::exp(U(rng) * std::log(K + 1.0))) - 1, K - 1);
+      }
+    }
+
+    T = eigen::matrix::Zero(N, 1 + S);
+    T.col(0).setOnes();
+    sample_pending = true;
+  }
+
+  // Returns the correction log(S * Q(c)) of the logit of class c.
+  [[nodiscard]] scalar log_expected_count(long c) const
+  {
+    return static_cast<scalar>(std::log(S * probability(c)));
+  }
+
+  void feedforward(eigen::matrix& result) override
+  {
+    long N = X.rows();
+    long D = X.cols();
+
+    sampled = training && sample_pending;
+    sample_pending = false;
+    if (!sampled)
+    {
+      result.noalias() = X * W.transpose();
+      result.rowwise() += b.transpose().row(0);
+      return;
+    }
+
+    if (static_cast<long>(true_classes.size()) != N)
+    {
+      throw std::runtime_error(fmt::format("sampled_softmax_layer: the targets have {} rows instead of {}", true_classes.size(), N));
+    }
+
+    W_sampled.resize(S, D);
+    eigen::matrix b_sampled(1, S);
+    for (long j = 0; j < S; j++)
+    {
+      W_sampled.row(j) = W.row(sampled_classes[j]);
+      b_sampled(0, j) = b(sampled_classes[j], 0) - log_expected_count(sampled_classes[j]);
+    }
+
+    result.resize(N, 1 + S);
+    result.rightCols(S).noalias() = X * W_sampled.transpose();
+    W_true.resize(N, D);
+
+    constexpr scalar masked = -1e9;  // the logit of a sampled class that is equal to the true class
+#pragma omp parallel for
+    for (long n = 0; n < N; n++)
+    {
+      long t = true_classes[n];
+      W_true.row(n) = W.row(t);
+      result(n, 0) = X.row(n).dot(W_true.row(n)) + b(t, 0) - log_expected_count(t);
+      for (long j = 0; j < S; j++)
+      {
+        result(n, 1 + j) = sampled_classes[j] == t ? masked : result(n, 1 + j) + b_sampled(0, j);
+      }
+    }
+  }
+
+  void backpropagate(const eigen::matrix& /* Y */, const eigen::matrix& DY) override
+  {
+    long N = X.rows();
+    long K = W.rows();
+
+    if (!sampled)
+    {
+      rows.resize(K);
+      std::iota(rows.begin(), rows.end(), 0);
+      DW_rows.noalias() = DY.transpose() * X;
+      Db_rows = DY.colwise().sum().transpose();
+      DX.noalias() = DY * W;
+      return;
+    }
+
+    // the classes with a nonzero gradient
+    rows = sampled_classes;
+    rows.insert(rows.end(), true_classes.begin(), true_classes.end());
+    std::sort(rows.begin(), rows.end());
+    rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+    auto position = [&](long c) { return std::lower_bound(rows.begin(), rows.end(), c) - rows.begin(); };
+
+    auto DY_true = DY.col(0);
+    auto DY_sampled = DY.rightCols(S);
+    DX.noalias() = DY_sampled * W_sampled;
+    DX += DY_true.asDiagonal() * W_true;
+
+    eigen::matrix DW_sampled = DY_sampled.transpose() * X;
+    eigen::matrix Db_sampled = DY_sampled.colwise().sum();
+    DW_rows = eigen::matrix::Zero(rows.size(), X.cols());
+    Db_rows = eigen::matrix::Zero(rows.size(), 1);
+    for (long j = 0; j < S; j++)
+    {
+      auto r = position(sampled_classes[j]);
+      DW_rows.row(r) += DW_sampled.row(j);
+      Db_rows(r, 0) += Db_sampled(0, j);
+    }
+    for (long n = 0; n < N; n++)
+    {
+      auto r = position(true_classes[n]);
+      DW_rows.row(r) += DY_true(n) * X.row(n);
+      Db_rows(r, 0) += DY_true(n);
+    }
+  }
+
+  void optimize(scalar eta) override
+  {
+    optimizer_W->update_rows(eta, rows, DW_rows);
+    optimizer_b->update_rows(eta, rows, Db_rows);
+  }
+
+  std::vector<eigen::matrix*> batch_buffers() override
+  {
+    auto result = super::batch_buffers();
+    result.insert(result.end(), { &T, &W_true });
+    return result;
+  }
+
+  void clip(scalar epsilon) override
+  {
+    if (optimizer_W)
+    {
+      optimizer_W->clip(epsilon);
+      optimizer_b->clip(epsilon);
+    }
+  }
+
+  void info(unsigned int layer_index) const override
+  {
+    std::string i = std::to_string(layer_index);
+    std::cout << to_string() << std::endl;
+    print_numpy_matrix("W" + i, W);
+    print_numpy_matrix("b" + i, b.transpose());
+  }
+};
+
+inline
+void set_weights_and_bias(sampled_softmax_layer& layer, weight_initialization w, std::mt19937& rng)
+{
+  auto init = make_weight_initializer(w, layer.W, rng);
+  set_weights(layer.W, [&init]() { return (*init)(); });
+  eigen::matrix b(1, layer.W.rows());
+  init->initialize_bias(b);
+  layer.b = b.transpose();
+}
+
+inline
+void set_sampled_softmax_layer_optimizer(sampled_softmax_layer& layer, const std::string& text)
+{
+  layer.optimizer_W = std::dynamic_pointer_cast<gradient_descent_optimizer<eigen::matrix>>(parse_optimizer(text, layer.W, layer.DW));
+  layer.optimizer_b = std::dynamic_pointer_cast<gradient_descent_optimizer<eigen::matrix>>(parse_optimizer(text, layer.b, layer.Db));
+  if (!layer.optimizer_W || !layer.optimizer_b)
+  {
+    throw std::runtime_error("The optimizer '" + text + "' does not support sampled softmax layers");
+  }
+}
+
+inline
+sampling_distribution parse_sampling_distribution(const std::string& text)
+{
+  if (text == "Uniform")
+  {
+    return sampling_distribution::uniform;
+  }
+  else if (text == "LogUniform")
+  {
+    return sampling_distribution::log_uniform;
+  }
+  throw std::runtime_error("unknown sampling distribution '" + text + "'");
+}
+
+} // namespace nerva
@@ -31,29 +31,35 @@ enum class computation
 
 inline computation NervaComputation = computation::eigen;
 
+// If true, the matrix products of dense linear layers use bf16 operands, see mixed_precision.h
+inline bool NervaMixedPrecision = false;
+
 inline
-void set_nerva_computation(const std::string& text)
+computation parse_computation(const std::string& text)
 {
   if (text == "eigen")
   {
-    NervaComputation = computation::eigen;
+    return computation::eigen;
   }
   else if (text == "mkl")
   {
-    NervaComputation = computation::mkl;
+    return computation::mkl;
   }
   else if (text == "blas")
   {
-    NervaComputation = computation::blas;
+    return computation::blas;
   }
   else if (text == "sycl")
   {
-    NervaComputation = computation::sycl;
-  }
-  else
-  {
-    throw std::runtime_error("unknown computation " + text);
+    return computation::sycl;
   }
+  throw std::runtime_error("unknown computation " + text);
+}
+
+inline
+void set_nerva_computation(const std::string& text)
+{
+  NervaComputation = parse_computation(text);
 }
 
 } // namespace nerva
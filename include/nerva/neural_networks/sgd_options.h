@@ -22,6 +22,8 @@ struct sgd_options
 {
   std::size_t epochs = 100;
   long batch_size = 1;
+  long eval_batch_size = 0;  // the batch size used for evaluation; if 0, batch_size is used
+  bool drop_last = true;     // if true, a final partial batch of each epoch is skipped
   bool shuffle = true;
   scalar regrow_rate = 0.0;
   bool regrow_separate_positive_negative = false; // apply the regrow rate to positive and negative values separately
@@ -29,6 +31,11 @@ struct sgd_options
   bool debug = false;
   scalar gradient_step = 0;  // if gradient_step > 0 then gradient checks will be done
   scalar clip = 0; // threshold for values that are clipped to 0
+  scalar loss_scale = 65536; // the initial loss scale in mixed precision mode, see mixed_precision.h
+  std::size_t task_graph_threads = 0; // if positive, backpropagation and optimization are executed as a task graph, see task_graph.h
+  bool fused_backpropagation = false; // if true, the weight gradients are applied in tiles and not stored, see fused_backpropagation.h
+  double activation_memory_budget = 0; // if positive, the memory budget in MB for activation checkpointing, see activation_checkpointing.h
+  std::string autotune_cache; // if not empty, the execution plans of the layers are tuned and cached in this file, see autotuning.h
 
   void info() const;
 };
@@ -38,6 +45,11 @@ std::ostream& operator<<(std::ostream& out, const sgd_options& options)
 {
   out << "epochs = " << options.epochs << std::endl;
   out << "batch size = " << options.batch_size << std::endl;
+  if (options.eval_batch_size > 0)
+  {
+    out << "eval batch size = " << options.eval_batch_size << std::endl;
+  }
+  out << "drop last = " << std::boolalpha << options.drop_last << std::endl;
   out << "shuffle = " << std::boolalpha << options.shuffle << std::endl;
   out << "clip = " << options.clip << std::endl;
   if (options.regrow_rate > 0)
@@ -45,6 +57,26 @@ std::ostream& operator<<(std::ostream& out, const sgd_options& options)
     out << "regrow rate = " << options.regrow_rate << std::endl;
     out << "regrow separate positive/negative weights = " << options.regrow_separate_positive_negative << std::endl;
   }
+  if (NervaMixedPrecision)
+  {
+    out << "loss scale = " << options.loss_scale << std::endl;
+  }
+  if (options.task_graph_threads > 0)
+  {
+    out << "task graph threads = " << options.task_graph_threads << std::endl;
+  }
+  if (options.fused_backpropagation)
+  {
+    out << "fused backpropagation = true (the weight gradients are not stored)" << std::endl;
+  }
+  if (options.activation_memory_budget > 0)
+  {
+    out << "activation memory budget = " << options.activation_memory_budget << " MB" << std::endl;
+  }
+  if (!options.autotune_cache.empty())
+  {
+    out << "autotune cache = " << options.autotune_cache << std::endl;
+  }
   out << "statistics = " << std::boolalpha << options.statistics << std::endl;
   out << "debug = " << std::boolalpha << options.debug << std::endl;
   return out;
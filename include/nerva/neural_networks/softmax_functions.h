@@ -207,6 +207,88 @@ auto stable_log_softmax_rowwise_jacobian(const Vector& x)
   return log_softmax_rowwise_jacobian(x);
 }
 
+// The functions below compute row-wise softmax functions and their Jacobian-vector products directly, one
+// row at a time. A row of a row-major matrix is contiguous in memory, so each row is processed in at most
+// two vectorized passes, and no temporaries of size N x N or N x K are created.
+
+/// Computes Y = stable_softmax_rowwise(Z).
+/// \param Z An N x K matrix
+/// \param Y An N x K matrix. It may be the same object as Z.
+inline
+void stable_softmax_rowwise(const eigen::matrix& Z, eigen::matrix& Y)
+{
+  const long N = Z.rows();
+  Y.resize(N, Z.cols());
+
+#pragma omp parallel for
+  for (long i = 0; i < N; i++)
+  {
+    scalar c = Z.row(i).maxCoeff();
+    Y.row(i) = (Z.row(i).array() - c).exp().matrix();
+    Y.row(i) /= Y.row(i).sum();
+  }
+}
+
+/// Computes Y = stable_log_softmax_rowwise(Z), and S = stable_softmax_rowwise(Z) as a by-product.
+/// \param Z An N x K matrix
+/// \param Y An N x K matrix that receives the log-softmax values
+/// \param S An N x K matrix that receives the softmax values
+inline
+void stable_log_softmax_rowwise(const eigen::matrix& Z, eigen::matrix& Y, eigen::matrix& S)
+{
+  const long N = Z.rows();
+  Y.resize(N, Z.cols());
+  S.resize(N, Z.cols());
+
+#pragma omp parallel for
+  for (long i = 0; i < N; i++)
+  {
+    scalar c = Z.row(i).maxCoeff();
+    S.row(i) = (Z.row(i).array() - c).exp().matrix();
+    scalar sum = S.row(i).sum();
+    Y.row(i) = (Z.row(i).array() - (c + std::log(sum))).matrix();
+    S.row(i) /= sum;
+  }
+}
+
+/// Computes the product DZ = hadamard(Y, DY - column_repeat(diag(DY * Y^T), K)) of the Jacobian of the
+/// softmax function with DY, where Y is the output of the softmax function.
+/// \param Y An N x K matrix with softmax values
+/// \param DY An N x K matrix
+/// \param DZ An N x K matrix that receives the result
+inline
+void softmax_rowwise_jacobian_product(const eigen::matrix& Y, const eigen::matrix& DY, eigen::matrix& DZ)
+{
+  const long N = Y.rows();
+  DZ.resize(N, Y.cols());
+
+#pragma omp parallel for
+  for (long i = 0; i < N; i++)
+  {
+    scalar dot = Y.row(i).dot(DY.row(i));
+    DZ.row(i) = (Y.row(i).array() * (DY.row(i).array() - dot)).matrix();
+  }
+}
+
+/// Computes the product DZ = DY - hadamard(S, column_repeat(rows_sum(DY), K)) of the Jacobian of the
+/// log-softmax function with DY, where S = softmax(Z) is the softmax of the input Z.
+/// \param S An N x K matrix with softmax values
+/// \param DY An N x K matrix
+/// \param DZ An N x K matrix that receives the result
+inline
+void log_softmax_rowwise_jacobian_product(const eigen::matrix& S, const eigen::matrix& DY, eigen::matrix& DZ)
+{
+  const long N = S.rows();
+  DZ.resize(N, S.cols());
+
+#pragma omp parallel for
+  for (long i = 0; i < N; i++)
+  {
+    scalar sum = DY.row(i).sum();
+    DZ.row(i) = DY.row(i) - sum * S.row(i);
+  }
+}
+
 // N.B. Numerically unstable!
 struct softmax
 {
@@ -238,7 +320,9 @@ struct stable_softmax
 
   auto operator()(const eigen::matrix& X) const -> eigen::matrix
   {
-    return nerva::stable_softmax_rowwise(X);
+    eigen::matrix Y;
+    nerva::stable_softmax_rowwise(X, Y);
+    return Y;
   }
 };
 
@@ -0,0 +1,313 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/static_mlp.h
+/// \brief A multilayer perceptron with a structure that is fixed at compile time.
+///
+/// The class static_mlp<Layers...> is an alternative to multilayer_perceptron for small dense models. The
+/// layer types, sizes and activation functions are template parameters, so there is no virtual dispatch,
+/// and the feedforward and backpropagation steps can be inlined completely. Weight matrices with at most
+/// static_mlp_max_fixed_size elements have a fixed size, and the buffers of the layers have a fixed number of
+/// columns. Only the batch size is dynamic. The computations are the same as in the corresponding layers of
+/// layers.h.
+
+#pragma once
+
+#include "nerva/neural_networks/layers.h"
+#include "nerva/neural_networks/multilayer_perceptron.h"
+#include "fmt/format.h"
+#include <tuple>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+
+namespace nerva {
+
+// The maximum number of elements of a weight matrix with a fixed size
+constexpr long static_mlp_max_fixed_size = 4096;
+
+// A matrix with a dynamic number of rows and Cols columns
+template <long Cols>
+using static_batch_matrix = Eigen::Matrix<scalar, Eigen::Dynamic, Cols, Cols == 1 ? Eigen::ColMajor : Eigen::RowMajor>;
+
+template <long Cols>
+using static_row_vector = Eigen::Matrix<scalar, 1, Cols, Eigen::RowMajor>;
+
+template <long Rows, long Cols>
+using static_weight_matrix = std::conditional_t<(Rows * Cols <= static_mlp_max_fixed_size),
+                                                Eigen::Matrix<scalar, Rows, Cols, Cols == 1 && Rows != 1 ? Eigen::ColMajor : Eigen::RowMajor>,
+                                                eigen::matrix>;
+
+// The identity function, for linear layers without an activation function
+struct no_activation
+{
+  template <typename Matrix>
+  const Matrix& operator()(const Matrix& X) const
+  {
+    return X;
+  }
+
+  [[nodiscard]] std::string to_string() const
+  {
+    return "NoActivation()";
+  }
+};
+
+/// A dense linear layer with D inputs and K outputs, followed by an activation function.
+template <long D, long K, typename ActivationFunction = no_activation>
+struct static_linear_layer
+{
+  static constexpr long input_size = D;
+  static constexpr long output_size = K;
+  using activation_function = ActivationFunction;
+  using input_matrix = static_batch_matrix<D>;
+  using output_matrix = static_batch_matrix<K>;
+
+  static_weight_matrix<K, D> W;
+  static_row_vector<K> b;
+  static_weight_matrix<K, D> DW;
+  static_row_vector<K> Db;
+  ActivationFunction act;
+  output_matrix Z;
+  output_matrix DZ;
+  output_matrix Y;   // the output
+  input_matrix DX;   // the gradient of the input
+
+  explicit static_linear_layer(ActivationFunction act_ = ActivationFunction())
+    : act(act_)
+  {
+    W.resize(K, D);
+    DW.resize(K, D);
+    W.setZero();
+    b.setZero();
+  }
+
+  void feedforward(const input_matrix& X)
+  {
+    Z.noalias() = X * W.transpose();
+    Z.rowwise() += b;
+    if constexpr (std::is_same_v<ActivationFunction, no_activation>)
+    {
+      Y = Z;
+    }
+    else
+    {
+      Y = act(Z);
+    }
+  }
+
+  // Computes the gradients of the parameters, and if ComputeDX is true also the gradient of the input.
+  template <bool ComputeDX = true>
+  void backpropagate(const input_matrix& X, const output_matrix& DY)
+  {
+    using eigen::hadamard;
+
+    if constexpr (std::is_same_v<ActivationFunction, no_activation>)
+    {
+      DZ = DY;
+    }
+    else if constexpr (std::is_same_v<ActivationFunction, srelu_activation>)
+    {
+      eigen::matrix DZ1;
+      act.backpropagate(Z, DY, DZ1);
+      DZ = DZ1;
+    }
+    else if constexpr (has_output_gradient<ActivationFunction>::value)
+    {
+      DZ = hadamard(DY, act.output_gradient(Y));
+    }
+    else
+    {
+      DZ = hadamard(DY, act.gradient(Z));
+    }
+    DW.noalias() = DZ.transpose() * X;
+    Db = DZ.colwise().sum();
+    if constexpr (ComputeDX)
+    {
+      DX.noalias() = DZ * W;
+    }
+  }
+
+  // Does a gradient descent step
+  void optimize(scalar eta)
+  {
+    W -= eta * DW;
+    b -= eta * Db;
+  }
+
+  [[nodiscard]] std::string to_string() const
+  {
+    return fmt::format("StaticDense(input_size={}, output_size={}, activation={})", D, K, act.to_string());
+  }
+};
+
+namespace detail {
+
+template <typename LayerTuple, std::size_t... I>
+constexpr bool static_layer_sizes_match(std::index_sequence<I...>)
+{
+  return ((std::tuple_element_t<I, LayerTuple>::output_size == std::tuple_element_t<I + 1, LayerTuple>::input_size) && ...);
+}
+
+} // namespace detail
+
+template <typename... Layers>
+struct static_mlp
+{
+  static constexpr std::size_t layer_count = sizeof...(Layers);
+  static_assert(layer_count > 0, "a static_mlp must have at least one layer");
+
+  using layer_tuple = std::tuple<Layers...>;
+  using first_layer = std::tuple_element_t<0, layer_tuple>;
+  using last_layer = std::tuple_element_t<layer_count - 1, layer_tuple>;
+
+  static constexpr long input_size = first_layer::input_size;
+  static constexpr long output_size = last_layer::output_size;
+
+  layer_tuple layers;
+  typename first_layer::input_matrix X;  // the input
+
+  static_assert(detail::static_layer_sizes_match<layer_tuple>(std::make_index_sequence<layer_count - 1>()), "the sizes of consecutive layers do not match");
+
+  private:
+    template <std::size_t I>
+    const auto& input() const
+    {
+      if constexpr (I == 0)
+      {
+        return X;
+      }
+      else
+      {
+        return std::get<I - 1>(layers).Y;
+      }
+    }
+
+    template <std::size_t... I>
+    void feedforward_layers(std::index_sequence<I...>)
+    {
+      (std::get<I>(layers).feedforward(input<I>()), ...);
+    }
+
+    template <std::size_t I, typename Matrix>
+    void backpropagate_layer(const Matrix& DY)
+    {
+      auto& layer = std::get<I>(layers);
+      if constexpr (I == 0)
+      {
+        layer.template backpropagate<false>(X, DY);
+      }
+      else
+      {
+        layer.template backpropagate<true>(input<I>(), DY);
+        backpropagate_layer<I - 1>(layer.DX);
+      }
+    }
+
+  public:
+    template <std::size_t I>
+    auto& layer()
+    {
+      return std::get<I>(layers);
+    }
+
+    template <std::size_t I>
+    const auto& layer() const
+    {
+      return std::get<I>(layers);
+    }
+
+    /// Computes the output of the model for the input, and returns a reference to it.
+    template <typename Matrix>
+    const typename last_layer::output_matrix& feedforward(const Matrix& input)
+    {
+      X = input;
+      feedforward_layers(std::make_index_sequence<layer_count>());
+      return std::get<layer_count - 1>(layers).Y;
+    }
+
+    template <typename Matrix>
+    void feedforward(const Matrix& input, eigen::matrix& result)
+    {
+      result = feedforward(input);
+    }
+
+    /// Computes the gradients of the parameters, given the gradient DY of the output of the previous call to feedforward.
+    template <typename Matrix>
+    void backpropagate(const Matrix& DY)
+    {
+      backpropagate_layer<layer_count - 1>(typename last_layer::output_matrix(DY));
+    }
+
+    void optimize(scalar eta)
+    {
+      std::apply([eta](auto&... layer) { (layer.optimize(eta), ...); }, layers);
+    }
+
+    [[nodiscard]] std::string to_string() const
+    {
+      std::string result;
+      std::apply([&result](const auto&... layer) { ((result += layer.to_string() + '\n'), ...); }, layers);
+      return result;
+    }
+};
+
+namespace detail {
+
+template <typename Layer>
+void load_static_layer(Layer& layer, const neural_network_layer* dynamic_layer, std::size_t index)
+{
+  using activation_function = typename Layer::activation_function;
+
+  const dense_linear_layer* dlayer;
+  if constexpr (std::is_same_v<activation_function, no_activation>)
+  {
+    dlayer = typeid(*dynamic_layer) == typeid(dense_linear_layer) ? static_cast<const dense_linear_layer*>(dynamic_layer) : nullptr;
+  }
+  else
+  {
+    auto alayer = dynamic_cast<const activation_layer<eigen::matrix, activation_function>*>(dynamic_layer);
+    if (alayer)
+    {
+      layer.act = alayer->act;
+    }
+    dlayer = alayer;
+  }
+
+  if (!dlayer)
+  {
+    throw std::runtime_error(fmt::format("layer {} does not match with {}", index + 1, layer.to_string()));
+  }
+  if (dlayer->W.rows() != Layer::output_size || dlayer->W.cols() != Layer::input_size)
+  {
+    throw std::runtime_error(fmt::format("layer {} has size {}x{} instead of {}x{}", index + 1, dlayer->W.rows(), dlayer->W.cols(), Layer::output_size, Layer::input_size));
+  }
+  layer.W = dlayer->W;
+  layer.b = dlayer->b;
+}
+
+template <typename StaticMLP, std::size_t... I>
+void load_static_layers(StaticMLP& S, const multilayer_perceptron& M, std::index_sequence<I...>)
+{
+  (load_static_layer(S.template layer<I>(), M.layers[I].get(), I), ...);
+}
+
+} // namespace detail
+
+/// Copies the parameters of M to the static model S. An exception is thrown if the layers of M do not match
+/// with the layers of S.
+template <typename... Layers>
+void load_static_mlp(static_mlp<Layers...>& S, const multilayer_perceptron& M)
+{
+  if (M.layers.size() != sizeof...(Layers))
+  {
+    throw std::runtime_error(fmt::format("expected a model with {} layers instead of {}", sizeof...(Layers), M.layers.size()));
+  }
+
+  detail::load_static_layers(S, M, std::make_index_sequence<sizeof...(Layers)>());
+}
+
+} // namespace nerva
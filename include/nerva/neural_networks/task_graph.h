@@ -0,0 +1,425 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/task_graph.h
+/// \brief Scheduling the backpropagation and optimization steps of a multilayer perceptron as a task graph.
+///
+/// In multilayer_perceptron the layers are backpropagated one by one, and the parameters are updated after the
+/// backpropagation has finished. But only the gradient DX of the input of a layer is needed by the previous
+/// layer. The gradients DW and Db and the update of the parameters of a layer can be done concurrently with the
+/// backpropagation of the previous layers. The class task_graph_executor expresses these dependencies as a
+/// directed acyclic graph of tasks, which is executed by a pool of worker threads with work stealing.
+///
+/// The tasks execute exactly the same computations as the sequential schedule, and every task runs in a thread
+/// outside of an OpenMP parallel region. The worker threads use the number of OpenMP threads of the thread that
+/// starts the execution, such that the matrix products use the same number of threads. Hence the results are
+/// bit-identical to those of the sequential schedule.
+
+#pragma once
+
+#include "nerva/neural_networks/dropout_layers.h"
+#include "nerva/neural_networks/multilayer_perceptron.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <omp.h>
+#include <thread>
+#include <vector>
+
+namespace nerva {
+
+/// A directed acyclic graph of tasks.
+class task_graph
+{
+  public:
+    using task = std::function<void()>;
+
+  protected:
+    std::vector<task> m_tasks;
+    std::vector<std::vector<std::size_t>> m_successors;
+    std::vector<std::size_t> m_predecessor_counts;
+
+  public:
+    /// Adds a task to the graph, and returns its index.
+    std::size_t add_task(task f)
+    {
+      m_tasks.push_back(std::move(f));
+      m_successors.emplace_back();
+      m_predecessor_counts.push_back(0);
+      return m_tasks.size() - 1;
+    }
+
+    /// Specifies that task j can only start after task i has finished.
+    void add_dependency(std::size_t i, std::size_t j)
+    {
+      m_successors[i].push_back(j);
+      m_predecessor_counts[j]++;
+    }
+
+    void clear()
+    {
+      m_tasks.clear();
+      m_successors.clear();
+      m_predecessor_counts.clear();
+    }
+
+    [[nodiscard]] std::size_t size() const
+    {
+      return m_tasks.size();
+    }
+
+    void run_task(std::size_t i) const
+    {
+      m_tasks[i]();
+    }
+
+    [[nodiscard]] const std::vector<std::size_t>& successors(std::size_t i) const
+    {
+      return m_successors[i];
+    }
+
+    [[nodiscard]] std::size_t predecessor_count(std::size_t i) const
+    {
+      return m_predecessor_counts[i];
+    }
+};
+
+/// A pool of worker threads that executes task graphs. Every worker has its own queue of tasks that are ready to
+/// run. A worker takes tasks from the front of its own queue, and if it is empty it steals tasks from the back of
+/// the queues of other workers. A worker without tasks waits until a task becomes ready. The thread that calls run
+/// acts as the first worker.
+class work_stealing_pool
+{
+  protected:
+    struct worker_queue
+    {
+      std::mutex mutex;
+      std::deque<std::size_t> tasks;
+    };
+
+    std::vector<std::thread> m_threads;
+    std::vector<std::unique_ptr<worker_queue>> m_queues;
+
+    const task_graph* m_graph = nullptr;
+    std::unique_ptr<std::atomic<std::size_t>[]> m_pending;  // the number of unfinished predecessors of the tasks
+    std::atomic<long> m_remaining{0};                       // the number of unfinished tasks
+    std::exception_ptr m_exception;
+
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_finish;
+    std::size_t m_generation = 0;
+    std::size_t m_active_workers = 0;
+    int m_omp_threads = 1;  // the number of OpenMP threads of the thread that calls run
+    bool m_stop = false;
+
+    // Idle workers wait on m_ready. The version is incremented when a task is pushed or when the execution ends,
+    // so a worker that reads the version before looking for a task cannot miss a wake-up.
+    std::mutex m_ready_mutex;
+    std::condition_variable m_ready;
+    std::size_t m_ready_version = 0;
+
+    void notify_ready(bool all)
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_ready_mutex);
+        m_ready_version++;
+      }
+      all ? m_ready.notify_all() : m_ready.notify_one();
+    }
+
+    void push(std::size_t worker, std::size_t i)
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_queues[worker]->mutex);
+        m_queues[worker]->tasks.push_front(i);
+      }
+      notify_ready(false);
+    }
+
+    bool pop(std::size_t worker, std::size_t& i)
+    {
+      std::lock_guard<std::mutex> lock(m_queues[worker]->mutex);
+      if (m_queues[worker]->tasks.empty())
+      {
+        return false;
+      }
+      i = m_queues[worker]->tasks.front();
+      m_queues[worker]->tasks.pop_front();
+      return true;
+    }
+
+    bool steal(std::size_t worker, std::size_t& i)
+    {
+      std::size_t n = m_queues.size();
+      for (std::size_t k = 1; k < n; k++)
+      {
+        auto& queue = *m_queues[(worker + k) % n];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+          i = queue.tasks.back();
+          queue.tasks.pop_back();
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void execute_tasks(std::size_t worker)
+    {
+      while (m_remaining > 0)
+      {
+        std::size_t version;
+        {
+          std::lock_guard<std::mutex> lock(m_ready_mutex);
+          version = m_ready_version;
+        }
+
+        std::size_t i;
+        if (!pop(worker, i) && !steal(worker, i))
+        {
+          std::unique_lock<std::mutex> lock(m_ready_mutex);
+          m_ready.wait(lock, [&]() { return m_ready_version != version || m_remaining <= 0; });
+          continue;
+        }
+
+        try
+        {
+          m_graph->run_task(i);
+        }
+        catch (...)
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          if (!m_exception)
+          {
+            m_exception = std::current_exception();
+          }
+          m_remaining = 0;  // the remaining tasks are cancelled
+          notify_ready(true);
+          return;
+        }
+
+        for (std::size_t j: m_graph->successors(i))
+        {
+          if (--m_pending[j] == 0)
+          {
+            push(worker, j);
+          }
+        }
+        if (--m_remaining == 0)
+        {
+          notify_ready(true);
+        }
+      }
+    }
+
+    void worker_loop(std::size_t worker)
+    {
+      std::size_t generation = 0;
+      while (true)
+      {
+        int omp_threads;
+        {
+          std::unique_lock<std::mutex> lock(m_mutex);
+          m_start.wait(lock, [&]() { return m_stop || m_generation != generation; });
+          if (m_stop)
+          {
+            return;
+          }
+          generation = m_generation;
+          omp_threads = m_omp_threads;
+        }
+
+        // N.B. the number of OpenMP threads is a per-thread setting, that is not inherited by std::thread
+        if (omp_get_max_threads() != omp_threads)
+        {
+          omp_set_num_threads(omp_threads);
+        }
+
+        execute_tasks(worker);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_active_workers == 0)
+        {
+          m_finish.notify_all();
+        }
+      }
+    }
+
+  public:
+    explicit work_stealing_pool(std::size_t thread_count = 2)
+    {
+      thread_count = std::max(thread_count, std::size_t(1));
+      for (std::size_t i = 0; i < thread_count; i++)
+      {
+        m_queues.push_back(std::make_unique<worker_queue>());
+      }
+      for (std::size_t i = 1; i < thread_count; i++)
+      {
+        m_threads.emplace_back([this, i]() { worker_loop(i); });
+      }
+    }
+
+    work_stealing_pool(const work_stealing_pool&) = delete;
+    work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+
+    ~work_stealing_pool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+      }
+      m_start.notify_all();
+      for (auto& thread: m_threads)
+      {
+        thread.join();
+      }
+    }
+
+    [[nodiscard]] std::size_t thread_count() const
+    {
+      return m_queues.size();
+    }
+
+    /// Executes the tasks of G, and returns when all of them have finished. If a task throws an exception, the
+    /// tasks that have not yet started are cancelled, and the exception is rethrown.
+    void run(const task_graph& G)
+    {
+      std::size_t n = G.size();
+      if (n == 0)
+      {
+        return;
+      }
+
+      m_graph = &G;
+      m_exception = nullptr;
+      m_pending = std::make_unique<std::atomic<std::size_t>[]>(n);
+      for (auto& queue: m_queues)
+      {
+        queue->tasks.clear();
+      }
+      std::size_t worker = 0;
+      for (std::size_t i = 0; i < n; i++)
+      {
+        m_pending[i] = G.predecessor_count(i);
+        if (G.predecessor_count(i) == 0)
+        {
+          m_queues[worker]->tasks.push_back(i);
+          worker = (worker + 1) % m_queues.size();
+        }
+      }
+      m_remaining = static_cast<long>(n);
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_active_workers = m_threads.size();
+        m_omp_threads = omp_get_max_threads();
+        m_generation++;
+      }
+      m_start.notify_all();
+
+      execute_tasks(0);
+
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_finish.wait(lock, [&]() { return m_active_workers == 0; });
+      if (m_exception)
+      {
+        std::rethrow_exception(m_exception);
+      }
+    }
+};
+
+/// Executes the backpropagation and optimization steps of a multilayer perceptron as a task graph. For a layer
+/// with index i there are the following tasks:
+///  - backpropagate_i: computes the gradients of layer i, and depends on the task of layer i+1 that computes DX
+///  - optimize_i: updates the parameters of layer i, and depends on backpropagate_i
+/// For dense linear layers in eigen mode backpropagate_i is split into a task that computes DZ, and two
+/// independent tasks that compute DW and Db, and DX.
+class task_graph_executor
+{
+  protected:
+    work_stealing_pool m_pool;
+    task_graph m_graph;
+
+    static bool is_splittable(neural_network_layer* layer)
+    {
+      auto llayer = dynamic_cast<linear_layer<eigen::matrix>*>(layer);
+      return llayer &&
+             llayer->plan.dense() == computation::eigen &&
+             !NervaMixedPrecision &&
+             !dynamic_cast<dropout_layer<eigen::matrix>*>(layer);
+    }
+
+  public:
+    explicit task_graph_executor(std::size_t thread_count = 2)
+      : m_pool(thread_count)
+    {}
+
+    /// Computes the same result as M.backpropagate(Y, DY) followed by M.optimize(eta).
+    void backpropagate_and_optimize(multilayer_perceptron& M, const eigen::matrix& Y, const eigen::matrix& DY, scalar eta)
+    {
+      NERVA_TIMER_START("backpropagate");
+      auto& layers = M.layers;
+      long n = static_cast<long>(layers.size());
+      std::vector<const eigen::matrix*> DZ(n, nullptr);
+
+      m_graph.clear();
+      std::size_t input_gradient_task = 0;  // the task that computes DX of layer i + 1
+      for (long i = n - 1; i >= 0; i--)
+      {
+        neural_network_layer* layer = layers[i].get();
+        const eigen::matrix* Yi = (i == n - 1) ? &Y : &layers[i + 1]->X;
+        const eigen::matrix* DYi = (i == n - 1) ? &DY : &layers[i + 1]->DX;
+
+        std::size_t optimize_task = m_graph.add_task([layer, eta]() { layer->optimize(eta); });
+
+        if (is_splittable(layer))
+        {
+          auto llayer = dynamic_cast<linear_layer<eigen::matrix>*>(layer);
+          std::size_t gradient_task = m_graph.add_task([llayer, Yi, DYi, &DZ, i]() { DZ[i] = &llayer->backpropagate_linear_gradient(*Yi, *DYi); });
+          std::size_t parameters_task = m_graph.add_task([llayer, &DZ, i]() { llayer->backpropagate_parameters(*DZ[i]); });
+          m_graph.add_dependency(gradient_task, parameters_task);
+          m_graph.add_dependency(parameters_task, optimize_task);
+          if (i < n - 1)
+          {
+            m_graph.add_dependency(input_gradient_task, gradient_task);
+          }
+
+          // the gradient of the input of the first layer is not needed
+          if (i > 0)
+          {
+            std::size_t input_task = m_graph.add_task([llayer, &DZ, i]() { llayer->backpropagate_input(*DZ[i]); });
+            m_graph.add_dependency(gradient_task, input_task);
+            m_graph.add_dependency(input_task, optimize_task);  // the update of W has to wait until DX has been computed
+            input_gradient_task = input_task;
+          }
+        }
+        else
+        {
+          std::size_t backpropagate_task = m_graph.add_task([layer, Yi, DYi]() { layer->backpropagate(*Yi, *DYi); });
+          m_graph.add_dependency(backpropagate_task, optimize_task);
+          if (i < n - 1)
+          {
+            m_graph.add_dependency(input_gradient_task, backpropagate_task);
+          }
+          input_gradient_task = backpropagate_task;
+        }
+      }
+
+      nerva_timer.suspend();  // the timer is not thread safe
+      m_pool.run(m_graph);
+      nerva_timer.resume();
+      NERVA_TIMER_STOP("backpropagate");
+    }
+};
+
+} // namespace nerva
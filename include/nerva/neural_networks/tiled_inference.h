@@ -0,0 +1,273 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file nerva/neural_networks/tiled_inference.h
+/// \brief Depth-first inference, that pushes tiles of rows through all layers at once.
+///
+/// The feedforward step of multilayer_perceptron applies each layer to the whole batch before the next layer
+/// starts. For narrow models the intermediate results then stream through main memory. The class
+/// tiled_inference splits the input into tiles of rows that are small enough to keep the intermediate results
+/// of a tile in the L2 cache, and pushes each tile through all layers. The tiles are processed in parallel.
+/// Since the computations are done row by row, the results are the same as those of multilayer_perceptron.
+
+#pragma once
+
+#include "nerva/neural_networks/batch_normalization_layers.h"
+#include "nerva/neural_networks/dropout_layers.h"
+#include "nerva/neural_networks/multilayer_perceptron.h"
+#include <algorithm>
+#include <functional>
+#include <typeinfo>
+#include <vector>
+
+namespace nerva {
+
+// The cache size that the intermediate results of a tile should fit into
+constexpr long tiled_inference_cache_size = 256 * 1024;
+
+class tiled_inference
+{
+  public:
+    // Computes the output Y of a layer for a tile X, without changing the state of the layer
+    using tile_function = std::function<void(const eigen::matrix& X, eigen::matrix& Y)>;
+
+  protected:
+    std::vector<tile_function> m_functions;
+    long m_tile_size = 0;
+    bool m_supported = true;
+
+    template <typename Matrix>
+    static void linear_product(const linear_layer<Matrix>& layer, const eigen::matrix& X, eigen::matrix& Z)
+    {
+      using eigen::row_repeat;
+
+      if constexpr (linear_layer<Matrix>::IsSparse)
+      {
+        Z.resize(X.rows(), layer.W.rows());
+        bool W_transposed = true;
+        mkl::dds_product(Z, X, layer.W, W_transposed);
+      }
+      else if (layer.plan.dense() == computation::eigen)
+      {
+        Z.noalias() = X * layer.W.transpose();
+      }
+      else
+      {
+        Z.resize(X.rows(), layer.W.rows());
+        mkl::ddd_product(Z, X, layer.W.transpose());
+      }
+      Z += row_repeat(layer.b, X.rows());
+    }
+
+    template <typename Matrix, typename ActivationFunction>
+    bool add_activation_layer(neural_network_layer* layer)
+    {
+      if (auto alayer = dynamic_cast<activation_layer<Matrix, ActivationFunction>*>(layer))
+      {
+        m_functions.emplace_back([alayer](const eigen::matrix& X, eigen::matrix& Y)
+        {
+          thread_local eigen::matrix Z;
+          linear_product(*alayer, X, Z);
+          if (linear_layer<Matrix>::IsSparse || alayer->plan.dense() == computation::eigen)
+          {
+            Y = alayer->act(Z);
+          }
+          else
+          {
+            mkl::apply_activation(alayer->act, Z, Y);
+          }
+        });
+        return true;
+      }
+      return false;
+    }
+
+    template <typename Matrix>
+    bool add_linear_layer(neural_network_layer* layer)
+    {
+      if (auto dlayer = dynamic_cast<dropout_layer<Matrix>*>(layer))
+      {
+        if (dlayer->training)
+        {
+          return false;
+        }
+      }
+
+      if (add_activation_layer<Matrix, relu_activation>(layer) ||
+          add_activation_layer<Matrix, leaky_relu_activation>(layer) ||
+          add_activation_layer<Matrix, all_relu_activation>(layer) ||
+          add_activation_layer<Matrix, trimmed_relu_activation>(layer) ||
+          add_activation_layer<Matrix, srelu_activation>(layer) ||
+          add_activation_layer<Matrix, sigmoid_activation>(layer) ||
+          add_activation_layer<Matrix, hyperbolic_tangent_activation>(layer))
+      {
+        return true;
+      }
+      else if (auto slayer = dynamic_cast<softmax_layer<Matrix>*>(layer))
+      {
+        m_functions.emplace_back([slayer](const eigen::matrix& X, eigen::matrix& Y)
+        {
+          thread_local eigen::matrix Z;
+          linear_product(*slayer, X, Z);
+          stable_softmax_rowwise(Z, Y);
+        });
+        return true;
+      }
+      else if (auto llayer = dynamic_cast<log_softmax_layer<Matrix>*>(layer))
+      {
+        m_functions.emplace_back([llayer](const eigen::matrix& X, eigen::matrix& Y)
+        {
+          thread_local eigen::matrix Z;
+          thread_local eigen::matrix S;
+          linear_product(*llayer, X, Z);
+          stable_log_softmax_rowwise(Z, Y, S);
+        });
+        return true;
+      }
+      else if (typeid(*layer) == typeid(linear_layer<Matrix>) || dynamic_cast<linear_dropout_layer<Matrix>*>(layer))
+      {
+        auto llayer = dynamic_cast<linear_layer<Matrix>*>(layer);
+        m_functions.emplace_back([llayer](const eigen::matrix& X, eigen::matrix& Y)
+        {
+          linear_product(*llayer, X, Y);
+        });
+        return true;
+      }
+      return false;
+    }
+
+    void add_scale_and_shift(const eigen::matrix& scale, const eigen::matrix& shift)
+    {
+      m_functions.emplace_back([scale, shift](const eigen::matrix& X, eigen::matrix& Y)
+      {
+        using eigen::hadamard;
+        using eigen::row_repeat;
+
+        auto N = X.rows();
+        Y = hadamard(row_repeat(scale, N), X) + row_repeat(shift, N);
+      });
+    }
+
+    bool add_layer(neural_network_layer* layer)
+    {
+      if (add_linear_layer<eigen::matrix>(layer) || add_linear_layer<mkl::sparse_matrix_csr<scalar>>(layer))
+      {
+        return true;
+      }
+      else if (auto blayer = dynamic_cast<batch_normalization_layer*>(layer))
+      {
+        if (blayer->training)
+        {
+          return false;
+        }
+        eigen::matrix scale;
+        eigen::matrix shift;
+        blayer->inference_scale_and_shift(scale, shift);
+        add_scale_and_shift(scale, shift);
+        return true;
+      }
+      else if (auto alayer = dynamic_cast<affine_layer*>(layer))
+      {
+        m_functions.emplace_back([alayer](const eigen::matrix& X, eigen::matrix& Y)
+        {
+          using eigen::hadamard;
+          using eigen::row_repeat;
+
+          auto N = X.rows();
+          Y = hadamard(row_repeat(alayer->gamma, N), X) + row_repeat(alayer->beta, N);
+        });
+        return true;
+      }
+      return false;
+    }
+
+  public:
+    /// Prepares the inference for M. If tile_size is 0, the tile size is chosen such that the intermediate results
+    /// of a tile fit into tiled_inference_cache_size. The parameters of the layers are used by reference, except for
+    /// the statistics of batch normalization layers.
+    explicit tiled_inference(multilayer_perceptron& M, long tile_size = 0)
+      : m_tile_size(tile_size)
+    {
+      // the results of mixed precision computations are not reproduced
+      if (NervaMixedPrecision)
+      {
+        m_supported = false;
+        return;
+      }
+
+      long max_width = M.layers.front()->X.cols();
+      for (auto& layer: M.layers)
+      {
+        if (!add_layer(layer.get()))
+        {
+          m_supported = false;
+          return;
+        }
+        max_width = std::max(max_width, static_cast<long>(layer->X.cols()));
+      }
+
+      if (m_tile_size <= 0)
+      {
+        // the input and the output of a layer must fit into the cache
+        long rows = tiled_inference_cache_size / (2 * max_width * static_cast<long>(sizeof(scalar)));
+        m_tile_size = std::clamp(rows - rows % 8, 8L, 256L);
+      }
+    }
+
+    /// Returns false if M contains layers that are not supported. These are layers in training mode, and layers
+    /// without an inference implementation.
+    [[nodiscard]] bool supported() const
+    {
+      return m_supported;
+    }
+
+    [[nodiscard]] long tile_size() const
+    {
+      return m_tile_size;
+    }
+
+    /// Computes the output Y of M for the input X.
+    template <typename Matrix>
+    void feedforward(const Matrix& X, eigen::matrix& Y) const
+    {
+      if (!m_supported)
+      {
+        throw std::runtime_error("tiled_inference: the model contains layers that are not supported");
+      }
+
+      long N = X.rows();
+      long tile_count = (N + m_tile_size - 1) / m_tile_size;
+      std::vector<eigen::matrix> outputs(tile_count);
+
+#pragma omp parallel
+      {
+        eigen::matrix A;
+        eigen::matrix B;
+
+#pragma omp for schedule(dynamic)
+        for (long t = 0; t < tile_count; t++)
+        {
+          long i0 = t * m_tile_size;
+          long n = std::min(m_tile_size, N - i0);
+          A = X.middleRows(i0, n);
+          for (std::size_t i = 0; i + 1 < m_functions.size(); i++)
+          {
+            m_functions[i](A, B);
+            std::swap(A, B);
+          }
+          m_functions.back()(A, outputs[t]);
+        }
+      }
+
+      Y.resize(N, outputs.front().cols());
+      for (long t = 0; t < tile_count; t++)
+      {
+        Y.middleRows(t * m_tile_size, outputs[t].rows()) = outputs[t];
+      }
+    }
+};
+
+} // namespace nerva
@@ -9,18 +9,26 @@
 
 #pragma once
 
+#include "nerva/neural_networks/activation_checkpointing.h"
+#include "nerva/neural_networks/autotuning.h"
 #include "nerva/neural_networks/check_gradients.h"
 #include "nerva/datasets/dataset.h"
 #include "nerva/neural_networks/eigen.h"
+#include "nerva/neural_networks/fused_backpropagation.h"
 #include "nerva/neural_networks/loss_functions.h"
+#include "nerva/neural_networks/mixed_precision.h"
 #include "nerva/neural_networks/mlp_algorithms.h"
 #include "nerva/neural_networks/nerva_timer.h"
 #include "nerva/neural_networks/sgd_options.h"
+#include "nerva/neural_networks/task_graph.h"
+#include "nerva/neural_networks/tiled_inference.h"
 #include "nerva/neural_networks/weights.h"
 #include "nerva/utilities/logger.h"
 #include "nerva/utilities/print.h"
+#include "nerva/utilities/stopwatch.h"
 #include "nerva/utilities/timer.h"
 #include <algorithm>
+#include <optional>
 #include "fmt/format.h"
 
 namespace nerva {
@@ -37,45 +45,75 @@ long output_count(const Matrix& T)
   return T.cols();
 }
 
+/// Returns the fraction of the examples in Xtest that are classified correctly. The examples are processed one
+/// batch of Q examples at a time, and the last batch may be smaller. The evaluation uses the buffers M.eval_buffers,
+/// so the buffers that are used for training are not changed, and every batch size has its own buffers.
 template <typename EigenMatrix>
-auto compute_accuracy(multilayer_perceptron& M, const EigenMatrix& Xtest, const EigenMatrix& Ttest, long Q) -> double
+auto compute_batch_accuracy(multilayer_perceptron& M, const EigenMatrix& Xtest, const EigenMatrix& Ttest, long Q) -> double
 {
-  nerva_timer.suspend();
-
-  auto is_correct = [](const auto& y, const auto& t)
-  {
-    auto i = std::max_element(y.begin(), y.end()) - y.begin(); // i is the index of the largest element
-    return t[i] == 1;
-  };
-
   long N = example_count(Xtest);
   long L = output_count(Ttest);
-  auto K = N / Q;        // the number of batches
+  auto K = (N + Q - 1) / Q;  // the number of batches, including a partial one
   eigen::matrix Ybatch(Q, L);
   std::size_t total_correct = 0;
 
   for (long k = 0; k < K; k++)
   {
-    auto batch = Eigen::seqN(k * Q, Q);
+    long batch_size = std::min(Q, N - k * Q);
+    scoped_batch_buffers buffers(M.layers, M.eval_buffers[batch_size]);
+    auto batch = Eigen::seqN(k * Q, batch_size);
     auto Xbatch = Xtest(batch, Eigen::indexing::all);
     auto Tbatch = Ttest(batch, Eigen::indexing::all);
     M.feedforward(Xbatch, Ybatch);
-    for (long i = 0; i < Q; i++)
+    for (long i = 0; i < Ybatch.rows(); i++)
     {
       const auto& y = Ybatch.row(i);
       const auto& t = Tbatch.row(i);
-      if (is_correct(y, t))
+      if (is_correct_classification(y, t))
       {
         total_correct++;
       }
     }
   }
 
-  nerva_timer.resume();
-
   return static_cast<double>(total_correct) / N;
 }
 
+/// Returns the fraction of the examples in Xtest that are classified correctly. If possible, the examples are
+/// processed in cache sized tiles that are pushed through all layers at once, see tiled_inference. Otherwise they
+/// are processed in batches of Q examples, see compute_batch_accuracy.
+template <typename EigenMatrix>
+auto compute_accuracy(multilayer_perceptron& M, const EigenMatrix& Xtest, const EigenMatrix& Ttest, long Q) -> double
+{
+  nerva_timer.suspend();
+
+  long N = example_count(Xtest);
+  std::size_t total_correct = 0;
+
+  tiled_inference M_tiled(M);
+  if (M_tiled.supported() && N > 0)
+  {
+    eigen::matrix Y;
+    M_tiled.feedforward(Xtest, Y);
+#pragma omp parallel for reduction(+:total_correct)
+    for (long i = 0; i < N; i++)
+    {
+      if (is_correct_classification(Y.row(i), Ttest.row(i)))
+      {
+        total_correct++;
+      }
+    }
+    nerva_timer.resume();
+    return static_cast<double>(total_correct) / N;
+  }
+
+  double result = compute_batch_accuracy(M, Xtest, Ttest, Q);
+  nerva_timer.resume();
+  return result;
+}
+
+/// Returns the average loss of M on the examples in X. The examples are processed in batches of Q examples, and
+/// the last batch may be smaller. The evaluation uses the buffers M.eval_buffers.
 inline
 auto compute_loss(multilayer_perceptron& M, const std::shared_ptr<loss_function>& loss, const eigen::matrix& X, const eigen::matrix& T, long Q) -> double
 {
@@ -89,13 +127,15 @@ auto compute_loss(multilayer_perceptron& M, const std::shared_ptr<loss_function>
 
   long N = example_count(X);
   long L = output_count(T);
-  auto K = N / Q;    // the number of batches
+  auto K = (N + Q - 1) / Q;  // the number of batches, including a partial one
   double total_loss = 0.0;
   eigen::matrix Ybatch(Q, L);
 
   for (long k = 0; k < K; k++)
   {
-    auto batch = Eigen::seqN(k * Q, Q);
+    long batch_size = std::min(Q, N - k * Q);
+    scoped_batch_buffers buffers(M.layers, M.eval_buffers[batch_size]);
+    auto batch = Eigen::seqN(k * Q, batch_size);
     auto Xbatch = X(batch, Eigen::indexing::all);
     auto Tbatch = T(batch, Eigen::indexing::all);
     M.feedforward(Xbatch, Ybatch);
@@ -115,16 +155,23 @@ void compute_statistics(multilayer_perceptron& M,
                         long Q, // the batch size
                         int epoch,
                         bool full_statistics,
-                        double elapsed_seconds = -1.0
+                        double elapsed_seconds = -1.0,
+                        double running_loss = -1.0 // the average of the batch losses during the epoch
 )
 {
   std::cout << fmt::format("epoch {:3d}", epoch + 1);
+  if (running_loss >= 0)
+  {
+    std::cout << fmt::format(" running loss: {:.8f}", running_loss);
+  }
   if (full_statistics)
   {
+    set_training_mode(M, false);
     auto training_loss = compute_loss(M, loss, data.Xtrain, data.Ttrain, Q);
     auto training_accuracy = compute_accuracy(M, data.Xtrain, data.Ttrain, Q);
     auto test_accuracy = compute_accuracy(M, data.Xtest, data.Ttest, Q);
     std::cout << fmt::format(" lr: {:.8f}  loss: {:.8f}  train accuracy: {:.8f}  test accuracy: {:.8f}", lr, training_loss, training_accuracy, test_accuracy);
+    set_training_mode(M, true);
   }
   if (elapsed_seconds >= 0)
   {
@@ -133,6 +180,47 @@ void compute_statistics(multilayer_perceptron& M,
   std::cout << std::endl;
 }
 
+/// Compares the test accuracy and the inference time of the trained model M with and without mixed precision.
+/// Tiled inference does not support mixed precision, so both precisions are evaluated batch by batch. Each
+/// measurement is preceded by an untimed warm-up pass.
+template <typename DataSet>
+void print_mixed_precision_inference_report(multilayer_perceptron& M, const DataSet& data, long Q)
+{
+  bool mixed_precision = NervaMixedPrecision;
+  set_training_mode(M, false);
+
+  auto measure = [&](bool bf16)
+  {
+    NervaMixedPrecision = bf16;
+    compute_batch_accuracy(M, data.Xtest, data.Ttest, Q);
+    utilities::stopwatch watch;
+    double accuracy = compute_batch_accuracy(M, data.Xtest, data.Ttest, Q);
+    return std::make_pair(accuracy, watch.seconds());
+  };
+
+  auto [fp32_accuracy, fp32_seconds] = measure(false);
+  auto [bf16_accuracy, bf16_seconds] = measure(true);
+
+  NervaMixedPrecision = mixed_precision;
+  set_training_mode(M, true);
+
+  std::cout << fmt::format("inference test accuracy fp32: {:.8f}  bf16: {:.8f}  delta: {:+.8f}\n", fp32_accuracy, bf16_accuracy, bf16_accuracy - fp32_accuracy);
+  std::cout << fmt::format("inference time fp32: {:.8f}s  bf16: {:.8f}s  speedup: {:.4f}\n", fp32_seconds, bf16_seconds, fp32_seconds / bf16_seconds);
+}
+
+/// Compares a mixed precision training run with an fp32 training run of the same model. The results are the pairs
+/// (test accuracy, training time) that are returned by stochastic_gradient_descent_algorithm::run.
+inline
+void print_mixed_precision_training_report(const std::pair<double, double>& fp32_result, const std::pair<double, double>& bf16_result, unsigned int epochs)
+{
+  auto [fp32_accuracy, fp32_seconds] = fp32_result;
+  auto [bf16_accuracy, bf16_seconds] = bf16_result;
+  fp32_seconds /= epochs;
+  bf16_seconds /= epochs;
+  std::cout << fmt::format("training test accuracy fp32: {:.8f}  bf16: {:.8f}  delta: {:+.8f}\n", fp32_accuracy, bf16_accuracy, bf16_accuracy - fp32_accuracy);
+  std::cout << fmt::format("training time per epoch fp32: {:.8f}s  bf16: {:.8f}s  speedup: {:.4f}\n", fp32_seconds, bf16_seconds, fp32_seconds / bf16_seconds);
+}
+
 template <typename DataSet>
 class stochastic_gradient_descent_algorithm
 {
@@ -144,6 +232,12 @@ class stochastic_gradient_descent_algorithm
     scalar learning_rate;
     std::mt19937& rng;
     utilities::map_timer timer;
+    scalar batch_loss = 0;   // the loss of the current batch, as computed during training
+    double epoch_loss = 0;   // the sum of the batch losses in the current epoch
+    loss_scaler scaler;      // only used in mixed precision mode
+    std::unique_ptr<task_graph_executor> executor;  // only used if options.task_graph_threads > 0
+    std::unique_ptr<activation_checkpointing> checkpointing;  // only used if options.activation_memory_budget > 0
+    sampled_softmax_layer* sampled_softmax = nullptr;  // only used if the last layer is a sampled softmax layer
 
   public:
     stochastic_gradient_descent_algorithm(multilayer_perceptron& M_,
@@ -158,8 +252,57 @@ class stochastic_gradient_descent_algorithm
         options(options_),
         loss(loss_),
         learning_rate(learning_rate_),
-        rng(rng_)
-    {}
+        rng(rng_),
+        scaler(options_.loss_scale)
+    {
+      for (std::size_t i = 1; i < M.layers.size(); i++)
+      {
+        if (dynamic_cast<embedding_layer*>(M.layers[i].get()))
+        {
+          throw std::runtime_error(fmt::format("an embedding layer must be the first layer, but it is layer {}", i + 1));
+        }
+      }
+      if (options.task_graph_threads > 0)
+      {
+        executor = std::make_unique<task_graph_executor>(options.task_graph_threads);
+      }
+      if (options.fused_backpropagation)
+      {
+        if (options.gradient_step > 0)
+        {
+          throw std::runtime_error("fused backpropagation cannot be combined with gradient checks, since the weight gradients are not stored");
+        }
+        if (NervaMixedPrecision)
+        {
+          throw std::runtime_error("fused backpropagation cannot be combined with mixed precision");
+        }
+        if (executor)
+        {
+          throw std::runtime_error("fused backpropagation cannot be combined with a task graph");
+        }
+        release_weight_gradients(M);
+      }
+      if (options.activation_memory_budget > 0)
+      {
+        if (executor || options.fused_backpropagation)
+        {
+          throw std::runtime_error("activation checkpointing cannot be combined with a task graph or fused backpropagation");
+        }
+        checkpointing = std::make_unique<activation_checkpointing>(M, static_cast<std::size_t>(options.activation_memory_budget * 1024 * 1024));
+      }
+      sampled_softmax = dynamic_cast<sampled_softmax_layer*>(M.layers.back().get());
+      if (sampled_softmax)
+      {
+        if (!dynamic_cast<softmax_cross_entropy_loss*>(loss.get()))
+        {
+          throw std::runtime_error("a sampled softmax layer must be combined with the softmax cross entropy loss");
+        }
+        if (options.gradient_step > 0 || NervaMixedPrecision || options.fused_backpropagation)
+        {
+          throw std::runtime_error("a sampled softmax layer cannot be combined with gradient checks, mixed precision or fused backpropagation");
+        }
+      }
+    }
 
     virtual ~stochastic_gradient_descent_algorithm() = default;
 
@@ -195,14 +338,32 @@ class stochastic_gradient_descent_algorithm
       long L = output_count(data.Ttrain);
       std::vector<long> I(N);
       std::iota(I.begin(), I.end(), 0);
-      eigen::matrix Y(options.batch_size, L);
-      long K = N / options.batch_size; // the number of batches
+      long Q = options.batch_size;
+      long K = options.drop_last ? N / Q : (N + Q - 1) / Q; // the number of batches
+      long eval_batch_size = options.eval_batch_size > 0 ? options.eval_batch_size : Q;
+
+      // A final partial batch uses separate buffers, such that the buffers of the full batches are not reallocated
+      eigen::matrix Y_full(Q, L);
+      eigen::matrix DY_full(Q, L);
+      eigen::matrix Y_partial;
+      eigen::matrix DY_partial;
+      batch_buffer_set partial_batch_buffers;
+
+      if (!options.autotune_cache.empty())
+      {
+        autotune(M, data.Xtrain.topRows(std::min(Q, N)), options.autotune_cache);
+        if (options.fused_backpropagation)
+        {
+          release_weight_gradients(M);  // the weight gradients were computed by the benchmarks
+        }
+      }
 
-      compute_statistics(M, learning_rate, loss, data, options.batch_size, -1, options.statistics, 0.0);
+      compute_statistics(M, learning_rate, loss, data, eval_batch_size, -1, options.statistics, 0.0);
 
       for (unsigned int epoch = 0; epoch < options.epochs; ++epoch)
       {
         on_start_epoch(epoch);
+        reset_routing_statistics(M);  // the routing statistics of mixture of experts layers cover a single epoch
         timer.start("epoch");
 
         if (options.shuffle)
@@ -210,27 +371,63 @@ class stochastic_gradient_descent_algorithm
           std::shuffle(I.begin(), I.end(), rng);      // shuffle the examples at the start of each epoch
         }
 
-        eigen::matrix DY(L, options.batch_size);
+        epoch_loss = 0;
+        long epoch_examples = 0;
 
         for (long batch_index = 0; batch_index < K; batch_index++)
         {
           on_start_batch(batch_index);
 
-          eigen::eigen_slice batch(I.begin() + batch_index * options.batch_size, options.batch_size);
+          long batch_size = std::min(Q, N - batch_index * Q);
+          bool partial = batch_size < Q;
+          std::optional<scoped_batch_buffers> partial_buffers;
+          if (partial)
+          {
+            partial_buffers.emplace(M.layers, partial_batch_buffers);
+          }
+          eigen::matrix& Y = partial ? Y_partial : Y_full;
+          eigen::matrix& DY = partial ? DY_partial : DY_full;
+
+          eigen::eigen_slice batch(I.begin() + batch_index * Q, batch_size);
           auto X = data.Xtrain(batch, Eigen::indexing::all);
           auto T = data.Ttrain(batch, Eigen::indexing::all);
-          M.feedforward(X, Y);
+          if (sampled_softmax)
+          {
+            sampled_softmax->sample(T);
+          }
+          if (checkpointing)
+          {
+            checkpointing->feedforward(M, X, Y);
+          }
+          else
+          {
+            M.feedforward(X, Y);
+          }
 
+          scalar loss_scale = 1;
           if (options.gradient_step > 0)
           {
-            DY = loss->gradient(Y, T);
+            batch_loss = loss->value_and_gradient(Y, T, DY);
             auto f = [this, &Y, &T]() { return loss->value(Y, T); };
             check_gradient("DY", f, Y, DY, options.gradient_step);
           }
           else
           {
-            DY = loss->gradient(Y, T) / options.batch_size;  // pytorch does it like this
+            if (NervaMixedPrecision)
+            {
+              loss_scale = scaler.scale;
+            }
+            if (sampled_softmax)
+            {
+              batch_loss = loss->value_and_gradient(Y, sampled_softmax->T, DY, loss_scale / batch_size);
+            }
+            else
+            {
+              batch_loss = loss->value_and_gradient(Y, T, DY, loss_scale / batch_size);  // pytorch scales the gradient like this
+            }
           }
+          epoch_loss += batch_loss;
+          epoch_examples += batch_size;
 
           if (options.debug)
           {
@@ -239,6 +436,7 @@ class stochastic_gradient_descent_algorithm
             print_numpy_matrix("X", X);
             print_numpy_matrix("Y", Y);
             print_numpy_matrix("DY", DY);
+            std::cout << "loss: " << batch_loss << '\n';
           }
 
           if (has_nan(Y))
@@ -253,27 +451,68 @@ class stochastic_gradient_descent_algorithm
             throw std::runtime_error("the gradient DY contains NaN values");
           }
 
-          M.backpropagate(Y, DY);
-
-          if (options.gradient_step > 0)
+          if (options.fused_backpropagation)
           {
-            M.check_gradients(loss, T, options.gradient_step);
+            fused_backpropagate_and_optimize(M, Y, DY, learning_rate);
+          }
+          else if (executor && !NervaMixedPrecision && options.gradient_step <= 0)
+          {
+            executor->backpropagate_and_optimize(M, Y, DY, learning_rate);
+          }
+          else
+          {
+            if (checkpointing)
+            {
+              checkpointing->backpropagate(M, Y, DY);
+            }
+            else
+            {
+              M.backpropagate(Y, DY);
+            }
+
+            if (options.gradient_step > 0)
+            {
+              M.check_gradients(loss, T, options.gradient_step);
+            }
+
+            if (NervaMixedPrecision)
+            {
+              // skip the update if the gradients overflowed, and otherwise undo the loss scaling
+              if (scaler.update(!has_finite_gradients(M)))
+              {
+                scale_gradients(M, 1 / loss_scale);
+                M.optimize(learning_rate);
+              }
+            }
+            else
+            {
+              M.optimize(learning_rate);
+            }
           }
 
-          M.optimize(learning_rate);
-
+          partial_buffers.reset();
           on_end_batch(batch_index);
         }
 
         double seconds = timer.stop("epoch");
-        compute_statistics(M, learning_rate, loss, data, options.batch_size, epoch, options.statistics, seconds);
+        compute_statistics(M, learning_rate, loss, data, eval_batch_size, epoch, options.statistics, seconds, epoch_loss / epoch_examples);
 
         on_end_epoch(epoch);
       }
 
-      double test_accuracy = compute_accuracy(M, data.Xtest, data.Ttest, options.batch_size);
+      set_training_mode(M, false);
+      double test_accuracy = compute_accuracy(M, data.Xtest, data.Ttest, eval_batch_size);
+      set_training_mode(M, true);
       double training_time = timer.total_seconds("epoch");
       std::cout << fmt::format("Total training time for the {} epochs: {:.8f}s\n", options.epochs, training_time);
+      if (NervaMixedPrecision)
+      {
+        std::cout << scaler.to_string() << '\n';
+      }
+      if (checkpointing)
+      {
+        std::cout << checkpointing->to_string() << '\n';
+      }
 
       on_end_training();
 
@@ -31,6 +31,36 @@ class Nesterov(Optimizer):
         return f'Nesterov({self.momentum})'
 
 
+class Adam(Optimizer):
+    def __init__(self, beta1: float = 0.9, beta2: float = 0.999, epsilon: float = 1e-8):
+        self.beta1 = beta1
+        self.beta2 = beta2
+        self.epsilon = epsilon
+
+    def __str__(self):
+        return f'Adam(beta1={self.beta1}, beta2={self.beta2}, epsilon={self.epsilon})'
+
+
+class AdamW(Optimizer):
+    def __init__(self, beta1: float = 0.9, beta2: float = 0.999, epsilon: float = 1e-8, weight_decay: float = 0.01):
+        self.beta1 = beta1
+        self.beta2 = beta2
+        self.epsilon = epsilon
+        self.weight_decay = weight_decay
+
+    def __str__(self):
+        return f'AdamW(beta1={self.beta1}, beta2={self.beta2}, epsilon={self.epsilon}, weight_decay={self.weight_decay})'
+
+
+class RMSProp(Optimizer):
+    def __init__(self, rho: float = 0.9, epsilon: float = 1e-8):
+        self.rho = rho
+        self.epsilon = epsilon
+
+    def __str__(self):
+        return f'RMSProp(rho={self.rho}, epsilon={self.epsilon})'
+
+
 def parse_optimizer(text: str) -> Optimizer:
     func = parse_function_call(text)
     if func.name =='GradientDescent':
@@ -41,4 +71,10 @@ def parse_optimizer(text: str) -> Optimizer:
     elif func.name =='Nesterov':
         momentum = func.as_float('momentum')
         return Nesterov(momentum)
+    elif func.name =='Adam':
+        return Adam(func.as_float('beta1', 0.9), func.as_float('beta2', 0.999), func.as_float('epsilon', 1e-8))
+    elif func.name =='AdamW':
+        return AdamW(func.as_float('beta1', 0.9), func.as_float('beta2', 0.999), func.as_float('epsilon', 1e-8), func.as_float('weight_decay', 0.01))
+    elif func.name =='RMSProp':
+        return RMSProp(func.as_float('rho', 0.9), func.as_float('epsilon', 1e-8))
     raise RuntimeError(f"could not parse optimizer '{text}'")
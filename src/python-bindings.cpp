@@ -419,6 +419,8 @@ PYBIND11_MODULE(nervalibrowwise, m)
   m.def("save_model_weights_to_npy", save_model_weights_to_npy);
   m.def("print_model_info", print_model_info);
   m.def("renew_dropout_masks", [](multilayer_perceptron& M) { renew_dropout_masks(M, nerva_rng); });
+  m.def("set_training_mode", set_training_mode);
+  m.def("fold_normalization_layers", fold_normalization_layers);
 
   /////////////////////////////////////////////////////////////////////////
   //                       weights
@@ -443,11 +445,17 @@ PYBIND11_MODULE(nervalibrowwise, m)
   py::class_<sgd_options>(m, "sgd_options")
     .def(py::init<>(), py::return_value_policy::copy)
     .def_readwrite("batch_size", &sgd_options::batch_size)
+    .def_readwrite("eval_batch_size", &sgd_options::eval_batch_size)
+    .def_readwrite("drop_last", &sgd_options::drop_last)
     .def_readwrite("epochs", &sgd_options::epochs)
     .def_readwrite("debug", &sgd_options::debug)
     .def_readwrite("clip", &sgd_options::clip)
     .def_readwrite("shuffle", &sgd_options::shuffle)
     .def_readwrite("statistics", &sgd_options::statistics)
+    .def_readwrite("loss_scale", &sgd_options::loss_scale)
+    .def_readwrite("task_graph_threads", &sgd_options::task_graph_threads)
+    .def_readwrite("fused_backpropagation", &sgd_options::fused_backpropagation)
+    .def_readwrite("activation_memory_budget", &sgd_options::activation_memory_budget)
     .def("info", &sgd_options::info)
     ;
 
@@ -471,6 +479,7 @@ PYBIND11_MODULE(nervalibrowwise, m)
   m.def("compute_statistics", compute_statistics<datasets::dataset_view>);
   m.def("set_num_threads", mkl_set_num_threads);
   m.def("set_nerva_computation", set_nerva_computation);
+  m.def("set_mixed_precision", [](bool enabled) { NervaMixedPrecision = enabled; });
 
   /////////////////////////////////////////////////////////////////////////
   //                       activation functions
@@ -0,0 +1,96 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file activation_checkpointing_test.cpp
+/// \brief Tests for activation checkpointing.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/activation_checkpointing.h"
+#include "mlp_test_fixture.h"
+#include <iostream>
+
+using namespace nerva;
+
+// A deeper model than make_test_model, such that there are segments of layers that can be recomputed
+multilayer_perceptron make_model(long N)
+{
+  long D = test_input_size;
+  long K = 8;
+  long L = test_output_size;
+
+  multilayer_perceptron M;
+  auto layer1 = std::make_shared<dense_relu_layer>(D, K, N);
+  auto layer2 = std::make_shared<dense_sigmoid_layer>(K, K, N);
+  auto layer3 = std::make_shared<dense_hyperbolic_tangent_layer>(K, K, N);
+  auto layer4 = std::make_shared<dense_batch_normalization_layer>(K, N);
+  auto layer5 = std::make_shared<dense_relu_layer>(K, K, N);
+  auto layer6 = std::make_shared<dense_linear_layer>(K, K, N);
+  auto layer7 = std::make_shared<dense_log_softmax_layer>(K, L, N);
+  set_linear_layer_optimizer(*layer1, "Momentum(0.9)");
+  set_linear_layer_optimizer(*layer2, "GradientDescent");
+  set_linear_layer_optimizer(*layer3, "GradientDescent");
+  set_batch_normalization_layer_optimizer(*layer4, "GradientDescent");
+  set_linear_layer_optimizer(*layer5, "Nesterov(0.9)");
+  set_linear_layer_optimizer(*layer6, "GradientDescent");
+  set_linear_layer_optimizer(*layer7, "GradientDescent");
+  M.layers = { layer1, layer2, layer3, layer4, layer5, layer6, layer7 };
+  return M;
+}
+
+TEST_CASE("test_activation_checkpointing")
+{
+  long N = 5;
+  auto [M1, M2] = make_identical_models(make_model, N);
+
+  // the batch normalization layer and the layer after it are always checkpoints
+  activation_checkpointing checkpointing(M2, std::vector<bool>{true});
+  std::vector<bool> expected = {true, false, false, true, true, false, false};
+  CHECK_EQ(checkpointing.checkpoints(), expected);
+  CHECK_EQ(checkpointing.recomputed_layers(), 6);
+  CHECK(checkpointing.peak_memory() < checkpointing.full_memory());
+
+  for (int i = 0; i < 3; i++)
+  {
+    eigen::matrix X = eigen::random_matrix(N, test_input_size, -1, 1);
+    eigen::matrix DY = eigen::random_matrix(N, test_output_size, -1, 1);
+    eigen::matrix Y1;
+    eigen::matrix Y2;
+
+    M1.feedforward(X, Y1);
+    M1.backpropagate(Y1, DY);
+
+    checkpointing.feedforward(M2, X, Y2);
+    CHECK_EQ(M2.layers[1]->X.size(), 0);
+    CHECK_EQ(M2.layers[6]->activation_size(), 0);
+    checkpointing.backpropagate(M2, Y2, DY);
+    CHECK_EQ(M2.layers[1]->X.size(), 0);
+
+    // the recomputed activations are bit-identical, and so are the gradients
+    CHECK_EQ(Y1, Y2);
+    CHECK_EQ(max_gradient_difference(M1, M2), 0);
+    CHECK_EQ(M1.layers[1]->DX, M2.layers[1]->DX);
+
+    M1.optimize(0.01);
+    M2.optimize(0.01);
+  }
+}
+
+TEST_CASE("test_activation_checkpointing_budget")
+{
+  multilayer_perceptron M = make_model(100);
+
+  activation_checkpointing unlimited(M, std::numeric_limits<std::size_t>::max());
+  CHECK_EQ(unlimited.recomputed_layers(), 0);
+  CHECK_EQ(unlimited.peak_memory(), unlimited.full_memory());
+
+  std::size_t budget = unlimited.full_memory() * 4 / 5;
+  activation_checkpointing limited(M, budget);
+  CHECK(limited.peak_memory() <= budget);
+  CHECK(limited.recomputed_layers() > 0);
+  std::cout << limited.to_string() << std::endl;
+}
@@ -0,0 +1,109 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file activation_function_test.cpp
+/// \brief Tests for activation functions.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/activation_functions.h"
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+using namespace nerva;
+
+// Returns the error of y with respect to the exact value in units of the last place (ulp)
+inline
+double ulp_error(scalar y, double exact)
+{
+  auto y_exact = static_cast<scalar>(exact);
+  auto ulp = std::nextafter(std::fabs(y_exact), std::numeric_limits<scalar>::infinity()) - std::fabs(y_exact);
+  return std::fabs(y - exact) / ulp;
+}
+
+// Checks the accuracy bounds that are documented in activation_functions.h
+TEST_CASE("test_activation_accuracy")
+{
+  long n = 100001;
+  eigen::matrix X(1, n);
+  for (long i = 0; i < n; i++)
+  {
+    X(0, i) = scalar(-20.0 + 40.0 * i / (n - 1));
+  }
+
+  eigen::matrix Y_tanh = Hyperbolic_tangent(X);
+  eigen::matrix Y_sigmoid = Sigmoid(X);
+
+  double tanh_error = 0;
+  double sigmoid_error = 0;
+  for (long i = 0; i < n; i++)
+  {
+    double x = X(0, i);
+    tanh_error = std::max(tanh_error, ulp_error(Y_tanh(0, i), std::tanh(x)));
+    sigmoid_error = std::max(sigmoid_error, ulp_error(Y_sigmoid(0, i), 1.0 / (1.0 + std::exp(-x))));
+  }
+  std::cout << "tanh error: " << tanh_error << " ulp, sigmoid error: " << sigmoid_error << " ulp" << std::endl;
+  CHECK_LE(tanh_error, 8);
+  CHECK_LE(sigmoid_error, 4);
+}
+
+// Checks that the gradients computed from the output match the gradients computed from the input
+TEST_CASE("test_activation_output_gradient")
+{
+  eigen::matrix X {
+    {-3.0, -0.5, 0.0},
+    {0.25, 1.0, 4.0}
+  };
+
+  scalar epsilon = 1e-6;
+
+  sigmoid_activation sigmoid;
+  eigen::matrix Y = sigmoid(X);
+  CHECK_LT((sigmoid.gradient(X) - sigmoid.output_gradient(Y)).norm(), epsilon);
+
+  hyperbolic_tangent_activation tanh;
+  Y = tanh(X);
+  CHECK_LT((tanh.gradient(X) - tanh.output_gradient(Y)).norm(), epsilon);
+}
+
+// Checks the fused srelu backpropagation against the element-wise formulas
+TEST_CASE("test_srelu_backpropagate")
+{
+  using eigen::apply;
+  using eigen::elements_sum;
+  using eigen::hadamard;
+
+  scalar al = 0.2;
+  scalar tl = -0.5;
+  scalar ar = 0.7;
+  scalar tr = 0.5;
+
+  eigen::matrix Z = eigen::random_matrix(9, 13, -2, 2);
+  eigen::matrix DY = eigen::random_matrix(9, 13, -1, 1);
+
+  srelu_activation act(al, tl, ar, tr);
+  eigen::matrix DZ;
+  act.backpropagate(Z, DY, DZ);
+
+  auto Al = [tl](scalar x) { return x <= tl ? x - tl : scalar(0); };
+  auto Ar = [tl, tr](scalar x) { return x <= tl || x < tr ? scalar(0) : x - tr; };
+  auto Tl = [tl, al](scalar x) { return x <= tl ? scalar(1) - al : scalar(0); };
+  auto Tr = [tr, ar](scalar x) { return x >= tr ? scalar(1) - ar : scalar(0); };
+
+  eigen::matrix DZ_expected = hadamard(DY, act.gradient(Z));
+  eigen::matrix Dx_expected {{
+    elements_sum(hadamard(DY, apply(Al, Z))),
+    elements_sum(hadamard(DY, apply(Tl, Z))),
+    elements_sum(hadamard(DY, apply(Ar, Z))),
+    elements_sum(hadamard(DY, apply(Tr, Z)))
+  }};
+
+  scalar epsilon = 1e-5;
+  CHECK_LT((DZ - DZ_expected).norm(), epsilon);
+  CHECK_LT((act.Dx - Dx_expected).norm(), epsilon);
+}
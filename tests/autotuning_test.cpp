@@ -0,0 +1,75 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file autotuning_test.cpp
+/// \brief Tests for execution plans and autotuning.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/autotuning.h"
+#include <cstdio>
+#include <iostream>
+
+using namespace nerva;
+
+TEST_CASE("test_execution_plan")
+{
+  execution_plan plan;
+  CHECK_EQ(plan.dense(), NervaComputation);
+  CHECK_EQ(plan.gradient_batch_size(100), 10);
+  CHECK_EQ(plan.gradient_batch_size(20), 4);
+
+  plan.dense_computation = computation::mkl;
+  plan.sparse_gradient = sparse_gradient_kernel::eigen;
+  plan.sparse_gradient_batch_size = 64;
+  CHECK_EQ(plan.gradient_batch_size(100), 64);
+  CHECK(parse_execution_plan(plan.to_string()) == plan);
+  CHECK(parse_execution_plan(execution_plan().to_string()) == execution_plan());
+  CHECK_THROWS(parse_execution_plan("ExecutionPlan(computation=gpu)"));
+}
+
+TEST_CASE("test_autotuning")
+{
+  long N = 8;
+  long D = 6;
+  long K = 5;
+
+  multilayer_perceptron M;
+  auto layer1 = std::make_shared<dense_relu_layer>(D, K, N);
+  auto layer2 = std::make_shared<dense_linear_layer>(K, K, N);
+  for (auto layer: { std::static_pointer_cast<linear_layer<eigen::matrix>>(layer1), std::static_pointer_cast<linear_layer<eigen::matrix>>(layer2) })
+  {
+    layer->W = eigen::random_matrix(layer->W.rows(), layer->W.cols(), -1, 1);
+    layer->b = eigen::random_matrix(1, layer->b.cols(), -1, 1);
+    set_linear_layer_optimizer(*layer, "GradientDescent");
+  }
+  M.layers = { layer1, layer2 };
+  eigen::matrix W1 = layer1->W;
+
+  std::string cache_file = "autotuning_test.cache";
+  std::remove(cache_file.c_str());
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  autotune(M, X, cache_file, 1);
+  CHECK(layer1->plan.dense_computation.has_value());
+  CHECK_EQ(layer1->W, W1);  // the benchmarks do not change the parameters
+
+  // the plans are stored in the cache
+  autotuning_cache cache(cache_file);
+  auto plan = cache.find(autotuning_key(*layer1));
+  REQUIRE(plan);
+  CHECK(*plan == layer1->plan);
+
+  // a plan that is found in the cache is used without measuring
+  execution_plan eigen_plan;
+  eigen_plan.dense_computation = computation::eigen;
+  cache.insert(autotuning_key(*layer2), eigen_plan);
+  cache.save();
+  layer2->plan = execution_plan();
+  autotune(M, X, cache_file, 1);
+  CHECK(layer2->plan == eigen_plan);
+  std::remove(cache_file.c_str());
+}
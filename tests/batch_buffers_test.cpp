@@ -0,0 +1,86 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file batch_buffers_test.cpp
+/// \brief Tests for batch buffer sets.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/training.h"
+#include "mlp_test_fixture.h"
+#include <iostream>
+
+using namespace nerva;
+
+TEST_CASE("test_batch_buffer_set")
+{
+  long N = 8;
+  multilayer_perceptron M = make_test_model(N);
+  set_random_parameters(M);
+
+  eigen::matrix X = eigen::random_matrix(N, test_input_size, -1, 1);
+  eigen::matrix Y;
+  M.feedforward(X, Y);
+  auto layer1 = dynamic_cast<dense_relu_layer*>(M.layers[0].get());
+  eigen::matrix Z = layer1->Z;
+  const scalar* Z_data = layer1->Z.data();
+  const scalar* X_data = M.layers[1]->X.data();
+
+  // a feedforward step with a larger batch in other buffers
+  batch_buffer_set buffers;
+  {
+    scoped_batch_buffers scope(M.layers, buffers);
+    eigen::matrix X1 = eigen::random_matrix(3 * N, test_input_size, -1, 1);
+    eigen::matrix Y1;
+    M.feedforward(X1, Y1);
+    CHECK_EQ(Y1.rows(), 3 * N);
+    CHECK_EQ(layer1->Z.rows(), 3 * N);
+  }
+
+  // the original buffers are restored without reallocation
+  CHECK_EQ(layer1->Z.data(), Z_data);
+  CHECK_EQ(M.layers[1]->X.data(), X_data);
+  CHECK_EQ(layer1->Z, Z);
+}
+
+TEST_CASE("test_partial_batches")
+{
+  long N = 10;
+  long Q = 4;
+  multilayer_perceptron M = make_test_model(Q);
+  set_random_parameters(M);
+  set_training_mode(M, false);
+
+  eigen::matrix X = eigen::random_matrix(N, test_input_size, -1, 1);
+  eigen::matrix T = eigen::matrix::Zero(N, test_output_size);
+  for (long i = 0; i < N; i++)
+  {
+    T(i, i % test_output_size) = 1;
+  }
+
+  std::shared_ptr<loss_function> loss = std::make_shared<squared_error_loss>();
+  const scalar* X_data = M.layers[1]->X.data();
+
+  // all examples are included, also those of the last batch
+  eigen::matrix Y;
+  M.feedforward(X, Y);
+  double expected = loss->value(Y, T) / N;
+  M.feedforward(X.topRows(Q), Y);
+  X_data = M.layers[1]->X.data();
+
+  CHECK(std::fabs(compute_loss(M, loss, X, T, Q) - expected) < 1e-5);
+  CHECK_EQ(M.layers[1]->X.data(), X_data);
+  CHECK_EQ(M.layers[1]->X.rows(), Q);
+
+  // the full batches and the partial batch have their own evaluation buffers
+  CHECK_EQ(M.eval_buffers.size(), 2);
+  compute_accuracy(M, X, T, Q);
+  CHECK_EQ(M.eval_buffers.size(), 2);
+
+  // by default the partial batch is only skipped during training
+  CHECK(sgd_options().drop_last);
+}
@@ -10,7 +10,9 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 
 #include "doctest/doctest.h"
+#include "nerva/neural_networks/batch_normalization_layers.h"
 #include "nerva/neural_networks/eigen.h"
+#include "nerva/neural_networks/mlp_algorithms.h"
 #include <iostream>
 
 using namespace nerva;
@@ -57,3 +59,186 @@ TEST_CASE("test_standardize")
   std::cout << "y2=\n" << y2 << std::endl;
   CHECK_LT((expected - y2).squaredNorm(), 1e-10);
 }
+
+// Compare the batch normalization kernels with the equations they are derived from.
+void test_batch_normalization_kernels(long N, long D)
+{
+  using eigen::diag;
+  using eigen::hadamard;
+  using eigen::inv_sqrt;
+  using eigen::row_repeat;
+  using eigen::columns_mean;
+  using eigen::columns_sum;
+  using eigen::identity;
+  using eigen::ones;
+
+  eigen::matrix X = eigen::random_matrix(N, D);
+  eigen::matrix DY = eigen::random_matrix(N, D);
+  eigen::matrix gamma = eigen::random_matrix(1, D);
+
+  // reference computation
+  eigen::matrix R = X - row_repeat(columns_mean(X), N);
+  eigen::matrix Sigma = diag(R.transpose() * R).transpose() / N;
+  eigen::matrix inv_sqrt_Sigma1 = inv_sqrt(Sigma);
+  eigen::matrix Z1 = hadamard(row_repeat(inv_sqrt_Sigma1, N), R);
+  eigen::matrix DZ = hadamard(row_repeat(gamma, N), DY);
+  eigen::matrix Dbeta1 = columns_sum(DY);
+  eigen::matrix Dgamma1 = columns_sum(hadamard(Z1, DY));
+  eigen::matrix DX1 = hadamard(row_repeat(inv_sqrt_Sigma1 / N, N), (N * identity<eigen::matrix>(N) - ones<eigen::matrix>(N, N)) * DZ - hadamard(Z1, row_repeat(diag(Z1.transpose() * DZ).transpose(), N)));
+
+  eigen::matrix Z2;
+  eigen::matrix inv_sqrt_Sigma2;
+  eigen::matrix DX2;
+  eigen::matrix Dgamma2;
+  eigen::matrix Dbeta2;
+  batch_normalization_standardize(X, Z2, inv_sqrt_Sigma2);
+  batch_normalization_backpropagate(Z2, DY, gamma, inv_sqrt_Sigma2, DX2, Dgamma2, Dbeta2);
+
+  scalar tolerance = 1e-4;
+  CHECK_LT((inv_sqrt_Sigma1 - inv_sqrt_Sigma2).norm(), tolerance * (1 + inv_sqrt_Sigma1.norm()));
+  CHECK_LT((Z1 - Z2).norm(), tolerance * (1 + Z1.norm()));
+  CHECK_LT((Dbeta1 - Dbeta2).norm(), tolerance * (1 + Dbeta1.norm()));
+  CHECK_LT((Dgamma1 - Dgamma2).norm(), tolerance * (1 + Dgamma1.norm()));
+  CHECK_LT((DX1 - DX2).norm(), tolerance * (1 + DX1.norm()));
+}
+
+TEST_CASE("test_batch_normalization_kernels")
+{
+  test_batch_normalization_kernels(2, 3);  // for N = 2 the gradient DX is zero
+  test_batch_normalization_kernels(5, 1);
+  test_batch_normalization_kernels(17, 70);  // more than one block of features
+}
+
+TEST_CASE("test_batch_normalization_running_statistics")
+{
+  long N = 4;
+  long D = 3;
+  eigen::matrix X = eigen::random_matrix(N, D);
+  eigen::matrix Y(N, D);
+
+  batch_normalization_layer layer(D, N);
+  layer.momentum = 0.5;
+  layer.X = X;
+  layer.feedforward(Y);
+  layer.feedforward(Y);
+
+  // after two steps with the same batch the running statistics move 3/4 of the way to the batch statistics
+  eigen::matrix mean = eigen::columns_mean(X);
+  eigen::matrix Sigma = eigen::columns_mean(eigen::square(X - eigen::row_repeat(mean, N)));
+  eigen::matrix expected_mean = 0.75 * mean;
+  eigen::matrix expected_Sigma = 0.25 * eigen::matrix::Ones(1, D) + 0.75 * Sigma;
+  CHECK_LT((layer.running_mean - expected_mean).norm(), 1e-5);
+  CHECK_LT((layer.running_Sigma - expected_Sigma).norm(), 1e-5);
+
+  // in inference mode the output of an example does not depend on the other examples in the batch
+  layer.training = false;
+  layer.feedforward(Y);
+  eigen::matrix Y1(1, D);
+  layer.X = X.topRows(1);
+  layer.feedforward(Y1);
+  CHECK_LT((Y.topRows(1) - Y1).norm(), 1e-5);
+}
+
+TEST_CASE("test_fold_batch_normalization_layer")
+{
+  long N = 5;
+  long D = 4;
+  long K = 3;
+  eigen::matrix X = eigen::random_matrix(N, D);
+
+  dense_linear_layer llayer(D, K, N);
+  llayer.W = eigen::random_matrix(K, D);
+  llayer.b = eigen::random_matrix(1, K);
+
+  batch_normalization_layer blayer(K, N);
+  blayer.gamma = eigen::random_matrix(1, K);
+  blayer.beta = eigen::random_matrix(1, K);
+  blayer.running_mean = eigen::random_matrix(1, K);
+  blayer.running_Sigma = eigen::matrix::Constant(1, K, 0.5);
+  blayer.training = false;
+
+  affine_layer alayer(K, N);
+  alayer.gamma = eigen::random_matrix(1, K);
+  alayer.beta = eigen::random_matrix(1, K);
+
+  // batch normalization
+  {
+    eigen::matrix Y1(N, K);
+    eigen::matrix Y2(N, K);
+    dense_linear_layer layer = llayer;
+    layer.X = X;
+    layer.feedforward(blayer.X);
+    blayer.feedforward(Y1);
+    fold_batch_normalization_layer(layer, blayer);
+    layer.feedforward(Y2);
+    CHECK_LT((Y1 - Y2).norm(), 1e-5 * Y1.norm());
+  }
+
+  // affine
+  {
+    eigen::matrix Y1(N, K);
+    eigen::matrix Y2(N, K);
+    dense_linear_layer layer = llayer;
+    layer.X = X;
+    layer.feedforward(alayer.X);
+    alayer.feedforward(Y1);
+    fold_affine_layer(layer, alayer);
+    layer.feedforward(Y2);
+    CHECK_LT((Y1 - Y2).norm(), 1e-5 * Y1.norm());
+  }
+}
+
+// A chain linear -> batch normalization -> affine must be folded into the linear layer completely, both for dense
+// and for sparse linear layers.
+template <typename LinearLayer>
+void test_fold_normalization_layers(const eigen::matrix& W)
+{
+  long N = 5;
+  long K = W.rows();
+  long D = W.cols();
+  eigen::matrix X = eigen::random_matrix(N, D);
+
+  auto llayer = std::make_shared<LinearLayer>(D, K, N);
+  if constexpr (std::is_same_v<LinearLayer, sparse_linear_layer>)
+  {
+    llayer->W = mkl::to_csr<scalar>(W);
+  }
+  else
+  {
+    llayer->W = W;
+  }
+  llayer->b = eigen::random_matrix(1, K);
+
+  auto blayer = std::make_shared<batch_normalization_layer>(K, N);
+  blayer->gamma = eigen::random_matrix(1, K);
+  blayer->beta = eigen::random_matrix(1, K);
+  blayer->running_mean = eigen::random_matrix(1, K);
+  blayer->running_Sigma = eigen::matrix::Constant(1, K, 0.5);
+  blayer->training = false;
+
+  auto alayer = std::make_shared<affine_layer>(K, N);
+  alayer->gamma = eigen::random_matrix(1, K);
+  alayer->beta = eigen::random_matrix(1, K);
+
+  multilayer_perceptron M;
+  M.layers = { llayer, blayer, alayer };
+  eigen::matrix Y1;
+  M.feedforward(X, Y1);
+
+  fold_normalization_layers(M);
+  CHECK_EQ(M.layers.size(), 1);
+  eigen::matrix Y2;
+  M.feedforward(X, Y2);
+  CHECK_LT((Y1 - Y2).norm(), 1e-5 * Y1.norm());
+}
+
+TEST_CASE("test_fold_normalization_layers")
+{
+  eigen::matrix W {
+    {1, 0, 2, 0},
+    {0, 3, 0, -1},
+    {2, 0, 0, 1}
+  };
+  test_fold_normalization_layers<dense_linear_layer>(W);
+  test_fold_normalization_layers<sparse_linear_layer>(W);
+}
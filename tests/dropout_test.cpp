@@ -0,0 +1,72 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file dropout_test.cpp
+/// \brief Tests for dropout layers.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/dropout_layers.h"
+#include <iostream>
+
+using namespace nerva;
+
+TEST_CASE("test_dropout_mask")
+{
+  long K = 7;
+  long D = 130;  // more than two words per row
+  scalar p = 0.8;
+
+  dropout_mask R(K, D);
+  CHECK_EQ(R.to_matrix(), eigen::matrix::Ones(K, D));
+
+  R.renew(p, 12345);
+  eigen::matrix R1 = R.to_matrix();
+  CHECK(((R1.array() == 0) || (R1.array() == 1 / p)).all());
+
+  // the fraction of nonzero elements should be close to p
+  scalar fraction = scalar((R1.array() != 0).count()) / (K * D);
+  CHECK_LT(std::fabs(fraction - p), 0.1);
+
+  // the mask only depends on the seed
+  R.renew(p, 12345);
+  CHECK_EQ(R.to_matrix(), R1);
+  R.renew(p, 54321);
+  CHECK_NE(R.to_matrix(), R1);
+}
+
+TEST_CASE("test_dropout_product")
+{
+  using eigen::hadamard;
+
+  long N = 5;
+  long K = 70;  // more than one block of rows
+  long D = 9;
+  scalar p = 0.5;
+
+  eigen::matrix X = eigen::random_matrix(N, D);
+  eigen::matrix DZ = eigen::random_matrix(N, K);
+  eigen::matrix W = eigen::random_matrix(K, D);
+  dropout_mask R(K, D);
+  R.renew(p, 42);
+  eigen::matrix R1 = R.to_matrix();
+
+  eigen::matrix Z;
+  dropout_product_transposed(X, W, R, Z);
+  eigen::matrix Z_expected = X * hadamard(W, R1).transpose();
+  CHECK_LT((Z - Z_expected).norm(), 1e-5 * Z_expected.norm());
+
+  eigen::matrix DX;
+  dropout_product(DZ, W, R, DX);
+  eigen::matrix DX_expected = DZ * hadamard(W, R1);
+  CHECK_LT((DX - DX_expected).norm(), 1e-5 * DX_expected.norm());
+
+  eigen::matrix DW = DZ.transpose() * X;
+  eigen::matrix DW_expected = hadamard(DW, R1);
+  R.apply(DW);
+  CHECK_LT((DW - DW_expected).norm(), 1e-5 * DW_expected.norm());
+}
@@ -0,0 +1,92 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file embedding_layer_test.cpp
+/// \brief Tests for embedding layers.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/parse_layer.h"
+#include <iostream>
+
+using namespace nerva;
+
+TEST_CASE("test_embedding_layer")
+{
+  long N = 4;
+  long V = 10;
+  long d = 3;
+
+  std::mt19937 rng{12345};
+  auto layer = make_linear_layer(1, d, N, 1, 0, "Embedding(rows=10)", "Xavier", "Momentum(0.9)", rng);
+  auto& elayer = dynamic_cast<embedding_layer&>(*layer);
+
+  // an embedding layer computes the same as a linear layer with one-hot encoded inputs
+  dense_linear_layer dlayer(V, d, N);
+  set_linear_layer_optimizer(dlayer, "Momentum(0.9)");
+  dlayer.W = elayer.W.transpose();
+  dlayer.b = eigen::matrix::Zero(1, d);
+
+  eigen::matrix X {{2}, {7}, {2}, {5}};
+  eigen::matrix X_one_hot = eigen::matrix::Zero(N, V);
+  for (long n = 0; n < N; n++)
+  {
+    X_one_hot(n, static_cast<long>(X(n, 0))) = 1;
+  }
+  eigen::matrix indices = one_hot_to_indices(X_one_hot, {V});
+  CHECK_EQ(indices, X);
+
+  eigen::matrix DY = eigen::random_matrix(N, d, -1, 1);
+  eigen::matrix Y1;
+  eigen::matrix Y2;
+  elayer.X = X;
+  elayer.feedforward(Y1);
+  elayer.backpropagate(Y1, DY);
+  dlayer.X = X_one_hot;
+  dlayer.feedforward(Y2);
+  dlayer.backpropagate(Y2, DY);
+  CHECK_EQ(Y1, Y2);
+
+  // only the rows that occur in the batch have a gradient
+  std::vector<long> expected_rows = {2, 5, 7};
+  CHECK_EQ(elayer.touched_rows, expected_rows);
+  eigen::matrix DW = dlayer.DW.transpose();
+  for (long r = 0; r < 3; r++)
+  {
+    CHECK(((elayer.DW_rows.row(r) - DW.row(expected_rows[r])).cwiseAbs().maxCoeff() < 1e-6));
+  }
+
+  // the row gradients have one row per index of the batch, and no full size gradient is stored
+  CHECK_EQ(elayer.DW_rows.rows(), N);
+  CHECK_EQ(elayer.DW_rows.row(3).cwiseAbs().maxCoeff(), 0);
+  CHECK_EQ(elayer.DW.size(), 0);
+  CHECK_EQ(elayer.batch_buffers().size(), 3);
+
+  // the other rows of the table are not updated
+  eigen::matrix W = elayer.W;
+  elayer.optimize(0.1);
+  dlayer.optimize(0.1);
+  CHECK(((elayer.W - dlayer.W.transpose()).cwiseAbs().maxCoeff() < 1e-6));
+  CHECK_EQ(elayer.W.row(0), W.row(0));
+
+  elayer.X(1, 0) = 10;
+  CHECK_THROWS(elayer.feedforward(Y1));
+}
+
+// An embedding layer consumes indices, so it can only be the first layer.
+TEST_CASE("test_embedding_layer_position")
+{
+  std::mt19937 rng{12345};
+  std::vector<std::string> weights = {"Xavier", "Xavier"};
+  std::vector<std::string> optimizers = {"GradientDescent", "GradientDescent"};
+  std::vector<double> densities = {1, 1};
+  std::vector<double> dropouts = {0, 0};
+
+  auto layers = make_layers({"Embedding(rows=10)", "ReLU"}, {2, 6, 4}, densities, dropouts, weights, optimizers, 4, rng);
+  CHECK_EQ(layers.size(), 2);
+  CHECK_THROWS(make_layers({"ReLU", "Embedding(rows=10)"}, {2, 2, 6}, densities, dropouts, weights, optimizers, 4, rng));
+}
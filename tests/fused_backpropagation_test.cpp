@@ -0,0 +1,64 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file fused_backpropagation_test.cpp
+/// \brief Tests for fused backpropagation.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/fused_backpropagation.h"
+#include "mlp_test_fixture.h"
+#include <iostream>
+
+using namespace nerva;
+
+// The fused schedule must give the same result as backpropagate followed by optimize, without storing the
+// weight gradients.
+TEST_CASE("test_fused_backpropagation")
+{
+  long N = 5;
+  auto [M1, M2] = make_identical_models(make_test_model, N);
+
+  release_weight_gradients(M2);
+  for (auto& layer: M2.layers)
+  {
+    if (auto llayer = dynamic_cast<dense_linear_layer*>(layer.get()))
+    {
+      CHECK_EQ(llayer->DW.size(), 0);
+    }
+  }
+
+  fused_backpropagation_tile_rows = 3;  // the tiles do not divide the number of rows
+  for (int i = 0; i < 5; i++)
+  {
+    eigen::matrix X = eigen::random_matrix(N, test_input_size, -1, 1);
+    eigen::matrix DY = eigen::random_matrix(N, test_output_size, -1, 1);
+    eigen::matrix Y1;
+    eigen::matrix Y2;
+
+    M1.feedforward(X, Y1);
+    M1.backpropagate(Y1, DY);
+    M1.optimize(0.01);
+
+    M2.feedforward(X, Y2);
+    fused_backpropagate_and_optimize(M2, Y2, DY, 0.01);
+
+    CHECK((Y1 - Y2).cwiseAbs().maxCoeff() < 1e-5);
+  }
+
+  // the tiles are added in a different order, so the results are only approximately equal
+  CHECK(max_parameter_difference(M1, M2) < 1e-5);
+
+  // the weight gradients are never stored
+  for (auto& layer: M2.layers)
+  {
+    if (auto llayer = dynamic_cast<dense_linear_layer*>(layer.get()))
+    {
+      CHECK_EQ(llayer->DW.size(), 0);
+    }
+  }
+}
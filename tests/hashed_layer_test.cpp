@@ -0,0 +1,67 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file hashed_layer_test.cpp
+/// \brief Tests for hashed layers.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/parse_layer.h"
+#include <iostream>
+
+using namespace nerva;
+
+TEST_CASE("test_hashed_layer")
+{
+  long N = 4;
+  long D = 200;  // D * K is larger than the block size, so multiple blocks are used
+  long K = 100;
+  long B = 64;
+
+  std::mt19937 rng{12345};
+  auto layer = make_linear_layer(D, K, N, 1, 0, "Hashed(buckets=64, seed=7, activation=ReLU)", "Xavier", "GradientDescent", rng);
+  auto& hlayer = dynamic_cast<hashed_relu_layer&>(*layer);
+  CHECK_EQ(hlayer.buckets(), B);
+  CHECK_EQ(hlayer.seed, 7);
+
+  // a hashed layer computes the same as a dense layer with the virtual weight matrix
+  dense_relu_layer dlayer(D, K, N);
+  dlayer.W = hlayer.weights();
+  dlayer.b = hlayer.b;
+  CHECK_EQ(dlayer.W(3, 5), hlayer.bucket(3, 5).second * hlayer.w(0, hlayer.bucket(3, 5).first));
+
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix DY = eigen::random_matrix(N, K, -1, 1);
+  eigen::matrix Y1;
+  eigen::matrix Y2;
+  hlayer.X = X;
+  hlayer.feedforward(Y1);
+  hlayer.backpropagate(Y1, DY);
+  dlayer.X = X;
+  dlayer.feedforward(Y2);
+  dlayer.backpropagate(Y2, DY);
+  CHECK(((Y1 - Y2).cwiseAbs().maxCoeff() < 1e-5));
+  CHECK(((hlayer.DX - dlayer.DX).cwiseAbs().maxCoeff() < 1e-5));
+  CHECK(((hlayer.Db - dlayer.Db).cwiseAbs().maxCoeff() < 1e-5));
+
+  // the gradient of a shared parameter is the signed sum of the gradients of the weights in its bucket
+  eigen::matrix Dw = eigen::matrix::Zero(1, B);
+  for (long i = 0; i < K; i++)
+  {
+    for (long j = 0; j < D; j++)
+    {
+      auto [k, sign] = hlayer.bucket(i, j);
+      Dw(0, k) += sign * dlayer.DW(i, j);
+    }
+  }
+  CHECK(((hlayer.Dw - Dw).cwiseAbs().maxCoeff() < 1e-4));
+
+  // the per-thread gradients are summed in a fixed order, so repeated runs give exactly the same result
+  eigen::matrix Dw1 = hlayer.Dw;
+  hlayer.backpropagate(Y1, DY);
+  CHECK(hlayer.Dw == Dw1);
+}
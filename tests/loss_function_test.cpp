@@ -153,3 +153,40 @@ TEST_CASE("test_loss5")
 
 
 //--- end generated code ---//
+
+// Compare value_and_gradient with separate calls to value and gradient.
+void test_value_and_gradient(const std::string& name, const loss_function& loss, const eigen::matrix& Y, const eigen::matrix& T)
+{
+  std::cout << "\n=== test_value_and_gradient " << name << " ===" << std::endl;
+  scalar epsilon = std::is_same<scalar, double>::value ? scalar(0.000001) : scalar(0.001);
+  scalar scale = 0.2;
+
+  eigen::matrix DY;
+  scalar L = loss.value_and_gradient(Y, T, DY, scale);
+  eigen::matrix DY_expected = scale * loss.gradient(Y, T);
+  CHECK(loss.value(Y, T) == doctest::Approx(L).epsilon(epsilon));
+  CHECK_LT((DY - DY_expected).norm(), epsilon * (1 + DY_expected.norm()));
+}
+
+TEST_CASE("test_value_and_gradient")
+{
+  eigen::matrix Y {
+    {0.23759169, 0.42272727, 0.33968104},
+    {0.43770149, 0.28115265, 0.28114586},
+    {0.20141643, 0.45190243, 0.34668113},
+    {0.35686849, 0.17944701, 0.46368450},
+  };
+
+  eigen::matrix T {
+    {1.00000000, 0.00000000, 0.00000000},
+    {1.00000000, 0.00000000, 0.00000000},
+    {0.00000000, 1.00000000, 0.00000000},
+    {0.00000000, 0.00000000, 1.00000000},
+  };
+
+  test_value_and_gradient("squared_error_loss", squared_error_loss(), Y, T);
+  test_value_and_gradient("softmax_cross_entropy_loss", softmax_cross_entropy_loss(), Y, T);
+  test_value_and_gradient("negative_log_likelihood_loss", negative_log_likelihood_loss(), Y, T);
+  test_value_and_gradient("cross_entropy_loss", cross_entropy_loss(), Y, T);
+  test_value_and_gradient("logistic_cross_entropy_loss", logistic_cross_entropy_loss(), Y, T);
+}
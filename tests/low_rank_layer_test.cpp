@@ -0,0 +1,110 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file low_rank_layer_test.cpp
+/// \brief Tests for low rank layers.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/parse_layer.h"
+#include <iostream>
+
+using namespace nerva;
+
+scalar max_difference(const eigen::matrix& A, const eigen::matrix& B)
+{
+  return (A - B).cwiseAbs().maxCoeff();
+}
+
+TEST_CASE("test_low_rank_factorization")
+{
+  long K = 7;
+  long D = 5;
+  long r = 2;
+  eigen::matrix W = eigen::random_matrix(K, r, -1, 1) * eigen::random_matrix(r, D, -1, 1);
+
+  eigen::matrix U;
+  eigen::matrix V;
+  low_rank_factorization(W, r, U, V);
+  CHECK_EQ(U.rows(), K);
+  CHECK_EQ(U.cols(), r);
+  CHECK_EQ(V.rows(), r);
+  CHECK_EQ(V.cols(), D);
+  CHECK(max_difference(U * V, W) < 1e-5);
+
+  CHECK_THROWS(low_rank_factorization(W, 6, U, V));
+}
+
+TEST_CASE("test_low_rank_layer")
+{
+  long N = 4;
+  long D = 5;
+  long K = 6;
+  long r = 3;
+
+  low_rank_relu_layer layer1(D, K, r, N, relu_activation());
+  layer1.U = eigen::random_matrix(K, r, -1, 1);
+  layer1.V = eigen::random_matrix(r, D, -1, 1);
+  layer1.b = eigen::random_matrix(1, K, -1, 1);
+
+  dense_relu_layer layer2(D, K, N);
+  layer2.W = layer1.weights();
+  layer2.b = layer1.b;
+
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix DY = eigen::random_matrix(N, K, -1, 1);
+  eigen::matrix Y1;
+  eigen::matrix Y2;
+
+  layer1.X = X;
+  layer1.feedforward(Y1);
+  layer1.backpropagate(Y1, DY);
+  layer2.X = X;
+  layer2.feedforward(Y2);
+  layer2.backpropagate(Y2, DY);
+
+  // the gradients of the factors follow from DW with the chain rule
+  CHECK(max_difference(Y1, Y2) < 1e-5);
+  CHECK(max_difference(layer1.DX, layer2.DX) < 1e-5);
+  CHECK(max_difference(layer1.Db, layer2.Db) < 1e-5);
+  CHECK(max_difference(layer1.DU, layer2.DW * layer1.V.transpose()) < 1e-5);
+  CHECK(max_difference(layer1.DV, layer1.U.transpose() * layer2.DW) < 1e-5);
+}
+
+TEST_CASE("test_make_low_rank_layer")
+{
+  long N = 4;
+  long D = 5;
+  long K = 3;
+
+  std::mt19937 rng{std::random_device{}()};
+  auto layer = make_linear_layer(D, K, N, 1, 0, "LowRank(rank=2, activation=Sigmoid)", "Xavier", "GradientDescent", rng);
+  auto llayer = std::dynamic_pointer_cast<low_rank_sigmoid_layer>(layer);
+  REQUIRE(llayer);
+  CHECK_EQ(llayer->rank(), 2);
+  CHECK_THROWS(make_linear_layer(D, K, N, 0.5, 0, "LowRank(2)", "Xavier", "GradientDescent", rng));
+
+  // a conversion of full rank preserves the output of a dense layer
+  dense_hyperbolic_tangent_layer dense_layer(D, K, N);
+  dense_layer.W = eigen::random_matrix(K, D, -1, 1);
+  dense_layer.b = eigen::random_matrix(1, K, -1, 1);
+  auto low_rank_layer = make_low_rank_layer(dense_layer, K, "Momentum(0.9)");
+  REQUIRE(dynamic_cast<low_rank_hyperbolic_tangent_layer*>(low_rank_layer.get()));
+
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix Y1;
+  eigen::matrix Y2;
+  dense_layer.X = X;
+  dense_layer.feedforward(Y1);
+  low_rank_layer->X = X;
+  low_rank_layer->feedforward(Y2);
+  CHECK(max_difference(Y1, Y2) < 1e-5);
+
+  // low rank layers have no dropout, so a dense layer with dropout can not be converted
+  dense_relu_dropout_layer layer_with_dropout(D, K, N, 0.3);
+  CHECK_THROWS(make_low_rank_layer(layer_with_dropout, K, "GradientDescent"));
+}
@@ -12,6 +12,7 @@
 #include "doctest/doctest.h"
 #include "nerva/neural_networks/eigen.h"
 #include "nerva/neural_networks/matrix_operations.h"
+#include <omp.h>
 
 using namespace nerva;
 
@@ -54,3 +55,33 @@ TEST_CASE("test_repeat_row")
   [[maybe_unused]] auto D4 = hadamard(log(X), log(Y));
   [[maybe_unused]] auto D5 = hadamard(X, row_repeat(inverse(columns_sum(X)), m));
 }
+
+TEST_CASE("test_parallel_operations")
+{
+  long m = 1000;
+  long n = 100;  // m * n is above the parallel threshold
+  eigen::matrix X = eigen::random_matrix(m, n, -1, 1);
+  eigen::matrix b = eigen::random_matrix(1, n, -1, 1);
+
+  eigen::matrix Y;
+  eigen::parallel_assign(Y, X + eigen::row_repeat(b, m));
+  CHECK_EQ(Y, X + eigen::row_repeat(b, m));
+
+  // the results of reductions do not depend on the number of threads
+  eigen::matrix s1;
+  eigen::matrix s2;
+  omp_set_num_threads(2);
+  eigen::parallel_columns_sum(X, s1);
+  auto sum1 = eigen::parallel_elements_sum(X);
+  omp_set_num_threads(3);
+  eigen::parallel_columns_sum(X, s2);
+  auto sum2 = eigen::parallel_elements_sum(X);
+  CHECK_EQ(s1, s2);
+  CHECK_EQ(sum1, sum2);
+  CHECK_LT((s1 - X.colwise().sum()).norm(), 1e-3);
+  CHECK_LT(std::fabs(sum1 - X.sum()), 1e-2);
+
+  CHECK(!eigen::parallel_has_nan(X));
+  X(m - 1, n - 1) = std::nan("");
+  CHECK(eigen::parallel_has_nan(X));
+}
@@ -0,0 +1,155 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file mixed_precision_test.cpp
+/// \brief Tests for mixed precision computations.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/layers.h"
+#include "nerva/neural_networks/mixed_precision.h"
+#include "nerva/neural_networks/mlp_algorithms.h"
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+using namespace nerva;
+
+TEST_CASE("test_bfloat16_conversion")
+{
+  // values with at most 8 significant bits are represented exactly
+  for (float x: {0.0f, 1.0f, -2.5f, 0.1875f, 255.0f, 1e30f})
+  {
+    float y = from_bfloat16(to_bfloat16(x));
+    CHECK_LE(std::fabs(x - y), std::fabs(x) / 256);
+  }
+  CHECK_EQ(from_bfloat16(to_bfloat16(1.0f)), 1.0f);
+  CHECK_EQ(from_bfloat16(to_bfloat16(255.0f)), 255.0f);
+
+  // round to nearest even
+  CHECK_EQ(from_bfloat16(to_bfloat16(1.0f + 1.0f / 256)), 1.0f);
+  CHECK_EQ(from_bfloat16(to_bfloat16(1.0f + 3.0f / 256)), 1.0f + 4.0f / 256);
+
+  CHECK(std::isnan(from_bfloat16(to_bfloat16(std::numeric_limits<float>::quiet_NaN()))));
+  CHECK(std::isinf(from_bfloat16(to_bfloat16(std::numeric_limits<float>::infinity()))));
+  CHECK(std::isinf(from_bfloat16(to_bfloat16(std::numeric_limits<float>::max()))));
+}
+
+TEST_CASE("test_bf16_product")
+{
+  eigen::matrix A = eigen::random_matrix(7, 20, -1, 1);
+  eigen::matrix B = eigen::random_matrix(5, 20, -1, 1);
+  bfloat16_matrix A1(A);
+  bfloat16_matrix B1(B);
+
+  eigen::matrix C;
+  bf16_product(C, A1, B1, false, true);
+  eigen::matrix C_expected = A * B.transpose();
+  std::cout << "bf16 product relative error: " << (C - C_expected).norm() / C_expected.norm() << std::endl;
+  CHECK_LT((C - C_expected).norm(), 1e-2 * C_expected.norm());
+
+  // the product of the rounded operands is computed with fp32 accumulation
+  eigen::matrix A2 = A;
+  eigen::matrix B2 = B;
+  round_to_bfloat16(A2);
+  round_to_bfloat16(B2);
+  C_expected = A2 * B2.transpose();
+  CHECK_LT((C - C_expected).norm(), 1e-5 * C_expected.norm());
+
+  bf16_product(C, A1, bfloat16_matrix(C_expected), true, false);
+  CHECK_EQ(C.rows(), 20);
+  CHECK_EQ(C.cols(), 5);
+}
+
+TEST_CASE("test_mixed_precision_layer")
+{
+  long D = 6;
+  long K = 4;
+  long N = 3;
+
+  dense_relu_layer layer(D, K, N);
+  layer.W = eigen::random_matrix(K, D, -1, 1);
+  layer.b = eigen::random_matrix(1, K, -1, 1);
+  layer.X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix DY = eigen::random_matrix(N, K, -1, 1);
+
+  eigen::matrix Y1;
+  layer.feedforward(Y1);
+  layer.backpropagate(Y1, DY);
+  eigen::matrix DW1 = layer.DW;
+  eigen::matrix DX1 = layer.DX;
+
+  NervaMixedPrecision = true;
+  eigen::matrix Y2;
+  layer.feedforward(Y2);
+  layer.backpropagate(Y2, DY);
+  NervaMixedPrecision = false;
+
+  scalar epsilon = 2e-2;
+  CHECK_LT((Y1 - Y2).norm(), epsilon * (1 + Y1.norm()));
+  CHECK_LT((DW1 - layer.DW).norm(), epsilon * (1 + DW1.norm()));
+  CHECK_LT((DX1 - layer.DX).norm(), epsilon * (1 + DX1.norm()));
+}
+
+TEST_CASE("test_loss_scaler")
+{
+  loss_scaler scaler(1024);
+  scaler.growth_interval = 2;
+
+  CHECK(scaler.update(false));
+  CHECK_EQ(scaler.scale, 1024);
+  CHECK(scaler.update(false));
+  CHECK_EQ(scaler.scale, 2048);
+  CHECK(!scaler.update(true));
+  CHECK_EQ(scaler.scale, 1024);
+  CHECK_EQ(scaler.overflow_count, 1);
+}
+
+// The loss scale must be removed from the gradients of all layer types, not only from the dense ones.
+TEST_CASE("test_scale_gradients")
+{
+  long N = 4;
+  multilayer_perceptron M;
+  std::vector<eigen::matrix*> gradients;
+
+  auto layer1 = std::make_shared<low_rank_linear_layer>(8, 8, 2, N);
+  M.layers.push_back(layer1);
+  gradients.insert(gradients.end(), { &layer1->DU, &layer1->DV, &layer1->Db });
+
+  auto layer2 = std::make_shared<monarch_linear_layer>(8, 8, 2, N);
+  M.layers.push_back(layer2);
+  gradients.insert(gradients.end(), { &layer2->DR, &layer2->DL, &layer2->Db });
+
+  auto layer3 = std::make_shared<relu_mixture_of_experts_layer>(8, 8, N, 4, 2, 4, relu_activation());
+  M.layers.push_back(layer3);
+  gradients.insert(gradients.end(), { &layer3->DWg, &layer3->Dbg, &layer3->DW1, &layer3->Db1, &layer3->DW2, &layer3->Db2 });
+
+  auto layer4 = std::make_shared<embedding_layer>(2, 10, 4, N);
+  layer4->DW_rows.resize(3, 4);  // the gradients of the rows touched by a batch
+  M.layers.push_back(layer4);
+  gradients.insert(gradients.end(), { &layer4->DW_rows });
+
+  auto layer5 = std::make_shared<hashed_linear_layer>(8, 4, 16, N);
+  M.layers.push_back(layer5);
+  gradients.insert(gradients.end(), { &layer5->Dw, &layer5->Db });
+
+  for (eigen::matrix* G: gradients)
+  {
+    G->setConstant(1024);
+  }
+  CHECK(has_finite_gradients(M));
+  scale_gradients(M, scalar(1) / 1024);
+  for (eigen::matrix* G: gradients)
+  {
+    CHECK_EQ(G->maxCoeff(), 1);
+    CHECK_EQ(G->minCoeff(), 1);
+  }
+
+  (*gradients.back())(0, 0) = std::numeric_limits<scalar>::infinity();
+  CHECK(!has_finite_gradients(M));
+}
@@ -0,0 +1,140 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file mixture_of_experts_layer_test.cpp
+/// \brief Tests for mixture of experts layers.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/mlp_algorithms.h"
+#include "nerva/neural_networks/parse_layer.h"
+#include <iostream>
+
+using namespace nerva;
+
+// Computes the output of the layer for the example x without grouping.
+template <typename Layer>
+eigen::matrix expected_output(const Layer& layer, const eigen::matrix& x)
+{
+  long E = layer.E;
+  long M = layer.M;
+  long K = layer.output_size();
+  eigen::matrix g = x * layer.Wg.transpose() + layer.bg;
+
+  std::vector<long> experts(E);
+  std::iota(experts.begin(), experts.end(), 0);
+  std::sort(experts.begin(), experts.end(), [&](long e1, long e2) { return g(0, e1) > g(0, e2); });
+  experts.resize(layer.k);
+
+  eigen::matrix result = eigen::matrix::Zero(1, K);
+  scalar sum = 0;
+  for (long e: experts)
+  {
+    scalar w = std::exp(g(0, e) - g(0, experts[0]));
+    eigen::matrix z = x * layer.W1.middleRows(e * M, M).transpose() + layer.b1.middleCols(e * M, M);
+    eigen::matrix h = z.cwiseMax(0);
+    result += w * (h * layer.W2.middleRows(e * K, K).transpose() + layer.b2.middleCols(e * K, K));
+    sum += w;
+  }
+  return result / sum;
+}
+
+TEST_CASE("test_mixture_of_experts_layer")
+{
+  long N = 8;
+  long D = 5;
+  long K = 3;
+  long E = 4;
+  long k = 2;
+  long M = 6;
+
+  std::mt19937 rng{12345};
+  auto layer = make_linear_layer(D, K, N, 1, 0, "MoE(experts=4, k=2, hidden=6, activation=ReLU)", "Xavier", "GradientDescent", rng);
+  auto& moe = dynamic_cast<relu_mixture_of_experts_layer&>(*layer);
+  CHECK_EQ(moe.E, E);
+  CHECK_EQ(moe.k, k);
+  CHECK_EQ(moe.M, M);
+
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix DY = eigen::random_matrix(N, K, -1, 1);
+  eigen::matrix Y;
+  moe.X = X;
+  moe.feedforward(Y);
+  for (long n = 0; n < N; n++)
+  {
+    CHECK((Y.row(n) - expected_output(moe, X.row(n))).cwiseAbs().maxCoeff() < 1e-5);
+  }
+
+  // every example is assigned to k experts
+  long total = std::accumulate(moe.expert_counts.begin(), moe.expert_counts.end(), 0L);
+  CHECK_EQ(total, N * k);
+  CHECK_EQ(moe.expert_offsets.back(), N * k);
+  CHECK(moe.load_imbalance() >= 1);
+  std::cout << moe.statistics() << std::endl;
+
+  // compare the gradients with finite differences of the loss elements_sum(hadamard(Y, DY))
+  moe.backpropagate(Y, DY);
+  auto loss = [&]()
+  {
+    eigen::matrix Y1;
+    moe.feedforward(Y1);
+    return static_cast<double>(Y1.cwiseProduct(DY).sum());
+  };
+  auto check_gradient = [&](eigen::matrix& W, const eigen::matrix& DW, long i, long j)
+  {
+    scalar h = 1e-3;
+    scalar w = W(i, j);
+    W(i, j) = w + h;
+    double f1 = loss();
+    W(i, j) = w - h;
+    double f2 = loss();
+    W(i, j) = w;
+    CHECK(std::fabs((f1 - f2) / (2 * h) - DW(i, j)) < 1e-2);
+  };
+  for (long j = 0; j < D; j++)
+  {
+    check_gradient(moe.Wg, moe.DWg, 1, j);
+    check_gradient(moe.W1, moe.DW1, 2 * M + 1, j);
+    check_gradient(moe.X, moe.DX, 3, j);
+  }
+  for (long j = 0; j < M; j++)
+  {
+    check_gradient(moe.W2, moe.DW2, K + 1, j);
+  }
+}
+
+// The routing statistics are only updated by feedforward steps in training mode.
+TEST_CASE("test_mixture_of_experts_statistics")
+{
+  long N = 8;
+  long D = 5;
+  long K = 3;
+  long k = 2;
+
+  std::mt19937 rng{12345};
+  multilayer_perceptron M;
+  M.layers = { make_linear_layer(D, K, N, 1, 0, "MoE(experts=4, k=2, hidden=6, activation=HyperbolicTangent)", "Xavier", "GradientDescent", rng) };
+  auto& moe = dynamic_cast<hyperbolic_tangent_mixture_of_experts_layer&>(*M.layers.front());
+  auto total = [&]() { return std::accumulate(moe.expert_counts.begin(), moe.expert_counts.end(), 0L); };
+
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix Y;
+
+  set_training_mode(M, false);
+  CHECK(!is_training_mode(M));
+  M.feedforward(X, Y);
+  CHECK_EQ(total(), 0);
+
+  set_training_mode(M, true);
+  CHECK(is_training_mode(M));
+  M.feedforward(X, Y);
+  M.feedforward(X, Y);
+  CHECK_EQ(total(), 2 * N * k);
+
+  reset_routing_statistics(M);
+  CHECK_EQ(total(), 0);
+}
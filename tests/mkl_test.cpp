@@ -13,6 +13,7 @@
 #include <Eigen/Dense>
 #include "nerva/utilities/print.h"
 #include "nerva/neural_networks/mkl_eigen.h"
+#include "nerva/neural_networks/mkl_jit_gemm.h"
 #include "nerva/neural_networks/eigen.h"
 #include "nerva/neural_networks/layers.h"
 #include "nerva/neural_networks/mkl_sparse_matrix.h"
@@ -926,3 +927,56 @@ TEST_CASE("test_assign_matrix_product")
   print_cpp_matrix("A1", mkl::to_eigen(A1));
   CHECK_EQ(A, mkl::to_eigen(A1));
 }
+
+TEST_CASE("test_jit_gemm_cache")
+{
+  long N = 4;
+  long D = 5;
+  long K = 3;
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix W = eigen::random_matrix(K, D, -1, 1);
+  eigen::matrix DY = eigen::random_matrix(N, K, -1, 1);
+  scalar epsilon = 1e-5;
+
+  mkl::jit_gemm_cache jit;
+  jit.set_batch_size(N);
+  eigen::matrix Y;
+  eigen::matrix DW;
+  eigen::matrix DX;
+  jit.product(Y, X, W, false, true);
+  jit.product(DW, DY, X, true, false);
+  jit.product(DX, DY, W);
+  CHECK_EQ(jit.size(), 3);
+  CHECK_LT((Y - X * W.transpose()).norm(), epsilon);
+  CHECK_LT((DW - DY.transpose() * X).norm(), epsilon);
+  CHECK_LT((DX - DY * W).norm(), epsilon);
+
+  // the kernels are reused for the same shapes
+  jit.product(Y, X, W, false, true);
+  CHECK_EQ(jit.size(), 3);
+
+  // the kernels are discarded if the batch size changes
+  jit.set_batch_size(N + 1);
+  CHECK_EQ(jit.size(), 0);
+
+  // large products are not done with JIT kernels
+  jit.set_batch_size(mkl::jit_gemm_max_batch_size + 1);
+  CHECK(!jit.use_jit(mkl::jit_gemm_max_batch_size + 1, K, D));
+}
+
+TEST_CASE("test_calibrate_jit_gemm_thresholds")
+{
+  long max_batch_size = mkl::jit_gemm_max_batch_size;
+  long max_dimension = mkl::jit_gemm_max_dimension;
+
+  auto [N, D] = mkl::calibrate_jit_gemm_thresholds(1);
+  std::cout << fmt::format("jit thresholds: batch size {}, dimension {}\n", N, D);
+  CHECK_EQ(N, mkl::jit_gemm_max_batch_size);
+  CHECK_EQ(D, mkl::jit_gemm_max_dimension);
+  CHECK((N == 0) == (D == 0));
+  CHECK_LE(N, 256);
+  CHECK_LE(D, 1024);
+
+  mkl::jit_gemm_max_batch_size = max_batch_size;
+  mkl::jit_gemm_max_dimension = max_dimension;
+}
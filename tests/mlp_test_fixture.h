@@ -0,0 +1,108 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file mlp_test_fixture.h
+/// \brief A small multilayer perceptron and utilities for comparing two copies of it. These are shared by the
+/// tests of the alternative schedules of the training step (task graphs, fused backpropagation, activation
+/// checkpointing and batch buffers).
+
+#pragma once
+
+#include "nerva/neural_networks/batch_normalization_layers.h"
+#include "nerva/neural_networks/layers.h"
+#include "nerva/neural_networks/multilayer_perceptron.h"
+#include <algorithm>
+#include <cstdlib>
+#include <utility>
+
+namespace nerva {
+
+inline constexpr long test_input_size = 6;
+inline constexpr long test_output_size = 3;
+
+/// Returns a multilayer perceptron ReLU -> BatchNormalization -> Sigmoid -> Softmax with batch size N, that uses
+/// a mix of optimizers.
+inline
+multilayer_perceptron make_test_model(long N)
+{
+  long D = test_input_size;
+  long K = 8;
+  long L = test_output_size;
+
+  multilayer_perceptron M;
+  auto layer1 = std::make_shared<dense_relu_layer>(D, K, N);
+  auto layer2 = std::make_shared<dense_batch_normalization_layer>(K, N);
+  auto layer3 = std::make_shared<dense_sigmoid_layer>(K, K, N);
+  auto layer4 = std::make_shared<dense_softmax_layer>(K, L, N);
+  set_linear_layer_optimizer(*layer1, "Momentum(0.9)");
+  set_batch_normalization_layer_optimizer(*layer2, "GradientDescent");
+  set_linear_layer_optimizer(*layer3, "Nesterov(0.9)");
+  set_linear_layer_optimizer(*layer4, "GradientDescent");
+  M.layers = { layer1, layer2, layer3, layer4 };
+  return M;
+}
+
+/// Sets the weights and bias vectors of the dense linear layers of M to random values. The random generator is
+/// seeded, so models with the same architecture get the same parameters.
+inline
+void set_random_parameters(multilayer_perceptron& M, unsigned int seed = 12345)
+{
+  std::srand(seed);
+  for (auto& layer: M.layers)
+  {
+    if (auto llayer = dynamic_cast<dense_linear_layer*>(layer.get()))
+    {
+      llayer->W = eigen::random_matrix(llayer->W.rows(), llayer->W.cols(), -1, 1);
+      llayer->b = eigen::random_matrix(1, llayer->b.cols(), -1, 1);
+    }
+  }
+}
+
+/// Returns two models with batch size N, that are created with make_model and have identical parameters.
+template <typename MakeModel>
+std::pair<multilayer_perceptron, multilayer_perceptron> make_identical_models(MakeModel make_model, long N)
+{
+  std::pair<multilayer_perceptron, multilayer_perceptron> result(make_model(N), make_model(N));
+  set_random_parameters(result.first);
+  set_random_parameters(result.second);
+  return result;
+}
+
+/// Returns the largest absolute difference between the weights and bias vectors of the dense linear layers of
+/// M1 and M2, which must have the same architecture.
+inline
+scalar max_parameter_difference(const multilayer_perceptron& M1, const multilayer_perceptron& M2)
+{
+  scalar result = 0;
+  for (std::size_t i = 0; i < M1.layers.size(); i++)
+  {
+    if (auto llayer1 = dynamic_cast<dense_linear_layer*>(M1.layers[i].get()))
+    {
+      auto llayer2 = dynamic_cast<dense_linear_layer*>(M2.layers[i].get());
+      result = std::max({result, (llayer1->W - llayer2->W).cwiseAbs().maxCoeff(), (llayer1->b - llayer2->b).cwiseAbs().maxCoeff()});
+    }
+  }
+  return result;
+}
+
+/// Returns the largest absolute difference between the gradients DW and Db of the dense linear layers of M1 and
+/// M2, which must have the same architecture.
+inline
+scalar max_gradient_difference(const multilayer_perceptron& M1, const multilayer_perceptron& M2)
+{
+  scalar result = 0;
+  for (std::size_t i = 0; i < M1.layers.size(); i++)
+  {
+    if (auto llayer1 = dynamic_cast<dense_linear_layer*>(M1.layers[i].get()))
+    {
+      auto llayer2 = dynamic_cast<dense_linear_layer*>(M2.layers[i].get());
+      result = std::max({result, (llayer1->DW - llayer2->DW).cwiseAbs().maxCoeff(), (llayer1->Db - llayer2->Db).cwiseAbs().maxCoeff()});
+    }
+  }
+  return result;
+}
+
+} // namespace nerva
@@ -0,0 +1,103 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file monarch_layer_test.cpp
+/// \brief Tests for Monarch layers.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/parse_layer.h"
+#include <iostream>
+
+using namespace nerva;
+
+scalar max_difference(const eigen::matrix& A, const eigen::matrix& B)
+{
+  return (A - B).cwiseAbs().maxCoeff();
+}
+
+TEST_CASE("test_monarch_permute")
+{
+  eigen::matrix X {{0, 1, 2, 3, 4, 5}};
+  eigen::matrix Y;
+  eigen::matrix Z;
+  monarch_permute(X, Y, 2);
+  eigen::matrix expected {{0, 3, 1, 4, 2, 5}};
+  CHECK_EQ(Y, expected);
+  monarch_permute_inverse(Y, Z, 2);
+  CHECK_EQ(Z, X);
+}
+
+TEST_CASE("test_monarch_layer")
+{
+  long N = 4;
+  long D = 9;
+  long K = 6;
+  long nblocks = 3;
+
+  monarch_sigmoid_layer layer1(D, K, nblocks, N, sigmoid_activation());
+  layer1.R = eigen::random_matrix(D, D / nblocks, -1, 1);
+  layer1.L = eigen::random_matrix(K, D / nblocks, -1, 1);
+  layer1.b = eigen::random_matrix(1, K, -1, 1);
+
+  // every output depends on every input
+  eigen::matrix W = layer1.weights();
+  CHECK_EQ(W.rows(), K);
+  CHECK_EQ(W.cols(), D);
+  CHECK((W.array() != 0).all());
+
+  dense_sigmoid_layer layer2(D, K, N);
+  layer2.W = W;
+  layer2.b = layer1.b;
+
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix DY = eigen::random_matrix(N, K, -1, 1);
+  eigen::matrix Y1;
+  eigen::matrix Y2;
+
+  layer1.X = X;
+  layer1.feedforward(Y1);
+  layer1.backpropagate(Y1, DY);
+  layer2.X = X;
+  layer2.feedforward(Y2);
+  layer2.backpropagate(Y2, DY);
+
+  CHECK(max_difference(Y1, Y2) < 1e-5);
+  CHECK(max_difference(layer1.DX, layer2.DX) < 1e-5);
+  CHECK(max_difference(layer1.Db, layer2.Db) < 1e-5);
+
+  // compare the gradients of the blocks with finite differences of the loss elements_sum(hadamard(Y, DY))
+  auto loss = [&]()
+  {
+    eigen::matrix Y;
+    layer1.feedforward(Y);
+    return Y.cwiseProduct(DY).sum();
+  };
+  scalar h = 1e-3;
+  for (long i = 0; i < layer1.L.rows(); i += 2)
+  {
+    scalar L_i = layer1.L(i, 1);
+    layer1.L(i, 1) = L_i + h;
+    scalar f1 = loss();
+    layer1.L(i, 1) = L_i - h;
+    scalar f2 = loss();
+    layer1.L(i, 1) = L_i;
+    CHECK(std::fabs((f1 - f2) / (2 * h) - layer1.DL(i, 1)) < 1e-2);
+  }
+}
+
+TEST_CASE("test_make_monarch_layer")
+{
+  std::mt19937 rng{std::random_device{}()};
+  auto layer = make_linear_layer(16, 8, 5, 1, 0, "Monarch(blocks=4, activation=ReLU)", "Xavier", "Momentum(0.9)", rng);
+  auto mlayer = std::dynamic_pointer_cast<monarch_relu_layer>(layer);
+  REQUIRE(mlayer);
+  CHECK_EQ(mlayer->R.rows(), 16);
+  CHECK_EQ(mlayer->R.cols(), 4);
+  CHECK_EQ(mlayer->L.rows(), 8);
+  CHECK_THROWS(make_linear_layer(16, 6, 5, 1, 0, "Monarch(4)", "Xavier", "GradientDescent", rng));
+}
@@ -0,0 +1,141 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file optimizer_test.cpp
+/// \brief Tests for the optimizers.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/optimizers.h"
+#include <cmath>
+#include <iostream>
+
+using namespace nerva;
+
+// Reference implementation of a number of Adam steps with constant gradient G
+eigen::matrix adam_reference(eigen::matrix X, const eigen::matrix& G, scalar eta, scalar beta1, scalar beta2, scalar epsilon, scalar weight_decay, int steps)
+{
+  eigen::matrix M = eigen::matrix::Zero(X.rows(), X.cols());
+  eigen::matrix V = eigen::matrix::Zero(X.rows(), X.cols());
+  for (int t = 1; t <= steps; t++)
+  {
+    M = beta1 * M + (1 - beta1) * G;
+    V = beta2 * V + (1 - beta2) * G.cwiseProduct(G);
+    eigen::matrix M_hat = M / (1 - std::pow(beta1, scalar(t)));
+    eigen::matrix V_hat = V / (1 - std::pow(beta2, scalar(t)));
+    X = X - eta * weight_decay * X;
+    X = X.array() - eta * M_hat.array() / (V_hat.array().sqrt() + epsilon);
+  }
+  return X;
+}
+
+void check_equal(const eigen::matrix& A, const eigen::matrix& B)
+{
+  CHECK_LE((A - B).squaredNorm(), scalar(1e-8));
+}
+
+TEST_CASE("test_momentum_nesterov")
+{
+  scalar eta = 0.1;
+  scalar mu = 0.9;
+  eigen::matrix X = eigen::random_matrix(4, 3, -1, 1);
+  eigen::matrix DX = eigen::random_matrix(4, 3, -1, 1);
+
+  eigen::matrix X1 = X;
+  eigen::matrix X2 = X;
+  momentum_optimizer<eigen::matrix> momentum(X1, DX, mu);
+  nesterov_optimizer<eigen::matrix> nesterov(X2, DX, mu);
+
+  eigen::matrix delta = eigen::matrix::Zero(4, 3);
+  eigen::matrix Y1 = X;
+  eigen::matrix Y2 = X;
+  for (int i = 0; i < 3; i++)
+  {
+    momentum.update(eta);
+    nesterov.update(eta);
+    delta = mu * delta - eta * DX;
+    Y1 += delta;
+    Y2 += mu * delta - eta * DX;
+  }
+  check_equal(X1, Y1);
+  check_equal(X2, Y2);
+}
+
+TEST_CASE("test_adam")
+{
+  scalar eta = 0.01;
+  eigen::matrix X = eigen::random_matrix(5, 4, -1, 1);
+  eigen::matrix DX = eigen::random_matrix(5, 4, -1, 1);
+
+  eigen::matrix X1 = X;
+  auto adam = parse_optimizer("Adam(beta1=0.8, beta2=0.99, epsilon=0.001)", X1, DX);
+  CHECK_EQ(adam->to_string(), "Adam(beta1=0.8, beta2=0.99, epsilon=0.001)");
+  eigen::matrix X2 = X;
+  auto adamw = parse_optimizer("AdamW(weight_decay=0.1)", X2, DX);
+  CHECK(dynamic_cast<adamw_optimizer<eigen::matrix>*>(adamw.get()));
+  for (int i = 0; i < 3; i++)
+  {
+    adam->update(eta);
+    adamw->update(eta);
+  }
+  check_equal(X1, adam_reference(X, DX, eta, 0.8, 0.99, 0.001, 0, 3));
+  check_equal(X2, adam_reference(X, DX, eta, 0.9, 0.999, 1e-8, 0.1, 3));
+}
+
+TEST_CASE("test_rmsprop")
+{
+  scalar eta = 0.01;
+  scalar rho = 0.9;
+  scalar epsilon = 1e-8;
+  eigen::matrix X = eigen::random_matrix(5, 4, -1, 1);
+  eigen::matrix DX = eigen::random_matrix(5, 4, -1, 1);
+
+  eigen::matrix X1 = X;
+  auto rmsprop = parse_optimizer("RMSProp", X1, DX);
+  eigen::matrix S = eigen::matrix::Zero(5, 4);
+  for (int i = 0; i < 3; i++)
+  {
+    rmsprop->update(eta);
+    S = rho * S + (1 - rho) * DX.cwiseProduct(DX);
+    X = X.array() - eta * DX.array() / (S.array().sqrt() + epsilon);
+  }
+  check_equal(X1, X);
+}
+
+// The sparse optimizers must give the same results as the dense optimizers, since the entries outside the support
+// of the dense parameters have a zero gradient, and remain zero.
+TEST_CASE("test_sparse_optimizers")
+{
+  scalar eta = 0.01;
+  eigen::matrix X {
+    {1, 0, 2, 0},
+    {0, 3, 0, 4},
+    {5, 0, 0, 6}
+  };
+  eigen::matrix DX {
+    {0.5, 0, -1, 0},
+    {0, 2, 0, -0.5},
+    {1, 0, 0, 0.25}
+  };
+
+  for (const char* text: { "GradientDescent", "Momentum(0.9)", "Nesterov(0.9)", "Adam", "AdamW", "RMSProp" })
+  {
+    std::cout << "optimizer = " << text << std::endl;
+    eigen::matrix X1 = X;
+    eigen::matrix DX1 = DX;
+    mkl::sparse_matrix_csr<scalar> X2 = mkl::to_csr<scalar>(X);
+    mkl::sparse_matrix_csr<scalar> DX2 = mkl::to_csr<scalar>(DX);
+    auto optimizer1 = parse_optimizer(text, X1, DX1);
+    auto optimizer2 = parse_optimizer(text, X2, DX2);
+    for (int i = 0; i < 3; i++)
+    {
+      optimizer1->update(eta);
+      optimizer2->update(eta);
+    }
+    check_equal(X1, mkl::to_eigen(X2));
+  }
+}
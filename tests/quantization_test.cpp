@@ -0,0 +1,100 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file quantization_test.cpp
+/// \brief Tests for int8 quantization.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/quantization.h"
+#include <iostream>
+
+using namespace nerva;
+
+TEST_CASE("test_int8_product")
+{
+  long N = 5;
+  long D = 150;  // more than two VNNI registers
+  long K = 7;
+
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix W = eigen::random_matrix(K, D, -1, 1);
+  for (long k = 0; k < K; k++)
+  {
+    for (long j = 0; j < D; j += 3)
+    {
+      W(k, j) = 0;
+    }
+  }
+
+  int8_matrix Xq;
+  quantize(X, quantization_scale(1), Xq);
+
+  int8_matrix Wq;
+  eigen::matrix W_scales;
+  quantize_weights(W, Wq, W_scales);
+  std::vector<std::int32_t> Wq_row_sums(K);
+  for (long k = 0; k < K; k++)
+  {
+    Wq_row_sums[k] = Wq.row(k).cast<std::int32_t>().sum();
+  }
+
+  int32_matrix expected = Xq.cast<std::int32_t>() * Wq.cast<std::int32_t>().transpose();
+
+  int32_matrix Z;
+  int8_product_block(Xq, Wq, Wq_row_sums, 0, N, Z);
+  CHECK_EQ(Z, expected);
+
+  int8_product_block(Xq, Wq, Wq_row_sums, 2, 3, Z);
+  CHECK_EQ(Z, expected.bottomRows(3));
+
+  int8_csr_matrix Wq_sparse;
+  eigen::matrix W_sparse_scales;
+  quantize_weights(mkl::to_csr(W), Wq_sparse, W_sparse_scales);
+  CHECK_EQ(W_sparse_scales, W_scales);
+  int8_product_block(Xq, Wq_sparse, 0, N, Z);
+  CHECK_EQ(Z, expected);
+}
+
+TEST_CASE("test_quantized_mlp")
+{
+  long N = 40;  // more than one block
+  long D = 6;
+  long K = 8;
+  long L = 3;
+
+  multilayer_perceptron M;
+  auto layer1 = std::make_shared<dense_relu_layer>(D, K, N);
+  auto layer2 = std::make_shared<dense_linear_layer>(K, L, N);
+  layer1->W = eigen::random_matrix(K, D, -1, 1);
+  layer1->b = eigen::random_matrix(1, K, -1, 1);
+  layer2->W = eigen::random_matrix(L, K, -1, 1);
+  layer2->b = eigen::random_matrix(1, L, -1, 1);
+  M.layers = { layer1, layer2 };
+
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix Y1;
+  M.feedforward(X, Y1);
+
+  quantized_mlp Mq = quantize_mlp(M, X, 16);
+  eigen::matrix Y2;
+  Mq.feedforward(X, Y2);
+
+  std::cout << "quantization relative error: " << (Y1 - Y2).norm() / Y1.norm() << std::endl;
+  CHECK_LT((Y1 - Y2).norm(), 0.05 * Y1.norm());
+
+  // the accuracy must not depend on the batch size, also if it does not divide the number of examples
+  eigen::matrix T = eigen::matrix::Zero(N, L);
+  for (long i = 0; i < N; i++)
+  {
+    long j;
+    Y2.row(i).maxCoeff(&j);
+    T(i, j) = 1;
+  }
+  CHECK_EQ(compute_accuracy(Mq, X, T, N), 1);
+  CHECK_EQ(compute_accuracy(Mq, X, T, 16), 1);
+}
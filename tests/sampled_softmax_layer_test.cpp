@@ -0,0 +1,101 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file sampled_softmax_layer_test.cpp
+/// \brief Tests for sampled softmax layers.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/loss_functions.h"
+#include "nerva/neural_networks/parse_layer.h"
+#include <iostream>
+
+using namespace nerva;
+
+TEST_CASE("test_sampled_softmax_layer")
+{
+  long N = 4;
+  long D = 3;
+  long K = 50;
+
+  std::mt19937 rng{12345};
+  auto layer = make_linear_layer(D, K, N, 1, 0, "SampledSoftmax(samples=5, distribution=LogUniform)", "Xavier", "GradientDescent", rng);
+  auto& slayer = dynamic_cast<sampled_softmax_layer&>(*layer);
+  CHECK_EQ(slayer.S, 5);
+
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix T = eigen::matrix::Zero(N, K);
+  T(0, 3) = 1;
+  T(1, 17) = 1;
+  T(2, 3) = 1;
+  T(3, 40) = 1;
+
+  // without a call to sample the logits of all classes are computed
+  dense_linear_layer dlayer(D, K, N);
+  dlayer.W = slayer.W;
+  dlayer.b = slayer.b.transpose();
+  eigen::matrix Y1;
+  eigen::matrix Y2;
+  slayer.X = X;
+  slayer.feedforward(Y1);
+  dlayer.X = X;
+  dlayer.feedforward(Y2);
+  CHECK_EQ(Y1.rows(), N);
+  CHECK_EQ(Y1.cols(), K);
+  CHECK(((Y1 - Y2).cwiseAbs().maxCoeff() < 1e-6));
+
+  // a training step
+  softmax_cross_entropy_loss loss;
+  slayer.sample(T);
+  eigen::matrix Y;
+  eigen::matrix DY;
+  slayer.feedforward(Y);
+  CHECK_EQ(Y.cols(), 1 + slayer.S);
+  loss.value_and_gradient(Y, slayer.T, DY, scalar(1) / N);
+  slayer.backpropagate(Y, DY);
+
+  // compare the gradients with finite differences of the sampled loss
+  auto sampled_loss = [&]()
+  {
+    eigen::matrix Y_;
+    slayer.sample_pending = true;
+    slayer.feedforward(Y_);
+    return static_cast<double>(loss.value(Y_, slayer.T) / N);
+  };
+  for (std::size_t r = 0; r < slayer.rows.size(); r++)
+  {
+    long c = slayer.rows[r];
+    for (long j = 0; j < D; j++)
+    {
+      scalar h = 1e-3;
+      scalar w = slayer.W(c, j);
+      slayer.W(c, j) = w + h;
+      double f1 = sampled_loss();
+      slayer.W(c, j) = w - h;
+      double f2 = sampled_loss();
+      slayer.W(c, j) = w;
+      CHECK(std::fabs((f1 - f2) / (2 * h) - slayer.DW_rows(r, j)) < 1e-2);
+    }
+  }
+
+  // only the rows of the true classes and the sampled classes are updated
+  eigen::matrix W = slayer.W;
+  slayer.optimize(0.1);
+  for (long c = 0; c < K; c++)
+  {
+    if (!std::binary_search(slayer.rows.begin(), slayer.rows.end(), c))
+    {
+      CHECK_EQ(slayer.W.row(c), W.row(c));
+    }
+  }
+  CHECK(slayer.W.row(17) != W.row(17));
+
+  // no full size gradients are stored, and the batch sized buffers include the sampled targets
+  CHECK_EQ(slayer.DW.size(), 0);
+  CHECK_EQ(slayer.Db.size(), 0);
+  CHECK_EQ(slayer.batch_buffers().size(), 4);
+}
@@ -44,3 +44,53 @@ TEST_CASE("test_softmax")
   };
   test_stable_softmax(X2);
 }
+
+// Compare the row-wise softmax kernels with the matrix equations.
+void test_softmax_kernels(const eigen::matrix& Z, const eigen::matrix& DY)
+{
+  using eigen::column_repeat;
+  using eigen::diag;
+  using eigen::hadamard;
+  using eigen::rows_sum;
+
+  auto K = Z.cols();
+  scalar tolerance = 1e-5;
+
+  eigen::matrix Y;
+  stable_softmax_rowwise(Z, Y);
+  eigen::matrix Y_expected = stable_softmax_rowwise(Z);
+  CHECK_LT((Y - Y_expected).norm(), tolerance);
+
+  eigen::matrix DZ;
+  softmax_rowwise_jacobian_product(Y, DY, DZ);
+  eigen::matrix DZ_expected = hadamard(Y, DY - column_repeat(diag(Y * DY.transpose()), K));
+  CHECK_LT((DZ - DZ_expected).norm(), tolerance);
+
+  eigen::matrix L;
+  eigen::matrix S;
+  stable_log_softmax_rowwise(Z, L, S);
+  eigen::matrix L_expected = stable_log_softmax_rowwise(Z);
+  CHECK_LT((L - L_expected).norm(), tolerance);
+  CHECK_LT((S - Y_expected).norm(), tolerance);
+
+  log_softmax_rowwise_jacobian_product(S, DY, DZ);
+  DZ_expected = DY - hadamard(stable_softmax_rowwise(Z), column_repeat(rows_sum(DY), K));
+  CHECK_LT((DZ - DZ_expected).norm(), tolerance);
+}
+
+TEST_CASE("test_softmax_kernels")
+{
+  eigen::matrix Z {
+    {1.0, 2.0, 7.0},
+    {3.0, 4.0, 9.0},
+    {-2.0, 0.5, 100.0}
+  };
+
+  eigen::matrix DY {
+    {0.5, -2.0, 1.0},
+    {3.0, 0.0, -1.0},
+    {1.0, 2.0, 3.0}
+  };
+
+  test_softmax_kernels(Z, DY);
+}
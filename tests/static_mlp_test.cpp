@@ -0,0 +1,60 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file static_mlp_test.cpp
+/// \brief Tests for static multilayer perceptrons.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/static_mlp.h"
+#include <iostream>
+
+using namespace nerva;
+
+TEST_CASE("test_static_mlp")
+{
+  long N = 5;
+
+  multilayer_perceptron M;
+  auto layer1 = std::make_shared<dense_relu_layer>(4, 8, N);
+  auto layer2 = std::make_shared<dense_sigmoid_layer>(8, 6, N);
+  auto layer3 = std::make_shared<dense_linear_layer>(6, 3, N);
+  for (auto layer: std::vector<dense_linear_layer*>{layer1.get(), layer2.get(), layer3.get()})
+  {
+    layer->W = eigen::random_matrix(layer->W.rows(), layer->W.cols(), -1, 1);
+    layer->b = eigen::random_matrix(1, layer->b.cols(), -1, 1);
+  }
+  M.layers = { layer1, layer2, layer3 };
+
+  static_mlp<static_linear_layer<4, 8, relu_activation>,
+             static_linear_layer<8, 6, sigmoid_activation>,
+             static_linear_layer<6, 3>> S;
+  load_static_mlp(S, M);
+  std::cout << S.to_string();
+
+  eigen::matrix X = eigen::random_matrix(N, 4, -1, 1);
+  eigen::matrix DY = eigen::random_matrix(N, 3, -1, 1);
+  scalar epsilon = 1e-5;
+
+  eigen::matrix Y1;
+  M.feedforward(X, Y1);
+  M.backpropagate(Y1, DY);
+
+  eigen::matrix Y2;
+  S.feedforward(X, Y2);
+  S.backpropagate(DY);
+
+  CHECK_LT((Y1 - Y2).norm(), epsilon);
+  CHECK_LT((layer1->DW - S.layer<0>().DW).norm(), epsilon);
+  CHECK_LT((layer2->Db - S.layer<1>().Db).norm(), epsilon);
+  CHECK_LT((layer3->DW - S.layer<2>().DW).norm(), epsilon);
+  CHECK_LT((layer3->DX - S.layer<2>().DX).norm(), epsilon);
+
+  // the architectures must match
+  static_mlp<static_linear_layer<4, 8>, static_linear_layer<8, 6, sigmoid_activation>, static_linear_layer<6, 3>> S1;
+  CHECK_THROWS(load_static_mlp(S1, M));
+}
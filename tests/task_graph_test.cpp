@@ -0,0 +1,96 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file task_graph_test.cpp
+/// \brief Tests for the task graph executor.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/task_graph.h"
+#include "mlp_test_fixture.h"
+#include <atomic>
+#include <iostream>
+#include <omp.h>
+
+using namespace nerva;
+
+TEST_CASE("test_task_graph")
+{
+  task_graph G;
+  std::vector<int> order;
+  std::mutex mutex;
+  auto add = [&](int value)
+  {
+    return G.add_task([&, value]() { std::lock_guard<std::mutex> lock(mutex); order.push_back(value); });
+  };
+  auto t1 = add(1);
+  auto t2 = add(2);
+  auto t3 = add(3);
+  auto t4 = add(4);
+  G.add_dependency(t1, t2);
+  G.add_dependency(t1, t3);
+  G.add_dependency(t2, t4);
+  G.add_dependency(t3, t4);
+
+  work_stealing_pool pool(3);
+  for (int i = 0; i < 10; i++)
+  {
+    order.clear();
+    pool.run(G);
+    CHECK_EQ(order.size(), 4);
+    CHECK_EQ(order.front(), 1);
+    CHECK_EQ(order.back(), 4);
+  }
+
+  G.add_task([]() { throw std::runtime_error("task failed"); });
+  CHECK_THROWS(pool.run(G));
+}
+
+TEST_CASE("test_task_graph_thread_count")
+{
+  // the tasks use the number of OpenMP threads of the thread that calls run, including the stolen ones
+  int threads = omp_get_max_threads();
+  omp_set_num_threads(2);
+
+  task_graph G;
+  std::atomic<int> mismatches{0};
+  for (int i = 0; i < 100; i++)
+  {
+    G.add_task([&]() { if (omp_get_max_threads() != 2) { mismatches++; } });
+  }
+  work_stealing_pool pool(4);
+  pool.run(G);
+  CHECK_EQ(mismatches, 0);
+
+  omp_set_num_threads(threads);
+}
+
+// The task graph executes the same computations as the sequential schedule, so the results must be bit-identical.
+TEST_CASE("test_task_graph_executor")
+{
+  long N = 5;
+  auto [M1, M2] = make_identical_models(make_test_model, N);
+
+  task_graph_executor executor(3);
+  for (int i = 0; i < 5; i++)
+  {
+    eigen::matrix X = eigen::random_matrix(N, test_input_size, -1, 1);
+    eigen::matrix DY = eigen::random_matrix(N, test_output_size, -1, 1);
+    eigen::matrix Y1;
+    eigen::matrix Y2;
+
+    M1.feedforward(X, Y1);
+    M1.backpropagate(Y1, DY);
+    M1.optimize(0.01);
+
+    M2.feedforward(X, Y2);
+    executor.backpropagate_and_optimize(M2, Y2, DY, 0.01);
+
+    CHECK_EQ(Y1, Y2);
+  }
+  CHECK_EQ(max_parameter_difference(M1, M2), 0);
+}
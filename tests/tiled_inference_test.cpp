@@ -0,0 +1,55 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file tiled_inference_test.cpp
+/// \brief Tests for tiled inference.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest/doctest.h"
+#include "nerva/neural_networks/mlp_algorithms.h"
+#include "nerva/neural_networks/tiled_inference.h"
+#include <iostream>
+
+using namespace nerva;
+
+TEST_CASE("test_tiled_inference")
+{
+  long N = 43;  // not a multiple of the tile size
+  long D = 6;
+  long K = 8;
+  long L = 3;
+
+  multilayer_perceptron M;
+  auto layer1 = std::make_shared<dense_relu_layer>(D, K, N);
+  auto layer2 = std::make_shared<batch_normalization_layer>(K, N);
+  auto layer3 = std::make_shared<dense_sigmoid_layer>(K, K, N);
+  auto layer4 = std::make_shared<dense_softmax_layer>(K, L, N);
+  layer1->W = eigen::random_matrix(K, D, -1, 1);
+  layer1->b = eigen::random_matrix(1, K, -1, 1);
+  layer2->running_mean = eigen::random_matrix(1, K, -1, 1);
+  layer2->running_Sigma = eigen::random_matrix(1, K, 1, 2);
+  layer3->W = eigen::random_matrix(K, K, -1, 1);
+  layer3->b = eigen::random_matrix(1, K, -1, 1);
+  layer4->W = eigen::random_matrix(L, K, -1, 1);
+  layer4->b = eigen::random_matrix(1, L, -1, 1);
+  M.layers = { layer1, layer2, layer3, layer4 };
+
+  // batch normalization layers in training mode are not supported
+  CHECK(!tiled_inference(M).supported());
+
+  set_training_mode(M, false);
+  eigen::matrix X = eigen::random_matrix(N, D, -1, 1);
+  eigen::matrix Y1;
+  M.feedforward(X, Y1);
+
+  tiled_inference M_tiled(M, 8);
+  CHECK(M_tiled.supported());
+  eigen::matrix Y2;
+  M_tiled.feedforward(X, Y2);
+  CHECK_EQ(Y1.rows(), Y2.rows());
+  CHECK_LT((Y1 - Y2).norm(), 1e-5);
+}
@@ -143,6 +143,38 @@ auto parse_optimizers(const std::string& text, std::size_t count) -> std::vector
   return words;
 }
 
+/// Replaces dense linear layers of M by low rank layers, which are initialized with a truncated singular value
+/// decomposition of their weights. The list ranks contains a rank for each linear layer, and linear layers with
+/// rank 0 are not changed.
+inline
+void replace_by_low_rank_layers(multilayer_perceptron& M,
+                                const std::vector<std::string>& layer_specifications,
+                                const std::vector<long>& ranks,
+                                const std::vector<std::string>& optimizers)
+{
+  std::size_t linear_layer_index = 0;
+  for (std::size_t i = 0; i < M.layers.size(); i++)
+  {
+    if (layer_specifications[i] == "BatchNormalization")
+    {
+      continue;
+    }
+    if (linear_layer_index >= ranks.size())
+    {
+      throw std::runtime_error("the number of low rank ranks is smaller than the number of linear layers");
+    }
+    long r = ranks[linear_layer_index++];
+    if (r > 0)
+    {
+      M.layers[i] = make_low_rank_layer(*M.layers[i], r, optimizers[i]);
+    }
+  }
+  if (linear_layer_index != ranks.size())
+  {
+    throw std::runtime_error("the number of low rank ranks is larger than the number of linear layers");
+  }
+}
+
 inline
 void set_optimizers(multilayer_perceptron& M, const std::string& optimizer)
 {
@@ -325,10 +357,14 @@ class mlp_tool: public command_line_tool
     std::string dropouts_text;
     std::string layer_specifications_text;
     std::string layer_weights_text = "None";
+    std::string low_rank_text;
     std::string computation = "eigen";
+    bool mixed_precision = false;
+    bool calibrate_jit = false;
     double overall_density = 1;
     std::string preprocessed_dir;  // a directory containing a dataset for every epoch
     bool no_shuffle = false;
+    bool no_drop_last = false;
     bool no_statistics = false;
     bool info = false;
     std::string timer = "disabled";
@@ -350,16 +386,21 @@ class mlp_tool: public command_line_tool
       cli |= lyra::opt(overall_density, "value")["--overall-density"]("The overall density level of the sparse layers");
       cli |= lyra::opt(layer_specifications_text, "value")["--layers"]("A semi-colon separated lists of layers. The following layers are supported: "
                                                                   "Linear, ReLU, Sigmoid, Softmax, LogSoftmax, HyperbolicTangent, BatchNormalization, "
-                                                                  "AllRelu(<alpha>), TReLU(<epsilon>)");
+                                                                  "AllRelu(<alpha>), TReLU(<epsilon>), LowRank(rank=<r>,activation=<activation>), Monarch(blocks=<b>,activation=<activation>), "
+                                                                  "Hashed(buckets=<B>,seed=<seed>,activation=<activation>), "
+                                                                  "MoE(experts=<E>,k=<k>,hidden=<M>,activation=<activation>), Embedding(rows=<V>), "
+                                                                  "SampledSoftmax(samples=<S>,distribution=<distribution>)");
 
       // training
       cli |= lyra::opt(options.epochs, "value")["--epochs"]("The number of epochs (default: 100)");
       cli |= lyra::opt(options.batch_size, "value")["--batch-size"]("The batch size of the training algorithm");
+      cli |= lyra::opt(options.eval_batch_size, "value")["--eval-batch-size"]("The batch size used for evaluation (default: the batch size of the training algorithm)");
+      cli |= lyra::opt(no_drop_last)["--no-drop-last"]("Also train on the final partial batch of each epoch");
       cli |= lyra::opt(no_shuffle)["--no-shuffle"]("Do not shuffle the dataset during training.");
       cli |= lyra::opt(no_statistics)["--no-statistics"]("Do not compute statistics during training.");
 
       // optimizer
-      cli |= lyra::opt(options.optimizer, "value")["--optimizers"]("The optimizer (GradientDescent, Momentum(<mu>), Nesterov(<mu>))");
+      cli |= lyra::opt(options.optimizer, "value")["--optimizers"]("The optimizer (GradientDescent, Momentum(<mu>), Nesterov(<mu>), Adam, AdamW, RMSProp)");
 
       // learning rate
       cli |= lyra::opt(options.learning_rate, "value")["--learning-rate"]("The learning rate (default: 0.01)");
@@ -372,6 +413,7 @@ class mlp_tool: public command_line_tool
       cli |= lyra::opt(layer_weights_text, "value")["--layer-weights"]("The weight initialization of the layers (default, he, uniform, xavier, normalized_xavier, uniform)");
       cli |= lyra::opt(load_weights_file, "value")["--load-weights"]("Loads the weights and bias from a file in .npz format");
       cli |= lyra::opt(save_weights_file, "value")["--save-weights"]("Saves the weights and bias to a file in .npz format");
+      cli |= lyra::opt(low_rank_text, "value")["--low-rank"]("A semicolon separated list with a rank for each linear layer. Dense layers with a positive rank are replaced by low rank layers, using a truncated SVD of their weights");
 
       // dataset
       cli |= lyra::opt(options.cifar10, "value")["--cifar10"]("The directory of the CIFAR-10 dataset");
@@ -395,9 +437,16 @@ class mlp_tool: public command_line_tool
 
       // miscellaneous
       cli |= lyra::opt(computation, "value")["--computation"]("The computation mode (eigen, mkl, blas)");
+      cli |= lyra::opt(calibrate_jit)["--calibrate-jit"]("Determine the sizes up to which MKL JIT kernels are used with micro benchmarks (only for --computation=mkl)");
       cli |= lyra::opt(options.clip, "value")["--clip"]("A threshold value that is used to set elements to zero");
       cli |= lyra::opt(options.threads, "value")["--threads"]("The number of threads used by Eigen.");
       cli |= lyra::opt(options.gradient_step, "value")["--gradient-step"]("If positive, gradient checks will be done with the given step size");
+      cli |= lyra::opt(mixed_precision)["--mixed-precision"]("Use bf16 matrix products with fp32 master weights and loss scaling");
+      cli |= lyra::opt(options.loss_scale, "value")["--loss-scale"]("The initial loss scale in mixed precision mode (default: 65536)");
+      cli |= lyra::opt(options.task_graph_threads, "value")["--task-graph-threads"]("If positive, backpropagation and optimization are executed as a task graph with the given number of worker threads");
+      cli |= lyra::opt(options.fused_backpropagation)["--fused-backpropagation"]("Apply the weight gradients in tiles during backpropagation instead of storing them (not compatible with gradient checks)");
+      cli |= lyra::opt(options.activation_memory_budget, "value")["--activation-memory-budget"]("If positive, use activation checkpointing to keep the activations within the given number of MB");
+      cli |= lyra::opt(options.autotune_cache, "file")["--autotune"]("Select the kernels of the linear layers with micro benchmarks on the first batch, and cache the results in the given file");
     }
 
     auto description() const -> std::string override
@@ -410,12 +459,17 @@ class mlp_tool: public command_line_tool
       NERVA_LOG(log::verbose) << command_line_call() << "\n\n";
 
       set_nerva_computation(computation);
+      NervaMixedPrecision = mixed_precision;
 
       options.debug = is_debug();
       if (no_shuffle)
       {
         options.shuffle = false;
       }
+      if (no_drop_last)
+      {
+        options.drop_last = false;
+      }
       if (no_statistics)
       {
         options.statistics = false;
@@ -436,6 +490,12 @@ class mlp_tool: public command_line_tool
         omp_set_num_threads(options.threads);
       }
 
+      if (calibrate_jit && NervaComputation == computation::mkl)
+      {
+        auto [max_batch_size, max_dimension] = mkl::calibrate_jit_gemm_thresholds();
+        std::cout << fmt::format("JIT kernels are used for batch sizes up to {} and dimensions up to {}\n", max_batch_size, max_dimension);
+      }
+
       std::mt19937 rng{static_cast<unsigned int>(options.seed)};
 
       if (!options.cifar10.empty())
@@ -471,14 +531,27 @@ class mlp_tool: public command_line_tool
       auto linear_layer_weights = parse_layer_weights(layer_weights_text, linear_layer_count);
       auto optimizers = parse_optimizers(options.optimizer, layer_specifications.size());
 
-      // construct the multilayer perceptron M
-      multilayer_perceptron M;
-      M.layers = make_layers(layer_specifications, linear_layer_sizes, linear_layer_densities, linear_layer_dropouts, linear_layer_weights, optimizers, options.batch_size, rng);
-
-      if (!load_weights_file.empty())
+      // constructs a multilayer perceptron, using model_rng for the initial weights
+      auto make_model = [&](std::mt19937& model_rng)
       {
-        load_weights_and_bias(M, load_weights_file);
-      }
+        multilayer_perceptron result;
+        result.layers = make_layers(layer_specifications, linear_layer_sizes, linear_layer_densities, linear_layer_dropouts, linear_layer_weights, optimizers, options.batch_size, model_rng);
+        if (!load_weights_file.empty())
+        {
+          load_weights_and_bias(result, load_weights_file);
+        }
+        if (!low_rank_text.empty())
+        {
+          replace_by_low_rank_layers(result, layer_specifications, parse_semicolon_separated_numbers<long>(low_rank_text), optimizers);
+        }
+        return result;
+      };
+
+      // in mixed precision mode an fp32 baseline is trained from the same initial model
+      std::mt19937 baseline_rng = rng;
+
+      // construct the multilayer perceptron M
+      multilayer_perceptron M = make_model(rng);
 
       if (!save_weights_file.empty())
       {
@@ -511,13 +584,26 @@ class mlp_tool: public command_line_tool
       CALLGRIND_START_INSTRUMENTATION;
 #endif
 
-      algorithm.run();
+      auto bf16_result = algorithm.run();
 
       if (timer == "brief" || timer == "full")
       {
         nerva_timer.print_report();
       }
 
+      if (mixed_precision)
+      {
+        print_mixed_precision_inference_report(M, dataset, options.batch_size);
+
+        std::cout << "\n=== fp32 baseline ===" << "\n";
+        NervaMixedPrecision = false;
+        multilayer_perceptron M_fp32 = make_model(baseline_rng);
+        sgd_algorithm baseline(M_fp32, dataset, options, loss, options.learning_rate, lr_scheduler, baseline_rng, preprocessed_dir, prune, grow);
+        auto fp32_result = baseline.run();
+        NervaMixedPrecision = true;
+        print_mixed_precision_training_report(fp32_result, bf16_result, options.epochs);
+      }
+
 #ifdef NERVA_ENABLE_PROFILING
       CALLGRIND_STOP_INSTRUMENTATION;
       CALLGRIND_DUMP_STATS;
@@ -0,0 +1,141 @@
+// Copyright: Wieger Wesselink 2023
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+//
+/// \file tools/quantize.cpp
+/// \brief A tool for comparing the accuracy and latency of a multilayer perceptron with its int8 quantization.
+
+#include "nerva/datasets/dataset.h"
+#include "nerva/neural_networks/mlp_algorithms.h"
+#include "nerva/neural_networks/multilayer_perceptron.h"
+#include "nerva/neural_networks/parse_layer.h"
+#include "nerva/neural_networks/quantization.h"
+#include "nerva/neural_networks/training.h"
+#include "nerva/utilities/command_line_tool.h"
+#include "nerva/utilities/parse_numbers.h"
+#include "nerva/utilities/stopwatch.h"
+#include "nerva/utilities/string_utility.h"
+
+#include "omp.h"
+#include "fmt/format.h"
+#include <iostream>
+#include <random>
+
+using namespace nerva;
+
+class quantize_tool: public command_line_tool
+{
+  protected:
+    std::string load_weights_file;
+    std::string load_dataset_file;
+    std::string linear_layer_sizes_text;
+    std::string densities_text;
+    std::string layer_specifications_text;
+    long batch_size = 100;
+    long calibration_size = 1000;
+    int repetitions = 10;
+    int threads = 1;
+
+    void add_options(lyra::cli& cli) override
+    {
+      cli |= lyra::opt(linear_layer_sizes_text, "value")["--layer-sizes"]("A semi-colon separated list of the linear layer sizes");
+      cli |= lyra::opt(densities_text, "value")["--densities"]("A semi-colon separated list of sparse layer densities (default: 1)");
+      cli |= lyra::opt(layer_specifications_text, "value")["--layers"]("A semi-colon separated lists of layers, see the mlp tool");
+      cli |= lyra::opt(load_weights_file, "value")["--load-weights"]("Loads the weights and bias from a file in .npz format").required();
+      cli |= lyra::opt(load_dataset_file, "value")["--load-dataset"]("Loads the dataset from a file in .npz format").required();
+      cli |= lyra::opt(batch_size, "value")["--batch-size"]("The batch size used for inference (default: 100)");
+      cli |= lyra::opt(calibration_size, "value")["--calibration-size"]("The number of test examples used for calibration (default: 1000)");
+      cli |= lyra::opt(repetitions, "value")["--repetitions"]("The number of times the latency is measured (default: 10)");
+      cli |= lyra::opt(threads, "value")["--threads"]("The number of threads");
+    }
+
+    auto description() const -> std::string override
+    {
+      return "A tool for comparing the accuracy and latency of a multilayer perceptron with its int8 quantization";
+    }
+
+    // Returns the minimum over the repetitions of the average time in seconds to process a batch.
+    template <typename Model>
+    double batch_latency(Model& M, const eigen::matrix& X)
+    {
+      long K = X.rows() / batch_size;
+      eigen::matrix Y;
+      double result = std::numeric_limits<double>::max();
+      for (int r = 0; r < repetitions; r++)
+      {
+        utilities::stopwatch watch;
+        for (long k = 0; k < K; k++)
+        {
+          M.feedforward(X.middleRows(k * batch_size, batch_size), Y);
+        }
+        result = std::min(result, watch.seconds() / K);
+      }
+      return result;
+    }
+
+    auto run() -> bool override
+    {
+      if (threads >= 1)
+      {
+        omp_set_num_threads(threads);
+      }
+
+      datasets::dataset data;
+      data.load(load_dataset_file);
+
+      auto layer_specifications = parse_layers(layer_specifications_text);
+      auto linear_layer_sizes = parse_semicolon_separated_numbers(linear_layer_sizes_text);
+      auto n = linear_layer_sizes.size() - 1;
+      std::vector<double> densities(n, 1.0);
+      std::vector<std::string> words = utilities::regex_split(utilities::trim_copy(densities_text), ";");
+      if (words.size() == 1)
+      {
+        densities = std::vector<double>(n, std::stod(words.front()));
+      }
+      else if (words.size() == n)
+      {
+        std::transform(words.begin(), words.end(), densities.begin(), [](const std::string& word) { return std::stod(word); });
+      }
+      else if (!words.empty())
+      {
+        throw std::runtime_error(fmt::format("The number of densities {} does not match with the number of linear layers {}.", words.size(), n));
+      }
+
+      std::mt19937 rng{std::random_device{}()};
+      multilayer_perceptron M;
+      M.layers = make_layers(layer_specifications,
+                             linear_layer_sizes,
+                             densities,
+                             std::vector<double>(n, 0.0),
+                             std::vector<std::string>(n, "None"),
+                             std::vector<std::string>(layer_specifications.size(), "GradientDescent"),
+                             batch_size,
+                             rng);
+      load_weights_and_bias(M, load_weights_file);
+      fold_normalization_layers(M);
+      set_training_mode(M, false);
+
+      long calibration_rows = std::min(calibration_size, static_cast<long>(data.Xtest.rows()));
+      quantized_mlp Mq = quantize_mlp(M, data.Xtest.topRows(calibration_rows), batch_size);
+
+      std::cout << "=== reference model ===\n" << M.to_string();
+      std::cout << "=== quantized model ===\n" << Mq.to_string() << '\n';
+
+      double accuracy = compute_accuracy(M, data.Xtest, data.Ttest, batch_size);
+      double quantized_accuracy = compute_accuracy(Mq, data.Xtest, data.Ttest, batch_size);
+      double latency = batch_latency(M, data.Xtest);
+      double quantized_latency = batch_latency(Mq, data.Xtest);
+
+      std::cout << fmt::format("test accuracy reference: {:.8f}  int8: {:.8f}  delta: {:+.8f}\n", accuracy, quantized_accuracy, quantized_accuracy - accuracy);
+      std::cout << fmt::format("batch latency reference: {:.8f}s  int8: {:.8f}s  speedup: {:.4f}\n", latency, quantized_latency, latency / quantized_latency);
+      return true;
+    }
+};
+
+auto main(int argc, const char* argv[]) -> int
+{
+  pybind11::scoped_interpreter guard{};
+  return quantize_tool().execute(argc, argv);
+}